@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+#   notice, this list of conditions and the following disclaimer.
+# * Redistributions in binary form must reproduce the above
+#   copyright notice, this list of conditions and the following disclaimer
+#   in the documentation and/or other materials provided with the
+#   distribution.
+# * Neither the name of the  nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+
+"""
+Compares two esp8266_bench CSV outputs.
+
+    ./esp8266_bench cbuf parse > now.csv
+    ./bench_compare.py esp8266_bench_x86_64.csv now.csv
+
+Prints every suite,case,param found in both with the relative change. Exits with 1
+if any of them got worse than --threshold percent. Lower is better for cycles, ns
+and bytes, higher for everything else (msgs/s, MB/s, speedup...).
+"""
+
+import argparse
+import csv
+import sys
+
+LOWER_IS_BETTER = ('cycles', 'ns', 'us', 'ms', 'bytes')
+
+
+def load(path):
+    results = {}
+    with open(path) as f:
+        for row in csv.reader(line for line in f if line.strip() and not line.startswith('#')):
+            if len(row) != 5 or row[0] == 'suite':
+                continue
+            suite, case, param, value, unit = row
+            results[(suite, case, param)] = (float(value), unit)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--threshold', type=float, default=25.0, help='regression threshold in percent')
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+
+    failed = False
+    print('%-56s %12s %12s %8s' % ('suite,case,param', 'baseline', 'current', 'change'))
+    for key in sorted(k for k in baseline if k in current):
+        old, unit = baseline[key]
+        new = current[key][0]
+        if old == 0:
+            continue
+        change = (new - old) / old * 100
+        worse = change if unit.split('/')[0] in LOWER_IS_BETTER else -change
+        flag = ''
+        if worse > args.threshold:
+            flag = ' REGRESSION'
+            failed = True
+        print('%-56s %12.4f %12.4f %+7.1f%%%s' % (','.join(key), old, new, change, flag))
+
+    if failed:
+        print('Regressions above %.1f%%' % args.threshold)
+        return 1
+    print('No regression above %.1f%%' % args.threshold)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -15,6 +15,19 @@
  * static uint8_t buffer[512];
  * static CircularBuffer circularBuffer;
  * circularBufferInit(&circularBuffer, buffer, 512);
+ *
+ * Zero copy access, the bytes are one or two contiguous spans:
+ *
+ * CircularBufferSpan spans[2];
+ * uint32_t n = circularBufferWriteSpans(&circularBuffer, spans);
+ * uint32_t got = read(fd, spans[0].data, spans[0].len);    // or readv() both
+ * circularBufferCommit(&circularBuffer, got);
+ * n = circularBufferReadSpans(&circularBuffer, spans);
+ * ...parse spans[0..n-1] in place...
+ * circularBufferConsume(&circularBuffer, parsed);
+ *
+ * On Linux, define CIRCULAR_BUFFER_MIRROR and use circularBufferInitMirrored():
+ * the ring is mapped twice in a row so every span is contiguous (n is at most 1).
 ********************************************/
 
 /* Exported types ------------------------------------------------------------*/
@@ -24,8 +37,16 @@ typedef struct{
     uint32_t size;
     uint32_t mask;
 	uint8_t* data;
+	/* data[i] and data[i+size] are the same byte, see circularBufferInitMirrored() */
+	bool mirrored;
 }CircularBuffer;
 
+/* One contiguous piece of the ring */
+typedef struct{
+	uint8_t *data;
+	uint32_t len;
+}CircularBufferSpan;
+
 
 /* GNU C Library (glibc) malloc.c isPowerOfTwo implementation */
 static inline bool isPowerOfTwo (unsigned int x)
@@ -48,6 +69,7 @@ static inline void circularBufferInit(CircularBuffer *queue, uint8_t *buffer, ui
 	queue->data = buffer;
 	queue->size = size;
 	queue->mask = (queue->size -1);
+	queue->mirrored = false;
 }
 
 static inline void circularBufferClear(CircularBuffer *queue){
@@ -59,21 +81,15 @@ static inline void circularBufferPut(CircularBuffer *queue, uint8_t item){
 	queue->tail = (queue->tail+1) & queue->mask;
 }
 
-static inline void circularBufferPutMultiple(CircularBuffer *queue, const uint8_t *item, uint32_t numItem){
-
-	if((queue->tail+numItem)==((queue->tail+numItem) & queue->mask)) {
-		memcpy(queue->data+queue->tail, item, numItem);
-	}
-	else{
-                uint32_t lenToTheEnd = queue->size-queue->tail;
-		/* Copy from tail up to the end */
-		memcpy(queue->data+queue->tail, item, lenToTheEnd);
-
-		/* Copy from beginning until remaining len */
-		memcpy(queue->data, item+lenToTheEnd, numItem-lenToTheEnd);
+/* Put that refuses to overwrite the oldest byte. Returns false if the buffer was full */
+static inline bool circularBufferTryPut(CircularBuffer *queue, uint8_t item){
+	uint32_t next = (queue->tail+1) & queue->mask;
+	if (next == queue->head){
+		return false;
 	}
-
-	queue->tail = (queue->tail+numItem) & queue->mask;
+	queue->data[queue->tail] = item;
+	queue->tail = next;
+	return true;
 }
 
 static inline uint8_t circularBufferGet(CircularBuffer *queue){
@@ -86,6 +102,10 @@ static inline void circularBufferDiscardMultiple(CircularBuffer *queue, uint32_t
 	queue->head = (queue->head+numItem) & queue->mask;
 }
 
+static inline void circularBufferDiscardFromEnd(CircularBuffer *queue, uint32_t numItem){
+	queue->tail = (queue->tail-numItem) & queue->mask;
+}
+
 static inline uint8_t circularBufferHead(CircularBuffer *queue){
 	return queue->data[queue->head];
 }
@@ -107,7 +127,7 @@ static inline uint32_t circularBufferUsedElementsNum(const CircularBuffer *queue
 	}
 }
 
-static inline uint32_t circularBufferFreeElementsNum(CircularBuffer *queue){
+static inline uint32_t circularBufferFreeElementsNum(const CircularBuffer *queue){
 	return queue->size -1 -circularBufferUsedElementsNum(queue);
 }
 
@@ -115,6 +135,65 @@ static inline uint8_t circularBufferPeek(CircularBuffer *queue, uint32_t element
 	return queue->data[(queue->head+elementPosition) & queue->mask];
 }
 
+/* Splits the len bytes starting at position start in at most two contiguous spans. Returns how many */
+static inline uint32_t circularBufferSpansAt(const CircularBuffer *queue, uint32_t start, uint32_t len, CircularBufferSpan spans[2]){
+	uint32_t lenToTheEnd = queue->size-start;
+
+	spans[0].data = queue->data+start;
+	if (len<=lenToTheEnd || queue->mirrored){
+		spans[0].len = len;
+		spans[1].data = queue->data;
+		spans[1].len = 0;
+		return len ? 1 : 0;
+	}
+	spans[0].len = lenToTheEnd;
+	spans[1].data = queue->data;
+	spans[1].len = len-lenToTheEnd;
+	return 2;
+}
+
+/* Every readable byte, oldest first. Returns the number of spans */
+static inline uint32_t circularBufferReadSpans(const CircularBuffer *queue, CircularBufferSpan spans[2]){
+	return circularBufferSpansAt(queue, queue->head, circularBufferUsedElementsNum(queue), spans);
+}
+
+/* The last len readable bytes, len must not be above circularBufferUsedElementsNum() */
+static inline uint32_t circularBufferLastSpans(const CircularBuffer *queue, uint32_t len, CircularBufferSpan spans[2]){
+	return circularBufferSpansAt(queue, (queue->tail-len) & queue->mask, len, spans);
+}
+
+/* The free room after the last byte. Fill it and circularBufferCommit() what was written */
+static inline uint32_t circularBufferWriteSpans(const CircularBuffer *queue, CircularBufferSpan spans[2]){
+	return circularBufferSpansAt(queue, queue->tail, circularBufferFreeElementsNum(queue), spans);
+}
+
+/* Makes numItem bytes written through circularBufferWriteSpans() readable */
+static inline void circularBufferCommit(CircularBuffer *queue, uint32_t numItem){
+	queue->tail = (queue->tail+numItem) & queue->mask;
+}
+
+/* Drops numItem bytes read through circularBufferReadSpans() */
+static inline void circularBufferConsume(CircularBuffer *queue, uint32_t numItem){
+	queue->head = (queue->head+numItem) & queue->mask;
+}
+
+static inline void circularBufferPutMultiple(CircularBuffer *queue, const uint8_t *item, uint32_t numItem){
+
+	if((queue->tail+numItem)==((queue->tail+numItem) & queue->mask)) {
+		memcpy(queue->data+queue->tail, item, numItem);
+	}
+	else{
+                uint32_t lenToTheEnd = queue->size-queue->tail;
+		/* Copy from tail up to the end */
+		memcpy(queue->data+queue->tail, item, lenToTheEnd);
+
+		/* Copy from beginning until remaining len */
+		memcpy(queue->data, item+lenToTheEnd, numItem-lenToTheEnd);
+	}
+
+	queue->tail = (queue->tail+numItem) & queue->mask;
+}
+
 static inline void circularBufferPeekMultiple(const CircularBuffer *queue, uint8_t *dest, const uint32_t len){
 	/* If continuous in memory */
 	if ((queue->head+len)==((queue->head+len) & queue->mask)){
@@ -138,7 +217,6 @@ static inline void circularBufferPeekFromEndMultiple(const CircularBuffer *queue
     /* If not continuous in memory */
     else{
             uint32_t lenToTheEnd = len-queue->tail;
-            //printf("lenToTheEnd %d , size %d, tail %d\n",lenToTheEnd,queue->size,queue->tail);
             /* Copy from head up to the end */
             memcpy(dest, queue->data+queue->size-lenToTheEnd, lenToTheEnd);
             /* Copy from beginning until remaining len */
@@ -166,6 +244,59 @@ static inline void circularBufferGetMultiple(CircularBuffer *queue, uint8_t *des
     queue->head = (queue->head+numItem) & queue->mask;
 }
 
+#ifdef CIRCULAR_BUFFER_MIRROR
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+* Linux only. Maps the same size bytes twice in a row, so every span is contiguous and
+* readers and writers never split a copy or a compare at the end of the ring.
+* size must be a power of two and a multiple of the page size.
+* Returns false if the mapping cannot be made, queue is left untouched.
+*/
+static inline bool circularBufferInitMirrored(CircularBuffer *queue, uint32_t size){
+	if (!isPowerOfTwo(size) || size % (uint32_t)sysconf(_SC_PAGESIZE) != 0){
+		return false;
+	}
+
+	int fd = syscall(SYS_memfd_create, "circular_buffer", 0);
+	if (fd < 0){
+		return false;
+	}
+	if (ftruncate(fd, size) != 0){
+		close(fd);
+		return false;
+	}
+
+	/* Reserve both halves first so nothing else lands in between */
+	uint8_t *base = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	bool mapped = base != MAP_FAILED &&
+	              mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+	              mmap(base+size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+	close(fd);
+
+	if (!mapped){
+		if (base != MAP_FAILED){
+			munmap(base, 2*size);
+		}
+		return false;
+	}
+
+	circularBufferInit(queue, base, size);
+	queue->mirrored = true;
+	return true;
+}
+
+static inline void circularBufferFreeMirrored(CircularBuffer *queue){
+	if (queue->mirrored){
+		munmap(queue->data, 2*queue->size);
+		queue->data = NULL;
+		queue->mirrored = false;
+	}
+}
+#endif
+
 
 /*static char none[8];
 static char buffer2[8];
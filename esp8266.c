@@ -30,25 +30,123 @@
  */
 
 #include "esp8266.h"
+#include "esp8266_log.h"
+#include "esp8266_scan.h"
+#include "esp8266_timer.h"
+#include "esp8266_wait.h"
+#ifdef ESP_MIRRORED_RING
+#define CIRCULAR_BUFFER_MIRROR
+#endif
 #include "circular_buffer.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 
 
-extern void delayMS(int ms);
 extern void espPrintln(int fd, const char *buf, int len);
 extern int espRead (int __fd, void *__buf, size_t __nbytes);
 extern uint32_t getCurrentMS (void);
+extern uint32_t getCurrentUS (void);
+
+
+/* Layout of the driver working memory, ESP_ARENA_SIZE bytes */
+#define ARENA_RING_OFFSET       0
+#define ARENA_CHUNK_OFFSET      (ARENA_RING_OFFSET + CIRCULAR_BUFFER_SIZE)
+#define ARENA_CMD_OFFSET        (ARENA_CHUNK_OFFSET + RX_CHUNK_SIZE)
+#define ARENA_LINE_OFFSET       (ARENA_CMD_OFFSET + CMD_BUFFER_SIZE)
+#define ARENA_FW_OFFSET         (ARENA_LINE_OFFSET + LIST_LINE_SIZE)
+#define ARENA_CLIENTS_OFFSET    (ARENA_FW_OFFSET + FW_VERSION_SIZE)
+#define ARENA_STATIONS_OFFSET   (ARENA_CLIENTS_OFFSET + MAX_NUMBER_OF_CLIENT*IP_BUFFER_SIZE)
+
+#ifdef ESP_STATIC_ARENA
+/* Set by espDriverSetArena() */
+#define ARENA_PTR(type, offset) NULL
+#else
+static uint8_t defaultArena[ESP_ARENA_SIZE];
+#define ARENA_PTR(type, offset) ((type)(defaultArena + (offset)))
+#endif
+
+static uint8_t *ringBuffer = ARENA_PTR(uint8_t*, ARENA_RING_OFFSET);
+static CircularBuffer circularBuffer;
 
+#ifdef ESP_MIRRORED_RING
+/* Linux only: the ring is a mirrored mapping, one page instead of the arena bytes, so the parser never meets a split line */
+#define MIRRORED_RING_SIZE 4096
+#endif
 
-static uint8_t buffer[CIRCULAR_BUFFER_SIZE];
-static CircularBuffer circularBuffer;
+/* Bytes read from the serial port but not parsed yet */
+static uint8_t *rxChunk = ARENA_PTR(uint8_t*, ARENA_CHUNK_OFFSET);
+static uint32_t rxChunkPos = 0;
+static uint32_t rxChunkLen = 0;
+
+/* Formatted AT commands */
+static char *cmdBuffer = ARENA_PTR(char*, ARENA_CMD_OFFSET);
+
+/*
+* One response line at a time: list lines, event lines, +IPD headers.
+* Every user is done with it before the parser runs again.
+*/
+static char *lineBuffer = ARENA_PTR(char*, ARENA_LINE_OFFSET);
+
+/* Lines peeked from the ring end looking for events */
+#define EVENT_LINE_SIZE 64
+
+/* Once "+IPD," is seen the payload is coming, at least this long is given to it whatever the caller timeout */
+#define IPD_PAYLOAD_TIMEOUT 500
+/* Time spent receiving +IPD payloads inside reads, left out of the response time samples */
+static uint32_t ipdTimeUS = 0;
+/* espSetUartBaud(), 0 until set */
+static uint32_t uartBaud = 0;
 
-char fwVersion[128] = {0};
+static char *fwVersion = ARENA_PTR(char*, ARENA_FW_OFFSET);
 
 int numClients=0;
-char clients[MAX_NUMBER_OF_CLIENT][IP_BUFFER_SIZE];
+static char (*clients)[IP_BUFFER_SIZE] = ARENA_PTR(char(*)[IP_BUFFER_SIZE], ARENA_CLIENTS_OFFSET);
+
+static EspEventHandlers eventHandlers;
+static int numEvents = 0;
+/* espProcessEventsMax() returns once numEvents reaches it, 0 when not limited */
+static int eventsStopAt = 0;
+/* espProcessEventsBurst() returns once numEvents passed it and the received bytes ran out, -1 when not set */
+static int eventsBurstFrom = -1;
+static bool linkOpen[NUM_LINKS];
+
+/* TCP server settings, started again after the module restarts */
+static bool serverRunning = false;
+static uint16_t serverPort;
+static uint8_t serverMaxConn;
+static uint16_t serverIdleTimeout;
+
+/* Longest SSL host name kept to do the handshake again */
+#define SSL_HOST_SIZE 64
+
+/* SSL links opened by the application, reopened when they drop */
+typedef struct{
+    bool active;
+    char host[SSL_HOST_SIZE];
+    uint16_t port;
+    uint16_t keepAlive;
+}EspSslLink;
+
+static EspSslLink sslLinks[NUM_LINKS];
+/* 0 until the application sets it */
+static uint32_t sslBufferSize = 0;
+static EspSslStats sslStats;
+
+static EspHealth health;
+/* Set when the module restarted on its own, its configuration has to be sent again */
+static bool restoreNeeded = false;
+static bool recovering = false;
+static void (*hardResetHandler)(void *ctx) = NULL;
+static void *hardResetCtx = NULL;
+
+static EspStation *defaultStations = ARENA_PTR(EspStation*, ARENA_STATIONS_OFFSET);
+static EspStation *stations = ARENA_PTR(EspStation*, ARENA_STATIONS_OFFSET);
+static uint32_t stationsCapacity = MAX_NUMBER_OF_CLIENT;
+static uint32_t numStations = 0;
+static uint32_t stationsDropped = 0;
+
+static uint8_t selectedModule = 0;
 
 
 const char* ESPTAGS[] =
@@ -58,7 +156,10 @@ const char* ESPTAGS[] =
     "\r\nFAIL\r\n",
     "\r\nSEND OK\r\n",
     "ALREADY CONNECTED\r\n",
-    "WIFI CONNECTED\r\n"
+    "WIFI CONNECTED\r\n",
+    "busy p...\r\n",
+    "busy s...\r\n",
+    "ready\r\n"
 };
 
 
@@ -69,749 +170,2450 @@ typedef enum{
     TAG_SENDOK,
     TAG_ALREADY_CONNECTED,
     TAG_WIFI_CONNECTED,
+    /* Recovery tags, they end any wait even without findTags */
+    TAG_BUSY_P,
+    TAG_BUSY_S,
+    TAG_READY,
     NUMESPTAGS
 } TagsEnum;
 
+#define FIRST_RECOVERY_TAG TAG_BUSY_P
+
 
 
 
 
 bool circularBufferEndWith(const char *tag){
-    uint8_t circularBufferEndWithBuff[CMD_BUFFER_SIZE];
 
-    uint32_t len_to_peek = strlen(tag);
-    if (circularBufferUsedElementsNum(&circularBuffer) < len_to_peek){
+    uint32_t len = strlen(tag);
+    if (circularBufferUsedElementsNum(&circularBuffer) < len){
         return false;
     }
 
+    /* Compare in place */
+    CircularBufferSpan spans[2];
+    uint32_t numSpans = circularBufferLastSpans(&circularBuffer, len, spans);
+    for (uint32_t i=0; i<numSpans; i++){
+        if (memcmp(spans[i].data, tag, spans[i].len) != 0){
+            return false;
+        }
+        tag += spans[i].len;
+    }
+    return true;
+}
+
+
+/* Empties circularBuffer, mapping it the first time when mirrored */
+static void espRingReset(void)
+{
+#ifdef ESP_MIRRORED_RING
+    if (circularBuffer.mirrored){
+        circularBufferClear(&circularBuffer);
+        return;
+    }
+    if (circularBufferInitMirrored(&circularBuffer, MIRRORED_RING_SIZE)){
+        return;
+    }
+    espLogWarn("Cannot map the mirrored ring, using the arena");
+#endif
+    circularBufferInit(&circularBuffer, ringBuffer, CIRCULAR_BUFFER_SIZE);
+}
 
-    circularBufferPeekFromEndMultiple(&circularBuffer, circularBufferEndWithBuff, len_to_peek);
-    circularBufferEndWithBuff[len_to_peek] ='\0';
 
-    //printf("[%s] <> [%s]\n",tag, buf);
-    //for(int i=0;i<len_to_peek;i++){
-    //    printf("t %c[%x] <> r %c[%x]\n", tag[i], tag[i], buf[i], buf[i]);
-    //}
+/*
+* The readable bytes of circularBuffer as one string, where they are if contiguous
+* (always when mirrored), copied into lineBuffer otherwise. The caller writes the
+* terminating '\0' over the line end. Returns NULL if they do not fit in LIST_LINE_SIZE.
+*/
+static char *espRingLine(uint32_t *len)
+{
+    CircularBufferSpan spans[2];
+    uint32_t numSpans = circularBufferReadSpans(&circularBuffer, spans);
 
-    return memcmp(tag, circularBufferEndWithBuff, len_to_peek) == 0;
+    *len = spans[0].len + spans[1].len;
+    if (*len == 0 || *len > LIST_LINE_SIZE){
+        return NULL;
+    }
+    if (numSpans == 1){
+        return (char*)spans[0].data;
+    }
+    circularBufferPeekMultiple(&circularBuffer, (uint8_t*)lineBuffer, *len);
+    return lineBuffer;
 }
 
 
 void espEmptyBuf(int fd)
 {
 
-    char espEmptyBufBuff[50];
-
-    int rdlen;
+    rxChunkPos = rxChunkLen = 0;
 
-    while((rdlen = espRead(fd, espEmptyBufBuff, sizeof(espEmptyBufBuff) - 1)) > 0){
-        espEmptyBufBuff[rdlen] = '\0';
+    /* Discard into rxChunk */
+    while(espRead(fd, rxChunk, RX_CHUNK_SIZE) > 0){
         //printf("Discarded = [\n%s]\n", buf);
     }
     //printf("clr\n");
 }
 
 
-// Read from serial until one of the tags is found
-// Returns:
-//   the index of the tag found in the ESPTAGS array
-//   -1 if no tag was found (timeout)
-int espReadUntil(int fd, unsigned int timeout, const char* tag, bool findTags)
+/*
+* Makes sure there are unparsed bytes in rxChunk, reading a whole chunk from the serial port if needed.
+* Returns the number of unparsed bytes.
+*/
+static uint32_t espFillChunk(int fd, bool wait)
 {
+    if (rxChunkPos == rxChunkLen){
+        int rdlen = espRead(fd, rxChunk, RX_CHUNK_SIZE);
+
+        rxChunkPos = 0;
+        rxChunkLen = rdlen > 0 ? rdlen : 0;
+        if (rxChunkLen == 0 && wait){
+            /* Until bytes arrive or the deadline of the caller, see esp8266_wait.h */
+            espWaitRx();
+        }
+    }
+    return rxChunkLen - rxChunkPos;
+}
 
 
-    circularBufferClear(&circularBuffer);
-
-    unsigned long start = getCurrentMS();
-    int ret = -1;
+/* Registers a millisecond timeout of a blocking call in the timer wheel */
+static void espStartDeadline(EspTimer *deadline, unsigned int timeout)
+{
+    espTimerInit(deadline, NULL, NULL);
+    espTimerStartMS(deadline, timeout);
+}
 
 
-    while ((getCurrentMS() - start < timeout) && ret<0) {
-        char c;
+/*
+* Reads exactly len bytes, unparsed bytes in rxChunk first.
+* dest can be NULL to discard them.
+* Returns the number of bytes read before timeout.
+*/
+static uint32_t espReadBytes(int fd, unsigned int timeout, uint8_t *dest, uint32_t len)
+{
+    uint32_t readen = 0;
+    EspTimer deadline;
 
-        //Read one char
-        if(espRead(fd, &c, sizeof(c)) > 0){
+    espStartDeadline(&deadline, timeout);
 
-            circularBufferPut(&circularBuffer, c);
+    while (espTimerPending(&deadline) && readen < len) {
+        uint32_t available = espFillChunk(fd, true);
+        if (available > len - readen){
+            available = len - readen;
+        }
 
-            if (tag!=NULL) {
-                if (circularBufferEndWith(tag)){
-                    ret = NUMESPTAGS;
-                }
-            }
-            if(findTags)
-            {
-                for(int i=0; i<NUMESPTAGS; i++)
-                {
-                    if (circularBufferEndWith(ESPTAGS[i]))
-                    {
-                        ret = i;
-                        break;
-                    }
-                }
-            }
+        if (dest){
+            memcpy(dest + readen, rxChunk + rxChunkPos, available);
         }
+        rxChunkPos += available;
+        readen += available;
     }
 
-    if (getCurrentMS() - start >= timeout)
-    {
-        printf("espReadUntil TIMEOUT!\n");
+    espTimerCancel(&deadline);
+    return readen;
+}
+
+
+/* Appends to circularBuffer dropping the oldest bytes if needed, so its end is always the latest input */
+static void espRingPut(const uint8_t *data, uint32_t len)
+{
+    uint32_t freeSpace = circularBufferFreeElementsNum(&circularBuffer);
+
+    if (len>freeSpace){
+        circularBufferDiscardMultiple(&circularBuffer, len-freeSpace);
     }
+    circularBufferPutMultiple(&circularBuffer, data, len);
+}
 
-    return ret;
+
+static int hexDigit(char c)
+{
+    if (c>='0' && c<='9') return c-'0';
+    if (c>='a' && c<='f') return c-'a'+10;
+    if (c>='A' && c<='F') return c-'A'+10;
+    return -1;
 }
 
-/*
-* Sends the AT command and returns the id of the TAG.
-* The additional arguments are formatted into the command using sprintf.
-* Return -1 if no tag is found.
-*/
-int espSendCmd(int fd, const char* cmd, int timeout, ...)
+
+static const char *espParseUInt(const char *p, uint32_t *value)
 {
+    if (*p<'0' || *p>'9'){
+        return NULL;
+    }
+    *value = 0;
+    while (*p>='0' && *p<='9'){
+        *value = *value*10 + (*p++ - '0');
+    }
+    return p;
+}
 
-    char tmpBuf[CMD_BUFFER_SIZE];
 
-    va_list args;
-    va_start (args, timeout);
-    vsnprintf(tmpBuf, CMD_BUFFER_SIZE, (char*)cmd, args);
-    va_end (args);
+/* Parses a dotted ip "a.b.c.d" */
+static const char *espParseIp(const char *p, uint8_t *ip)
+{
+    uint32_t value;
 
-    espPrintln(fd, tmpBuf, strlen(tmpBuf));
-    //printf("espSendCmd>>%s\n",tmpBuf);
+    for (int i=0; i<4; i++){
+        if (!(p = espParseUInt(p, &value)) || value>255 || (i<3 && *p++!='.')){
+            return NULL;
+        }
+        ip[i] = value;
+    }
+    return p;
+}
 
-    int idx = espReadUntil(fd, timeout, NULL, true);
 
-    return idx;
+/* Parses a mac "aa:bb:cc:dd:ee:ff" */
+static const char *espParseMac(const char *p, uint8_t *mac)
+{
+    for (int i=0; i<6; i++){
+        int hi = hexDigit(p[0]);
+        int lo = hexDigit(p[1]);
+        if (hi<0 || lo<0 || (i<5 && p[2]!=':')){
+            return NULL;
+        }
+        mac[i] = (hi<<4) | lo;
+        p += (i<5) ? 3 : 2;
+    }
+    return p;
 }
 
 
-bool espWifiConnect(int fd, const char* ssid, const char *passphrase) {
+static void espAddDelim(uint8_t *delims, uint32_t *numDelims, uint8_t delim)
+{
+    for (uint32_t i=0; i<*numDelims; i++){
+        if (delims[i]==delim){
+            return;
+        }
+    }
+    delims[(*numDelims)++] = delim;
+}
 
-    // TODO
-    // Escape character syntax is needed if "SSID" or "password" contains
-    // any special characters (',', '"' and '/')
 
-    // connect to access point, use CUR mode to avoid connection at boot
-    int ret = espSendCmd(fd, "AT+CWJAP_CUR=\"%s\",\"%s\"\r\n", 20000, ssid, passphrase);
+static bool espDispatchLinkEvent(const char *l, uint32_t lineLen)
+{
+    if (lineLen<3 || l[0]<'0' || l[0]>='0'+NUM_LINKS || l[1]!=','){
+        return false;
+    }
 
-    if (ret==TAG_WIFI_CONNECTED)
-    {
-        printf("Connected to %s\n", ssid);
+    uint8_t conn_id = l[0]-'0';
+
+    if (lineLen==9 && memcmp(l+2, "CONNECT", 7)==0){
+        linkOpen[conn_id] = true;
+        if (eventHandlers.onConnect){
+            eventHandlers.onConnect(eventHandlers.ctx, conn_id);
+        }
+    }
+    else if ((lineLen==8 && memcmp(l+2, "CLOSED", 6)==0) ||
+             (lineLen==14 && memcmp(l+2, "CONNECT FAIL", 12)==0)){
+        linkOpen[conn_id] = false;
+        if (eventHandlers.onClose){
+            eventHandlers.onClose(eventHandlers.ctx, conn_id);
+        }
     }
     else{
-        printf("Not connected to %s\n", ssid);
         return false;
     }
+    return true;
+}
 
-    ret = espReadUntil(fd, 5000, "WIFI GOT IP\r\n", false);
 
-    if (ret==NUMESPTAGS)
-    {
-        printf("Got IP from %s\n", ssid);
+static EspStation *espFindStation(const uint8_t *mac)
+{
+    for (uint32_t i=0; i<numStations; i++){
+        if (memcmp(stations[i].mac, mac, 6)==0){
+            return &stations[i];
+        }
     }
+    return NULL;
+}
 
-    ret = espReadUntil(fd, 5000, NULL, true);
 
-    if (ret==TAG_OK)
-    {
-        printf("Connected and RDY!\n");
-        return true;
+static EspStation *espAddStation(const uint8_t *mac)
+{
+    EspStation *station = espFindStation(mac);
+
+    if (!station){
+        if (numStations==stationsCapacity){
+            stationsDropped++;
+            return NULL;
+        }
+        station = &stations[numStations++];
+        memcpy(station->mac, mac, 6);
+        station->hasIp = false;
     }
+    return station;
+}
 
-    printf("Failed connecting to %s\n", ssid);
 
-    // clean additional messages logged after the FAIL tag
-    delayMS(1000);
+/* "+STA_CONNECTED:"<mac>"", "+DIST_STA_IP:"<mac>","<ip>"" and "+STA_DISCONNECTED:"<mac>"" */
+static bool espDispatchStationEvent(const char *l, uint32_t lineLen)
+{
+    uint8_t mac[6];
+    const char *p;
+    EspStation *station;
 
-    return false;
+    if (lineLen>16 && memcmp(l, "+STA_CONNECTED:\"", 16)==0){
+        if (!espParseMac(l+16, mac)){
+            return false;
+        }
+        station = espAddStation(mac);
+        if (station && eventHandlers.onStation){
+            eventHandlers.onStation(eventHandlers.ctx, station, true);
+        }
+    }
+    else if (lineLen>14 && memcmp(l, "+DIST_STA_IP:\"", 14)==0){
+        if (!(p = espParseMac(l+14, mac)) || memcmp(p, "\",\"", 3)!=0){
+            return false;
+        }
+        station = espAddStation(mac);
+        if (station){
+            if (!espParseIp(p+3, station->ip)){
+                return false;
+            }
+            station->hasIp = true;
+            if (eventHandlers.onStation){
+                eventHandlers.onStation(eventHandlers.ctx, station, true);
+            }
+        }
+    }
+    else if (lineLen>19 && memcmp(l, "+STA_DISCONNECTED:\"", 19)==0){
+        if (!espParseMac(l+19, mac)){
+            return false;
+        }
+        station = espFindStation(mac);
+        if (station){
+            if (eventHandlers.onStation){
+                eventHandlers.onStation(eventHandlers.ctx, station, false);
+            }
+            /* Keep the table packed */
+            *station = stations[--numStations];
+        }
+    }
+    else{
+        return false;
+    }
+    return true;
 }
 
 
-
 /*
-* Sends the AT command and stops if any of the TAGS is found.
-* Extract the string enclosed in the passed tags and returns it in the outStr buffer.
-* Returns true if the string is extracted, false if tags are not found of timed out.
+* Called when circularBuffer ends with '\n'. Dispatches link and station event lines
+* and removes them from circularBuffer.
+* Returns true if the line was an event.
 */
-bool espSendCmdGet(int fd, const char* cmd, const char* startTag, const char* endTag, char* outStr, int outStrLen)
+static bool espDispatchLineEvent(void)
 {
-    int idx;
-    bool ret = false;
+    const uint8_t *line = (const uint8_t*)lineBuffer;
+    uint32_t used = circularBufferUsedElementsNum(&circularBuffer);
+    uint32_t len = used < EVENT_LINE_SIZE ? used : EVENT_LINE_SIZE;
 
-    outStr[0] = '\0';
+    if (len < 4){
+        return false;
+    }
 
-    if (cmd){
+    /* Parse in place unless the line is split by the end of the ring */
+    CircularBufferSpan spans[2];
+    if (circularBufferLastSpans(&circularBuffer, len, spans) == 1){
+        line = spans[0].data;
+    }
+    else{
+        circularBufferPeekFromEndMultiple(&circularBuffer, (uint8_t*)lineBuffer, len);
+    }
 
-        // send AT command to ESP
-        espPrintln(fd, cmd, strlen(cmd));
+    if (line[len-2] != '\r'){
+        return false;
     }
 
-    // read result until the startTag is found
-    idx = espReadUntil(fd, 1000, startTag, true);
+    /* Find where the line starts */
+    uint32_t start = len-2;
+    while (start>0 && line[start-1]!='\n'){
+        start--;
+    }
+    if (start==0 && used>len){
+        /* Longer than any event */
+        return false;
+    }
 
-    if(idx==NUMESPTAGS)
-    {
+    uint32_t lineLen = len-2-start;
+    const char *l = (const char*)line+start;
+    bool isEvent;
 
-        // start tag found, search the endTag
-        idx = espReadUntil(fd, 500, endTag, true);
+    if (l[0]=='+'){
+        isEvent = espDispatchStationEvent(l, lineLen);
+    }
+    else{
+        isEvent = espDispatchLinkEvent(l, lineLen);
+    }
 
-        if(idx==NUMESPTAGS)
-        {
-            // end tag found
-            // copy result to output buffer avoiding overflow
-            //ringBuf.getStrN(outStr, strlen(endTag), outStrLen-1);
+    if (!isEvent){
+        return false;
+    }
 
-            //circularBufferDiscardMultiple(&circularBuffer, strlen(endTag));
-            int copied_chars = circularBufferUsedElementsNum(&circularBuffer);
-            if (outStrLen<copied_chars){
-                copied_chars = outStrLen;
-            }
-            //circularBufferGetMultiple(&circularBuffer, outStr, outStrLen-1);
-            //-1 to allow space for null terminating
-            circularBufferGetMultiple(&circularBuffer, outStr, copied_chars-1);
-            outStr[copied_chars] = '\0';
+    numEvents++;
+    circularBufferDiscardFromEnd(&circularBuffer, lineLen+2);
+    return true;
+}
 
-            // read the remaining part of the response
-            espReadUntil(fd, 2000, NULL, true);
 
-            ret = true;
-        }
-        else
-        {
-            printf("End tag not found\n");
-        }
-    }
-    else if(idx>=0 && idx<NUMESPTAGS)
-    {
-        // the command has returned but no start tag is found
-        printf("No start tag found: %d\n", idx);
-    }
-    else
-    {
-        // the command has returned but no tag is found
-        printf("No tag found\n");
+/*
+* Parses "<id>,<len>[,<ip>,<port>]" as sent after "+IPD,".
+* Returns false if the header is malformed.
+*/
+static bool espParseIpdHeader(const char *header, EspIpdInfo *info)
+{
+    uint32_t value;
+    const char *p = header;
+
+    memset(info, 0, sizeof(*info));
+
+    if (!(p = espParseUInt(p, &value)) || *p++!=',' || value>=NUM_LINKS){
+        return false;
     }
+    info->conn_id = value;
 
-    return ret;
-}
+    if (!(p = espParseUInt(p, &value))){
+        return false;
+    }
+    info->length = value;
 
+    /* Remote ip and port are only there with AT+CIPDINFO=1 */
+    if (*p++!=','){
+        return true;
+    }
 
-char* espFwVersion(int fd) {
-    printf("> getFwVersion");
+    if (!(p = espParseIp(p, info->ip)) || *p++!=','){
+        return false;
+    }
 
-    espSendCmdGet(fd,"AT+GMR\r\n", "SDK version:", "\r\n", fwVersion, sizeof(fwVersion));
+    if (!(p = espParseUInt(p, &value)) || value>0xFFFF){
+        return false;
+    }
+    info->port = value;
 
-    return fwVersion;
+    return true;
 }
 
 
-void espReset(int fd)
+/*
+* Called right after "+IPD," is consumed. Reads the frame header and hands the payload
+* over to eventHandlers.onData in place, straight from rxChunk.
+*/
+static void espDispatchData(int fd, unsigned int timeout)
 {
-    //printf("> reset\n");
+    char *header = lineBuffer;
+    uint32_t headerLen = 0;
+    uint32_t buffered = rxChunkLen - rxChunkPos;
+    const uint8_t *colon = memchr(rxChunk+rxChunkPos, ':', buffered < LIST_LINE_SIZE-1 ? buffered : LIST_LINE_SIZE-1);
+
+    if (colon){
+        /* The whole header is already in rxChunk, the usual case */
+        headerLen = colon - (rxChunk+rxChunkPos);
+        memcpy(header, rxChunk+rxChunkPos, headerLen);
+        rxChunkPos += headerLen+1;
+    }
+    else{
+        while (headerLen<LIST_LINE_SIZE-1){
+            if (espReadBytes(fd, timeout, (uint8_t*)header+headerLen, 1)!=1){
+                return;
+            }
+            if (header[headerLen]==':'){
+                break;
+            }
+            headerLen++;
+        }
+    }
+    header[headerLen] = '\0';
 
-    //TODO: Uncomment here or better to use an IO to reset ESP8266 module
-    //espSendCmd(fd, "AT+RST\r\n", 1000);
-    //delayMS(3000);
-    delayMS(1000);
-    espEmptyBuf(fd);  // empty dirty characters from the buffer
+    EspIpdInfo info;
+    if (!espParseIpdHeader(header, &info)){
+        espLogError("Bad +IPD header [%s]", header);
+        return;
+    }
 
-    // disable echo of commands
-    espSendCmd(fd, "ATE0\r\n", 1000);
+    uint32_t offset = 0;
+    EspTimer deadline;
 
-    // set station mode
-    espSendCmd(fd,"AT+CWMODE=1\r\n", 1000);
-    delayMS(10000);
+    if (info.length && rxChunkLen - rxChunkPos >= info.length){
+        /* Nothing to wait for */
+        eventHandlers.onData(eventHandlers.ctx, &info, 0, rxChunk+rxChunkPos, info.length);
+        rxChunkPos += info.length;
+        numEvents++;
+        return;
+    }
 
-    // set multiple connections mode
-    espSendCmd(fd,"AT+CIPMUX=1\r\n", 1000);
+    espStartDeadline(&deadline, timeout);
 
-    // Show remote IP and port with "+IPD"
-    espSendCmd(fd,"AT+CIPDINFO=1\r\n", 1000);
+    while (offset<info.length && espTimerPending(&deadline)){
+        uint32_t available = espFillChunk(fd, true);
+        if (available>info.length-offset){
+            available = info.length-offset;
+        }
+        if (available==0){
+            continue;
+        }
 
-    // Disable autoconnect
-    // Automatic connection can create problems during initialization phase at next boot
-    espSendCmd(fd,"AT+CWAUTOCONN=0\r\n", 1000);
+        eventHandlers.onData(eventHandlers.ctx, &info, offset, rxChunk+rxChunkPos, available);
+        rxChunkPos += available;
+        offset += available;
+    }
 
-    // enable DHCP
-    espSendCmd(fd,"AT+CWDHCP=1,1\r\n", 1000);
-    delayMS(200);
+    espTimerCancel(&deadline);
+    numEvents++;
 }
 
 
-bool espDriverInit(int fd){
-
+/* "ready" out of the blue: the module restarted (brownout, watchdog) and lost links and settings */
+static void espOnModuleRestart(void)
+{
+    health.reboots++;
+    restoreNeeded = true;
+    numStations = 0;
+
+    for (uint8_t conn_id=0; conn_id<NUM_LINKS; conn_id++){
+        if (linkOpen[conn_id]){
+            linkOpen[conn_id] = false;
+            if (eventHandlers.onClose){
+                eventHandlers.onClose(eventHandlers.ctx, conn_id);
+            }
+        }
+    }
+}
 
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
 
-    espSendCmd(fd, "ATE0\r\n", 1000);
+/*
+* Moves bytes from rxChunk into circularBuffer stopping right after the first tag found.
+* Only positions holding the last char of a tag can end a tag, so the chunk is
+* scanned for those chars and the tags are compared only there.
+* Returns the same as espReadUntil.
+*/
+static int espConsumeUntil(int fd, unsigned int timeout, const char* tag, bool findTags)
+{
+    uint8_t delims[3];
+    uint32_t numDelims = 0;
 
-    espSendCmd(fd, "ATE0\r\n", 1000);
+    if (tag!=NULL) {
+        espAddDelim(delims, &numDelims, tag[strlen(tag)-1]);
+    }
+    /* Every ESPTAGS entry and every event line ends with "\r\n" */
+    espAddDelim(delims, &numDelims, '\n');
+    /* "+IPD," */
+    if (eventHandlers.onData) {
+        espAddDelim(delims, &numDelims, ',');
+    }
 
-    espSendCmd(fd, "ATE0\r\n", 1000);
+    EspTimer deadline;
+    int ret = -1;
 
-    bool initOK = false;
+    espStartDeadline(&deadline, timeout);
 
-    for(int i=0; i<5; i++)
-    {
-        if (espSendCmd(fd, "AT\r\n", 1000) == TAG_OK)
+    while (ret<0 && espTimerPending(&deadline) && (eventsStopAt==0 || numEvents<eventsStopAt)) {
+        bool burstDone = eventsBurstFrom >= 0 && numEvents > eventsBurstFrom;
+        uint32_t available = espFillChunk(fd, !burstDone);
+        if (available == 0){
+            if (burstDone){
+                break;
+            }
+            continue;
+        }
+
+        uint32_t delimPos;
+        uint8_t *chunk = rxChunk + rxChunkPos;
+
+        if (espScanDelims(chunk, available, delims, numDelims, &delimPos, 1) == 0){
+            /* No tag can end in this chunk */
+            espRingPut(chunk, available);
+            rxChunkPos += available;
+            continue;
+        }
+
+        espRingPut(chunk, delimPos+1);
+        rxChunkPos += delimPos+1;
+
+        if (chunk[delimPos]=='\n' && espDispatchLineEvent()){
+            continue;
+        }
+        if (chunk[delimPos]==',' && eventHandlers.onData && circularBufferEndWith("+IPD,")){
+            uint32_t dispatchStart = getCurrentUS();
+            uint32_t end = deadline.deadline;
+
+            circularBufferDiscardFromEnd(&circularBuffer, 5);
+            espDispatchData(fd, timeout > IPD_PAYLOAD_TIMEOUT ? timeout : IPD_PAYLOAD_TIMEOUT);
+
+            /* The payload of another link is not part of the wait, the deadline is paused meanwhile */
+            uint32_t spent = getCurrentUS() - dispatchStart;
+            ipdTimeUS += spent;
+            espTimerStartAt(&deadline, end + spent);
+            continue;
+        }
+
+        if (tag!=NULL) {
+            if (circularBufferEndWith(tag)){
+                ret = NUMESPTAGS;
+            }
+        }
+        if(findTags)
         {
-            initOK=true;
-            break;
+            for(int i=0; i<NUMESPTAGS; i++)
+            {
+                if (circularBufferEndWith(ESPTAGS[i]))
+                {
+                    ret = i;
+                    break;
+                }
+            }
+        }
+        else if (chunk[delimPos]=='\n')
+        {
+            for(int i=FIRST_RECOVERY_TAG; i<NUMESPTAGS; i++)
+            {
+                if (circularBufferEndWith(ESPTAGS[i]))
+                {
+                    ret = i;
+                    break;
+                }
+            }
+        }
+
+        if (ret==TAG_READY){
+            espOnModuleRestart();
         }
-        delayMS(1000);
     }
 
-    if (!initOK)
+    espTimerCancel(&deadline);
+    return ret;
+}
+
+
+// Read from serial until one of the tags is found
+// Returns:
+//   the index of the tag found in the ESPTAGS array
+//   -1 if no tag was found (timeout)
+int espReadUntil(int fd, unsigned int timeout, const char* tag, bool findTags)
+{
+
+
+    circularBufferClear(&circularBuffer);
+
+    int ret = espConsumeUntil(fd, timeout, tag, findTags);
+
+    if (ret < 0)
     {
-        printf("Cannot initialize ESP module\n");
-        return false;
+        espLogWarn("espReadUntil TIMEOUT!");
     }
 
-    espReset(fd);
+    return ret;
+}
 
-    // check firmware version - Maybe a different function
-    espFwVersion(fd);
 
-    // prints a warning message if the firmware is not 1.X
-    if (fwVersion[0] != '1' || fwVersion[1] != '.') {
-        printf("Warning: Unsupported firmware %s\n", fwVersion);
+/* Smallest rttvar term, the blocking loops count whole milliseconds */
+#define RTT_GRANULARITY_US 1000
+
+/* Initial timeout and bounds of every EspCmdClass, in ms */
+static const uint32_t rttDefaults[NUM_CMD_CLASSES][3] =
+{
+    /* initial, min, max */
+    {1000, 20, 2000},       /* ESP_CMD_LOCAL */
+    {1000, 100, 5000},      /* ESP_CMD_FLASH */
+    {2000, 20, 2000},       /* ESP_CMD_PROMPT */
+    {2000, 50, 5000},       /* ESP_CMD_SEND */
+    {3000, 200, 10000},     /* ESP_CMD_CONNECT */
+    {20000, 2000, 20000},   /* ESP_CMD_WIFI */
+    {10000, 1000, 20000},   /* ESP_CMD_HANDSHAKE */
+};
+
+static EspRttStats rtt[NUM_CMD_CLASSES];
+
+
+static void espRttClamp(EspRttStats *r)
+{
+    if (r->rtoUS < r->minUS){
+        r->rtoUS = r->minUS;
     }
-    else
-    {
-        printf("Initilization successful %s\n", fwVersion);
+    if (r->rtoUS > r->maxUS){
+        r->rtoUS = r->maxUS;
     }
-    return true;
 }
 
+static EspRttStats *espRtt(EspCmdClass cls)
+{
+    EspRttStats *r = &rtt[cls];
 
-bool espDriverMode(int fd, EspMode mode){
+    if (r->maxUS == 0){
+        r->minUS = rttDefaults[cls][1] * 1000;
+        r->maxUS = rttDefaults[cls][2] * 1000;
+        r->rtoUS = rttDefaults[cls][0] * 1000;
+        espRttClamp(r);
+    }
+    return r;
+}
 
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
+static unsigned int espRttTimeoutMS(EspCmdClass cls)
+{
+    return (espRtt(cls)->rtoUS + 999) / 1000;
+}
 
-    if ( espSendCmd(fd, "AT+CWMODE=%d\r\n", 1000, mode)  == TAG_OK){
-        printf("Current mode is %d\n",mode);
-        return true;
+static void espRttSample(EspCmdClass cls, bool answered, uint32_t elapsedUS)
+{
+    EspRttStats *r = espRtt(cls);
+
+    if (!answered){
+        /* Back off, the estimate stays until the module answers again */
+        r->timeouts++;
+        r->rtoUS = (r->rtoUS > r->maxUS/2) ? r->maxUS : r->rtoUS*2;
+        return;
+    }
+
+    if (r->samples == 0){
+        r->srttUS = elapsedUS;
+        r->rttvarUS = elapsedUS / 2;
     }
     else{
-        printf("Cannot set mode to %d\n",mode);
+        uint32_t err = (r->srttUS > elapsedUS) ? r->srttUS - elapsedUS : elapsedUS - r->srttUS;
+        r->rttvarUS = r->rttvarUS - r->rttvarUS/4 + err/4;
+        r->srttUS = r->srttUS - r->srttUS/8 + elapsedUS/8;
+    }
+    r->samples++;
+
+    uint32_t var = 4 * r->rttvarUS;
+    r->rtoUS = r->srttUS + (var > RTT_GRANULARITY_US ? var : RTT_GRANULARITY_US);
+    espRttClamp(r);
+}
+
+/* UART time of len bytes, 10 bits each */
+static uint32_t espWireTimeUS(uint32_t len)
+{
+    uint32_t baud = uartBaud ? uartBaud : ESP_UART_BAUD;
+
+    return (uint32_t)((uint64_t)len * 10000000u / baud);
+}
+
+/*
+* espReadUntil() with the learned timeout of cls, the response time is fed back.
+* wireUS is the UART time of what was just written, it adds to the timeout and is
+* left out of the sample so one estimate holds for every payload size.
+*/
+static int espAwait(int fd, EspCmdClass cls, const char* tag, bool findTags, uint32_t wireUS)
+{
+    uint32_t start = getCurrentUS();
+    uint32_t ipdStart = ipdTimeUS;
+
+    int ret = espReadUntil(fd, espRttTimeoutMS(cls) + (wireUS + 999)/1000, tag, findTags);
+
+    /* busy and ready are not answers to the command, they say nothing about its response time */
+    if (ret<FIRST_RECOVERY_TAG || ret==NUMESPTAGS){
+        uint32_t elapsed = getCurrentUS() - start - (ipdTimeUS - ipdStart);
+        espRttSample(cls, ret>=0, elapsed > wireUS ? elapsed - wireUS : 0);
+    }
+    return ret;
+}
+
+
+void espSetTimeoutBounds(EspCmdClass cls, uint32_t minMS, uint32_t maxMS)
+{
+    if (cls >= NUM_CMD_CLASSES || minMS == 0 || minMS > maxMS){
+        return;
+    }
+    EspRttStats *r = espRtt(cls);
+    r->minUS = minMS * 1000;
+    r->maxUS = maxMS * 1000;
+    espRttClamp(r);
+}
+
+
+void espSetUartBaud(uint32_t baud)
+{
+    uartBaud = baud;
+}
+
+
+bool espGetRttStats(EspCmdClass cls, EspRttStats *stats)
+{
+    if (cls >= NUM_CMD_CLASSES){
         return false;
     }
+    *stats = *espRtt(cls);
+    return true;
+}
 
+
+void espResetRtt(void)
+{
+    for (int cls=0; cls<NUM_CMD_CLASSES; cls++){
+        EspRttStats *r = espRtt(cls);
+        r->srttUS = r->rttvarUS = 0;
+        r->samples = r->timeouts = 0;
+        r->rtoUS = rttDefaults[cls][0] * 1000;
+        espRttClamp(r);
+    }
 }
 
 
-bool espTxPower(int fd, int txPower){
+static void espWriteCmd(int fd, const char* cmd, va_list args)
+{
+    vsnprintf(cmdBuffer, CMD_BUFFER_SIZE, (char*)cmd, args);
 
-	if ( txPower<0 || 82<txPower){
-		return false;
+    espPrintln(fd, cmdBuffer, strlen(cmdBuffer));
+    //printf("espSendCmd>>%s\n",cmdBuffer);
+}
 
-	}
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
+/*
+* Sends the AT command and returns the id of the TAG.
+* The additional arguments are formatted into the command using sprintf.
+* Return -1 if no tag is found.
+*/
+int espSendCmd(int fd, const char* cmd, int timeout, ...)
+{
+
+    va_list args;
+    va_start (args, timeout);
+    espWriteCmd(fd, cmd, args);
+    va_end (args);
+
+    int idx = espReadUntil(fd, timeout, NULL, true);
+
+    return idx;
+}
+
+
+/* Recovery ------------------------------------------------------------------*/
+
+/* busy answers retried before going for a resync */
+#define BUSY_RETRIES 5
+/* First backoff, doubled on every retry plus up to the same amount of jitter */
+#define BACKOFF_BASE_MS 10
+#define RESYNC_PROBES 3
+/* From AT+RST or the hard reset to "ready" */
+#define RESET_READY_TIMEOUT 5000
+
+/* Commands that can be sent again once the module answers, without side effects if it ran the first one */
+static const bool classReplayable[NUM_CMD_CLASSES] =
+{
+    true,   /* ESP_CMD_LOCAL */
+    true,   /* ESP_CMD_FLASH */
+    false,  /* ESP_CMD_PROMPT */
+    false,  /* ESP_CMD_SEND */
+    true,   /* ESP_CMD_CONNECT, a second CIPSTART answers ALREADY CONNECTED */
+    false,  /* ESP_CMD_WIFI */
+    true,   /* ESP_CMD_HANDSHAKE, same as ESP_CMD_CONNECT */
+};
+
+/*
+* Answers of the CIPSEND data phase. Until the module took the whole payload it reads
+* anything written as data, AT probes included, so a missing answer never resyncs or
+* resets the module: it fails the link only.
+*/
+static const bool classDataPhase[NUM_CMD_CLASSES] =
+{
+    false,  /* ESP_CMD_LOCAL */
+    false,  /* ESP_CMD_FLASH */
+    true,   /* ESP_CMD_PROMPT */
+    true,   /* ESP_CMD_SEND */
+    false,  /* ESP_CMD_CONNECT */
+    false,  /* ESP_CMD_WIFI */
+    false,  /* ESP_CMD_HANDSHAKE */
+};
+
+static uint32_t jitterSeed = 0;
+
+static void espBackoff(uint32_t attempt)
+{
+    uint32_t base = BACKOFF_BASE_MS << attempt;
+
+    if (jitterSeed==0){
+        jitterSeed = getCurrentUS() | 1;
+    }
+    /* xorshift32 */
+    jitterSeed ^= jitterSeed << 13;
+    jitterSeed ^= jitterSeed >> 17;
+    jitterSeed ^= jitterSeed << 5;
+
+    espSleepMS(base + jitterSeed % base);
+}
+
+static bool espIsBusy(int tag)
+{
+    return tag==TAG_BUSY_P || tag==TAG_BUSY_S;
+}
+
+static void espRecovered(uint32_t troubleStartUS)
+{
+    health.state = ESP_HEALTH_OK;
+    health.recoveries++;
+    health.lastRecoveryUS = getCurrentUS() - troubleStartUS;
+    health.totalRecoveryUS += health.lastRecoveryUS;
+}
+
+static int espCommand(int fd, EspCmdClass cls, const char* cmd, ...);
+
+/*
+* espAwait() for a classDataPhase answer. Past the learned timeout the answer is
+* still waited for up to the class maximum, a late ">" or SEND OK is still good.
+*/
+static int espAwaitDataPhase(int fd, EspCmdClass cls, const char* tag, bool findTags, uint32_t wireUS)
+{
+    int ret = espAwait(fd, cls, tag, findTags, wireUS);
+
+    if (ret<0){
+        health.timeouts++;
+        /* Keeps what already arrived of the answer */
+        ret = espConsumeUntil(fd, espRtt(cls)->maxUS/1000 + (wireUS + 999)/1000, tag, findTags);
+    }
+    return ret;
+}
+
+/* Settings espReset() and the application gave the module, lost when it restarts */
+static bool espRestoreConfig(int fd)
+{
+    espSendCmd(fd, "ATE0\r\n", espRttTimeoutMS(ESP_CMD_LOCAL));
+
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPMUX=1\r\n") != TAG_OK ||
+        espCommand(fd, ESP_CMD_LOCAL, "AT+CIPDINFO=1\r\n") != TAG_OK){
+        return false;
+    }
+    if (sslBufferSize && espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSSLSIZE=%u\r\n", sslBufferSize) != TAG_OK){
+        return false;
+    }
+    if (serverRunning){
+        return espStartTCPServer(fd, serverPort, serverMaxConn, serverIdleTimeout);
+    }
+    return true;
+}
+
+/* Drops whatever is pending and probes with AT until the module answers OK */
+static bool espResync(int fd)
+{
+    health.state = ESP_HEALTH_RESYNC;
+    health.resyncs++;
+
+    for (uint32_t i=0; i<RESYNC_PROBES; i++){
+        espEmptyBuf(fd);
+        circularBufferClear(&circularBuffer);
+
+        int ret = espSendCmd(fd, "AT\r\n", espRttTimeoutMS(ESP_CMD_LOCAL));
+        if (ret==TAG_OK){
+            return true;
+        }
+        /* ready means it just restarted, it answers the next probe */
+        if (ret!=TAG_READY){
+            espBackoff(i);
+        }
+    }
+    return false;
+}
+
+static bool espWaitReady(int fd)
+{
+    int ret = espReadUntil(fd, RESET_READY_TIMEOUT, ESPTAGS[TAG_READY], false);
+
+    restoreNeeded = true;
+    return ret==TAG_READY || ret==NUMESPTAGS;
+}
+
+/* A restarted module answers the probe but has lost its settings */
+static bool espResyncAndRestore(int fd)
+{
+    if (!espResync(fd)){
+        return false;
+    }
+    if (restoreNeeded){
+        if (!espRestoreConfig(fd)){
+            return false;
+        }
+        restoreNeeded = false;
+    }
+    return true;
+}
 
-    if ( espSendCmd(fd, "AT+RFPOWER=%d\r\n", 1000, txPower)  == TAG_OK){
-        printf("Current TxPower is %d\n",txPower);
+/* AT probe, then AT+RST, then the hard reset handler if there is one */
+static bool espRecoverSteps(int fd)
+{
+    if (espResyncAndRestore(fd)){
         return true;
     }
-    else{
-        printf("Cannot set TxPower to %d\n",txPower);
+
+    health.state = ESP_HEALTH_SOFT_RESET;
+    health.softResets++;
+    espEmptyBuf(fd);
+    espPrintln(fd, "AT+RST\r\n", 8);
+    if (espWaitReady(fd) && espResyncAndRestore(fd)){
+        return true;
+    }
+
+    if (hardResetHandler){
+        health.state = ESP_HEALTH_HARD_RESET;
+        health.hardResets++;
+        hardResetHandler(hardResetCtx);
+        if (espWaitReady(fd) && espResyncAndRestore(fd)){
+            return true;
+        }
+    }
+
+    health.state = ESP_HEALTH_DEAD;
+    return false;
+}
+
+
+bool espRecover(int fd)
+{
+    if (recovering){
         return false;
     }
 
+    uint32_t start = getCurrentUS();
+
+    recovering = true;
+    bool ok = espRecoverSteps(fd);
+    recovering = false;
+
+    if (ok){
+        espRecovered(start);
+    }
+    else{
+        health.failures++;
+    }
+    return ok;
 }
 
-//<mode>
-//0 : set ESP8266 soft-AP
-//1 : set ESP8266 station
-// 2 : set both softAP and station
-//<en>
-//0 : Disable DHCP
-//1 : Enable DHCP
 
-bool espDHCP(int fd, EspMode mode, int enabled){
-    // from 0 to 2 here
-    mode-=1;
+/*
+* espSendCmd() with the learned timeout of cls and the recovery layer:
+* busy answers are retried with jittered backoff, an unanswered command resyncs
+* (or resets) the module and is sent once more if its class is replayable.
+*/
+static int espCommandV(int fd, EspCmdClass cls, const char* tag, bool findTags, const char* cmd, va_list args)
+{
+    bool trouble = false;
+    bool replayed = false;
+    uint32_t busyRetries = 0;
+
+    if (restoreNeeded && !recovering){
+        espRecover(fd);
+    }
+
+    /* Time to recovery counts from the first try, detecting the failure is part of it */
+    uint32_t troubleStart = getCurrentUS();
+
+    for (;;){
+        va_list attemptArgs;
+        va_copy(attemptArgs, args);
+        /* Recovery commands reuse cmdBuffer, format it again on every attempt */
+        espWriteCmd(fd, cmd, attemptArgs);
+        va_end(attemptArgs);
+
+        int ret = classDataPhase[cls] ? espAwaitDataPhase(fd, cls, tag, findTags, 0) : espAwait(fd, cls, tag, findTags, 0);
+
+        if (ret>=0 && !espIsBusy(ret) && ret!=TAG_READY){
+            if (trouble && !recovering){
+                espRecovered(troubleStart);
+            }
+            return ret;
+        }
+
+        trouble = true;
+
+        if (espIsBusy(ret)){
+            health.busy++;
+            if (busyRetries<BUSY_RETRIES){
+                /* The module dropped the command, sending it again is always safe */
+                health.state = ESP_HEALTH_BUSY;
+                espBackoff(busyRetries++);
+                health.replays++;
+                continue;
+            }
+        }
+        else if (ret<0){
+            if (classDataPhase[cls]){
+                /* Counted by espAwaitDataPhase(), the module may still be taking data */
+                espLogWarn("No answer in the data phase, link failed");
+                return ret;
+            }
+            health.timeouts++;
+        }
+
+        if (recovering || replayed){
+            return ret;
+        }
+
+        recovering = true;
+        bool recovered = espRecoverSteps(fd);
+        recovering = false;
+
+        if (!recovered){
+            health.failures++;
+            return ret;
+        }
+        if (!classReplayable[cls]){
+            espRecovered(troubleStart);
+            return ret;
+        }
+        replayed = true;
+        health.replays++;
+    }
+}
+
+static int espCommand(int fd, EspCmdClass cls, const char* cmd, ...)
+{
+    va_list args;
+    va_start (args, cmd);
+    int ret = espCommandV(fd, cls, NULL, true, cmd, args);
+    va_end (args);
+
+    return ret;
+}
+
+/* espCommand() waiting for tag, without the ESPTAGS unless findTags */
+static int espCommandUntil(int fd, EspCmdClass cls, const char* tag, bool findTags, const char* cmd, ...)
+{
+    va_list args;
+    va_start (args, cmd);
+    int ret = espCommandV(fd, cls, tag, findTags, cmd, args);
+    va_end (args);
+
+    return ret;
+}
+
+
+void espGetHealth(EspHealth *h)
+{
+    *h = health;
+}
+
+
+void espResetHealth(void)
+{
+    memset(&health, 0, sizeof(health));
+}
+
+
+void espSetHardReset(void (*reset)(void *ctx), void *ctx)
+{
+    hardResetHandler = reset;
+    hardResetCtx = ctx;
+}
+
+
+bool espWifiConnect(int fd, const char* ssid, const char *passphrase) {
+
+    // TODO
+    // Escape character syntax is needed if "SSID" or "password" contains
+    // any special characters (',', '"' and '/')
+
+    // connect to access point, use CUR mode to avoid connection at boot
+    int ret = espCommand(fd, ESP_CMD_WIFI, "AT+CWJAP_CUR=\"%s\",\"%s\"\r\n", ssid, passphrase);
+
+    if (ret==TAG_WIFI_CONNECTED)
+    {
+        espLogInfo("Connected to %s", ssid);
+    }
+    else{
+        espLogError("Not connected to %s", ssid);
+        return false;
+    }
+
+    ret = espReadUntil(fd, 5000, "WIFI GOT IP\r\n", false);
+
+    if (ret==NUMESPTAGS)
+    {
+        espLogInfo("Got IP from %s", ssid);
+    }
+
+    ret = espReadUntil(fd, 5000, NULL, true);
+
+    if (ret==TAG_OK)
+    {
+        espLogInfo("Connected and RDY!");
+        return true;
+    }
+
+    espLogError("Failed connecting to %s", ssid);
+
+    // clean additional messages logged after the FAIL tag
+    espSleepMS(1000);
+
+    return false;
+}
+
+
+
+/*
+* Sends the AT command and stops if any of the TAGS is found.
+* Extract the string enclosed in the passed tags and returns it in the outStr buffer.
+* Returns true if the string is extracted, false if tags are not found of timed out.
+*/
+bool espSendCmdGet(int fd, const char* cmd, const char* startTag, const char* endTag, char* outStr, int outStrLen)
+{
+    int idx;
+    bool ret = false;
+
+    outStr[0] = '\0';
+
+    if (cmd){
+
+        // send AT command to ESP
+        espPrintln(fd, cmd, strlen(cmd));
+    }
+
+    // read result until the startTag is found
+    if (cmd){
+        idx = espAwait(fd, ESP_CMD_LOCAL, startTag, true, 0);
+    }
+    else{
+        idx = espReadUntil(fd, 1000, startTag, true);
+    }
+
+    if(idx==NUMESPTAGS)
+    {
+
+        // start tag found, search the endTag
+        idx = espReadUntil(fd, 500, endTag, true);
+
+        if(idx==NUMESPTAGS)
+        {
+            // end tag found
+            // copy result to output buffer avoiding overflow
+            //ringBuf.getStrN(outStr, strlen(endTag), outStrLen-1);
+
+            //circularBufferDiscardMultiple(&circularBuffer, strlen(endTag));
+            int copied_chars = circularBufferUsedElementsNum(&circularBuffer);
+            if (outStrLen<copied_chars){
+                copied_chars = outStrLen;
+            }
+            //circularBufferGetMultiple(&circularBuffer, outStr, outStrLen-1);
+            //-1 to allow space for null terminating
+            circularBufferGetMultiple(&circularBuffer, outStr, copied_chars-1);
+            outStr[copied_chars-1] = '\0';
+
+            // read the remaining part of the response
+            espReadUntil(fd, 2000, NULL, true);
+
+            ret = true;
+        }
+        else
+        {
+            espLogError("End tag not found");
+        }
+    }
+    else if(idx>=0 && idx<NUMESPTAGS)
+    {
+        // the command has returned but no start tag is found
+        espLogError("No start tag found: %d", idx);
+    }
+    else
+    {
+        // the command has returned but no tag is found
+        espLogError("No tag found");
+    }
+
+    return ret;
+}
+
+
+char* espFwVersion(int fd) {
+    espLogDebug("getFwVersion");
+
+    espSendCmdGet(fd,"AT+GMR\r\n", "SDK version:", "\r\n", fwVersion, FW_VERSION_SIZE);
+
+    return fwVersion;
+}
+
+
+void espReset(int fd)
+{
+    //printf("> reset\n");
+
+    //TODO: Uncomment here or better to use an IO to reset ESP8266 module
+    //espSendCmd(fd, "AT+RST\r\n", 1000);
+    //delayMS(3000);
+    espSleepMS(1000);
+    espEmptyBuf(fd);  // empty dirty characters from the buffer
+
+    // disable echo of commands
+    espSendCmd(fd, "ATE0\r\n", 1000);
+
+    // set station mode
+    espCommand(fd, ESP_CMD_LOCAL, "AT+CWMODE=1\r\n");
+    espSleepMS(10000);
+
+    // set multiple connections mode
+    espCommand(fd, ESP_CMD_LOCAL, "AT+CIPMUX=1\r\n");
+
+    // Show remote IP and port with "+IPD"
+    espCommand(fd, ESP_CMD_LOCAL, "AT+CIPDINFO=1\r\n");
+
+    // Disable autoconnect
+    // Automatic connection can create problems during initialization phase at next boot
+    espCommand(fd, ESP_CMD_LOCAL, "AT+CWAUTOCONN=0\r\n");
+
+    // enable DHCP
+    espCommand(fd, ESP_CMD_LOCAL, "AT+CWDHCP=1,1\r\n");
+    espSleepMS(200);
+}
+
+
+bool espDriverInit(int fd){
+
+    if (!ringBuffer){
+        espLogError("No driver arena, call espDriverSetArena() first");
+        return false;
+    }
+
+    espRingReset();
+
+    espSendCmd(fd, "ATE0\r\n", 1000);
+
+    espSendCmd(fd, "ATE0\r\n", 1000);
+
+    espSendCmd(fd, "ATE0\r\n", 1000);
+
+    bool initOK = false;
+
+    for(int i=0; i<5; i++)
+    {
+        if (espSendCmd(fd, "AT\r\n", 1000) == TAG_OK)
+        {
+            initOK=true;
+            break;
+        }
+        espSleepMS(1000);
+    }
+
+    if (!initOK)
+    {
+        espLogError("Cannot initialize ESP module");
+        return false;
+    }
+
+    espReset(fd);
+
+    // check firmware version - Maybe a different function
+    espFwVersion(fd);
+
+    // prints a warning message if the firmware is not 1.X
+    if (fwVersion[0] != '1' || fwVersion[1] != '.') {
+        espLogWarn("Unsupported firmware %s", fwVersion);
+    }
+    else
+    {
+        espLogInfo("Initilization successful %s", fwVersion);
+    }
+    return true;
+}
+
+
+bool espDriverMode(int fd, EspMode mode){
+
+    espRingReset();
+
+    if ( espCommand(fd, ESP_CMD_LOCAL, "AT+CWMODE=%d\r\n", mode)  == TAG_OK){
+        espLogInfo("Current mode is %d",mode);
+        return true;
+    }
+    else{
+        espLogError("Cannot set mode to %d",mode);
+        return false;
+    }
+
+}
+
+
+bool espTxPower(int fd, int txPower){
+
+	if ( txPower<0 || 82<txPower){
+		return false;
+
+	}
+    espRingReset();
+
+    if ( espCommand(fd, ESP_CMD_LOCAL, "AT+RFPOWER=%d\r\n", txPower)  == TAG_OK){
+        espLogInfo("Current TxPower is %d",txPower);
+        return true;
+    }
+    else{
+        espLogError("Cannot set TxPower to %d",txPower);
+        return false;
+    }
+
+}
+
+//<mode>
+//0 : set ESP8266 soft-AP
+//1 : set ESP8266 station
+// 2 : set both softAP and station
+//<en>
+//0 : Disable DHCP
+//1 : Enable DHCP
+
+bool espDHCP(int fd, EspMode mode, int enabled){
+    // from 0 to 2 here
+    mode-=1;
+
+    espRingReset();
+
+    if ( espCommand(fd, ESP_CMD_FLASH, "AT+CWDHCP_DEF=%d,%d\r\n", mode, enabled)  == TAG_OK){
+        espLogInfo("Current DHCP mode is %d,%d",mode,enabled);
+        return true;
+    }
+    else{
+        espLogError("Cannot set DHCP mode to %d,%d",mode,enabled);
+        return false;
+    }
+
+}
+
+
+bool espSetIPRangeDHCP(int fd, const char *startIP, const char *endIP){
+    espRingReset();
+
+    int leaseTime = 300;
+
+    if ( espCommand(fd, ESP_CMD_FLASH, "AT+CWDHCPS_DEF=1,%d,\"%s\",\"%s\"\r\n", leaseTime, startIP, endIP)  == TAG_OK){
+        espLogInfo("DHCP IP range set from %s to %s", startIP, endIP);
+        return true;
+    }
+    else{
+        espLogError("Cannot set DHCP IP range");
+        return false;
+    }
+}
+
+bool espSetSoftApIP(int fd, const char *softApIP){
+    espRingReset();
+
+    if ( espCommand(fd, ESP_CMD_FLASH, "AT+CIPAP_DEF=\"%s\",\"%s\",\"255.255.255.0\"\r\n", softApIP, softApIP)  == TAG_OK){
+        espLogInfo("SoftAP IP set to %s", softApIP);
+        return true;
+    }
+    else{
+        espLogError("Cannot set IP");
+        return false;
+    }
+}
+
+
+void espGetIpAddress(int fd)
+{
+
+    char buf[20];
+    if (espSendCmdGet(fd,"AT+CIFSR\r\n", ":STAIP,\"", "\"\r\n", buf, sizeof(buf)))
+    {
+        espLogInfo("Client IP:%s",buf);
+//		char* token;
+
+//		token = strtok(buf, ".");
+//		_localIp[0] = atoi(token);
+//		token = strtok(NULL, ".");
+//		_localIp[1] = atoi(token);
+//		token = strtok(NULL, ".");
+//		_localIp[2] = atoi(token);
+//		token = strtok(NULL, ".");
+//		_localIp[3] = atoi(token);
+
+//		ip = _localIp;
+    }
+}
+
+
+void espGetIPAddressAP(int fd)
+{
+
+    char buf[20];
+    if (espSendCmdGet(fd,"AT+CIPAP?\r\n", "+CIPAP:ip:\"", "\"\r\n", buf, sizeof(buf)))
+    {
+        espLogInfo("AP IP:%s",buf);
+//        char* token;
+
+//        token = strtok(buf, ".");
+//        _localIp[0] = atoi(token);
+//        token = strtok(NULL, ".");
+//        _localIp[1] = atoi(token);
+//        token = strtok(NULL, ".");
+//        _localIp[2] = atoi(token);
+//        token = strtok(NULL, ".");
+//        _localIp[3] = atoi(token);
+
+//        ip = _localIp;
+    }
+}
+
+
+bool espStartAP(int fd, const char* ssid, const char* pwd, uint8_t channel, uint8_t enc, bool hidden)
+{
+    // TODO
+    // Escape character syntax is needed if "SSID" or "password" contains
+    // any special characters (',', '"' and '/')
+
+    // start access point
+    int ret = espCommand(fd, ESP_CMD_WIFI, "AT+CWSAP_DEF=\"%s\",\"%s\",%d,%d,%d,%d\r\n", ssid, pwd, channel, enc, 4, hidden);
+
+    if (ret!=TAG_OK){
+        espLogError("Failed to start AP with ssid:%s",ssid);
+        return false;
+    }
+    else{
+        espLogInfo("Started AP with ssid:%s",ssid);
+        return true;
+    }
+}
+
+bool espStartUDPServer(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, uint16_t localPort)
+{
+
+    int ret = espCommand(fd, ESP_CMD_CONNECT, "AT+CIPSTART=%d,\"UDP\",\"%s\",%u,%u,2\r\n", conn_id, dest, remotePort, localPort);
+
+    if (ret==TAG_OK) {
+        espLogInfo("UDP Server open at port %u", localPort);
+        return true;
+    }
+    else if (ret==TAG_ALREADY_CONNECTED) {
+        espLogWarn("UDP Server already open at port %u, cleaning ERROR msg", localPort);
+        espReadUntil(fd, 200, NULL, true);
+        return true;
+    }
+    else{
+        return false;
+    }
+
+}
+
+
+bool espStartTCPConnection(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort){
+    int ret = espCommand(fd, ESP_CMD_CONNECT, "AT+CIPSTART=%d,\"TCP\",\"%s\",%u\r\n", conn_id, dest, remotePort);
+
+    if (ret==TAG_OK) {
+        espLogInfo("TCP connected at port %u", remotePort);
+        return true;
+    }
+    else if (ret==TAG_ALREADY_CONNECTED) {
+        espLogWarn("TCP already connected at port %u, cleaning ERROR msg", remotePort);
+        espReadUntil(fd, 200, NULL, true);
+        return true;
+    }
+    else{
+        espLogError("TCP Cannot connect to %s:%u", dest, remotePort);
+        return false;
+    }
+}
+
+bool espSetSSLBufferSize(int fd, uint32_t size){
+    if (size<2048 || size>4096){
+        return false;
+    }
+
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSSLSIZE=%u\r\n", size) != TAG_OK){
+        espLogError("Cannot set SSL buffer size to %u", size);
+        return false;
+    }
+    sslBufferSize = size;
+    return true;
+}
+
+
+static bool espSSLHandshake(int fd, uint8_t conn_id)
+{
+    EspSslLink *link = &sslLinks[conn_id];
+    uint32_t startUS = getCurrentUS();
+
+    int ret = espCommand(fd, ESP_CMD_HANDSHAKE, "AT+CIPSTART=%d,\"SSL\",\"%s\",%u,%u\r\n",
+                         conn_id, link->host, link->port, link->keepAlive);
+
+    if (ret==TAG_ALREADY_CONNECTED) {
+        espLogWarn("SSL already connected at port %u, cleaning ERROR msg", link->port);
+        espReadUntil(fd, 200, NULL, true);
+        linkOpen[conn_id] = true;
+        return true;
+    }
+    if (ret!=TAG_OK) {
+        sslStats.handshakeFailures++;
+        espLogError("SSL Cannot connect to %s:%u", link->host, link->port);
+        return false;
+    }
+
+    sslStats.handshakes++;
+    sslStats.lastHandshakeUS = getCurrentUS() - startUS;
+    sslStats.totalHandshakeUS += sslStats.lastHandshakeUS;
+    linkOpen[conn_id] = true;
+    espLogInfo("SSL connected at port %u", link->port);
+    return true;
+}
+
+
+bool espStartSSLConnection(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, uint16_t keepAlive){
+    if (conn_id>=NUM_LINKS || strlen(dest)>=SSL_HOST_SIZE || keepAlive>7200){
+        return false;
+    }
+
+    EspSslLink *link = &sslLinks[conn_id];
+    strcpy(link->host, dest);
+    link->port = remotePort;
+    link->keepAlive = keepAlive;
+
+    link->active = espSSLHandshake(fd, conn_id);
+    return link->active;
+}
+
+
+void espGetSSLStats(EspSslStats *stats){
+    *stats = sslStats;
+}
+
+
+bool espSendTCPData(int fd, uint8_t conn_id, const char *data, int dataLen){
+
+    /* A dropped SSL link costs a new handshake, done here rather than from the CLOSED event */
+    if (conn_id<NUM_LINKS && sslLinks[conn_id].active && !linkOpen[conn_id]){
+        sslStats.reconnects++;
+        if (!espSSLHandshake(fd, conn_id)){
+            return false;
+        }
+    }
+
+    char *currentByte = data;
+    int bytesLeft = dataLen;
+
+    while (bytesLeft>0) {
+        int bytesToSend;
+
+        if(bytesLeft>MAX_SEND_TCP_DATA_SIZE){
+            bytesToSend = MAX_SEND_TCP_DATA_SIZE;
+        }
+        else{
+            bytesToSend = bytesLeft;
+        }
+
+        int idx = espCommandUntil(fd, ESP_CMD_PROMPT, ">", false, "AT+CIPSEND=%d,%d\r\n", conn_id, bytesToSend);
+        if(idx!=NUMESPTAGS)
+        {
+            espLogError("Data packet send error (1)");
+            return false;
+        }
+
+        espPrintln(fd, currentByte, bytesToSend);
+
+        idx = espAwaitDataPhase(fd, ESP_CMD_SEND, NULL, true, espWireTimeUS(bytesToSend));
+        if(idx!=TAG_SENDOK){
+            espLogError("Data packet send error (2)");
+            return false;
+        }
+
+        bytesLeft-=bytesToSend;
+        currentByte+=bytesToSend;
+    }
+
+
+    return true;
+}
+
+bool espReceiveData(int fd, unsigned int timeout, EspIpdInfo *info, uint8_t *data, uint32_t size, uint32_t *receivedLen){
+
+    char *header;
+    uint32_t len;
+
+    if (espConsumeUntil(fd, timeout, "+IPD,", false) != NUMESPTAGS){
+        return false;
+    }
+
+    circularBufferClear(&circularBuffer);
+
+    if (espConsumeUntil(fd, timeout, ":", false) != NUMESPTAGS){
+        return false;
+    }
+
+    header = espRingLine(&len);
+    if (!header){
+        return false;
+    }
+    //Remove ":"
+    header[len-1] = '\0';
+    circularBufferClear(&circularBuffer);
+
+    if (!espParseIpdHeader(header, info)){
+        espLogError("Bad +IPD header [%s]", header);
+        return false;
+    }
+
+    //Read data straight into the caller buffer, what does not fit is read and dropped
+    uint32_t stored = info->length < size ? info->length : size;
+    uint32_t bytes_readen = espReadBytes(fd, timeout, data, stored);
+    if (bytes_readen == stored && stored < info->length){
+        espReadBytes(fd, timeout, NULL, info->length - stored);
+    }
+
+    if (receivedLen){
+        *receivedLen = bytes_readen;
+    }
+
+    return true;
+}
+
+
+bool espWaitForData(int fd, unsigned int timeout, char *host, char *data, uint32_t *receivedLen){
+
+    EspIpdInfo info;
+
+    if (!espReceiveData(fd, timeout, &info, (uint8_t*)data, UINT32_MAX, receivedLen)){
+        return false;
+    }
+
+    if (host){
+        sprintf(host,"%d.%d.%d.%d", info.ip[0], info.ip[1], info.ip[2], info.ip[3]);
+    }
+
+    return true;
+}
+
+
+bool espSendData(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, const char *data, int dataLen){
+
+    int idx = espCommandUntil(fd, ESP_CMD_PROMPT, ">", false, "AT+CIPSEND=%d,%d,\"%s\",%d\r\n", conn_id, dataLen, dest, remotePort);
+    if(idx!=NUMESPTAGS)
+    {
+        espLogError("Data packet send error (1)");
+        return false;
+    }
+
+    espPrintln(fd, data, dataLen);
+
+    idx = espAwaitDataPhase(fd, ESP_CMD_SEND, NULL, true, espWireTimeUS(dataLen));
+    if(idx!=TAG_SENDOK){
+        espLogError("Data packet send error (2)");
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+* Streaming engine for multi-line list responses.
+* Sends cmd and hands every "<prefix><fields>" line to onLine as soon as it arrives, with the
+* prefix stripped. Only one line is held at a time, so the response length is not bounded by
+* any buffer. Lines longer than LIST_LINE_SIZE are skipped.
+* Returns the tag that ended the list (TAG_OK, TAG_ERROR...) or -1 on timeout.
+*/
+static int espListCmd(int fd, const char *cmd, unsigned int timeout, const char *prefix,
+                      void (*onLine)(void *ctx, const char *fields), void *ctx)
+{
+    uint32_t prefixLen = prefix ? strlen(prefix) : 0;
+    int idx;
+
+    espPrintln(fd, cmd, strlen(cmd));
+    circularBufferClear(&circularBuffer);
+
+    do{
+        idx = espConsumeUntil(fd, timeout, "\r\n", true);
+
+        if (idx == NUMESPTAGS){
+            uint32_t len;
+            char *line = espRingLine(&len);
+
+            if (line && len < LIST_LINE_SIZE){
+                /* Drop "\r\n" */
+                line[len-2] = '\0';
+
+                const char *l = line;
+                while (*l=='\r' || *l=='\n'){
+                    l++;
+                }
+
+                if (strncmp(l, prefix ? prefix : "", prefixLen)==0){
+                    onLine(ctx, l+prefixLen);
+                }
+            }
+            else{
+                espLogWarn("List line too long (%u bytes)", len);
+            }
+
+            /* Keep the line end so "\r\nOK\r\n" still matches */
+            circularBufferClear(&circularBuffer);
+            circularBufferPutMultiple(&circularBuffer, (const uint8_t*)"\r\n", 2);
+        }
+    } while(idx==NUMESPTAGS);
+
+    return idx;
+}
+
+
+/* "<ip>,<mac>" */
+static void espOnStationLine(void *ctx, const char *fields)
+{
+    uint8_t ip[4];
+    uint8_t mac[6];
+    const char *p;
+    (void)ctx;
+
+    if ((p = espParseIp(fields, ip)) && *p==',' && espParseMac(p+1, mac)){
+        EspStation *station = espAddStation(mac);
+        if (station){
+            memcpy(station->ip, ip, 4);
+            station->hasIp = true;
+        }
+    }
+}
+
+
+bool espResyncStations(int fd){
+
+    numStations = 0;
+
+    if (espListCmd(fd, "AT+CWLIF\r\n", 1000, NULL, espOnStationLine, NULL) != TAG_OK){
+        espLogWarn("Station list did not end with OK");
+        return false;
+    }
+    return true;
+}
+
+
+/* "(<ecn>,"<ssid>",<rssi>,"<mac>",<channel>,...)" */
+static bool espParseAccessPoint(const char *fields, EspAccessPoint *ap)
+{
+    uint32_t value;
+    const char *p = fields;
+
+    memset(ap, 0, sizeof(*ap));
+
+    if (*p++!='(' || !(p = espParseUInt(p, &value)) || *p++!=',' || *p++!='"'){
+        return false;
+    }
+    ap->enc = value;
+
+    /* The ssid can hold quotes and commas, it ends at the quote followed by the rssi */
+    const char *ssidEnd = p;
+    while (*ssidEnd && !(ssidEnd[0]=='"' && ssidEnd[1]==',' && (ssidEnd[2]=='-' || (ssidEnd[2]>='0' && ssidEnd[2]<='9')))){
+        ssidEnd++;
+    }
+    if (!*ssidEnd){
+        return false;
+    }
+    uint32_t ssidLen = ssidEnd-p;
+    if (ssidLen>SSID_MAX_LEN){
+        ssidLen = SSID_MAX_LEN;
+    }
+    memcpy(ap->ssid, p, ssidLen);
+    ap->ssid[ssidLen] = '\0';
+    p = ssidEnd+2;
+
+    bool negative = (*p=='-');
+    if (negative){
+        p++;
+    }
+    if (!(p = espParseUInt(p, &value)) || *p++!=',' || *p++!='"'){
+        return false;
+    }
+    ap->rssi = negative ? -(int)value : (int)value;
+
+    if (!(p = espParseMac(p, ap->bssid)) || *p++!='"' || *p++!=',' || !(p = espParseUInt(p, &value))){
+        return false;
+    }
+    ap->channel = value;
+
+    return true;
+}
+
+
+typedef struct{
+    EspAccessPoint *aps;
+    uint32_t maxAps;
+    uint32_t numAps;
+    bool sortByRssi;
+    void (*onAccessPoint)(void *ctx, const EspAccessPoint *ap);
+    void *ctx;
+}EspScanContext;
+
+static void espOnAccessPointLine(void *ctx, const char *fields)
+{
+    EspScanContext *scan = ctx;
+    EspAccessPoint ap;
+
+    if (!espParseAccessPoint(fields, &ap)){
+        espLogWarn("Bad access point line [%s]", fields);
+        return;
+    }
+
+    if (scan->onAccessPoint){
+        scan->onAccessPoint(scan->ctx, &ap);
+        return;
+    }
+
+    if (!scan->sortByRssi){
+        if (scan->numAps<scan->maxAps){
+            scan->aps[scan->numAps++] = ap;
+        }
+        return;
+    }
+
+    /* Sorted insert, strongest first. When full the weakest one falls off */
+    uint32_t pos = scan->numAps;
+    while (pos>0 && scan->aps[pos-1].rssi<ap.rssi){
+        pos--;
+    }
+    if (pos>=scan->maxAps){
+        return;
+    }
+    uint32_t last = scan->numAps<scan->maxAps ? scan->numAps : scan->maxAps-1;
+    memmove(&scan->aps[pos+1], &scan->aps[pos], (last-pos)*sizeof(EspAccessPoint));
+    scan->aps[pos] = ap;
+    if (scan->numAps<scan->maxAps){
+        scan->numAps++;
+    }
+}
+
+
+int espScanAccessPoints(int fd, EspAccessPoint *aps, uint32_t maxAps, bool sortByRssi){
+
+    EspScanContext scan = {aps, maxAps, 0, sortByRssi, NULL, NULL};
+
+    if (maxAps==0 || espListCmd(fd, "AT+CWLAP\r\n", 10000, "+CWLAP:", espOnAccessPointLine, &scan) != TAG_OK){
+        espLogError("Access point scan failed");
+        return -1;
+    }
+    return scan.numAps;
+}
+
+
+bool espScanAccessPointsCb(int fd, void (*onAccessPoint)(void *ctx, const EspAccessPoint *ap), void *ctx){
+
+    EspScanContext scan = {NULL, 0, 0, false, onAccessPoint, ctx};
+
+    if (espListCmd(fd, "AT+CWLAP\r\n", 10000, "+CWLAP:", espOnAccessPointLine, &scan) != TAG_OK){
+        espLogError("Access point scan failed");
+        return false;
+    }
+    return true;
+}
+
+
+typedef struct{
+    EspLinkStatus *links;
+    uint32_t maxLinks;
+    uint32_t numLinks;
+    /* Every +CIPSTATUS line, also the ones of single connection mode that have no id */
+    uint32_t numLines;
+    uint8_t status;
+}EspStatusContext;
+
+/* "STATUS:<stat>" and "+CIPSTATUS:<id>,"<type>","<ip>",<remote port>,<local port>,<tetype>" */
+static void espOnStatusLine(void *ctx, const char *fields)
+{
+    EspStatusContext *status = ctx;
+    EspLinkStatus link;
+    uint32_t value;
+    const char *p;
+
+    if (strncmp(fields, "STATUS:", 7)==0){
+        if (espParseUInt(fields+7, &value)){
+            status->status = value;
+        }
+        return;
+    }
 
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
+    if (strncmp(fields, "+CIPSTATUS:", 11)!=0){
+        return;
+    }
+    p = fields+11;
+    status->numLines++;
+    memset(&link, 0, sizeof(link));
 
-    if ( espSendCmd(fd, "AT+CWDHCP_DEF=%d,%d\r\n", 1000, mode, enabled)  == TAG_OK){
-        printf("Current DHCP mode is %d,%d\n",mode,enabled);
-        return true;
+    if (!(p = espParseUInt(p, &value)) || value>=NUM_LINKS || *p++!=',' || *p++!='"'){
+        return;
+    }
+    link.conn_id = value;
+
+    if (strncmp(p, "TCP\"", 4)==0){
+        link.type = TCP_MODE;
+        p += 4;
+    }
+    else if (strncmp(p, "UDP\"", 4)==0){
+        link.type = UDP_MODE;
+        p += 4;
+    }
+    else if (strncmp(p, "SSL\"", 4)==0){
+        link.type = SSL_MODE;
+        p += 4;
     }
     else{
-        printf("Cannot set DHCP mode to %d,%d\n",mode,enabled);
-        return false;
+        return;
     }
 
-}
+    if (*p++!=',' || *p++!='"' || !(p = espParseIp(p, link.remoteIp)) || *p++!='"' || *p++!=','){
+        return;
+    }
+    if (!(p = espParseUInt(p, &value)) || *p++!=','){
+        return;
+    }
+    link.remotePort = value;
+    if (!(p = espParseUInt(p, &value)) || *p++!=','){
+        return;
+    }
+    link.localPort = value;
+    if (!(p = espParseUInt(p, &value))){
+        return;
+    }
+    link.server = (value==1);
 
+    if (status->numLinks<status->maxLinks){
+        status->links[status->numLinks++] = link;
+    }
+}
 
-bool espSetIPRangeDHCP(int fd, const char *startIP, const char *endIP){
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
 
-    int leaseTime = 300;
+static bool espListStatus(int fd, EspStatusContext *status){
 
-    if ( espSendCmd(fd, "AT+CWDHCPS_DEF=1,%d,\"%s\",\"%s\"\r\n", 1000, leaseTime, startIP, endIP)  == TAG_OK){
-        printf("DHCP IP range set from %s to %s\n", startIP, endIP);
-        return true;
-    }
-    else{
-        printf("Cannot set DHCP IP range\n");
+    if (espListCmd(fd, "AT+CIPSTATUS\r\n", 1000, NULL, espOnStatusLine, status) != TAG_OK){
+        espLogError("Cannot get connection status");
         return false;
     }
+    return true;
 }
 
-bool espSetSoftApIP(int fd, const char *softApIP){
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
+int espGetLinkStatus(int fd, EspLinkStatus *links, uint32_t maxLinks, uint8_t *stat){
 
-    if ( espSendCmd(fd, "AT+CIPAP_DEF=\"%s\",\"%s\",\"255.255.255.0\"\r\n", 1000, softApIP, softApIP)  == TAG_OK){
-        printf("SoftAP IP set to %s\n", softApIP);
-        return true;
+    EspStatusContext status = {links, maxLinks, 0, 0, 0};
+
+    if (!espListStatus(fd, &status)){
+        return -1;
     }
-    else{
-        printf("Cannot set IP\n");
-        return false;
+
+    if (stat){
+        *stat = status.status;
     }
+    return status.numLinks;
 }
 
 
-void espGetIpAddress(int fd)
-{
-
-    char buf[20];
-    if (espSendCmdGet(fd,"AT+CIFSR\r\n", ":STAIP,\"", "\"\r\n", buf, sizeof(buf)))
-    {
-        printf("Client IP:%s\n",buf);
-//		char* token;
+typedef struct{
+    char *out;
+    uint32_t size;
+    bool found;
+}EspQueryContext;
 
-//		token = strtok(buf, ".");
-//		_localIp[0] = atoi(token);
-//		token = strtok(NULL, ".");
-//		_localIp[1] = atoi(token);
-//		token = strtok(NULL, ".");
-//		_localIp[2] = atoi(token);
-//		token = strtok(NULL, ".");
-//		_localIp[3] = atoi(token);
+static void espOnQueryLine(void *ctx, const char *fields)
+{
+    EspQueryContext *query = ctx;
 
-//		ip = _localIp;
+    if (!query->found){
+        uint32_t len = strlen(fields);
+        if (len >= query->size){
+            len = query->size-1;
+        }
+        memcpy(query->out, fields, len);
+        query->out[len] = '\0';
+        query->found = true;
     }
 }
 
-
-void espGetIPAddressAP(int fd)
+/* Value of the "<prefix><value>" line of a query command. False if the module did not give one */
+static bool espQuery(int fd, const char *cmd, const char *prefix, char *out, uint32_t size)
 {
+    EspQueryContext query = {out, size, false};
 
-    char buf[20];
-    if (espSendCmdGet(fd,"AT+CIPAP?\r\n", "+CIPAP:ip:\"", "\"\r\n", buf, sizeof(buf)))
-    {
-        printf("AP IP:%s\n",buf);
-//        char* token;
+    return espListCmd(fd, cmd, 1000, prefix, espOnQueryLine, &query) == TAG_OK && query.found;
+}
 
-//        token = strtok(buf, ".");
-//        _localIp[0] = atoi(token);
-//        token = strtok(NULL, ".");
-//        _localIp[1] = atoi(token);
-//        token = strtok(NULL, ".");
-//        _localIp[2] = atoi(token);
-//        token = strtok(NULL, ".");
-//        _localIp[3] = atoi(token);
+/* "STAIP,"<ip>"" and "APIP,"<ip>"", the MAC lines are skipped */
+static void espOnAddressLine(void *ctx, const char *fields)
+{
+    EspAttachInfo *info = ctx;
 
-//        ip = _localIp;
+    if (strncmp(fields, "STAIP,\"", 7)==0){
+        espParseIp(fields+7, info->staIp);
+    }
+    else if (strncmp(fields, "APIP,\"", 6)==0){
+        espParseIp(fields+6, info->apIp);
     }
 }
 
-
-bool espStartAP(int fd, const char* ssid, const char* pwd, uint8_t channel, uint8_t enc, bool hidden)
+/* Reads the state of the running module into info and rebuilds the driver view. False if it does not add up */
+static bool espAttachProbe(int fd, EspAttachInfo *info)
 {
-    // TODO
-    // Escape character syntax is needed if "SSID" or "password" contains
-    // any special characters (',', '"' and '/')
+    static const uint8_t noIp[4] = {0, 0, 0, 0};
+    char value[SSID_MAX_LEN+8];
+    uint32_t number;
 
-    // start access point
-    int ret = espSendCmd(fd,"AT+CWSAP_DEF=\"%s\",\"%s\",%d,%d,%d,%d\r\n", 10000, ssid, pwd, channel, enc, 4, hidden);
+    if (!espQuery(fd, "AT+CWMODE?\r\n", "+CWMODE:", value, sizeof(value)) ||
+        !espParseUInt(value, &number) || number<MODE_STA || number>MODE_STA_AP){
+        espLogWarn("Attach: no valid mode");
+        return false;
+    }
+    info->mode = (EspMode)number;
 
-    if (ret!=TAG_OK){
-        printf("Failed to start AP with ssid:%s\n",ssid);
+    if (!espQuery(fd, "AT+CIPMUX?\r\n", "+CIPMUX:", value, sizeof(value)) || !espParseUInt(value, &number)){
+        espLogWarn("Attach: no connection mode");
         return false;
     }
-    else{
-        printf("Started AP with ssid:%s\n",ssid);
-        return true;
+
+    EspStatusContext status = {info->links, NUM_LINKS, 0, 0, 0};
+    if (!espListStatus(fd, &status)){
+        return false;
     }
-}
+    info->numLinks = status.numLinks;
+    info->status = status.status;
 
-bool espStartUDPServer(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, uint16_t localPort)
-{
+    if (number!=1){
+        /* Single connection links have no id, the driver cannot take them over. STATUS:3 is a link open */
+        if (status.numLines>0 || status.status==3){
+            espLogWarn("Attach: link open in single connection mode");
+            return false;
+        }
+        if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPMUX=1\r\n") != TAG_OK){
+            return false;
+        }
+    }
 
-    int ret = espSendCmd(fd,"AT+CIPSTART=%d,\"UDP\",\"%s\",%u,%u,2\r\n", 1000, conn_id, dest, remotePort, localPort);
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPDINFO=1\r\n") != TAG_OK){
+        return false;
+    }
 
-    if (ret==TAG_OK) {
-        printf("UDP Server open at port %u\n", localPort);
-        return true;
+    if (info->mode!=MODE_AP && espQuery(fd, "AT+CWJAP_CUR?\r\n", "+CWJAP_CUR:\"", value, sizeof(value))){
+        char *end = strchr(value, '"');
+        if (end){
+            *end = '\0';
+        }
+        strncpy(info->ssid, value, SSID_MAX_LEN);
+        info->ssid[SSID_MAX_LEN] = '\0';
+        info->joined = true;
     }
-    else if (ret==TAG_ALREADY_CONNECTED) {
-        printf("UDP Server already open at port %u, cleaning ERROR msg\n", localPort);
-        espReadUntil(fd, 200, NULL, true);
-        return true;
+
+    if (espListCmd(fd, "AT+CIFSR\r\n", 1000, "+CIFSR:", espOnAddressLine, info) != TAG_OK){
+        espLogWarn("Attach: no local addresses");
+        return false;
     }
-    else{
+
+    /* STATUS:2 and 3 say the station got its IP */
+    if ((info->status==2 || info->status==3) && info->mode!=MODE_AP &&
+        (!info->joined || memcmp(info->staIp, noIp, 4)==0)){
+        espLogWarn("Attach: status %u without a joined access point", info->status);
         return false;
     }
 
+    for (uint32_t i=0; i<NUM_LINKS; i++){
+        linkOpen[i] = false;
+    }
+    for (uint32_t i=0; i<info->numLinks; i++){
+        linkOpen[info->links[i].conn_id] = true;
+    }
+
+    if (info->mode!=MODE_STA){
+        espResyncStations(fd);
+    }
+    return true;
 }
 
 
-bool espStartTCPConnection(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort){
-    int ret = espSendCmd(fd,"AT+CIPSTART=%d,\"TCP\",\"%s\",%u\r\n", 3000, conn_id, dest, remotePort);
+bool espDriverAttach(int fd, EspAttachInfo *info){
 
-    if (ret==TAG_OK) {
-        printf("TCP connected at port %u\n", remotePort);
-        return true;
-    }
-    else if (ret==TAG_ALREADY_CONNECTED) {
-        printf("TCP already connected at port %u, cleaning ERROR msg\n", remotePort);
-        espReadUntil(fd, 200, NULL, true);
-        return true;
+    EspAttachInfo local;
+    uint32_t startUS = getCurrentUS();
+    bool answered = false;
+
+    if (!info){
+        info = &local;
     }
-    else{
-        printf("TCP Cannot connect to %s:%u\n", dest, remotePort);
+    memset(info, 0, sizeof(*info));
+
+    if (!ringBuffer){
+        espLogError("No driver arena, call espDriverSetArena() first");
         return false;
     }
-}
-
-bool espSendTCPData(int fd, uint8_t conn_id, const char *data, int dataLen){
-
-    char *currentByte = data;
-    int bytesLeft = dataLen;
 
-    while (bytesLeft>0) {
-        int bytesToSend;
+    espRingReset();
+    espEmptyBuf(fd);
 
-        if(bytesLeft>MAX_SEND_TCP_DATA_SIZE){
-            bytesToSend = MAX_SEND_TCP_DATA_SIZE;
-        }
-        else{
-            bytesToSend = bytesLeft;
-        }
+    espSendCmd(fd, "ATE0\r\n", 1000);
 
-        char cmdBuf[64];
+    for (int i=0; i<3 && !answered; i++){
+        answered = espSendCmd(fd, "AT\r\n", 1000) == TAG_OK;
+    }
 
-        snprintf(cmdBuf, 64, "AT+CIPSEND=%d,%d\r\n", conn_id, bytesToSend);
+    if (!answered || !espAttachProbe(fd, info)){
+        espLogWarn("Module state is inconsistent, resetting it");
+        memset(info, 0, sizeof(*info));
+        info->fullReset = true;
+        bool ok = espDriverInit(fd);
+        info->attachUS = getCurrentUS() - startUS;
+        return ok;
+    }
 
-        espPrintln(fd, cmdBuf, strlen(cmdBuf));
+    espFwVersion(fd);
 
+    info->attachUS = getCurrentUS() - startUS;
+    espLogInfo("Attached to %s in %u ms, mode %d, %u links", fwVersion, info->attachUS/1000, info->mode, info->numLinks);
+    return true;
+}
 
-        int idx = espReadUntil(fd, 2000, ">", false);
-        if(idx!=NUMESPTAGS)
-        {
-            printf("Data packet send error (1)\n");
-            return false;
-        }
 
-        espPrintln(fd, currentByte, bytesToSend);
+int espGetConnectedClients(int fd){
 
-        idx = espReadUntil(fd, 2000, NULL, true);
-        if(idx!=TAG_SENDOK){
-            printf("Data packet send error (2)\n");
-            return false;
-        }
+    espResyncStations(fd);
 
-        bytesLeft-=bytesToSend;
-        currentByte+=bytesToSend;
+    numClients = 0;
+    for (uint32_t i=0; i<numStations && numClients<MAX_NUMBER_OF_CLIENT; i++){
+        const uint8_t *ip = stations[i].ip;
+        snprintf(clients[numClients++], IP_BUFFER_SIZE, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
     }
 
-
-    return true;
+    return numClients;
 }
 
-bool espWaitForData(int fd, unsigned int timeout, char *host, char *data, uint32_t *receivedLen){
+char* espGetConnectedClient(int clientNum){
+    return clients[clientNum];
+}
 
-    char espWaitForDataBuff[3000];
+int espGetNumConnectedClients(){
+    return numClients;
+}
 
-    unsigned long start = getCurrentMS();
 
-    bool foundipd = false;
-    while ((getCurrentMS() - start < timeout) && !foundipd) {
-        char c;
+bool espGetConnectedAP(int fd, char *ssid, uint32_t len){
+    /* Only the quoted SSID is needed, lineBuffer would be overwritten by the events dispatched meanwhile */
+    char apBuffer[SSID_MAX_LEN+3];
 
-        //Read one char
-        if(espRead(fd, &c, sizeof(c)) > 0){
-            circularBufferPut(&circularBuffer, c);
-            foundipd = circularBufferEndWith("+IPD,");
+    if (espSendCmdGet(fd,"AT+CWJAP_CUR?\r\n", "+CWJAP_CUR:", "\r\n", apBuffer, sizeof(apBuffer)))
+    {
+        for( int i=1; i <(int)sizeof(apBuffer) && apBuffer[i]; i++ ){
+            if (apBuffer[i]=='\"'){
+                uint32_t ssidLen = i-1;
+                if (ssidLen>=len){
+                    ssidLen = len-1;
+                }
+                memcpy(ssid, apBuffer+1, ssidLen);
+                ssid[ssidLen] = '\0';
+                return true;
+            }
         }
     }
+    return false;
+}
 
-    if (!foundipd){
-        return false;
-    }
 
-    circularBufferClear(&circularBuffer);
+bool espCloseConnection(int fd, uint8_t conn_id){
 
-    start = getCurrentMS();
-    bool foundstart = false;
-    while ((getCurrentMS() - start < timeout) && !foundstart) {
-        char c;
+    espRingReset();
 
-        //Read one char
-        if(espRead(fd, &c, sizeof(c)) > 0){
-            circularBufferPut(&circularBuffer, c);
-            foundstart = circularBufferEndWith(":");
-        }
+    if (conn_id<NUM_LINKS){
+        sslLinks[conn_id].active = false;
     }
 
-    if (!foundstart){
+    if ( espCommand(fd, ESP_CMD_LOCAL, "AT+CIPCLOSE=%d\r\n", conn_id)  == TAG_OK){
+        espLogInfo("Connection id %d closed", conn_id);
+        return true;
+    }
+    else{
+        espLogError("Connection id %d cannot be closed", conn_id);
         return false;
     }
 
-
-    int len = circularBufferUsedElementsNum(&circularBuffer);
-    circularBufferGetMultiple(&circularBuffer, espWaitForDataBuff, len);
-    //Remove ":"
-    espWaitForDataBuff[len-1] = '\0';
-    circularBufferClear(&circularBuffer);
+}
 
 
-    int conn_id=0;
-    int data_len=0;
-    int ip0, ip1, ip2, ip3, port;
 
-    sscanf(espWaitForDataBuff,"%d,%d,%d.%d.%d.%d,%d", &conn_id, &data_len, &ip0, &ip1, &ip2, &ip3, &port);
+void espSetEventHandlers(const EspEventHandlers *handlers){
+    if (handlers){
+        eventHandlers = *handlers;
+    }
+    else{
+        memset(&eventHandlers, 0, sizeof(eventHandlers));
+    }
+}
 
-    //Read data
-    //int bytes_readen = espRead(fd, buff, data_len);
 
+int espProcessEvents(int fd, unsigned int timeout){
+    int before = numEvents;
 
-    int bytes_readen = 0;
-    start = getCurrentMS();
+    espConsumeUntil(fd, timeout, NULL, false);
 
-    while (((getCurrentMS() - start) < timeout) && (bytes_readen != data_len)) {
-		char c;
+    return numEvents - before;
+}
 
-		//Read one char
-		if(espRead(fd, &c, sizeof(c)) > 0){
-			*(espWaitForDataBuff+bytes_readen) = c;
-			bytes_readen++;
-		}
-	}
 
-    //printf("\n%d %d %d.%d.%d.%d:%d ", conn_id, data_len, ip0, ip1, ip2, ip3, port);
-    //buff[bytes_readen] = '\0';
-    //printf("Data:%s\n",buff);
+int espProcessEventsMax(int fd, unsigned int timeout, uint32_t maxEvents){
+    int before = numEvents;
 
-    if (host){
-        sprintf(host,"%d.%d.%d.%d",ip0, ip1, ip2, ip3);
+    if (maxEvents == 0){
+        return 0;
     }
+    eventsStopAt = before + maxEvents;
+    espConsumeUntil(fd, timeout, NULL, false);
+    eventsStopAt = 0;
 
-    if (data){
-        memcpy(data, espWaitForDataBuff, bytes_readen);
-    }
+    return numEvents - before;
+}
 
-    if (receivedLen){
-        *receivedLen = bytes_readen;
+
+int espProcessEventsBurst(int fd, unsigned int timeout, uint32_t maxEvents){
+    int before = numEvents;
+
+    if (maxEvents == 0){
+        return 0;
     }
+    eventsStopAt = before + maxEvents;
+    eventsBurstFrom = before;
+    espConsumeUntil(fd, timeout, NULL, false);
+    eventsBurstFrom = -1;
+    eventsStopAt = 0;
 
-    return true;
+    return numEvents - before;
 }
 
 
+bool espLinkIsOpen(uint8_t conn_id){
+    return conn_id<NUM_LINKS && linkOpen[conn_id];
+}
 
-bool espSendData(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, const char *data, int dataLen){
-
-    char cmdBuf[50];
-    snprintf(cmdBuf,50, "AT+CIPSEND=%d,%d,\"%s\",%d\r\n", conn_id, dataLen, dest, remotePort);
 
-    espPrintln(fd, cmdBuf, strlen(cmdBuf));
+bool espStartTCPServer(int fd, uint16_t port, uint8_t maxConn, uint16_t idleTimeout){
 
+    if (maxConn<1 || NUM_LINKS<maxConn || 7200<idleTimeout){
+        return false;
+    }
 
-    int idx = espReadUntil(fd, 200, ">", false);
-    if(idx!=NUMESPTAGS)
-    {
-        printf("Data packet send error (1)\n");
+    // must be set before the server is started
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSERVERMAXCONN=%d\r\n", maxConn) != TAG_OK){
+        espLogError("Cannot set max connections to %d", maxConn);
         return false;
     }
 
-    espPrintln(fd, data, dataLen);
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSERVER=1,%u\r\n", port) != TAG_OK){
+        espLogError("Cannot open TCP Server at port %u", port);
+        return false;
+    }
 
-    idx = espReadUntil(fd, 200, NULL, true);
-    if(idx!=TAG_SENDOK){
-        printf("Data packet send error (2)\n");
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSTO=%u\r\n", idleTimeout) != TAG_OK){
+        espLogError("Cannot set TCP Server timeout to %u", idleTimeout);
         return false;
     }
 
+    serverRunning = true;
+    serverPort = port;
+    serverMaxConn = maxConn;
+    serverIdleTimeout = idleTimeout;
+
+    espLogInfo("TCP Server open at port %u", port);
     return true;
 }
 
 
-int espGetConnectedClients(int fd){
-
-    char cmdBuf[] = "AT+CWLIF\r\n";
-    espPrintln(fd, cmdBuf, strlen(cmdBuf));
+bool espStopTCPServer(int fd){
 
-    int idx;
-    numClients = 0;
-    do{
-        idx = espReadUntil(fd, 200, ",", true);
+    if (espCommand(fd, ESP_CMD_LOCAL, "AT+CIPSERVER=0\r\n") == TAG_OK){
+        serverRunning = false;
+        espLogInfo("TCP Server closed");
+        return true;
+    }
+    else{
+        espLogError("Cannot close TCP Server");
+        return false;
+    }
+}
 
-        if (idx == NUMESPTAGS){
-            /* Do not get "," therefore -1 */
-            int numElem = circularBufferUsedElementsNum(&circularBuffer)-1;
 
-            /* Force max ip size to IP_BUFFER_SIZE */
-            numElem = numElem>IP_BUFFER_SIZE?IP_BUFFER_SIZE:numElem;
+void espSetStationTable(EspStation *storage, uint32_t capacity){
+    if (storage && capacity>0){
+        stations = storage;
+        stationsCapacity = capacity;
+    }
+    else{
+        stations = defaultStations;
+        stationsCapacity = MAX_NUMBER_OF_CLIENT;
+    }
+    numStations = 0;
+    stationsDropped = 0;
+}
 
-            circularBufferGetMultiple(&circularBuffer, clients[numClients], numElem);
-            clients[numClients][numElem] = '\0';
-            numClients++;
 
-            /* Consume line upto end */
-            idx = espReadUntil(fd, 200, "\r\n", false);
-        }
-    } while(idx==NUMESPTAGS);
+uint32_t espGetNumStations(void){
+    return numStations;
+}
 
-    //printf("Found %d clients\n", numClients);
-    //for (int i =0;i<numClients;i++){
-    //    printf("Client %d: %s\n",i, clients[i]);
-    //}
 
-    return numClients;
+const EspStation *espGetStation(uint32_t idx){
+    if (idx>=numStations){
+        return NULL;
+    }
+    return &stations[idx];
 }
 
-char* espGetConnectedClient(int clientNum){
-    return clients[clientNum];
-}
 
-int espGetNumConnectedClients(){
-    return numClients;
+uint32_t espGetStationsDropped(void){
+    return stationsDropped;
 }
 
 
-bool espGetConnectedAP(int fd, char *ssid, uint32_t len){
-    char espGetConnectedAPBuff[200];
+#if ESP_MAX_MODULES > 1
 
-    if (espSendCmdGet(fd,"AT+CWJAP_CUR?\r\n", "+CWJAP_CUR:", "\r\n", espGetConnectedAPBuff, sizeof(espGetConnectedAPBuff)))
-    {
-        for( int i=1; i <sizeof(espGetConnectedAPBuff); i++ ){
-            if (espGetConnectedAPBuff[i]=='\"'){
-                strncpy(ssid, espGetConnectedAPBuff+1, i-1);
-                ssid[i-1] = '\0';
-                return true;
-            }
-        }
-    }
-    return false;
-}
+/* Everything that belongs to one module, swapped in and out by espSelectModule() */
+#define MODULE_STATE(X) \
+    X(ringBuffer) X(circularBuffer) X(rxChunk) X(rxChunkPos) X(rxChunkLen) \
+    X(cmdBuffer) X(lineBuffer) X(fwVersion) X(numClients) X(clients) \
+    X(eventHandlers) X(numEvents) X(linkOpen) \
+    X(serverRunning) X(serverPort) X(serverMaxConn) X(serverIdleTimeout) \
+    X(sslLinks) X(sslBufferSize) X(sslStats) \
+    X(health) X(restoreNeeded) X(hardResetHandler) X(hardResetCtx) \
+    X(defaultStations) X(stations) X(stationsCapacity) X(numStations) X(stationsDropped) \
+    X(rtt) X(uartBaud)
 
+#define MODULE_FIELD(v) __typeof__(v) v;
+#define MODULE_SAVE(v) memcpy(&state->v, &v, sizeof(v));
+#define MODULE_LOAD(v) memcpy(&v, &state->v, sizeof(v));
 
-bool espCloseConnection(int fd, uint8_t conn_id){
+typedef struct{
+    MODULE_STATE(MODULE_FIELD)
+}EspModuleState;
+
+static EspModuleState moduleStates[ESP_MAX_MODULES];
+static bool moduleUsed[ESP_MAX_MODULES];
+
+#endif
 
-    circularBufferInit(&circularBuffer, buffer, CIRCULAR_BUFFER_SIZE);
 
-    if ( espSendCmd(fd, "AT+CIPCLOSE=%d\r\n", 1000, conn_id)  == TAG_OK){
-        printf("Connection id %d closed\n", conn_id);
+bool espSelectModule(uint8_t module){
+    if (module>=ESP_MAX_MODULES){
+        return false;
+    }
+#if ESP_MAX_MODULES > 1
+    if (module==selectedModule){
         return true;
     }
-    else{
-        printf("Connection id %d cannot be closed\n", conn_id);
+
+    EspModuleState *state = &moduleStates[selectedModule];
+    MODULE_STATE(MODULE_SAVE)
+    moduleUsed[selectedModule] = true;
+
+    state = &moduleStates[module];
+    if (!moduleUsed[module]){
+        /* Same as the statics at start, without an arena */
+        memset(state, 0, sizeof(*state));
+        state->stationsCapacity = MAX_NUMBER_OF_CLIENT;
+        moduleUsed[module] = true;
+    }
+    MODULE_STATE(MODULE_LOAD)
+#endif
+    selectedModule = module;
+    return true;
+}
+
+
+uint8_t espSelectedModule(void){
+    return selectedModule;
+}
+
+
+bool espDriverSetArena(uint8_t *arena, uint32_t size){
+    if (!arena || size<ESP_ARENA_SIZE){
+        espLogError("Driver arena needs %u bytes", (unsigned)ESP_ARENA_SIZE);
         return false;
     }
 
+    ringBuffer = arena + ARENA_RING_OFFSET;
+    rxChunk = arena + ARENA_CHUNK_OFFSET;
+    cmdBuffer = (char*)arena + ARENA_CMD_OFFSET;
+    lineBuffer = (char*)arena + ARENA_LINE_OFFSET;
+    fwVersion = (char*)arena + ARENA_FW_OFFSET;
+    clients = (char(*)[IP_BUFFER_SIZE])(arena + ARENA_CLIENTS_OFFSET);
+    defaultStations = (EspStation*)(arena + ARENA_STATIONS_OFFSET);
+
+    memset(arena, 0, ESP_ARENA_SIZE);
+    rxChunkPos = rxChunkLen = 0;
+    numClients = 0;
+    espSetStationTable(NULL, 0);
+    return true;
 }
@@ -42,12 +42,33 @@ extern "C" {
 
 #define CIRCULAR_BUFFER_SIZE 512
 
+/* Serial bytes read per espRead() call, must be smaller than CIRCULAR_BUFFER_SIZE */
+#define RX_CHUNK_SIZE 128
+
 #define MAX_NUMBER_OF_CLIENT 4
 #define IP_BUFFER_SIZE 16
+
+/* Longest line of a list response (CWLAP, CIPSTATUS, CWLIF) */
+#define LIST_LINE_SIZE 128
+#define SSID_MAX_LEN 32
+
+#define FW_VERSION_SIZE 128
     
     
 /* From AT documentation - "ESP8266 AT Instruction Set" */
 #define MAX_SEND_TCP_DATA_SIZE 2048
+/* Default UART speed, see espSetUartBaud() */
+#ifndef ESP_UART_BAUD
+#define ESP_UART_BAUD 115200
+#endif
+
+/* Link ids 0 to 4 in multiple connections mode (AT+CIPMUX=1) */
+#define NUM_LINKS 5
+
+/* Modules driven by one driver instance, see espSelectModule() */
+#ifndef ESP_MAX_MODULES
+#define ESP_MAX_MODULES 1
+#endif
 
 //bool debug= false;
 
@@ -72,8 +93,197 @@ enum wl_enc_type {
 typedef enum {TCP_MODE, UDP_MODE, SSL_MODE} ProtocolMode;
 
 
+/* Header of a received "+IPD,<id>,<len>,<ip>,<port>:" frame */
+typedef struct{
+    uint8_t conn_id;
+    uint32_t length;
+    uint8_t ip[4];
+    uint16_t port;
+}EspIpdInfo;
+
+/* SoftAP station, as reported by +STA_CONNECTED / +DIST_STA_IP or AT+CWLIF */
+typedef struct{
+    uint8_t mac[6];
+    uint8_t ip[4];
+    /* false until +DIST_STA_IP assigns the ip */
+    bool hasIp;
+}EspStation;
+
+/*
+* Size of all the driver working memory: parse ring, receive chunk, command and line
+* buffers, firmware version, legacy client strings and the default station table.
+* Built with ESP_STATIC_ARENA the driver has no storage of its own and must be given
+* one array of this size before espDriverInit():
+*
+* static uint8_t espArena[ESP_ARENA_SIZE];
+* espDriverSetArena(espArena, sizeof(espArena));
+*/
+#define ESP_ARENA_SIZE (CIRCULAR_BUFFER_SIZE + RX_CHUNK_SIZE + CMD_BUFFER_SIZE + LIST_LINE_SIZE + \
+                        FW_VERSION_SIZE + MAX_NUMBER_OF_CLIENT*IP_BUFFER_SIZE + \
+                        MAX_NUMBER_OF_CLIENT*sizeof(EspStation))
+
+/* One +CWLAP entry */
+typedef struct{
+    /* enum wl_enc_type */
+    uint8_t enc;
+    char ssid[SSID_MAX_LEN+1];
+    int8_t rssi;
+    uint8_t bssid[6];
+    uint8_t channel;
+}EspAccessPoint;
+
+/* One +CIPSTATUS entry */
+typedef struct{
+    uint8_t conn_id;
+    ProtocolMode type;
+    uint8_t remoteIp[4];
+    uint16_t remotePort;
+    uint16_t localPort;
+    /* true if the module is the server side of the link */
+    bool server;
+}EspLinkStatus;
+
+/*
+* Unsolicited messages are dispatched from whichever driver call is reading the serial port
+* (espProcessEvents() or any command). Handlers must not send AT commands, queue the work
+* and do it after the driver call returns.
+* Any handler can be NULL.
+*/
+typedef struct{
+    void *ctx;
+    /* "<id>,CONNECT" */
+    void (*onConnect)(void *ctx, uint8_t conn_id);
+    /* "<id>,CLOSED" or "<id>,CONNECT FAIL" */
+    void (*onClose)(void *ctx, uint8_t conn_id);
+    /*
+    * "+IPD" payload, handed over in pieces as it arrives from the serial port.
+    * offset is the position of data inside the frame, the frame is complete when
+    * offset+len == info->length.
+    * While onData is set espWaitForData() never sees any data.
+    */
+    void (*onData)(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len);
+    /* SoftAP station joined, got its ip (connected true) or left (connected false) */
+    void (*onStation)(void *ctx, const EspStation *station, bool connected);
+}EspEventHandlers;
+
+/* Command classes, each one learns its own response time */
+typedef enum{
+    /* Configuration commands answered by the module itself */
+    ESP_CMD_LOCAL,
+    /* *_DEF commands, they write the flash */
+    ESP_CMD_FLASH,
+    /* ">" prompt after AT+CIPSEND */
+    ESP_CMD_PROMPT,
+    /* SEND OK after the payload */
+    ESP_CMD_SEND,
+    /* AT+CIPSTART */
+    ESP_CMD_CONNECT,
+    /* AT+CWJAP and AT+CWSAP */
+    ESP_CMD_WIFI,
+    /* AT+CIPSTART of an SSL link, the TLS handshake takes seconds */
+    ESP_CMD_HANDSHAKE,
+    NUM_CMD_CLASSES
+}EspCmdClass;
+
+/*
+* Response time estimate of a command class, TCP RTO style (RFC 6298):
+* rto = srtt + 4*rttvar, doubled on every timeout, always within [min, max].
+*/
+typedef struct{
+    uint32_t srttUS;
+    uint32_t rttvarUS;
+    /* Timeout of the next command of the class */
+    uint32_t rtoUS;
+    uint32_t minUS;
+    uint32_t maxUS;
+    uint32_t samples;
+    uint32_t timeouts;
+}EspRttStats;
+
+/* Where the recovery layer is */
+typedef enum{
+    ESP_HEALTH_OK,
+    /* Answered busy p... or busy s..., retrying */
+    ESP_HEALTH_BUSY,
+    /* Probing with AT */
+    ESP_HEALTH_RESYNC,
+    ESP_HEALTH_SOFT_RESET,
+    ESP_HEALTH_HARD_RESET,
+    /* Every step failed, only espDriverInit() is left */
+    ESP_HEALTH_DEAD
+}EspHealthState;
+
+typedef struct{
+    EspHealthState state;
+    /* busy answers */
+    uint32_t busy;
+    /* Commands not answered at all */
+    uint32_t timeouts;
+    /* Commands sent again after a busy answer or a recovery */
+    uint32_t replays;
+    /* "ready" seen, the module restarted on its own */
+    uint32_t reboots;
+    uint32_t resyncs;
+    uint32_t softResets;
+    uint32_t hardResets;
+    uint32_t recoveries;
+    uint32_t failures;
+    /* From the first failed answer to the module working again */
+    uint32_t lastRecoveryUS;
+    uint64_t totalRecoveryUS;
+}EspHealth;
+
+/* What espDriverAttach() found on the running module */
+typedef struct{
+    EspMode mode;
+    /* Station joined to an access point */
+    bool joined;
+    char ssid[SSID_MAX_LEN+1];
+    /* 0.0.0.0 if the interface has no address */
+    uint8_t staIp[4];
+    uint8_t apIp[4];
+    /* AT+CIPSTATUS STATUS:<stat> */
+    uint8_t status;
+    /* Links taken over, the driver knows them as open */
+    uint32_t numLinks;
+    EspLinkStatus links[NUM_LINKS];
+    /* The state did not add up and the module went through espDriverInit() */
+    bool fullReset;
+    uint32_t attachUS;
+}EspAttachInfo;
+
+/* SSL links, see espStartSSLConnection() */
+typedef struct{
+    uint32_t handshakes;
+    uint32_t handshakeFailures;
+    /* Links opened again after the module or the server dropped them */
+    uint32_t reconnects;
+    uint32_t lastHandshakeUS;
+    uint64_t totalHandshakeUS;
+}EspSslStats;
+
+
 void espEmptyBuf(int fd);
+/*
+* Built with ESP_MAX_MODULES > 1 the driver keeps the state of every module apart
+* (parse ring, links, handlers, learned timeouts, health) and works on the selected
+* one. Select the module before any call with its fd. Module 0 is selected at start,
+* the others need their own espDriverSetArena() before espDriverInit().
+*/
+bool espSelectModule(uint8_t module);
+uint8_t espSelectedModule(void);
+/* Optional without ESP_STATIC_ARENA, arena must be ESP_ARENA_SIZE bytes */
+bool espDriverSetArena(uint8_t *arena, uint32_t size);
 bool espDriverInit(int fd);
+/*
+* Warm restart: takes over a module that kept running while the host restarted, without
+* resetting it. Reads the mode, the joined access point, the addresses and the open links
+* back and only falls back to espDriverInit() if they do not add up. info can be NULL.
+* A TCP server is not restarted, call espStartTCPServer() again to keep it.
+*/
+bool espDriverAttach(int fd, EspAttachInfo *info);
+/* AT+GMR, the buffer returned is overwritten by the next call */
+char* espFwVersion(int fd);
 bool espWifiConnect(int fd, const char* ssid, const char *passphrase);
 bool espDriverMode(int fd, EspMode mode);
 /* Tx power [0,82] each step 0.25 dBm.. not very precise according to documentation */
@@ -84,17 +294,95 @@ void espGetIPAddressAP(int fd);
 bool espStartAP(int fd, const char *ssid, const char* pwd, uint8_t channel, uint8_t enc, bool hidden);
 bool espStartUDPServer(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, uint16_t localPort);
 bool espStartTCPConnection(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort);
+/*
+* SSL buffer of the module, [2048,4096] bytes. Set it before the first SSL link,
+* it is sent again after the module restarts.
+*/
+bool espSetSSLBufferSize(int fd, uint32_t size);
+/*
+* Opens an SSL link with TCP keepalive every keepAlive seconds [0,7200], 0 disables it.
+* The link is used with espSendTCPData() and the +IPD handlers like a TCP one. If it
+* drops, the next espSendTCPData() on it does the handshake again, until espCloseConnection().
+*/
+bool espStartSSLConnection(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, uint16_t keepAlive);
+void espGetSSLStats(EspSslStats *stats);
 bool espSendTCPData(int fd, uint8_t conn_id, const char *data, int dataLen);
 bool espWaitForData(int fd, unsigned int timeout, char *host, char *data, uint32_t *receivedLen);
+/*
+* Waits for the next +IPD frame and reads up to size bytes of it into data, the rest of
+* the frame is dropped. info->length is the whole frame, receivedLen what was stored.
+*/
+bool espReceiveData(int fd, unsigned int timeout, EspIpdInfo *info, uint8_t *data, uint32_t size, uint32_t *receivedLen);
 bool espSendData(int fd, uint8_t conn_id, const char* dest, uint16_t remotePort, const char *data, int dataLen);
 bool espSetIPRangeDHCP(int fd, const char *startIP, const char *endIP);
 bool espSetSoftApIP(int fd, const char *softApIP);
+/* Resyncs the station table from AT+CWLIF and copies up to MAX_NUMBER_OF_CLIENT ips as strings */
 int espGetConnectedClients(int fd);
 char* espGetConnectedClient(int clientNum);
 int espGetNumConnectedClients();
 bool espGetConnectedAP(int fd, char *data, uint32_t size);
 bool espCloseConnection(int fd, uint8_t conn_id);
 
+void espSetEventHandlers(const EspEventHandlers *handlers);
+/* Dispatches unsolicited messages for timeout ms. Returns the number of events dispatched */
+int espProcessEvents(int fd, unsigned int timeout);
+/* Same, but returns as soon as maxEvents were dispatched, e.g. when the caller has room for that many */
+int espProcessEventsMax(int fd, unsigned int timeout, uint32_t maxEvents);
+/* Waits up to timeout ms for the first event, then dispatches only what was already received, at most maxEvents */
+int espProcessEventsBurst(int fd, unsigned int timeout, uint32_t maxEvents);
+/* Link state as tracked from CONNECT/CLOSED messages */
+bool espLinkIsOpen(uint8_t conn_id);
+/* maxConn [1,5], idleTimeout in seconds [0,7200], 0 never closes idle links */
+bool espStartTCPServer(int fd, uint16_t port, uint8_t maxConn, uint16_t idleTimeout);
+bool espStopTCPServer(int fd);
+
+/*
+* SoftAP station table, kept up to date from station events.
+* Uses an internal table of MAX_NUMBER_OF_CLIENT entries unless storage is given.
+*/
+void espSetStationTable(EspStation *storage, uint32_t capacity);
+uint32_t espGetNumStations(void);
+const EspStation *espGetStation(uint32_t idx);
+/* Stations that did not fit in the table since it was set */
+uint32_t espGetStationsDropped(void);
+/* Rebuilds the station table from AT+CWLIF. Returns true if the list ended with OK */
+bool espResyncStations(int fd);
+
+/*
+* Scans for access points storing at most maxAps of them.
+* With sortByRssi the strongest maxAps are kept, strongest first.
+* Returns the number stored or -1 on error.
+*/
+int espScanAccessPoints(int fd, EspAccessPoint *aps, uint32_t maxAps, bool sortByRssi);
+/* Same scan, every access point is handed to onAccessPoint as it is parsed */
+bool espScanAccessPointsCb(int fd, void (*onAccessPoint)(void *ctx, const EspAccessPoint *ap), void *ctx);
+/*
+* AT+CIPSTATUS. Stores up to maxLinks open links and the module status (2 got ip,
+* 3 connected, 4 disconnected, 5 not connected to an AP) in stat if not NULL.
+* Returns the number of links stored or -1 on error.
+*/
+int espGetLinkStatus(int fd, EspLinkStatus *links, uint32_t maxLinks, uint8_t *stat);
+
+/* UART speed, ESP_UART_BAUD until set. The SEND OK wait adds the wire time of the payload */
+void espSetUartBaud(uint32_t baud);
+/* Bounds of the learned timeouts of a class. Defaults are in esp8266.c */
+void espSetTimeoutBounds(EspCmdClass cls, uint32_t minMS, uint32_t maxMS);
+bool espGetRttStats(EspCmdClass cls, EspRttStats *stats);
+/* Forgets the learned values, bounds are kept */
+void espResetRtt(void);
+
+/*
+* Recovery layer. Driver commands retry busy answers with jittered backoff and
+* recover an unresponsive module with an AT probe, then AT+RST, then the hard
+* reset handler (a GPIO pulse on the reset pin, set by the application).
+* Mean time to recovery is totalRecoveryUS/recoveries.
+*/
+void espSetHardReset(void (*reset)(void *ctx), void *ctx);
+/* Brings the module back without the full espDriverInit(). Returns true if it answers again */
+bool espRecover(int fd);
+void espGetHealth(EspHealth *health);
+void espResetHealth(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_HPP
+#define ESP8266_HPP
+
+#include "esp8266.h"
+#include "esp8266_udp.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+/*************** How to use *****************
+ * Header only C++17 facade of esp8266.h. Nothing in it allocates: strings go in as
+ * std::string_view, bytes as esp::Span<const std::byte> (std::span in C++20), and
+ * received data comes back as views into the caller buffer or as move-only pool buffers.
+ *
+ * esp::Driver wifi(fd);
+ * if (auto r = wifi.connect(ssid, pass); !r){
+ *     printf("%s\n", esp::errorName(r.error()));
+ * }
+ * wifi.send(0, esp::asBytes(request));
+ *
+ * std::byte buffer[1460];
+ * if (auto rx = wifi.receive(buffer, 1000)){
+ *     handle(rx->data, rx->truncated());          // view into buffer
+ * }
+ *
+ * esp::UdpServer udp(wifi, pool);                 // espUdpInit(), see esp8266_udp.h
+ * esp::Datagram batch[16];
+ * auto n = udp.receive(batch, 100);               // each one releases its buffer when destroyed
+ *
+ * The driver is one global state machine: one esp::Driver per fd, not thread safe,
+ * same rules as the C calls. Every call costs exactly the C call it wraps, plus the
+ * copy of string_view arguments into stack buffers to terminate them.
+********************************************/
+
+namespace esp{
+
+enum class Error{
+    /* The module answered ERROR, FAIL or something else than expected */
+    Failed,
+    /* Nothing arrived in time */
+    Timeout,
+    InvalidArgument,
+    /* A string or payload longer than the command accepts */
+    TooLong,
+    BufferTooSmall
+};
+
+inline const char *errorName(Error error){
+    switch (error){
+    case Error::Failed: return "failed";
+    case Error::Timeout: return "timeout";
+    case Error::InvalidArgument: return "invalid argument";
+    case Error::TooLong: return "too long";
+    case Error::BufferTooSmall: return "buffer too small";
+    }
+    return "unknown";
+}
+
+
+/* std::expected style result, check it before taking the value */
+template<class T>
+class Result{
+public:
+    Result(T value) : v(std::move(value)) {}
+    Result(Error error) : v(error) {}
+
+    bool has_value() const { return v.index() == 0; }
+    explicit operator bool() const { return has_value(); }
+
+    T &value() & { return *std::get_if<0>(&v); }
+    const T &value() const & { return *std::get_if<0>(&v); }
+    T &&value() && { return std::move(*std::get_if<0>(&v)); }
+    T &operator*() & { return value(); }
+    const T &operator*() const & { return value(); }
+    T &&operator*() && { return std::move(value()); }
+    T *operator->() { return std::get_if<0>(&v); }
+    const T *operator->() const { return std::get_if<0>(&v); }
+
+    template<class U>
+    T value_or(U &&fallback) const & { return has_value() ? value() : static_cast<T>(std::forward<U>(fallback)); }
+
+    Error error() const { return *std::get_if<1>(&v); }
+
+private:
+    std::variant<T, Error> v;
+};
+
+template<>
+class Result<void>{
+public:
+    Result() : ok(true), err(Error::Failed) {}
+    Result(Error error) : ok(false), err(error) {}
+
+    bool has_value() const { return ok; }
+    explicit operator bool() const { return ok; }
+    Error error() const { return err; }
+
+private:
+    bool ok;
+    Error err;
+};
+
+inline Result<void> check(bool ok, Error error = Error::Failed){
+    return ok ? Result<void>() : Result<void>(error);
+}
+
+
+#if __cplusplus > 201703L && __has_include(<span>)
+template<class T>
+using Span = std::span<T>;
+#else
+/* The part of std::span the facade needs, until C++20 */
+template<class T>
+class Span{
+public:
+    constexpr Span() : ptr(nullptr), len(0) {}
+    constexpr Span(T *data, std::size_t size) : ptr(data), len(size) {}
+    template<std::size_t N>
+    constexpr Span(T (&array)[N]) : ptr(array), len(N) {}
+    /* Containers with data() and size(): std::array, std::vector, another Span... */
+    template<class C, class = std::enable_if_t<
+        std::is_convertible_v<decltype(std::declval<C&>().data()), T*> &&
+        !std::is_array_v<std::remove_reference_t<C>>>>
+    constexpr Span(C &&container) : ptr(container.data()), len(container.size()) {}
+
+    constexpr T *data() const { return ptr; }
+    constexpr std::size_t size() const { return len; }
+    constexpr std::size_t size_bytes() const { return len * sizeof(T); }
+    constexpr bool empty() const { return len == 0; }
+    constexpr T &operator[](std::size_t i) const { return ptr[i]; }
+    constexpr T *begin() const { return ptr; }
+    constexpr T *end() const { return ptr + len; }
+    constexpr Span first(std::size_t count) const { return Span(ptr, count); }
+    constexpr Span subspan(std::size_t offset) const { return Span(ptr + offset, len - offset); }
+    constexpr Span subspan(std::size_t offset, std::size_t count) const { return Span(ptr + offset, count); }
+
+private:
+    T *ptr;
+    std::size_t len;
+};
+#endif
+
+using ByteView = Span<const std::byte>;
+
+inline ByteView asBytes(std::string_view text){
+    return ByteView(reinterpret_cast<const std::byte*>(text.data()), text.size());
+}
+
+inline std::string_view asText(ByteView bytes){
+    return std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+
+/* NUL terminated copy of a string_view on the stack, for the C calls */
+template<std::size_t N>
+class CString{
+public:
+    explicit CString(std::string_view text) : fits(text.size() < N) {
+        std::size_t len = fits ? text.size() : 0;
+        if (len){
+            std::memcpy(buf, text.data(), len);
+        }
+        buf[len] = '\0';
+    }
+    bool ok() const { return fits; }
+    const char *c_str() const { return buf; }
+
+private:
+    char buf[N];
+    bool fits;
+};
+
+
+/* A received +IPD frame, data points into the buffer given to Driver::receive() */
+struct Received{
+    EspIpdInfo info;
+    ByteView data;
+
+    uint8_t link() const { return info.conn_id; }
+    /* The frame did not fit the buffer, the rest was dropped */
+    bool truncated() const { return data.size() < info.length; }
+};
+
+
+class Driver{
+public:
+    explicit Driver(int fd) : fd_(fd) {}
+    Driver(const Driver&) = delete;
+    Driver &operator=(const Driver&) = delete;
+
+    int fd() const { return fd_; }
+
+    Result<void> init() { return check(espDriverInit(fd_)); }
+    Result<void> mode(EspMode mode) { return check(espDriverMode(fd_, mode)); }
+
+    Result<void> connect(std::string_view ssid, std::string_view passphrase){
+        CString<SSID_MAX_LEN + 1> s(ssid);
+        CString<64 + 1> p(passphrase);
+        if (!s.ok() || !p.ok()){
+            return Error::TooLong;
+        }
+        return check(espWifiConnect(fd_, s.c_str(), p.c_str()));
+    }
+
+    Result<void> connectTcp(uint8_t link, std::string_view host, uint16_t port){
+        CString<HOST_SIZE> h(host);
+        if (link >= NUM_LINKS){
+            return Error::InvalidArgument;
+        }
+        if (!h.ok()){
+            return Error::TooLong;
+        }
+        return check(espStartTCPConnection(fd_, link, h.c_str(), port));
+    }
+
+    Result<void> connectSsl(uint8_t link, std::string_view host, uint16_t port, uint16_t keepAlive = 0){
+        CString<HOST_SIZE> h(host);
+        if (link >= NUM_LINKS){
+            return Error::InvalidArgument;
+        }
+        if (!h.ok()){
+            return Error::TooLong;
+        }
+        return check(espStartSSLConnection(fd_, link, h.c_str(), port, keepAlive));
+    }
+
+    Result<void> close(uint8_t link) { return check(espCloseConnection(fd_, link)); }
+    bool isOpen(uint8_t link) const { return espLinkIsOpen(link); }
+
+    /* Split in MAX_SEND_TCP_DATA_SIZE pieces by the driver */
+    Result<void> send(uint8_t link, ByteView data){
+        if (data.size() > INT32_MAX){
+            return Error::TooLong;
+        }
+        return check(espSendTCPData(fd_, link, reinterpret_cast<const char*>(data.data()), (int)data.size()));
+    }
+
+    Result<void> send(uint8_t link, std::string_view text) { return send(link, asBytes(text)); }
+
+    /* One datagram, at most MAX_SEND_TCP_DATA_SIZE bytes */
+    Result<void> sendTo(uint8_t link, std::string_view host, uint16_t port, ByteView data){
+        CString<HOST_SIZE> h(host);
+        if (!h.ok() || data.size() > MAX_SEND_TCP_DATA_SIZE){
+            return Error::TooLong;
+        }
+        return check(espSendData(fd_, link, h.c_str(), port, reinterpret_cast<const char*>(data.data()), (int)data.size()));
+    }
+
+    /* Next +IPD frame into buffer, bytes beyond it are dropped and reported by truncated() */
+    Result<Received> receive(Span<std::byte> buffer, unsigned int timeout){
+        Received rx;
+        uint32_t len = 0;
+        uint32_t size = buffer.size() < UINT32_MAX ? (uint32_t)buffer.size() : UINT32_MAX;
+        if (!espReceiveData(fd_, timeout, &rx.info, reinterpret_cast<uint8_t*>(buffer.data()), size, &len)){
+            return Error::Timeout;
+        }
+        rx.data = ByteView(buffer.data(), len);
+        return rx;
+    }
+
+    /* int count, one per unsolicited message dispatched to the event handlers */
+    int processEvents(unsigned int timeout) { return espProcessEvents(fd_, timeout); }
+
+    /* View of the driver buffer, valid until the next firmwareVersion() */
+    Result<std::string_view> firmwareVersion(){
+        const char *version = espFwVersion(fd_);
+        if (!version[0]){
+            return Error::Failed;
+        }
+        return std::string_view(version);
+    }
+
+    /* SSID of the access point, written to buffer */
+    Result<std::string_view> connectedAp(Span<char> buffer){
+        if (buffer.empty()){
+            return Error::BufferTooSmall;
+        }
+        if (!espGetConnectedAP(fd_, buffer.data(), (uint32_t)buffer.size())){
+            return Error::Failed;
+        }
+        return std::string_view(buffer.data());
+    }
+
+    /* AT+CWLIF, the clients are then read with connectedClient() */
+    Result<uint32_t> refreshClients(){
+        int n = espGetConnectedClients(fd_);
+        if (n < 0){
+            return Error::Failed;
+        }
+        return (uint32_t)n;
+    }
+
+    uint32_t numClients() const { return (uint32_t)espGetNumConnectedClients(); }
+
+    /* View of the driver table, valid until the next refreshClients() */
+    std::string_view connectedClient(uint32_t idx) const{
+        if (idx >= numClients()){
+            return std::string_view();
+        }
+        return std::string_view(espGetConnectedClient((int)idx));
+    }
+
+private:
+    /* Host names and dotted ips */
+    static constexpr std::size_t HOST_SIZE = 128;
+
+    int fd_;
+};
+
+
+/* A datagram of an esp::UdpServer, holds its pool buffer until destroyed */
+class Datagram{
+public:
+    Datagram() : pool(nullptr), d() {}
+    Datagram(EspUdpPool *udpPool, const EspDatagram &datagram) : pool(udpPool), d(datagram) {}
+    Datagram(const Datagram&) = delete;
+    Datagram &operator=(const Datagram&) = delete;
+    Datagram(Datagram &&other) noexcept : pool(other.pool), d(other.d) { other.pool = nullptr; }
+    Datagram &operator=(Datagram &&other) noexcept{
+        if (this != &other){
+            reset();
+            pool = other.pool;
+            d = other.d;
+            other.pool = nullptr;
+        }
+        return *this;
+    }
+    ~Datagram() { reset(); }
+
+    explicit operator bool() const { return pool != nullptr; }
+    ByteView data() const { return ByteView(reinterpret_cast<const std::byte*>(d.data), pool ? d.length : 0); }
+    uint8_t link() const { return d.conn_id; }
+    const uint8_t *ip() const { return d.ip; }
+    uint16_t port() const { return d.port; }
+    uint32_t timestampUS() const { return d.timestampUS; }
+
+    /* Gives the buffer back to the pool now */
+    void reset(){
+        if (pool){
+            espUdpRelease(pool, d.data);
+            pool = nullptr;
+        }
+    }
+
+private:
+    EspUdpPool *pool;
+    EspDatagram d;
+};
+
+
+/* espUdpInit() on construction, it owns the event handlers from then on */
+class UdpServer{
+public:
+    UdpServer(Driver &driver, EspUdpPool &udpPool, const EspEventHandlers *appHandlers = nullptr)
+        : fd(driver.fd()), pool(&udpPool) { espUdpInit(pool, appHandlers); }
+    UdpServer(const UdpServer&) = delete;
+    UdpServer &operator=(const UdpServer&) = delete;
+
+    Result<void> start(uint8_t link, std::string_view dest, uint16_t remotePort, uint16_t localPort){
+        CString<128> h(dest);
+        if (!h.ok()){
+            return Error::TooLong;
+        }
+        return check(espUdpStartServer(fd, link, h.c_str(), remotePort, localPort));
+    }
+
+    void stop(uint8_t link) { espUdpStopServer(fd, link); }
+
+    /*
+    * Fills batch with every datagram already received, waiting up to timeout ms for the first.
+    * Datagrams still held in batch are released first, move out the ones to keep.
+    */
+    std::size_t receive(Span<Datagram> batch, unsigned int timeout){
+        EspDatagram raw[UDP_QUEUE_SIZE];
+        for (Datagram &datagram : batch){
+            datagram.reset();
+        }
+        uint32_t max = batch.size() < UDP_QUEUE_SIZE ? (uint32_t)batch.size() : UDP_QUEUE_SIZE;
+        uint32_t n = espUdpRecvBatch(fd, raw, max, timeout);
+        for (uint32_t i = 0; i < n; i++){
+            batch[i] = Datagram(pool, raw[i]);
+        }
+        return n;
+    }
+
+    EspUdpStats stats() const{
+        EspUdpStats s;
+        espUdpGetStats(&s);
+        return s;
+    }
+
+private:
+    int fd;
+    EspUdpPool *pool;
+};
+
+} // namespace esp
+
+#endif // ESP8266_HPP
@@ -0,0 +1,2053 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*************** How to use *****************
+ * Linux only, links against the replay backend:
+ *
+ * gcc -O2 -std=gnu99 -pthread -DESP_MAX_MODULES=4 -o esp8266_bench esp8266_bench.c esp8266.c esp8266_http.c \
+ *     esp8266_mqtt.c esp8266_multi.c esp8266_scan.c esp8266_timer.c esp8266_replay.c esp8266_capture.c \
+ *     esp8266_txqueue.c esp8266_udp.c esp8266_log.c esp8266_wait.c esp8266_wait_pthread.c esp8266_sched.c \
+ *     esp8266_lz.c esp8266_writer.c
+ * ./esp8266_bench [suite...]
+ *
+ * Every result is printed as one "suite,case,param,value,unit" line so runs can be diffed.
+ * Cycle counts come from the TSC on x86. Elsewhere set ESP_BENCH_CPU_MHZ to convert
+ * nanoseconds to cycles.
+********************************************/
+
+#include "esp8266.h"
+#include "esp8266_http.h"
+#include "esp8266_log.h"
+#include "esp8266_lz.h"
+#include "esp8266_mqtt.h"
+#include "esp8266_multi.h"
+#include "esp8266_scan.h"
+#include "esp8266_replay.h"
+#include "esp8266_sched.h"
+#include "esp8266_txqueue.h"
+#include "esp8266_udp.h"
+#include "esp8266_wait.h"
+#include "esp8266_writer.h"
+#include "circular_buffer.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+static double nowNS(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1.0e9 + ts.tv_nsec;
+}
+
+static uint64_t nowCycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    static double cpuMHz = -1;
+    if (cpuMHz < 0){
+        const char *env = getenv("ESP_BENCH_CPU_MHZ");
+        cpuMHz = env ? atof(env) : 1000.0;
+    }
+    return (uint64_t)(nowNS() * cpuMHz / 1000.0);
+#endif
+}
+
+static void report(const char *suite, const char *name, const char *param, double value, const char *unit){
+    printf("%s,%s,%s,%.4f,%s\n", suite, name, param, value, unit);
+}
+
+
+/* Scan ---------------------------------------------------------------------*/
+
+/* Typical long responses, repeated to fill the benchmark buffer */
+static const char *scanSamples[] =
+{
+    "+CWLAP:(3,\"Office-5G-Guest\",-71,\"a4:2b:b0:12:34:56\",6,-12,0)\r\n",
+    "+CWLAP:(4,\"Meeting room\",-58,\"c0:25:e9:ab:cd:ef\",11,3,0)\r\n",
+    "+CIFSR:STAIP,\"192.168.0.112\"\r\n+CIFSR:STAMAC,\"5c:cf:7f:01:02:03\"\r\n",
+    "\r\n+IPD,0,512,192.168.0.10,8080:",
+};
+
+static uint32_t scanPositions[1 << 16];
+
+static void benchScan(void){
+    const EspScanImpl *impls;
+    uint32_t numImpls = espScanGetImplementations(&impls);
+    const uint8_t delims[] = {'\n', '+', ':', '>'};
+    const uint32_t sizes[] = {64, 512, 4096, 65536};
+
+    uint8_t *data = malloc(65536);
+    uint32_t filled = 0;
+    for (int i = 0; filled < 65536; i++){
+        const char *sample = scanSamples[i % (sizeof(scanSamples)/sizeof(scanSamples[0]))];
+        uint32_t len = strlen(sample);
+        if (len > 65536 - filled){
+            len = 65536 - filled;
+        }
+        memcpy(data + filled, sample, len);
+        filled += len;
+    }
+
+    for (uint32_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+        uint32_t size = sizes[s];
+        uint32_t iterations = (64u << 20) / size;
+        char param[32];
+        snprintf(param, sizeof(param), "%u", size);
+
+        for (uint32_t k = 0; k < numImpls; k++){
+            uint32_t found = 0;
+
+            uint64_t cycles = nowCycles();
+            for (uint32_t it = 0; it < iterations; it++){
+                found += impls[k].scan(data, size, delims, 4, scanPositions, sizeof(scanPositions)/sizeof(scanPositions[0]));
+            }
+            cycles = nowCycles() - cycles;
+
+            if (found == 0){
+                printf("# scan %s found nothing\n", impls[k].name);
+            }
+            report("scan", impls[k].name, param, (double)size * iterations / cycles, "bytes/cycle");
+        }
+    }
+
+    free(data);
+}
+
+
+/* CircularBuffer -----------------------------------------------------------*/
+
+typedef enum{
+    CBUF_PUT,
+    CBUF_PUT_MULTIPLE,
+    CBUF_GET_MULTIPLE,
+    CBUF_PEEK_MULTIPLE,
+    CBUF_PEEK_FROM_END,
+    CBUF_PEEK_AND_PUT,
+    NUM_CBUF_OPS
+}CbufOp;
+
+static const char *cbufOpNames[NUM_CBUF_OPS] =
+{
+    "Put", "PutMultiple", "GetMultiple", "PeekMultiple", "PeekFromEndMultiple", "PeekMultipleAndPutMultiple"
+};
+
+/* Best of BENCH_RUNS, the minimum is the least disturbed by the rest of the system */
+#define BENCH_RUNS 5
+
+static uint8_t cbufData[4096];
+static uint8_t cbufOther[4096];
+static uint8_t cbufCopy[4096];
+
+/*
+* Cycles per byte of every primitive, with the len bytes either in one piece
+* ("flat") or split by the end of the ring ("wrap").
+*/
+static void benchCircularBuffer(void){
+    const uint32_t sizes[] = {64, 512, 4096};
+    const uint32_t lens[] = {4, 16, 48};
+
+    for (uint32_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+        for (uint32_t l = 0; l < sizeof(lens)/sizeof(lens[0]); l++){
+            for (int wrap = 0; wrap < 2; wrap++){
+                uint32_t size = sizes[s];
+                uint32_t len = lens[l];
+                /* Where the len bytes start, half of them past the end when wrapping */
+                uint32_t start = wrap ? size - (len + 1) / 2 : 0;
+                uint32_t iterations = (4u << 20) / len;
+                char param[32];
+                snprintf(param, sizeof(param), "%u/%u/%s", size, len, wrap ? "wrap" : "flat");
+
+                for (int op = 0; op < NUM_CBUF_OPS; op++){
+                    CircularBuffer queue;
+                    CircularBuffer other;
+                    uint32_t sink = 0;
+                    uint64_t best = UINT64_MAX;
+
+                    circularBufferInit(&queue, cbufData, size);
+                    circularBufferInit(&other, cbufOther, 4096);
+
+                    for (int run = 0; run < BENCH_RUNS; run++){
+                        uint64_t cycles = nowCycles();
+                        for (uint32_t it = 0; it < iterations; it++){
+                            /* Reading ops find len bytes at start, writing ops write them there */
+                            queue.head = start;
+                            queue.tail = (start + len) & queue.mask;
+                            switch (op){
+                            case CBUF_PUT:
+                                queue.tail = start;
+                                for (uint32_t i = 0; i < len; i++){
+                                    circularBufferPut(&queue, (uint8_t)i);
+                                }
+                                break;
+                            case CBUF_PUT_MULTIPLE:
+                                queue.tail = start;
+                                circularBufferPutMultiple(&queue, cbufCopy, len);
+                                break;
+                            case CBUF_GET_MULTIPLE:
+                                circularBufferGetMultiple(&queue, cbufCopy, len);
+                                break;
+                            case CBUF_PEEK_MULTIPLE:
+                                circularBufferPeekMultiple(&queue, cbufCopy, len);
+                                break;
+                            case CBUF_PEEK_FROM_END:
+                                circularBufferPeekFromEndMultiple(&queue, cbufCopy, len);
+                                break;
+                            case CBUF_PEEK_AND_PUT:
+                                other.head = other.tail = 0;
+                                circularBufferPeekMultipleAndPutMultiple(&queue, &other, len);
+                                break;
+                            }
+                            sink += queue.head + queue.tail + cbufCopy[len - 1] + other.tail;
+                        }
+                        cycles = nowCycles() - cycles;
+                        if (cycles < best){
+                            best = cycles;
+                        }
+                    }
+
+                    if (sink == 0xFFFFFFFFu){
+                        printf("# cbuf sink\n");
+                    }
+                    report("cbuf", cbufOpNames[op], param, (double)best / ((double)iterations * len), "cycles/byte");
+                }
+            }
+        }
+    }
+}
+
+
+/* Emulated session helpers ------------------------------------------------*/
+
+typedef struct{
+    char *text;
+    size_t len;
+    size_t size;
+}Capture;
+
+static void captureAppend(Capture *cap, const char *fmt, ...){
+    va_list args;
+
+    for (;;){
+        va_start(args, fmt);
+        int n = vsnprintf(cap->text + cap->len, cap->size - cap->len, fmt, args);
+        va_end(args);
+
+        if (cap->len + n < cap->size){
+            cap->len += n;
+            return;
+        }
+        cap->size = cap->size ? cap->size * 2 : 4096;
+        cap->text = realloc(cap->text, cap->size);
+    }
+}
+
+/* Every session starts with the AT+CWMODE exchange espDriverMode() needs to set the driver up */
+static void captureStart(Capture *cap){
+    memset(cap, 0, sizeof(*cap));
+    captureAppend(cap, "> 0 \"AT+CWMODE=1\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+}
+
+/* One record at timestampMS with its payload escaped, dir is '<' or '>' */
+static void captureBytesAt(Capture *cap, char dir, uint32_t timestampMS, const char *data, size_t len){
+    captureAppend(cap, "%c %u \"", dir, timestampMS);
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = data[i];
+        if (c == '\r') captureAppend(cap, "\\r");
+        else if (c == '\n') captureAppend(cap, "\\n");
+        else if (c == '"' || c == '\\') captureAppend(cap, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f) captureAppend(cap, "\\x%02x", c);
+        else captureAppend(cap, "%c", c);
+    }
+    captureAppend(cap, "\"\n");
+}
+
+static void captureBytes(Capture *cap, char dir, const char *data, size_t len){
+    captureBytesAt(cap, dir, 0, data, len);
+}
+
+/* Data as the host writes it, through the CIPSEND exchange */
+static void captureSend(Capture *cap, int link, const char *data, size_t len){
+    captureAppend(cap, "> 0 \"AT+CIPSEND=%d,%u\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n> \"\n", link, (unsigned)len);
+    captureBytes(cap, '>', data, len);
+    captureAppend(cap, "< 0 \"\\r\\nRecv %u bytes\\r\\n\\r\\nSEND OK\\r\\n\"\n", (unsigned)len);
+}
+
+/* Data from the remote end as one +IPD */
+static void captureReceive(Capture *cap, int link, const char *host, int port, const char *data, size_t len){
+    char ipd[64];
+    int n = snprintf(ipd, sizeof(ipd), "\r\n+IPD,%d,%u,%s,%d:", link, (unsigned)len, host, port);
+    captureBytes(cap, '<', ipd, n);
+    captureBytes(cap, '<', data, len);
+}
+
+static void captureRun(Capture *cap){
+    espReplayLoad(cap->text, REPLAY_FAST);
+    espDriverMode(REPLAY_FD, MODE_STA);
+}
+
+
+/* Parse paths --------------------------------------------------------------*/
+
+/* Driver internals, not part of esp8266.h */
+extern bool circularBufferEndWith(const char *tag);
+extern int espReadUntil(int fd, unsigned int timeout, const char *tag, bool findTags);
+
+#define PARSE_RESPONSES 512
+#define PARSE_IPD_FRAMES 4096
+#define PARSE_IPD_SIZE 64
+
+/* Random printable text with a line break now and then, few delimiters to stop at */
+static size_t parseSynthetic(char *dest, size_t size){
+    uint32_t seed = 0x2545F491;
+    for (size_t i = 0; i < size; i++){
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        dest[i] = (i % 97 == 96) ? '\n' : (char)('a' + seed % 26);
+    }
+    return size;
+}
+
+/* Responses shaped like the recorded ones, the samples the scan suite uses */
+static size_t parseRecorded(char *dest, size_t size){
+    size_t filled = 0;
+    for (int i = 0; ; i++){
+        const char *sample = scanSamples[i % 3];
+        size_t len = strlen(sample);
+        if (filled + len > size){
+            break;
+        }
+        memcpy(dest + filled, sample, len);
+        filled += len;
+    }
+    return filled;
+}
+
+/*
+* espReadUntil() cycles per byte on a 1 KB response ending in OK, circularBufferEndWith()
+* cycles per call once the response is in the ring, and espWaitForData() per +IPD frame,
+* most of it the sscanf of the header.
+*/
+static void benchParse(void){
+    struct{
+        const char *name;
+        size_t (*fill)(char *dest, size_t size);
+    }traffic[] = {{"synthetic", parseSynthetic}, {"recorded", parseRecorded}};
+    char body[1024];
+
+    for (uint32_t t = 0; t < sizeof(traffic)/sizeof(traffic[0]); t++){
+        size_t bodyLen = traffic[t].fill(body, sizeof(body) - 6);
+        memcpy(body + bodyLen, "\r\nOK\r\n", 6);
+        bodyLen += 6;
+
+        Capture cap;
+        captureStart(&cap);
+        for (uint32_t i = 0; i < PARSE_RESPONSES; i++){
+            captureBytes(&cap, '<', body, bodyLen);
+        }
+        captureRun(&cap);
+
+        uint32_t found = 0;
+        uint64_t cycles = nowCycles();
+        for (uint32_t i = 0; i < PARSE_RESPONSES; i++){
+            found += espReadUntil(REPLAY_FD, 1000, NULL, true) == 0;
+        }
+        cycles = nowCycles() - cycles;
+
+        if (found != PARSE_RESPONSES){
+            printf("# parse %s: %u/%u responses found\n", traffic[t].name, found, PARSE_RESPONSES);
+        }
+        report("parse", "espReadUntil", traffic[t].name, (double)cycles / ((double)PARSE_RESPONSES * bodyLen), "cycles/byte");
+
+        /* The ring holds the tail of the last response now */
+        const char *tags[] = {"\r\nOK\r\n", "\r\nERROR\r\n", "+IPD,"};
+        const char *tagNames[] = {"hit", "miss", "miss_early"};
+        for (uint32_t k = 0; k < sizeof(tags)/sizeof(tags[0]); k++){
+            uint32_t iterations = 1u << 20;
+            uint32_t hits = 0;
+            uint64_t best = UINT64_MAX;
+            for (int run = 0; run < BENCH_RUNS; run++){
+                hits = 0;
+                cycles = nowCycles();
+                for (uint32_t i = 0; i < iterations; i++){
+                    hits += circularBufferEndWith(tags[k]);
+                }
+                cycles = nowCycles() - cycles;
+                if (cycles < best){
+                    best = cycles;
+                }
+            }
+
+            char param[32];
+            snprintf(param, sizeof(param), "%s/%s", traffic[t].name, tagNames[k]);
+            if (hits != (k == 0 ? iterations : 0)){
+                printf("# parse EndWith %s: %u hits\n", param, hits);
+            }
+            report("parse", "circularBufferEndWith", param, (double)best / iterations, "cycles/call");
+        }
+
+        free(cap.text);
+    }
+
+    char payload[PARSE_IPD_SIZE];
+    memset(payload, 'd', sizeof(payload));
+
+    Capture cap;
+    captureStart(&cap);
+    for (uint32_t i = 0; i < PARSE_IPD_FRAMES; i++){
+        captureReceive(&cap, i % NUM_LINKS, "192.168.4.2", 5000 + i % 1000, payload, sizeof(payload));
+    }
+    captureRun(&cap);
+    espSetEventHandlers(NULL);
+
+    char host[16];
+    char data[PARSE_IPD_SIZE];
+    uint32_t received = 0;
+    uint64_t cycles = nowCycles();
+    for (uint32_t i = 0; i < PARSE_IPD_FRAMES; i++){
+        uint32_t len = 0;
+        if (espWaitForData(REPLAY_FD, 1000, host, data, &len) && len == PARSE_IPD_SIZE){
+            received++;
+        }
+    }
+    cycles = nowCycles() - cycles;
+
+    if (received != PARSE_IPD_FRAMES){
+        printf("# parse ipd: %u/%u frames\n", received, PARSE_IPD_FRAMES);
+    }
+    report("parse", "espWaitForData", "64", (double)cycles / PARSE_IPD_FRAMES, "cycles/frame");
+
+    free(cap.text);
+}
+
+
+/* TCP server ---------------------------------------------------------------*/
+
+typedef struct{
+    uint32_t connects;
+    uint32_t closes;
+    uint64_t bytes;
+}ServerCounters;
+
+static void serverOnConnect(void *ctx, uint8_t conn_id){
+    (void)conn_id;
+    ((ServerCounters*)ctx)->connects++;
+}
+
+static void serverOnClose(void *ctx, uint8_t conn_id){
+    (void)conn_id;
+    ((ServerCounters*)ctx)->closes++;
+}
+
+static void serverOnData(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len){
+    (void)info; (void)offset; (void)data;
+    ((ServerCounters*)ctx)->bytes += len;
+}
+
+/* Five clients connect, each sends framesPerClient frames interleaved with the others, then close */
+static void benchServer(void){
+    const uint32_t frameSizes[] = {64, 512, 1460};
+    const uint32_t framesPerClient = 200;
+
+    for (uint32_t f = 0; f < sizeof(frameSizes)/sizeof(frameSizes[0]); f++){
+        uint32_t frameSize = frameSizes[f];
+        char *frame = malloc(frameSize + 1);
+        memset(frame, 'x', frameSize);
+        frame[frameSize] = '\0';
+
+        Capture cap;
+        captureStart(&cap);
+        for (uint32_t link = 0; link < NUM_LINKS; link++){
+            captureAppend(&cap, "< 1 \"%u,CONNECT\\r\\n\"\n", link);
+        }
+        for (uint32_t i = 0; i < framesPerClient; i++){
+            for (uint32_t link = 0; link < NUM_LINKS; link++){
+                captureAppend(&cap, "< 1 \"\\r\\n+IPD,%u,%u,192.168.4.%u,%u:%s\"\n", link, frameSize, link + 2, 5000 + link, frame);
+            }
+        }
+        for (uint32_t link = 0; link < NUM_LINKS; link++){
+            captureAppend(&cap, "< 1 \"%u,CLOSED\\r\\n\"\n", link);
+        }
+
+        ServerCounters counters = {0, 0, 0};
+        EspEventHandlers handlers = {&counters, serverOnConnect, serverOnClose, serverOnData, NULL};
+
+        captureRun(&cap);
+        espSetEventHandlers(&handlers);
+
+        double ns = nowNS();
+        int events = 0;
+        while (!espReplayDone()){
+            events += espProcessEvents(REPLAY_FD, 10);
+        }
+        ns = nowNS() - ns;
+
+        espSetEventHandlers(NULL);
+
+        char param[32];
+        snprintf(param, sizeof(param), "%u", frameSize);
+        if (counters.connects != NUM_LINKS || counters.closes != NUM_LINKS ||
+            counters.bytes != (uint64_t)frameSize * framesPerClient * NUM_LINKS){
+            printf("# server %s lost events\n", param);
+        }
+        report("server", "payload", param, counters.bytes / ns * 1.0e3, "MB/s");
+        report("server", "events", param, events / ns * 1.0e9, "events/s");
+
+        free(cap.text);
+        free(frame);
+    }
+}
+
+
+/* Recovery ----------------------------------------------------------------*/
+
+#define RECOVERY_WARMUP 20
+#define RECOVERY_ROUNDS 10
+
+/* What the module does to the AT+CWMODE=2 of every round */
+static void recoveryBusy(Capture *cap){
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"busy p...\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"busy p...\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+}
+
+static void recoveryGarbage(Capture *cap){
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\xf0\\x1c\\x8a\\x00\\xfe\"\n");
+    captureAppend(cap, "> 0 \"AT\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+}
+
+static void recoveryReboot(Capture *cap){
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\r\\n ets Jan  8 2013,rst cause:2, boot mode:(3,7)\\r\\n\\r\\nready\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT\\r\\n\"\n< 0 \"AT\\r\\r\\n\\r\\nOK\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"ATE0\\r\\n\"\n< 0 \"ATE0\\r\\r\\n\\r\\nOK\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CIPMUX=1\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CIPDINFO=1\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+    captureAppend(cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+}
+
+/*
+* Mean time to recovery on the emulated module, in session (virtual) time.
+* Every scenario starts with a warm up so the learned timeouts are in place.
+*/
+static void benchRecovery(void){
+    const struct{
+        const char *name;
+        void (*fault)(Capture *cap);
+    }scenarios[] =
+    {
+        {"busy", recoveryBusy},
+        {"garbage", recoveryGarbage},
+        {"reboot", recoveryReboot},
+    };
+
+    for (uint32_t k = 0; k < sizeof(scenarios)/sizeof(scenarios[0]); k++){
+        Capture cap;
+        captureStart(&cap);
+        for (uint32_t i = 0; i < RECOVERY_WARMUP; i++){
+            captureAppend(&cap, "> 0 \"AT+CWMODE=2\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n");
+        }
+        for (uint32_t i = 0; i < RECOVERY_ROUNDS; i++){
+            scenarios[k].fault(&cap);
+        }
+
+        captureRun(&cap);
+        espResetRtt();
+        for (uint32_t i = 0; i < RECOVERY_WARMUP; i++){
+            espDriverMode(REPLAY_FD, MODE_AP);
+        }
+        espResetHealth();
+
+        uint32_t ok = 0;
+        for (uint32_t i = 0; i < RECOVERY_ROUNDS; i++){
+            ok += espDriverMode(REPLAY_FD, MODE_AP);
+        }
+
+        EspHealth health;
+        EspReplayStats stats;
+        espGetHealth(&health);
+        espReplayGetStats(&stats);
+        if (ok != RECOVERY_ROUNDS || stats.mismatches || stats.recordsLeft){
+            printf("# recovery %s: %u/%u commands ok, %u mismatches, %u records left\n",
+                   scenarios[k].name, ok, RECOVERY_ROUNDS, stats.mismatches, stats.recordsLeft);
+        }
+        double mttr = health.recoveries ? (double)health.totalRecoveryUS / health.recoveries / 1000.0 : 0;
+        report("recovery", scenarios[k].name, "mttr", mttr, "ms");
+        report("recovery", scenarios[k].name, "recoveries", health.recoveries, "count");
+
+        free(cap.text);
+    }
+}
+
+
+/* HTTP client ------------------------------------------------------------*/
+
+#define HTTP_BENCH_LINK 4
+#define HTTP_BENCH_HOST "192.168.0.1"
+#define HTTP_BENCH_REQUESTS 2000
+#define HTTP_BENCH_BODY 256
+
+typedef struct{
+    uint32_t bodyBytes;
+    uint32_t completed;
+    /* Request body left to hand to readBody */
+    uint32_t toSend;
+}HttpCounters;
+
+static void httpOnBody(void *ctx, const uint8_t *data, uint32_t len){
+    (void)data;
+    ((HttpCounters*)ctx)->bodyBytes += len;
+}
+
+static void httpOnComplete(void *ctx, bool ok){
+    if (ok){
+        ((HttpCounters*)ctx)->completed++;
+    }
+}
+
+static uint32_t httpReadBody(void *ctx, uint8_t *buf, uint32_t size){
+    HttpCounters *counters = ctx;
+    uint32_t n = counters->toSend < size ? counters->toSend : size;
+    memset(buf, 'b', n);
+    counters->toSend -= n;
+    return n;
+}
+
+/*
+* Requests per second on one kept alive connection to an emulated local server.
+* "pipelined" keeps HTTP_MAX_PIPELINE requests in flight, "post" streams a chunked request body.
+*/
+static void benchHttp(void){
+    const char *cases[] = {"keepalive", "chunked", "pipelined", "post"};
+
+    char body[HTTP_BENCH_BODY + 1];
+    memset(body, 'x', HTTP_BENCH_BODY);
+    body[HTTP_BENCH_BODY] = '\0';
+
+    char lengthResponse[512];
+    int lengthResponseLen = snprintf(lengthResponse, sizeof(lengthResponse),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s", HTTP_BENCH_BODY, body);
+    char chunkedResponse[512];
+    int chunkedResponseLen = snprintf(chunkedResponse, sizeof(chunkedResponse),
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n80\r\n%.128s\r\n80\r\n%.128s\r\n0\r\n\r\n", body, body);
+
+    const char *getRequest = "GET /status HTTP/1.1\r\nHost: " HTTP_BENCH_HOST "\r\n\r\n";
+    char postRequest[512];
+    char postBody[HTTP_BENCH_BODY];
+    memset(postBody, 'b', sizeof(postBody));
+    int postRequestLen = snprintf(postRequest, sizeof(postRequest),
+        "POST /log HTTP/1.1\r\nHost: " HTTP_BENCH_HOST "\r\nTransfer-Encoding: chunked\r\n\r\n%04x\r\n%.*s\r\n0\r\n\r\n",
+        HTTP_BENCH_BODY, HTTP_BENCH_BODY, postBody);
+
+    for (uint32_t k = 0; k < sizeof(cases)/sizeof(cases[0]); k++){
+        bool pipelined = strcmp(cases[k], "pipelined") == 0;
+        bool post = strcmp(cases[k], "post") == 0;
+        const char *request = post ? postRequest : getRequest;
+        size_t requestLen = post ? (size_t)postRequestLen : strlen(getRequest);
+        const char *response = strcmp(cases[k], "chunked") == 0 ? chunkedResponse : lengthResponse;
+        size_t responseLen = strcmp(cases[k], "chunked") == 0 ? (size_t)chunkedResponseLen : (size_t)lengthResponseLen;
+        uint32_t depth = pipelined ? HTTP_MAX_PIPELINE : 1;
+
+        Capture cap;
+        captureStart(&cap);
+        captureAppend(&cap, "> 0 \"AT+CIPSTART=%d,\\\"TCP\\\",\\\"" HTTP_BENCH_HOST "\\\",80\\r\\n\"\n", HTTP_BENCH_LINK);
+        captureAppend(&cap, "< 0 \"%d,CONNECT\\r\\n\\r\\nOK\\r\\n\"\n", HTTP_BENCH_LINK);
+        for (uint32_t i = 0; i < HTTP_BENCH_REQUESTS; i += depth){
+            for (uint32_t d = 0; d < depth; d++){
+                captureSend(&cap, HTTP_BENCH_LINK, request, requestLen);
+            }
+            for (uint32_t d = 0; d < depth; d++){
+                captureReceive(&cap, HTTP_BENCH_LINK, HTTP_BENCH_HOST, 80, response, responseLen);
+            }
+        }
+        /* The server drops the connection at the end, the next case starts from scratch */
+        captureAppend(&cap, "< 0 \"%d,CLOSED\\r\\n\"\n", HTTP_BENCH_LINK);
+
+        HttpCounters counters = {0, 0, 0};
+        EspHttpRequest reqs[HTTP_MAX_PIPELINE];
+        for (uint32_t d = 0; d < HTTP_MAX_PIPELINE; d++){
+            EspHttpRequest req = {post ? "POST" : "GET", post ? "/log" : "/status", NULL,
+                                  post ? HTTP_BODY_CHUNKED : 0, httpReadBody,
+                                  NULL, NULL, httpOnBody, httpOnComplete, &counters, 0, false, false};
+            reqs[d] = req;
+        }
+
+        captureRun(&cap);
+        espHttpInit(NULL);
+
+        double ns = nowNS();
+        for (uint32_t i = 0; i < HTTP_BENCH_REQUESTS; i += depth){
+            for (uint32_t d = 0; d < depth; d++){
+                counters.toSend = HTTP_BENCH_BODY;
+                espHttpSend(REPLAY_FD, HTTP_BENCH_HOST, 80, &reqs[d]);
+            }
+            espHttpWait(REPLAY_FD, &reqs[depth-1], 1000);
+        }
+        ns = nowNS() - ns;
+
+        while (!espReplayDone()){
+            espHttpPoll(REPLAY_FD, 10);
+        }
+        espSetEventHandlers(NULL);
+
+        EspReplayStats stats;
+        espReplayGetStats(&stats);
+        if (counters.completed != HTTP_BENCH_REQUESTS || counters.bodyBytes != HTTP_BENCH_REQUESTS * HTTP_BENCH_BODY ||
+            stats.mismatches || stats.recordsLeft){
+            printf("# http %s: %u/%u completed, %u body bytes, %u mismatches, %u records left\n", cases[k],
+                   counters.completed, HTTP_BENCH_REQUESTS, counters.bodyBytes, stats.mismatches, stats.recordsLeft);
+        }
+        report("http", cases[k], "256", counters.completed / ns * 1.0e9, "req/s");
+
+        free(cap.text);
+    }
+}
+
+
+/* MQTT ---------------------------------------------------------------------*/
+
+#define MQTT_BENCH_LINK 3
+#define MQTT_BENCH_HOST "192.168.0.1"
+#define MQTT_BENCH_MESSAGES 1024
+#define MQTT_BENCH_TOPIC "bench/sensor/12"
+#define MQTT_BENCH_PAYLOAD 32
+
+/* PUBLISH exactly as the client encodes it, remaining length fits one byte */
+static size_t mqttBenchPublish(char *dest, uint8_t qos, uint16_t packetId){
+    size_t topicLen = strlen(MQTT_BENCH_TOPIC);
+    size_t n = 0;
+
+    dest[n++] = 0x30 | (qos << 1);
+    dest[n++] = 2 + topicLen + (qos ? 2 : 0) + MQTT_BENCH_PAYLOAD;
+    dest[n++] = 0;
+    dest[n++] = topicLen;
+    memcpy(dest + n, MQTT_BENCH_TOPIC, topicLen);
+    n += topicLen;
+    if (qos){
+        dest[n++] = packetId >> 8;
+        dest[n++] = packetId & 0xFF;
+    }
+    memset(dest + n, 'p', MQTT_BENCH_PAYLOAD);
+    return n + MQTT_BENCH_PAYLOAD;
+}
+
+/*
+* Publish rate to an emulated broker, coalesced into full CIPSEND frames against
+* one CIPSEND per message (flushLatencyMS 0). Wire bytes count both directions,
+* the 115200 baud rate is what that traffic allows on a real UART.
+*/
+static void benchMqtt(void){
+    const char *cases[] = {"coalesced", "immediate", "coalesced_qos1", "immediate_qos1"};
+    static const char connectPacket[] = "\x10\x11\x00\x04MQTT\x04\x02\x00\x00\x00\x05" "bench";
+    static const char connackPacket[] = "\x20\x02\x00\x00";
+
+    for (uint32_t k = 0; k < sizeof(cases)/sizeof(cases[0]); k++){
+        bool coalesced = strncmp(cases[k], "coalesced", 9) == 0;
+        uint8_t qos = strstr(cases[k], "qos1") ? 1 : 0;
+        char publish[64];
+        size_t publishLen = mqttBenchPublish(publish, qos, 1);
+        /* Messages per CIPSEND, QoS 1 also stops at the in-flight window */
+        uint32_t perFrame = coalesced ? MAX_SEND_TCP_DATA_SIZE / publishLen : 1;
+        if (qos && perFrame > MQTT_MAX_INFLIGHT){
+            perFrame = MQTT_MAX_INFLIGHT;
+        }
+
+        Capture cap;
+        captureStart(&cap);
+        captureAppend(&cap, "> 0 \"AT+CIPSTART=%d,\\\"TCP\\\",\\\"" MQTT_BENCH_HOST "\\\",1883\\r\\n\"\n", MQTT_BENCH_LINK);
+        captureAppend(&cap, "< 0 \"%d,CONNECT\\r\\n\\r\\nOK\\r\\n\"\n", MQTT_BENCH_LINK);
+        captureSend(&cap, MQTT_BENCH_LINK, connectPacket, sizeof(connectPacket) - 1);
+        captureReceive(&cap, MQTT_BENCH_LINK, MQTT_BENCH_HOST, 1883, connackPacket, sizeof(connackPacket) - 1);
+
+        char *frame = malloc(MAX_SEND_TCP_DATA_SIZE);
+        char acks[4 * MQTT_MAX_INFLIGHT];
+        size_t acksLen = 0;
+        size_t frameLen = 0;
+        for (uint32_t i = 1; i <= MQTT_BENCH_MESSAGES; i++){
+            frameLen += mqttBenchPublish(frame + frameLen, qos, i);
+            if (qos){
+                acks[acksLen++] = 0x40;
+                acks[acksLen++] = 2;
+                acks[acksLen++] = i >> 8;
+                acks[acksLen++] = i & 0xFF;
+            }
+            if (i % perFrame == 0 || i == MQTT_BENCH_MESSAGES){
+                captureSend(&cap, MQTT_BENCH_LINK, frame, frameLen);
+                frameLen = 0;
+            }
+            /* The client only reads the acks once its in-flight window is full */
+            if (acksLen && (i % MQTT_MAX_INFLIGHT == 0 || i == MQTT_BENCH_MESSAGES)){
+                captureReceive(&cap, MQTT_BENCH_LINK, MQTT_BENCH_HOST, 1883, acks, acksLen);
+                acksLen = 0;
+            }
+        }
+        free(frame);
+        captureAppend(&cap, "< 0 \"%d,CLOSED\\r\\n\"\n", MQTT_BENCH_LINK);
+
+        EspMqttConfig config = {"bench", NULL, NULL, 0, true, coalesced ? 20 : 0, NULL, NULL, NULL};
+        uint8_t payload[MQTT_BENCH_PAYLOAD];
+        memset(payload, 'p', sizeof(payload));
+
+        captureRun(&cap);
+        espMqttInit(NULL);
+        if (!espMqttConnect(REPLAY_FD, MQTT_BENCH_LINK, MQTT_BENCH_HOST, 1883, &config, 1000)){
+            printf("# mqtt %s: no CONNACK\n", cases[k]);
+        }
+
+        EspReplayStats before;
+        espReplayGetStats(&before);
+
+        uint32_t published = 0;
+        double ns = nowNS();
+        while (published < MQTT_BENCH_MESSAGES && espMqttConnected()){
+            if (espMqttPublish(REPLAY_FD, MQTT_BENCH_TOPIC, payload, sizeof(payload), qos, false)){
+                published++;
+                continue;
+            }
+            /* In-flight window full, send what is queued and wait for the acks */
+            EspMqttStats mqttStats;
+            espMqttFlush(REPLAY_FD);
+            do{
+                espMqttLoop(REPLAY_FD, 1);
+                espMqttGetStats(&mqttStats);
+            }while (espMqttConnected() && mqttStats.published != mqttStats.acked);
+        }
+        espMqttFlush(REPLAY_FD);
+        ns = nowNS() - ns;
+
+        while (!espReplayDone()){
+            espMqttLoop(REPLAY_FD, 10);
+        }
+        espSetEventHandlers(NULL);
+
+        EspReplayStats stats;
+        espReplayGetStats(&stats);
+        EspMqttStats mqttStats;
+        espMqttGetStats(&mqttStats);
+        if (published != MQTT_BENCH_MESSAGES || (qos && mqttStats.acked != MQTT_BENCH_MESSAGES) ||
+            stats.mismatches || stats.recordsLeft){
+            printf("# mqtt %s: %u/%u published, %u acked, %u mismatches, %u records left\n", cases[k],
+                   published, MQTT_BENCH_MESSAGES, mqttStats.acked, stats.mismatches, stats.recordsLeft);
+        }
+
+        double wireBytes = (double)(stats.bytesFed + stats.bytesChecked - before.bytesFed - before.bytesChecked) / published;
+        report("mqtt", cases[k], "32", published / ns * 1.0e9, "msgs/s");
+        report("mqtt", cases[k], "32", wireBytes, "wire bytes/msg");
+        report("mqtt", cases[k], "115200", 11520.0 / wireBytes, "msgs/s");
+
+        free(cap.text);
+    }
+}
+
+
+/* Multiple modules -----------------------------------------------------------*/
+
+#define MULTI_BENCH_LINKS_PER_MODULE 4
+#define MULTI_BENCH_ROUNDS 64
+#define MULTI_BENCH_SIZE 1024
+#define MULTI_BENCH_HOST "192.168.0.1"
+
+static uint8_t multiArenas[ESP_MAX_MODULES][ESP_ARENA_SIZE];
+
+/*
+* Aggregate throughput of MULTI_BENCH_LINKS_PER_MODULE links per module spread by
+* the aggregation layer. Every module has its own emulated UART, the rate is the
+* payload over the time the busiest one needs for its wire bytes at 115200 baud.
+*/
+static void benchMulti(void){
+    char data[MULTI_BENCH_SIZE];
+    double baseRate = 0;
+
+    memset(data, 'm', sizeof(data));
+
+    for (uint8_t n = 1; n <= ESP_MAX_MODULES; n *= 2){
+        uint32_t numLinks = n * MULTI_BENCH_LINKS_PER_MODULE;
+        Capture caps[ESP_MAX_MODULES];
+        int fds[ESP_MAX_MODULES];
+
+        /* Placement is round robin while every module looks the same: link i on module i%n, conn_id i/n */
+        for (uint8_t i = 0; i < n; i++){
+            fds[i] = REPLAY_FD + i;
+            captureStart(&caps[i]);
+            for (uint32_t c = 0; c < MULTI_BENCH_LINKS_PER_MODULE; c++){
+                captureAppend(&caps[i], "> 0 \"AT+CIPSTART=%u,\\\"TCP\\\",\\\"" MULTI_BENCH_HOST "\\\",80\\r\\n\"\n", c);
+                captureAppend(&caps[i], "< 0 \"%u,CONNECT\\r\\n\\r\\nOK\\r\\n\"\n", c);
+            }
+            for (uint32_t r = 0; r < MULTI_BENCH_ROUNDS; r++){
+                for (uint32_t c = 0; c < MULTI_BENCH_LINKS_PER_MODULE; c++){
+                    captureSend(&caps[i], c, data, sizeof(data));
+                }
+            }
+            for (uint32_t c = 0; c < MULTI_BENCH_LINKS_PER_MODULE; c++){
+                captureAppend(&caps[i], "< 0 \"%u,CLOSED\\r\\n\"\n", c);
+            }
+        }
+
+        espReplayLoad(caps[0].text, REPLAY_FAST);
+        for (uint8_t i = 0; i < n; i++){
+            if (i > 0){
+                espReplayLoadSession(fds[i], caps[i].text);
+            }
+            espSelectModule(i);
+            espDriverSetArena(multiArenas[i], ESP_ARENA_SIZE);
+            espResetRtt();
+            espDriverMode(fds[i], MODE_STA);
+        }
+        espMultiInit(fds, n, NULL);
+
+        int links[ESP_MAX_MODULES * MULTI_BENCH_LINKS_PER_MODULE];
+        uint32_t misplaced = 0;
+        for (uint32_t l = 0; l < numLinks; l++){
+            links[l] = espMultiOpen(TCP_MODE, MULTI_BENCH_HOST, 80, 0);
+            if (espMultiLinkModule(links[l]) != (int)(l % n)){
+                misplaced++;
+            }
+        }
+
+        uint32_t sent = 0;
+        double ns = nowNS();
+        for (uint32_t r = 0; r < MULTI_BENCH_ROUNDS; r++){
+            for (uint32_t l = 0; l < numLinks; l++){
+                sent += espMultiSend(links[l], data, sizeof(data)) ? 1 : 0;
+            }
+        }
+        ns = nowNS() - ns;
+
+        while (!espReplayDone()){
+            espMultiPoll(10);
+        }
+
+        uint64_t busiest = 0;
+        EspReplayStats total;
+        espReplayGetStats(&total);
+        for (uint8_t i = 0; i < n; i++){
+            EspReplayStats stats;
+            espReplayGetSessionStats(fds[i], &stats);
+            if (stats.bytesFed + stats.bytesChecked > busiest){
+                busiest = stats.bytesFed + stats.bytesChecked;
+            }
+            espSelectModule(i);
+            espSetEventHandlers(NULL);
+            free(caps[i].text);
+        }
+        espSelectModule(0);
+
+        if (sent != numLinks * MULTI_BENCH_ROUNDS || misplaced || total.mismatches || total.recordsLeft){
+            printf("# multi %u: %u/%u sent, %u misplaced, %u mismatches, %u records left\n", n, sent,
+                   numLinks * MULTI_BENCH_ROUNDS, misplaced, total.mismatches, total.recordsLeft);
+        }
+
+        char param[16];
+        snprintf(param, sizeof(param), "%u", n);
+        double rate = (double)sent * MULTI_BENCH_SIZE / (busiest / 11520.0) / 1000.0;
+        if (n == 1){
+            baseRate = rate;
+        }
+        report("multi", "aggregate_115200", param, rate, "kB/s");
+        report("multi", "speedup", param, rate / baseRate, "x");
+        report("multi", "cpu", param, (double)sent * MULTI_BENCH_SIZE / ns * 1.0e3, "MB/s");
+    }
+}
+
+
+/* UART transmit queue --------------------------------------------------------*/
+
+/* Simulated UART: a TX FIFO drained at the line rate, in virtual nanoseconds */
+#define TX_SIM_FIFO_DEPTH 16
+#define TX_SIM_BYTE_NS (10 * 1000000000ull / 115200)
+#define TX_BENCH_CHUNK MAX_SEND_TCP_DATA_SIZE
+#define TX_BENCH_CHUNKS 8
+
+static struct{
+    bool dma;
+    bool irqEnabled;
+    uint32_t fifoLevel;
+    const uint8_t *dmaData;
+    uint32_t dmaLeft;
+    uint64_t now;
+    uint8_t *wire;
+    uint32_t wireLen;
+    /* Spent in the writer waits and in the interrupt handlers */
+    uint64_t waitCycles;
+    uint64_t isrCycles;
+}txSim;
+
+static uint32_t txSimFifoWrite(void *ctx, const uint8_t *data, uint32_t len){
+    uint32_t taken = TX_SIM_FIFO_DEPTH - txSim.fifoLevel;
+    if (taken > len){
+        taken = len;
+    }
+    memcpy(txSim.wire + txSim.wireLen, data, taken);
+    txSim.wireLen += taken;
+    txSim.fifoLevel += taken;
+    return taken;
+}
+
+static void txSimIrqEnable(void *ctx, bool enable){
+    txSim.irqEnabled = enable;
+}
+
+static bool txSimDmaStart(void *ctx, const uint8_t *data, uint32_t len){
+    txSim.dmaData = data;
+    txSim.dmaLeft = len;
+    return true;
+}
+
+/* One byte time on the line, raising the interrupts the hardware would */
+static void txSimTick(void){
+    txSim.now += TX_SIM_BYTE_NS;
+    if (txSim.dma){
+        if (txSim.dmaLeft > 0){
+            txSim.wire[txSim.wireLen++] = *txSim.dmaData++;
+            if (--txSim.dmaLeft == 0 && txSim.irqEnabled){
+                uint64_t cycles = nowCycles();
+                espTxQueueOnDmaDone();
+                txSim.isrCycles += nowCycles() - cycles;
+            }
+        }
+        return;
+    }
+    if (txSim.fifoLevel > 0){
+        txSim.fifoLevel--;
+    }
+    if (txSim.fifoLevel == 0 && txSim.irqEnabled){
+        uint64_t cycles = nowCycles();
+        espTxQueueOnTxEmpty();
+        txSim.isrCycles += nowCycles() - cycles;
+    }
+}
+
+static bool txSimIdle(void){
+    return espTxQueueUsed() == 0 && txSim.dmaLeft == 0 && txSim.fifoLevel == 0;
+}
+
+/* The writer waits for room: the line keeps running, the CPU would be free */
+static void txSimWait(void *ctx){
+    uint64_t cycles = nowCycles();
+    txSimTick();
+    txSim.waitCycles += nowCycles() - cycles;
+}
+
+/*
+* CPU time spent sending TX_BENCH_CHUNKS CIPSEND chunks. UART_Send(BLOCKING) holds the
+* CPU for the whole line time, the queue only for the copies and the interrupts.
+* The bytes on the simulated line are checked against what was written.
+*/
+static void benchTx(void){
+    const uint32_t ringSizes[] = {512, 4096};
+    uint8_t *payload = malloc(TX_BENCH_CHUNK);
+    uint8_t *expected = malloc(TX_BENCH_CHUNKS * (TX_BENCH_CHUNK + 32));
+    uint8_t *ring = malloc(4096);
+
+    for (uint32_t i = 0; i < TX_BENCH_CHUNK; i++){
+        payload[i] = (uint8_t)(i * 7 + 1);
+    }
+
+    report("tx", "blocking", "2048", TX_BENCH_CHUNK * TX_SIM_BYTE_NS / 1000.0, "us_cpu/chunk");
+
+    for (int dma = 0; dma < 2; dma++){
+        for (uint32_t r = 0; r < sizeof(ringSizes)/sizeof(ringSizes[0]); r++){
+            EspUartHal hal = {NULL, txSimFifoWrite, txSimIrqEnable, dma ? txSimDmaStart : NULL, txSimWait};
+            memset(&txSim, 0, sizeof(txSim));
+            txSim.dma = dma;
+            txSim.wire = malloc(TX_BENCH_CHUNKS * (TX_BENCH_CHUNK + 32));
+            espTxQueueInit(&hal, ring, ringSizes[r]);
+
+            uint32_t expectedLen = 0;
+            uint64_t writerBlockedNS = 0;
+            uint64_t writerCycles = 0;
+            for (uint32_t c = 0; c < TX_BENCH_CHUNKS; c++){
+                char cmd[32];
+                int cmdLen = snprintf(cmd, sizeof(cmd), "AT+CIPSEND=%u,%u\r\n", c % NUM_LINKS, TX_BENCH_CHUNK);
+                memcpy(expected + expectedLen, cmd, cmdLen);
+                memcpy(expected + expectedLen + cmdLen, payload, TX_BENCH_CHUNK);
+                expectedLen += cmdLen + TX_BENCH_CHUNK;
+
+                uint64_t before = txSim.now;
+                uint64_t cycles = nowCycles();
+                espTxQueueWrite((const uint8_t*)cmd, cmdLen);
+                writerCycles += nowCycles() - cycles;
+
+                /* The module answers ">" about 20 byte times later, the line drains meanwhile */
+                for (int i = 0; i < 20; i++){
+                    txSimTick();
+                }
+
+                before = txSim.now;
+                txSim.waitCycles = 0;
+                cycles = nowCycles();
+                espTxQueueWrite(payload, TX_BENCH_CHUNK);
+                writerCycles += nowCycles() - cycles - txSim.waitCycles;
+                writerBlockedNS += txSim.now - before;
+
+                /* SEND OK once the module got the whole payload */
+                while (!txSimIdle()){
+                    txSimTick();
+                }
+            }
+
+            EspTxQueueStats stats;
+            espTxQueueGetStats(&stats);
+            uint32_t mismatches = txSim.wireLen != expectedLen;
+            for (uint32_t i = 0; i < expectedLen && i < txSim.wireLen; i++){
+                mismatches += txSim.wire[i] != expected[i];
+            }
+            if (mismatches){
+                printf("# tx %s/%u: %u of %u bytes wrong on the line\n", dma ? "dma" : "irq", ringSizes[r], mismatches, expectedLen);
+            }
+
+            char param[32];
+            snprintf(param, sizeof(param), "%u/%u", ringSizes[r], TX_BENCH_CHUNK);
+            const char *name = dma ? "dma" : "irq";
+            report("tx", name, param, (double)(writerCycles + txSim.isrCycles) / TX_BENCH_CHUNKS, "cycles_cpu/chunk");
+            report("tx", name, param, (double)stats.interrupts / TX_BENCH_CHUNKS, "interrupts/chunk");
+            report("tx", name, param, writerBlockedNS / 1000.0 / TX_BENCH_CHUNKS, "us_writer_blocked/chunk");
+
+            free(txSim.wire);
+        }
+    }
+
+    free(ring);
+    free(expected);
+    free(payload);
+}
+
+
+/* UDP batch receive ----------------------------------------------------------*/
+
+#define UDP_BENCH_DATAGRAMS 2048
+#define UDP_BENCH_BUFFERS 16
+#define UDP_BENCH_BATCH 16
+
+static uint8_t udpStorage[UDP_BENCH_BUFFERS * 1472];
+
+/* A UDP server on link 0 receiving UDP_BENCH_DATAGRAMS from a few senders */
+static void udpCapture(Capture *cap, const char *payload, uint32_t size){
+    const char *start = "AT+CIPSTART=0,\"UDP\",\"192.168.0.1\",5000,5000,2\r\n";
+    captureStart(cap);
+    captureBytes(cap, '>', start, strlen(start));
+    captureAppend(cap, "< 0 \"0,CONNECT\\r\\n\\r\\nOK\\r\\n\"\n");
+    for (uint32_t i = 0; i < UDP_BENCH_DATAGRAMS; i++){
+        char host[16];
+        snprintf(host, sizeof(host), "192.168.0.%u", 10 + i % 4);
+        captureReceive(cap, 0, host, 6000 + i % 4, payload, size);
+    }
+}
+
+/*
+* Datagrams per CPU second, one espWaitForData() per datagram against espUdpRecvBatch()
+* filling UDP_BENCH_BATCH descriptors at a time from the pool.
+*/
+static void benchUdp(void){
+    const uint32_t sizes[] = {64, 512, 1472};
+    char *payload = malloc(1472);
+    char *data = malloc(MAX_SEND_TCP_DATA_SIZE);
+    memset(payload, 'u', 1472);
+
+    for (uint32_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+        uint32_t size = sizes[s];
+        char param[16];
+        snprintf(param, sizeof(param), "%u", size);
+
+        Capture cap;
+        udpCapture(&cap, payload, size);
+        captureRun(&cap);
+        espSetEventHandlers(NULL);
+        espStartUDPServer(REPLAY_FD, 0, "192.168.0.1", 5000, 5000);
+
+        uint32_t received = 0;
+        double ns = nowNS();
+        for (uint32_t i = 0; i < UDP_BENCH_DATAGRAMS; i++){
+            char host[16];
+            uint32_t len = 0;
+            if (espWaitForData(REPLAY_FD, 1000, host, data, &len) && len == size){
+                received++;
+            }
+        }
+        ns = nowNS() - ns;
+        if (received != UDP_BENCH_DATAGRAMS){
+            printf("# udp wait_for_data %s: %u/%u datagrams\n", param, received, UDP_BENCH_DATAGRAMS);
+        }
+        report("udp", "wait_for_data", param, received / ns * 1.0e9, "datagrams/s");
+        free(cap.text);
+
+        EspUdpPool pool;
+        EspDatagram batch[UDP_BENCH_BATCH];
+        espUdpPoolInit(&pool, udpStorage, UDP_BENCH_BUFFERS, 1472);
+        udpCapture(&cap, payload, size);
+        captureRun(&cap);
+        espUdpInit(&pool, NULL);
+        espUdpStartServer(REPLAY_FD, 0, "192.168.0.1", 5000, 5000);
+
+        received = 0;
+        uint32_t batches = 0;
+        ns = nowNS();
+        while (received < UDP_BENCH_DATAGRAMS){
+            uint32_t n = espUdpRecvBatch(REPLAY_FD, batch, UDP_BENCH_BATCH, 1000);
+            if (n == 0){
+                break;
+            }
+            for (uint32_t i = 0; i < n; i++){
+                received += batch[i].length == size && batch[i].port >= 6000;
+                /* The worker is done with it */
+                espUdpRelease(&pool, batch[i].data);
+            }
+            batches++;
+        }
+        ns = nowNS() - ns;
+
+        EspUdpStats stats;
+        espUdpGetStats(&stats);
+        if (received != UDP_BENCH_DATAGRAMS || stats.droppedNoBuffer || stats.droppedQueueFull){
+            printf("# udp batch %s: %u/%u datagrams, %u no buffer, %u queue full\n", param, received,
+                   UDP_BENCH_DATAGRAMS, stats.droppedNoBuffer, stats.droppedQueueFull);
+        }
+        report("udp", "batch", param, received / ns * 1.0e9, "datagrams/s");
+        report("udp", "batch_size", param, batches ? (double)received / batches : 0, "datagrams");
+        espSetEventHandlers(NULL);
+        free(cap.text);
+    }
+
+    free(data);
+    free(payload);
+}
+
+
+/* Logging --------------------------------------------------------------------*/
+
+#define LOG_BENCH_BATCH 32
+#define LOG_BENCH_BATCHES 4096
+
+static void logDiscard(void *ctx, uint8_t level, uint32_t timestampUS, const char *line){
+}
+
+/*
+* Cycles per log call, batches of LOG_BENCH_BATCH records with the ring emptied in between.
+* snprintf is what the same call cost when it was formatted on the spot, before the
+* console write itself.
+*/
+static void benchLog(void){
+    static uintptr_t raw[ESP_LOG_RING_WORDS];
+    char line[ESP_LOG_LINE_SIZE];
+    const char *host = "192.168.0.10";
+    uint64_t cycles[5] = {0};
+
+    espLogFlush();
+    espLogSetOutput(logDiscard, NULL);
+    uint32_t droppedBefore = espLogDropped();
+
+    for (uint32_t b = 0; b < LOG_BENCH_BATCHES; b++){
+        uint64_t start = nowCycles();
+        for (uint32_t i = 0; i < LOG_BENCH_BATCH; i++){
+            espLogInfo("TCP connected at port %u", i);
+        }
+        cycles[0] += nowCycles() - start;
+        espLogReadRaw(raw, ESP_LOG_RING_WORDS);
+
+        start = nowCycles();
+        for (uint32_t i = 0; i < LOG_BENCH_BATCH; i++){
+            espLogError("TCP Cannot connect to %s:%u", host, i);
+        }
+        cycles[1] += nowCycles() - start;
+
+        start = nowCycles();
+        espLogFlush();
+        cycles[2] += nowCycles() - start;
+
+        start = nowCycles();
+        for (uint32_t i = 0; i < LOG_BENCH_BATCH; i++){
+            espLogDebug("TCP connected at port %u", i);
+            __asm__ volatile("" ::: "memory");
+        }
+        cycles[3] += nowCycles() - start;
+
+        start = nowCycles();
+        for (uint32_t i = 0; i < LOG_BENCH_BATCH; i++){
+            snprintf(line, sizeof(line), "TCP Cannot connect to %s:%u", host, i);
+            __asm__ volatile("" ::: "memory");
+        }
+        cycles[4] += nowCycles() - start;
+    }
+
+    if (espLogDropped() != droppedBefore){
+        printf("# log: %u records dropped\n", espLogDropped() - droppedBefore);
+    }
+    double calls = (double)LOG_BENCH_BATCH * LOG_BENCH_BATCHES;
+    report("log", "enabled", "int", cycles[0] / calls, "cycles/call");
+    report("log", "enabled", "string", cycles[1] / calls, "cycles/call");
+    report("log", "flush", "string", cycles[2] / calls, "cycles/record");
+    report("log", "filtered", "int", cycles[3] / calls, "cycles/call");
+    report("log", "snprintf", "string", cycles[4] / calls, "cycles/call");
+    espLogSetOutput(NULL, NULL);
+}
+
+
+/* Idle wait ------------------------------------------------------------------*/
+
+/* The module sends one CONNECT after IDLE_BENCH_EVENT_MS, the driver waits IDLE_BENCH_WAIT_MS */
+#define IDLE_BENCH_EVENT_MS 300
+#define IDLE_BENCH_WAIT_MS 500
+
+/* Replay backend clock, since the session was loaded in real time mode */
+extern uint32_t getCurrentUS(void);
+
+static uint32_t idleEventUS;
+
+static void idleOnConnect(void *ctx, uint8_t conn_id){
+    idleEventUS = getCurrentUS();
+}
+
+/* Stands for the UART interrupt or reader thread: bytes are there at IDLE_BENCH_EVENT_MS */
+static void *idleNotifier(void *arg){
+    int32_t remaining = IDLE_BENCH_EVENT_MS * 1000 - (int32_t)getCurrentUS();
+    if (remaining > 0){
+        struct timespec ts = {remaining / 1000000, (remaining % 1000000) * 1000L};
+        nanosleep(&ts, NULL);
+    }
+    espWaitNotifyRx();
+    return NULL;
+}
+
+static sem_t idleSem;
+
+static bool idleSemTake(void *sem, uint32_t timeoutMS){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeoutMS / 1000;
+    ts.tv_nsec += (timeoutMS % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L){
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return sem_timedwait(sem, &ts) == 0;
+}
+
+static void idleSemGive(void *sem){
+    sem_post(sem);
+}
+
+/*
+* CPU time of a driver waiting for one event on a real time session: spinning on espRead()
+* (no hooks), the pthread condition variable adapter and the RTOS adapter on a POSIX semaphore.
+*/
+static void benchIdle(void){
+    const char *names[] = {"spin", "pthread", "rtos_sem"};
+    EspEventHandlers handlers = {NULL, idleOnConnect, NULL, NULL, NULL};
+    EspRtosSemaphore rtos = {&idleSem, idleSemTake, idleSemGive, NULL};
+    char param[16];
+    Capture cap;
+
+    snprintf(param, sizeof(param), "%u", IDLE_BENCH_WAIT_MS);
+    sem_init(&idleSem, 0, 0);
+
+    for (int mode = 0; mode < 3; mode++){
+        captureStart(&cap);
+        captureAppend(&cap, "< %u \"0,CONNECT\\r\\n\"\n", IDLE_BENCH_EVENT_MS);
+        espReplayLoad(cap.text, REPLAY_REALTIME);
+        espDriverMode(REPLAY_FD, MODE_STA);
+        espSetEventHandlers(&handlers);
+
+        if (mode == 1){
+            espWaitUsePthread();
+        }
+        else if (mode == 2){
+            espWaitUseRtos(&rtos);
+        }
+
+        pthread_t notifier;
+        pthread_create(&notifier, NULL, idleNotifier, NULL);
+
+        struct timespec cpu0, cpu1;
+        idleEventUS = 0;
+        double wall = nowNS();
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        espProcessEvents(REPLAY_FD, IDLE_BENCH_WAIT_MS);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        wall = nowNS() - wall;
+
+        pthread_join(notifier, NULL);
+        espSetWaitHooks(NULL);
+        espSetEventHandlers(NULL);
+
+        double cpu = (cpu1.tv_sec - cpu0.tv_sec) * 1.0e9 + (cpu1.tv_nsec - cpu0.tv_nsec);
+        report("idle", names[mode], param, 100.0 * cpu / wall, "cpu%");
+        if (idleEventUS){
+            report("idle", names[mode], "wake_latency", idleEventUS / 1000.0 - IDLE_BENCH_EVENT_MS, "ms");
+        }
+        else{
+            printf("# idle %s: event not seen\n", names[mode]);
+        }
+        free(cap.text);
+    }
+    sem_destroy(&idleSem);
+}
+
+
+/* Transmit scheduler ---------------------------------------------------------*/
+
+/* A 64 KB upload on link 0 (bulk) while link 1 (high) sends a 64 byte control frame every 100 ms */
+#define SCHED_BENCH_UPLOAD (64 * 1024)
+#define SCHED_BENCH_CONTROLS 40
+#define SCHED_BENCH_CONTROL_SIZE 64
+#define SCHED_BENCH_PERIOD_MS 100
+#define SCHED_BENCH_MAX_SEGMENTS 512
+
+extern uint32_t getCurrentMS(void);
+extern void delayMS(int ms);
+
+typedef struct{
+    uint8_t link;
+    uint32_t len;
+    uint32_t startMS;
+    uint32_t endMS;
+}SchedSegment;
+
+static SchedSegment schedPlan[SCHED_BENCH_MAX_SEGMENTS];
+static uint32_t schedPlanLen;
+
+/* UART time of one CIPSEND exchange at 115200 baud, about 48 bytes of AT around the payload */
+static uint32_t schedSegmentMS(uint32_t len){
+    return ((len + 48) * 10 * 1000 + 115199) / 115200;
+}
+
+/* Stands for the module while planning the session: takes the UART time, records the segment */
+static bool schedModelSend(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len){
+    uint32_t start = getCurrentMS();
+    delayMS(schedSegmentMS(len));
+    if (schedPlanLen < SCHED_BENCH_MAX_SEGMENTS){
+        schedPlan[schedPlanLen++] = (SchedSegment){conn_id, len, start, getCurrentMS()};
+    }
+    return true;
+}
+
+/* Same calls, same virtual clock, whether the segments go to the model or to the driver */
+static void schedWorkload(const uint8_t *upload, const uint8_t *control, uint32_t *uploadDoneMS){
+    static EspTxFrame uploadFrame;
+    static EspTxFrame controlFrames[SCHED_BENCH_CONTROLS];
+    uint32_t start = getCurrentMS();
+    uint32_t next = 0;
+
+    espSchedResetStats();
+    espSchedSetLink(0, ESP_TX_BULK, 0);
+    espSchedSetLink(1, ESP_TX_HIGH, 0);
+    espSchedEnqueue(0, &uploadFrame, upload, SCHED_BENCH_UPLOAD, NULL, NULL);
+    *uploadDoneMS = 0;
+
+    while (next < SCHED_BENCH_CONTROLS || !espSchedIdle()){
+        while (next < SCHED_BENCH_CONTROLS && getCurrentMS() - start >= (next + 1) * SCHED_BENCH_PERIOD_MS){
+            espSchedEnqueue(1, &controlFrames[next], control, SCHED_BENCH_CONTROL_SIZE, NULL, NULL);
+            /* Produced on its tick, while the segment in flight held the UART */
+            controlFrames[next].queuedUS = (start + (next + 1) * SCHED_BENCH_PERIOD_MS) * 1000u;
+            next++;
+        }
+        if (espSchedRun(REPLAY_FD, 1) == 0){
+            delayMS(1);
+        }
+        if (!*uploadDoneMS && espSchedQueued(0) == 0){
+            *uploadDoneMS = getCurrentMS() - start;
+        }
+    }
+}
+
+/*
+* Control frame queueing delay behind an upload. fifo is espSendTCPData() as the
+* application calls it, the upload in 2 KB chunks before any control frame.
+* sched runs the scheduler twice on the same virtual clock: against a model of the
+* UART to plan the session, then through the driver on the planned capture, which
+* must replay without a mismatch.
+*/
+static void benchSched(void){
+    uint8_t *upload = malloc(SCHED_BENCH_UPLOAD);
+    uint8_t control[SCHED_BENCH_CONTROL_SIZE];
+    uint32_t uploadDoneMS;
+    char param[16];
+
+    memset(upload, 'u', SCHED_BENCH_UPLOAD);
+    memset(control, 'c', sizeof(control));
+    snprintf(param, sizeof(param), "%u", SCHED_BENCH_UPLOAD);
+
+    /* fifo, in closed form on the same UART model */
+    uint32_t fifoUploadMS = 0;
+    for (uint32_t sent = 0; sent < SCHED_BENCH_UPLOAD; sent += MAX_SEND_TCP_DATA_SIZE){
+        fifoUploadMS += schedSegmentMS(MAX_SEND_TCP_DATA_SIZE);
+    }
+    uint32_t busyUntil = fifoUploadMS;
+    uint64_t fifoTotal = 0;
+    uint32_t fifoMax = 0;
+    for (uint32_t i = 0; i < SCHED_BENCH_CONTROLS; i++){
+        uint32_t queued = (i + 1) * SCHED_BENCH_PERIOD_MS;
+        uint32_t start = busyUntil > queued ? busyUntil : queued;
+        fifoTotal += start - queued;
+        fifoMax = start - queued > fifoMax ? start - queued : fifoMax;
+        busyUntil = start + schedSegmentMS(SCHED_BENCH_CONTROL_SIZE);
+    }
+    report("sched", "fifo_control_delay_avg", param, (double)fifoTotal / SCHED_BENCH_CONTROLS, "ms");
+    report("sched", "fifo_control_delay_max", param, fifoMax, "ms");
+    report("sched", "fifo_upload_time", param, fifoUploadMS, "ms");
+
+    /* Plan */
+    Capture cap;
+    captureStart(&cap);
+    espReplayLoad(cap.text, REPLAY_FAST);
+    schedPlanLen = 0;
+    espSchedSetSender(schedModelSend, NULL);
+    schedWorkload(upload, control, &uploadDoneMS);
+    espSchedSetSender(NULL, NULL);
+
+    for (uint32_t i = 0; i < schedPlanLen; i++){
+        const SchedSegment *seg = &schedPlan[i];
+        const char *payload = (const char*)(seg->link == 0 ? upload : control);
+        char text[64];
+        int n = snprintf(text, sizeof(text), "AT+CIPSEND=%u,%u\r\n", seg->link, seg->len);
+        captureBytesAt(&cap, '>', seg->startMS, text, n);
+        captureBytesAt(&cap, '<', seg->startMS, "\r\nOK\r\n> ", 8);
+        captureBytesAt(&cap, '>', seg->startMS, payload, seg->len);
+        n = snprintf(text, sizeof(text), "\r\nRecv %u bytes\r\n\r\nSEND OK\r\n", seg->len);
+        captureBytesAt(&cap, '<', seg->endMS, text, n);
+    }
+
+    /* Through the driver */
+    captureRun(&cap);
+    schedWorkload(upload, control, &uploadDoneMS);
+
+    EspReplayStats replay;
+    EspTxLinkStats stats;
+    espReplayGetStats(&replay);
+    espSchedGetStats(1, &stats);
+    if (replay.mismatches || replay.recordsLeft || stats.frames != SCHED_BENCH_CONTROLS){
+        printf("# sched: %u mismatches, %u records left, %u control frames\n",
+               replay.mismatches, replay.recordsLeft, stats.frames);
+    }
+    report("sched", "control_delay_avg", param, stats.frames ? stats.totalDelayUS / 1000.0 / stats.frames : 0, "ms");
+    report("sched", "control_delay_max", param, stats.maxDelayUS / 1000.0, "ms");
+    report("sched", "upload_time", param, uploadDoneMS, "ms");
+
+    free(cap.text);
+    free(upload);
+}
+
+
+/* Write coalescing ----------------------------------------------------------*/
+
+#define WRITER_BENCH_LINK 0
+#define WRITER_BENCH_MESSAGES 400
+/* Longest message, the frames of a session hold them all */
+#define WRITER_BENCH_MESSAGE_SIZE 32
+
+typedef struct{
+    uint32_t offset;
+    uint32_t len;
+    uint32_t startMS;
+    uint32_t endMS;
+}WriterFrame;
+
+static WriterFrame writerPlan[WRITER_BENCH_MESSAGES];
+static uint32_t writerPlanLen;
+static uint8_t writerPlanBytes[WRITER_BENCH_MESSAGES * WRITER_BENCH_MESSAGE_SIZE];
+static uint32_t writerPlanFill;
+/* Stream offset right after every message */
+static uint32_t writerMessageEnd[WRITER_BENCH_MESSAGES];
+
+/* Stands for the module while planning the session, same UART model as the sched suite */
+static bool writerModelSend(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len){
+    uint32_t start = getCurrentMS();
+    delayMS(schedSegmentMS(len));
+    if (writerPlanLen < WRITER_BENCH_MESSAGES && writerPlanFill + len <= sizeof(writerPlanBytes)){
+        memcpy(writerPlanBytes + writerPlanFill, data, len);
+        writerPlan[writerPlanLen++] = (WriterFrame){writerPlanFill, len, start, getCurrentMS()};
+        writerPlanFill += len;
+    }
+    return true;
+}
+
+/* One small JSON message every gapMS, the writer left to flush on its own. Returns the session time */
+static uint32_t writerWorkload(EspWriter *writer, uint32_t gapMS, uint32_t delay, uint32_t *startMS){
+    static uint8_t storage[MAX_SEND_TCP_DATA_SIZE];
+    char msg[WRITER_BENCH_MESSAGE_SIZE];
+    uint32_t start = getCurrentMS();
+    uint32_t offset = 0;
+
+    *startMS = start;
+
+    espWriterInit(writer, WRITER_BENCH_LINK, storage, sizeof(storage), delay);
+
+    for (uint32_t i = 0; i < WRITER_BENCH_MESSAGES; i++){
+        while (getCurrentMS() - start < i * gapMS){
+            uint32_t frames = writer->stats.frames;
+            espWriterPoll(REPLAY_FD, writer);
+            if (writer->stats.frames == frames){
+                delayMS(1);
+            }
+        }
+        int n = snprintf(msg, sizeof(msg), "{\"seq\":%u,\"temp\":21.5}\n", i);
+        espWrite(REPLAY_FD, writer, (const uint8_t*)msg, n);
+        offset += n;
+        writerMessageEnd[i] = offset;
+    }
+    while (espWriterPending(writer)){
+        uint32_t frames = writer->stats.frames;
+        espWriterPoll(REPLAY_FD, writer);
+        if (writer->stats.frames == frames){
+            delayMS(1);
+        }
+    }
+    return getCurrentMS() - start;
+}
+
+/*
+* Throughput and latency of small writes against the flush delay, for messages
+* produced back to back (gap 0) and paced. Delay 0 is one CIPSEND per write, what
+* espSendTCPData() does. Latency counts from when a message was produced, so the
+* time it waited for the application to get out of a send is in. Every point is planned against the UART model and then
+* replayed through the driver, which must not mismatch.
+*/
+static void benchWriter(void){
+    const uint32_t gaps[] = {0, 2, 10};
+    const uint32_t delays[] = {0, 1, 2, 5, 10, 20, 50};
+    static EspWriter writer;
+
+    for (uint32_t g = 0; g < sizeof(gaps)/sizeof(gaps[0]); g++){
+        for (uint32_t d = 0; d < sizeof(delays)/sizeof(delays[0]); d++){
+            Capture cap;
+            captureStart(&cap);
+
+            /* Plan */
+            espReplayLoad(cap.text, REPLAY_FAST);
+            writerPlanLen = writerPlanFill = 0;
+            espWriterSetSender(writerModelSend, NULL);
+            uint32_t startMS;
+            writerWorkload(&writer, gaps[g], delays[d], &startMS);
+            espWriterSetSender(NULL, NULL);
+
+            /* From the time the application produced a message to the end of the send of its frame */
+            uint64_t totalLatencyMS = 0;
+            uint32_t maxLatencyMS = 0;
+            for (uint32_t i = 0, f = 0; i < WRITER_BENCH_MESSAGES && f < writerPlanLen; i++){
+                while (f + 1 < writerPlanLen && writerPlan[f].offset + writerPlan[f].len < writerMessageEnd[i]){
+                    f++;
+                }
+                uint32_t latency = writerPlan[f].endMS - (startMS + i * gaps[g]);
+                totalLatencyMS += latency;
+                maxLatencyMS = latency > maxLatencyMS ? latency : maxLatencyMS;
+            }
+
+            for (uint32_t i = 0; i < writerPlanLen; i++){
+                const WriterFrame *frame = &writerPlan[i];
+                char text[64];
+                int n = snprintf(text, sizeof(text), "AT+CIPSEND=%u,%u\r\n", WRITER_BENCH_LINK, frame->len);
+                captureBytesAt(&cap, '>', frame->startMS, text, n);
+                captureBytesAt(&cap, '<', frame->startMS, "\r\nOK\r\n> ", 8);
+                /* The payload holds the UART until the end, SEND OK follows right away */
+                captureBytesAt(&cap, '>', frame->endMS, (const char*)writerPlanBytes + frame->offset, frame->len);
+                n = snprintf(text, sizeof(text), "\r\nRecv %u bytes\r\n\r\nSEND OK\r\n", frame->len);
+                captureBytesAt(&cap, '<', frame->endMS, text, n);
+            }
+
+            /* Through the driver */
+            captureRun(&cap);
+            uint32_t sessionMS = writerWorkload(&writer, gaps[g], delays[d], &startMS);
+
+            EspReplayStats replay;
+            espReplayGetStats(&replay);
+            if (replay.mismatches || replay.recordsLeft || writer.stats.writes != WRITER_BENCH_MESSAGES){
+                printf("# writer: %u mismatches, %u records left, %u writes\n",
+                       replay.mismatches, replay.recordsLeft, writer.stats.writes);
+            }
+
+            char param[32];
+            snprintf(param, sizeof(param), "gap%u_delay%u", gaps[g], delays[d]);
+            report("writer", "throughput", param, writer.stats.bytes / (double)sessionMS * 1000.0 / 1024, "KB/s");
+            report("writer", "latency_avg", param, (double)totalLatencyMS / WRITER_BENCH_MESSAGES, "ms");
+            report("writer", "latency_max", param, maxLatencyMS, "ms");
+            report("writer", "frames", param, writer.stats.frames, "count");
+
+            free(cap.text);
+        }
+    }
+}
+
+
+/* Compression -------------------------------------------------------------*/
+
+#define LZ_BENCH_BYTES (32 * 1024)
+#define LZ_BENCH_LINK 0
+#define LZ_BENCH_BAUD 115200
+#define LZ_BENCH_CPU_ROUNDS 50
+
+static uint32_t lzSeed;
+
+static uint32_t lzRandom(void){
+    lzSeed = lzSeed * 1103515245u + 12345u;
+    return lzSeed >> 16;
+}
+
+/* Sensor telemetry, one JSON object per line */
+static size_t lzJson(char *dest, size_t size){
+    size_t len = 0;
+    for (uint32_t i = 0; len + 160 < size; i++){
+        len += snprintf(dest + len, size - len,
+                        "{\"ts\":%u,\"dev\":\"node-%02u\",\"temp\":%u.%02u,\"hum\":%u.%u,\"rssi\":-%u,\"state\":\"%s\"}\n",
+                        1760000000u + i * 5, lzRandom() % 16, 18 + lzRandom() % 8, lzRandom() % 100,
+                        40 + lzRandom() % 20, lzRandom() % 10, 50 + lzRandom() % 30, lzRandom() % 8 ? "ok" : "alarm");
+    }
+    return len;
+}
+
+static size_t lzLog(char *dest, size_t size){
+    static const char *levels[] = {"INFO ", "DEBUG", "WARN "};
+    static const char *modules[] = {"mqtt", "http", "wifi", "sensor"};
+    size_t len = 0;
+    for (uint32_t i = 0; len + 160 < size; i++){
+        len += snprintf(dest + len, size - len, "2026-10-19 12:%02u:%02u.%03u %s %s: publish topic=sensors/node-%02u/temp qos=1 id=%u\n",
+                        (i / 60) % 60, i % 60, lzRandom() % 1000, levels[lzRandom() % 3], modules[lzRandom() % 4],
+                        lzRandom() % 16, i);
+    }
+    return len;
+}
+
+/* Already compressed or encrypted data */
+static size_t lzNoise(char *dest, size_t size){
+    size_t len = size - 160;
+    for (size_t i = 0; i < len; i++){
+        dest[i] = lzRandom();
+    }
+    return len;
+}
+
+/* UART time of n bytes, 10 bits each */
+static double lzUartMS(size_t n){
+    return n * 10000.0 / LZ_BENCH_BAUD;
+}
+
+/* captureSend() with the UART time of every byte on the module clock */
+static void lzCaptureSend(Capture *cap, double *clockMS, const uint8_t *data, size_t len){
+    char cmd[32];
+    char done[48];
+    int n = snprintf(cmd, sizeof(cmd), "AT+CIPSEND=%d,%u\r\n", LZ_BENCH_LINK, (unsigned)len);
+    int d = snprintf(done, sizeof(done), "\r\nRecv %u bytes\r\n\r\nSEND OK\r\n", (unsigned)len);
+
+    *clockMS += lzUartMS(n + 9);
+    captureBytesAt(cap, '>', (uint32_t)*clockMS, cmd, n);
+    captureBytesAt(cap, '<', (uint32_t)*clockMS, "\r\nOK\r\n> ", 9);
+    *clockMS += lzUartMS(len + d);
+    captureBytesAt(cap, '>', (uint32_t)*clockMS, (const char*)data, len);
+    captureBytesAt(cap, '<', (uint32_t)*clockMS, done, d);
+}
+
+static uint8_t *lzOut;
+static size_t lzOutLen;
+
+static void lzOnData(void *ctx, const uint8_t *data, uint32_t len){
+    (void)ctx;
+    memcpy(lzOut + lzOutLen, data, len);
+    lzOutLen += len;
+}
+
+/* Session (virtual) time of the send, in ms. Checks the replay went as planned */
+static double lzTimedSend(Capture *cap, const uint8_t *data, size_t len, bool framed){
+    EspLzTx tx;
+    memset(&tx, 0, sizeof(tx));
+
+    captureRun(cap);
+    uint32_t startUS = getCurrentUS();
+    bool ok = framed ? espLzSend(REPLAY_FD, LZ_BENCH_LINK, &tx, data, len)
+                     : espSendTCPData(REPLAY_FD, LZ_BENCH_LINK, (const char*)data, len);
+    double ms = (getCurrentUS() - startUS) / 1000.0;
+
+    EspReplayStats stats;
+    espReplayGetStats(&stats);
+    if (!ok || stats.mismatches || stats.recordsLeft){
+        printf("# lz %s send: ok %d, %u mismatches, %u records left\n", framed ? "framed" : "plain", ok,
+               stats.mismatches, stats.recordsLeft);
+    }
+    return ms;
+}
+
+/*
+* Payload throughput over a 115200 baud UART, where every byte costs its serial time:
+* plain espSendTCPData() against espLzSend() of the same data. The gain is what the
+* link delivers more per second, compression CPU time is reported apart (host CPU).
+*/
+static void benchLz(void){
+    const struct{
+        const char *name;
+        size_t (*fill)(char *dest, size_t size);
+    }payloads[] =
+    {
+        {"json", lzJson},
+        {"log", lzLog},
+        {"random", lzNoise},
+    };
+    uint8_t *data = malloc(LZ_BENCH_BYTES);
+    uint8_t *frame = malloc(ESP_LZ_FRAME_BOUND);
+    uint8_t *block = malloc(ESP_LZ_FRAME_BOUND);
+    static EspLzRx rx;
+
+    lzOut = malloc(LZ_BENCH_BYTES);
+
+    for (uint32_t k = 0; k < sizeof(payloads)/sizeof(payloads[0]); k++){
+        lzSeed = 1;
+        size_t len = payloads[k].fill((char*)data, LZ_BENCH_BYTES);
+
+        /* Plain sends, split like espSendTCPData() does */
+        Capture cap;
+        double clockMS = 0;
+        captureStart(&cap);
+        for (size_t pos = 0; pos < len; pos += MAX_SEND_TCP_DATA_SIZE){
+            size_t n = len - pos < MAX_SEND_TCP_DATA_SIZE ? len - pos : MAX_SEND_TCP_DATA_SIZE;
+            lzCaptureSend(&cap, &clockMS, data + pos, n);
+        }
+        double plainMS = lzTimedSend(&cap, data, len, false);
+        free(cap.text);
+
+        /* Frames planned with a model EspLzTx, decoded back on the way */
+        EspLzTx model;
+        memset(&model, 0, sizeof(model));
+        espLzRxInit(&rx, lzOnData, NULL);
+        lzOutLen = 0;
+        clockMS = 0;
+        captureStart(&cap);
+        for (size_t pos = 0; pos < len; pos += ESP_LZ_MAX_BLOCK){
+            size_t n = len - pos < ESP_LZ_MAX_BLOCK ? len - pos : ESP_LZ_MAX_BLOCK;
+            uint32_t size = espLzEncodeFrame(&model, data + pos, n, frame);
+            lzCaptureSend(&cap, &clockMS, frame, size);
+            espLzFeed(&rx, frame, size);
+        }
+        double framedMS = lzTimedSend(&cap, data, len, true);
+        free(cap.text);
+
+        if (lzOutLen != len || memcmp(lzOut, data, len) != 0 || rx.errors){
+            printf("# lz %s: decoded stream differs\n", payloads[k].name);
+        }
+
+        /* Codec alone, the part the target CPU pays */
+        double compressNS = nowNS();
+        uint32_t compressed = 0;
+        for (uint32_t r = 0; r < LZ_BENCH_CPU_ROUNDS; r++){
+            for (size_t pos = 0; pos + ESP_LZ_MAX_BLOCK <= len; pos += ESP_LZ_MAX_BLOCK){
+                compressed += espLzCompress(data + pos, ESP_LZ_MAX_BLOCK, block, ESP_LZ_FRAME_BOUND);
+            }
+        }
+        compressNS = nowNS() - compressNS;
+
+        uint32_t blockLen = espLzCompress(data, ESP_LZ_MAX_BLOCK, block, ESP_LZ_FRAME_BOUND);
+        double decompressNS = nowNS();
+        int32_t decompressed = 0;
+        for (uint32_t r = 0; r < LZ_BENCH_CPU_ROUNDS * (len / ESP_LZ_MAX_BLOCK); r++){
+            decompressed += espLzDecompress(block, blockLen, frame, ESP_LZ_MAX_BLOCK);
+        }
+        decompressNS = nowNS() - decompressNS;
+        if (!compressed || decompressed <= 0){
+            printf("# lz codec sink\n");
+        }
+
+        double cpuBytes = (double)LZ_BENCH_CPU_ROUNDS * (len / ESP_LZ_MAX_BLOCK) * ESP_LZ_MAX_BLOCK;
+        report("lz", payloads[k].name, "ratio", (double)model.stats.rawBytes / model.stats.wireBytes, "x");
+        report("lz", payloads[k].name, "plain", len / plainMS * 1000.0 / 1024, "KB/s");
+        report("lz", payloads[k].name, "framed", len / framedMS * 1000.0 / 1024, "KB/s");
+        report("lz", payloads[k].name, "gain", plainMS / framedMS, "x");
+        report("lz", payloads[k].name, "skipped", model.stats.skippedFrames, "frames");
+        report("lz", payloads[k].name, "compress", cpuBytes / compressNS * 1.0e3, "MB/s");
+        report("lz", payloads[k].name, "decompress", cpuBytes / decompressNS * 1.0e3, "MB/s");
+    }
+
+    free(lzOut);
+    free(block);
+    free(frame);
+    free(data);
+}
+
+
+/* Warm restart --------------------------------------------------------------*/
+
+/* Time the module takes to answer a command, about 30 bytes each way at 115200 baud plus its own work */
+#define ATTACH_ANSWER_MS 5
+
+/* One command and its answer, answered ATTACH_ANSWER_MS after the module clock */
+static void attachExchange(Capture *cap, uint32_t *clockMS, const char *cmd, const char *answer){
+    *clockMS += ATTACH_ANSWER_MS;
+    captureBytesAt(cap, '>', *clockMS, cmd, strlen(cmd));
+    captureBytesAt(cap, '<', *clockMS, answer, strlen(answer));
+}
+
+/* What espDriverInit() exchanges, clockMS also runs through the sleeps of espReset() */
+static void attachColdInit(Capture *cap, uint32_t *clockMS){
+    for (uint32_t i = 0; i < 3; i++){
+        attachExchange(cap, clockMS, "ATE0\r\n", "\r\nOK\r\n");
+    }
+    attachExchange(cap, clockMS, "AT\r\n", "\r\nOK\r\n");
+    *clockMS += 1000;
+    attachExchange(cap, clockMS, "ATE0\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CWMODE=1\r\n", "\r\nOK\r\n");
+    *clockMS += 10000;
+    attachExchange(cap, clockMS, "AT+CIPMUX=1\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CIPDINFO=1\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CWAUTOCONN=0\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CWDHCP=1,1\r\n", "\r\nOK\r\n");
+    *clockMS += 200;
+    attachExchange(cap, clockMS, "AT+GMR\r\n", "AT version:1.2.0.0\r\nSDK version:1.5.4.1\r\n\r\nOK\r\n");
+}
+
+/* Probes of espDriverAttach(), the module is a station with two links open unless cipmux is 0 */
+static void attachProbes(Capture *cap, uint32_t *clockMS, int cipmux){
+    attachExchange(cap, clockMS, "ATE0\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CWMODE?\r\n", "+CWMODE:1\r\n\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CIPMUX?\r\n", cipmux ? "+CIPMUX:1\r\n\r\nOK\r\n" : "+CIPMUX:0\r\n\r\nOK\r\n");
+    if (!cipmux){
+        /* Single connection mode, the link line has no id */
+        attachExchange(cap, clockMS, "AT+CIPSTATUS\r\n",
+                       "STATUS:3\r\n"
+                       "+CIPSTATUS:\"TCP\",\"192.168.0.10\",1883,40001,0\r\n\r\nOK\r\n");
+        return;
+    }
+    attachExchange(cap, clockMS, "AT+CIPSTATUS\r\n",
+                   "STATUS:3\r\n"
+                   "+CIPSTATUS:0,\"TCP\",\"192.168.0.10\",1883,40001,0\r\n"
+                   "+CIPSTATUS:3,\"UDP\",\"192.168.0.1\",53,40003,0\r\n\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CIPDINFO=1\r\n", "\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CWJAP_CUR?\r\n", "+CWJAP_CUR:\"office\",\"a0:f3:c1:22:10:07\",6,-58\r\n\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+CIFSR\r\n",
+                   "+CIFSR:STAIP,\"192.168.0.42\"\r\n+CIFSR:STAMAC,\"5c:cf:7f:01:02:03\"\r\n\r\nOK\r\n");
+    attachExchange(cap, clockMS, "AT+GMR\r\n", "AT version:1.2.0.0\r\nSDK version:1.5.4.1\r\n\r\nOK\r\n");
+}
+
+/*
+* Session (virtual) time to get a working driver after the host restarted: the full
+* espDriverInit(), a warm espDriverAttach() and an attach that finds the module in single
+* connection mode with links open and has to reset it. Every case ends sending on link 0.
+*/
+static void benchAttach(void){
+    const char *names[] = {"init", "warm", "inconsistent"};
+    const char payload[] = "ping";
+
+    for (uint32_t k = 0; k < sizeof(names)/sizeof(names[0]); k++){
+        Capture cap;
+        uint32_t clockMS = 0;
+
+        memset(&cap, 0, sizeof(cap));
+        if (k != 0){
+            attachProbes(&cap, &clockMS, k == 1);
+        }
+        if (k != 1){
+            attachColdInit(&cap, &clockMS);
+        }
+        captureSend(&cap, 0, payload, strlen(payload));
+
+        espReplayLoad(cap.text, REPLAY_FAST);
+        espResetRtt();
+
+        EspAttachInfo info;
+        bool ok;
+        if (k == 0){
+            memset(&info, 0, sizeof(info));
+            uint32_t startUS = getCurrentUS();
+            ok = espDriverInit(REPLAY_FD);
+            info.attachUS = getCurrentUS() - startUS;
+        }
+        else{
+            ok = espDriverAttach(REPLAY_FD, &info);
+        }
+        ok = ok && espSendTCPData(REPLAY_FD, 0, payload, strlen(payload));
+
+        EspReplayStats stats;
+        espReplayGetStats(&stats);
+        if (!ok || stats.mismatches || stats.recordsLeft || info.fullReset != (k == 2) ||
+            (k == 1 && (info.numLinks != 2 || !espLinkIsOpen(3) || strcmp(info.ssid, "office") != 0))){
+            printf("# attach %s: ok %d, full reset %d, %u links, %u mismatches, %u records left\n",
+                   names[k], ok, info.fullReset, info.numLinks, stats.mismatches, stats.recordsLeft);
+        }
+        report("attach", names[k], "time", info.attachUS / 1000.0, "ms");
+
+        free(cap.text);
+    }
+}
+
+
+typedef struct{
+    const char *name;
+    void (*run)(void);
+}BenchSuite;
+
+static const BenchSuite suites[] =
+{
+    {"scan", benchScan},
+    {"cbuf", benchCircularBuffer},
+    {"parse", benchParse},
+    {"server", benchServer},
+    {"recovery", benchRecovery},
+    {"http", benchHttp},
+    {"mqtt", benchMqtt},
+    {"multi", benchMulti},
+    {"tx", benchTx},
+    {"udp", benchUdp},
+    {"log", benchLog},
+    {"idle", benchIdle},
+    {"sched", benchSched},
+    {"attach", benchAttach},
+    {"lz", benchLz},
+    {"writer", benchWriter},
+};
+
+/* No argument runs every suite */
+static bool suiteSelected(int argc, char **argv, const char *name){
+    if (argc < 2){
+        return true;
+    }
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], name) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv){
+    printf("suite,case,param,value,unit\n");
+    printf("# scan dispatches to %s\n", espScanSelectedName());
+
+    for (uint32_t i = 0; i < sizeof(suites)/sizeof(suites[0]); i++){
+        if (suiteSelected(argc, argv, suites[i].name)){
+            suites[i].run();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_capture.h"
+
+
+void espCaptureWrite(FILE *file, EspCaptureDir dir, uint32_t timestampMS, const void *buf, int len){
+    const uint8_t *bytes = buf;
+
+    if (!file || len <= 0){
+        return;
+    }
+
+    fprintf(file, "%c %u \"", dir, timestampMS);
+    for (int i = 0; i < len; i++){
+        switch (bytes[i]){
+        case '\r': fputs("\\r", file); break;
+        case '\n': fputs("\\n", file); break;
+        case '\t': fputs("\\t", file); break;
+        case '"': fputs("\\\"", file); break;
+        case '\\': fputs("\\\\", file); break;
+        default:
+            if (bytes[i] < 0x20 || bytes[i] >= 0x7f){
+                fprintf(file, "\\x%02x", bytes[i]);
+            }
+            else{
+                fputc(bytes[i], file);
+            }
+        }
+    }
+    fputs("\"\n", file);
+    fflush(file);
+}
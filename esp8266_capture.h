@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_CAPTURE_H
+#define ESP8266_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Capture file format, one record per line:
+ *
+ *   # comment
+ *   < 1532 "\r\nOK\r\n"        module -> host, driver reads it
+ *   > 1530 "AT\r\n"            host -> module, driver must write it
+ *
+ * The number is the time in milliseconds since the start of the session.
+ * Payload strings accept the C escapes \r \n \t \" \\ and \xHH.
+ * Written by a live backend built with CAPTURE_ESP8266, read by esp8266_replay.c.
+ */
+
+typedef enum{
+        CAPTURE_FROM_MODULE = '<',
+        CAPTURE_TO_MODULE = '>'
+}EspCaptureDir;
+
+/* Capture writer, to be called from a live backend to produce replayable sessions */
+void espCaptureWrite(FILE *file, EspCaptureDir dir, uint32_t timestampMS, const void *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_CAPTURE_H
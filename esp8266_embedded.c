@@ -34,25 +34,139 @@
 #include <stdio.h>
 
 #include "esp8266_embedded.h"
+#include "esp8266_txqueue.h"
+#include "esp8266_wait.h"
 #include "lpc13xx_uart.h"
 
 uint8_t rxBuffer[SERIAL_RX_BUFFER_SIZE];
+static uint8_t txBuffer[SERIAL_TX_BUFFER_SIZE];
+
+static EspSerialRxStats rxStats;
+static bool rxDropping = false;
+
+/* Backpressure, off until espSerialRxSetBackpressure() */
+static uint32_t rxHighThreshold = SERIAL_RX_BUFFER_SIZE;
+static uint32_t rxLowThreshold = 0;
+static void (*rxBackpressure)(void *ctx, bool pause) = NULL;
+static void *rxBackpressureCtx = NULL;
+/* Set by the interrupt only, cleared by espRead() only */
+static volatile bool rxAbove = false;
+static uint32_t rxAboveSinceMS = 0;
+
+
+/* Fills the FIFO only while it has room, UART_Send() returns what it took */
+static uint32_t lpcFifoWrite(void *ctx, const uint8_t *data, uint32_t len){
+	return UART_Send(LPC_UART, (uint8_t*)data, len, NONE_BLOCKING);
+}
+
+static void lpcIrqEnable(void *ctx, bool enable){
+	UART_IntConfig(LPC_UART, UART_INTCFG_THRE, enable ? ENABLE : DISABLE);
+}
+
+static const EspUartHal lpcUartHal = {NULL, lpcFifoWrite, lpcIrqEnable, NULL, NULL};
+
+/* espSerialRxPut() runs from the receive interrupt, masking it keeps rxStats whole */
+static void lpcRxIrqEnable(bool enable){
+	UART_IntConfig(LPC_UART, UART_INTCFG_RBR, enable ? ENABLE : DISABLE);
+}
 
 
 void initEspInputBuffer(){
 	circularBufferInit(&serialRxBuffer, rxBuffer, SERIAL_RX_BUFFER_SIZE);
+	/* The UART interrupt handler calls espTxQueueOnTxEmpty() on THRE */
+	espTxQueueInit(&lpcUartHal, txBuffer, SERIAL_TX_BUFFER_SIZE);
 }
 
 uint32_t getCurrentMS (void){
 	return delay_GetTickCounter();
 }
 
+/* The tick counter runs at 1 ms, deadlines get millisecond resolution here */
+uint32_t getCurrentUS (void){
+	return delay_GetTickCounter() * 1000u;
+}
+
 void delayMS(int ms){
     uint32_t start = getCurrentMS();
     while (getCurrentMS() - start < ms);
 }
 
 
+void espSerialRxPut(uint8_t byte){
+	if (!circularBufferTryPut(&serialRxBuffer, byte)){
+		rxStats.bytesDropped++;
+		if (!rxDropping){
+			rxDropping = true;
+			rxStats.overflows++;
+		}
+		return;
+	}
+	rxDropping = false;
+	rxStats.bytesReceived++;
+
+	uint32_t used = circularBufferUsedElementsNum(&serialRxBuffer);
+	/* The driver only waits on an empty ring, the first byte is enough to wake it up */
+	if (used == 1){
+		espWaitNotifyRx();
+	}
+	if (used > rxStats.highWater){
+		rxStats.highWater = used;
+	}
+	if (!rxAbove && used >= rxHighThreshold){
+		rxAbove = true;
+		rxAboveSinceMS = getCurrentMS();
+		rxStats.backpressureEvents++;
+		if (rxBackpressure){
+			rxBackpressure(rxBackpressureCtx, true);
+		}
+	}
+}
+
+
+/* Consumer side of the backpressure, after espRead() took bytes out */
+static void espSerialRxCheckResume(void){
+	if (rxAbove && circularBufferUsedElementsNum(&serialRxBuffer) <= rxLowThreshold){
+		rxStats.msAboveThreshold += getCurrentMS() - rxAboveSinceMS;
+		rxAbove = false;
+		if (rxBackpressure){
+			rxBackpressure(rxBackpressureCtx, false);
+		}
+	}
+}
+
+
+void espSerialRxSetBackpressure(uint32_t high, uint32_t low, void (*onBackpressure)(void *ctx, bool pause), void *ctx){
+	/* The ring holds SERIAL_RX_BUFFER_SIZE-1 bytes at most, and an empty ring never pauses */
+	if (high == 0){
+		high = 1;
+	}
+	rxHighThreshold = high < SERIAL_RX_BUFFER_SIZE ? high : SERIAL_RX_BUFFER_SIZE-1;
+	rxLowThreshold = low < rxHighThreshold ? low : rxHighThreshold-1;
+	rxBackpressureCtx = ctx;
+	rxBackpressure = onBackpressure;
+}
+
+
+void espSerialRxGetStats(EspSerialRxStats *stats){
+	lpcRxIrqEnable(false);
+	*stats = rxStats;
+	if (rxAbove){
+		stats->msAboveThreshold += getCurrentMS() - rxAboveSinceMS;
+	}
+	lpcRxIrqEnable(true);
+}
+
+
+void espSerialRxResetStats(void){
+	/* The UART FIFO keeps what arrives meanwhile, nothing is lost */
+	lpcRxIrqEnable(false);
+	memset(&rxStats, 0, sizeof(rxStats));
+	rxStats.highWater = circularBufferUsedElementsNum(&serialRxBuffer);
+	rxAboveSinceMS = getCurrentMS();
+	lpcRxIrqEnable(true);
+}
+
+
 //#define DEBUG
 void espPrintln(int fd, const char *buf, int len){
     //len+=2;
@@ -64,24 +178,28 @@ void espPrintln(int fd, const char *buf, int len){
     printf("\n");
 #endif
     //write(fd, buf, len);
-    UART_Send(LPC_UART, buf, len, BLOCKING);
+    /* Returns once queued, the AT replies are what the driver waits for */
+    espTxQueueWrite((const uint8_t*)buf, len);
     //write(2, buf, len);
 }
 
 ssize_t espRead (int __fd, void *__buf, size_t __nbytes){
 	if (__fd == SERIAL_ESP8266_FD_NUM){
-		uint32_t availableBytes = circularBufferUsedElementsNum(&serialRxBuffer);
-		if ( __nbytes > availableBytes){
-			circularBufferGetMultiple(&serialRxBuffer, __buf, availableBytes);
-			//trace_write(__buf, availableBytes);
-			return availableBytes;
-		}
-		else{
-			circularBufferGetMultiple(&serialRxBuffer, __buf, __nbytes);
-			//trace_write(__buf, __nbytes);
-			return __nbytes;
-		}
+		/* Straight out of the spans the UART interrupt filled */
+		CircularBufferSpan spans[2];
+		uint32_t numSpans = circularBufferReadSpans(&serialRxBuffer, spans);
+		uint8_t *dest = __buf;
+		size_t copied = 0;
 
+		for (uint32_t i = 0; i < numSpans && copied < __nbytes; i++){
+			size_t len = spans[i].len < __nbytes - copied ? spans[i].len : __nbytes - copied;
+			memcpy(dest + copied, spans[i].data, len);
+			copied += len;
+		}
+		circularBufferConsume(&serialRxBuffer, copied);
+		espSerialRxCheckResume();
+		//trace_write(__buf, copied);
+		return copied;
 	}
    #ifdef DEBUG
    printf("[espRead]Asked for %d, got %d=", __nbytes, num);
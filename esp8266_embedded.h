@@ -36,10 +36,52 @@
 
 static const int SERIAL_ESP8266_FD_NUM = 3;
 
+#ifndef SERIAL_RX_BUFFER_SIZE
 #define SERIAL_RX_BUFFER_SIZE 256
+#endif
+
+/*
+* Transmit ring drained by the TX FIFO empty interrupt, see esp8266_txqueue.h.
+* 512 holds any AT command line. A CIPSEND payload above it (up to MAX_SEND_TCP_DATA_SIZE)
+* makes espPrintln() wait for the missing room, 4096 (the ring size is a power of two)
+* never does.
+*/
+#ifndef SERIAL_TX_BUFFER_SIZE
+#define SERIAL_TX_BUFFER_SIZE 512
+#endif
 
 CircularBuffer serialRxBuffer;
 
+/* Receive ring telemetry, to size SERIAL_RX_BUFFER_SIZE from field data */
+typedef struct{
+    uint32_t bytesReceived;
+    /* Bytes thrown away because the ring was full, each one a corrupted response or +IPD frame */
+    uint32_t bytesDropped;
+    /* Runs of dropped bytes */
+    uint32_t overflows;
+    /* Most bytes ever waiting in the ring */
+    uint32_t highWater;
+    /* Time spent at or above the backpressure threshold */
+    uint32_t msAboveThreshold;
+    uint32_t backpressureEvents;
+}EspSerialRxStats;
+
 void initEspInputBuffer();
 
+/* Called by the UART receive interrupt for every byte, instead of circularBufferPut() */
+void espSerialRxPut(uint8_t byte);
+
+/*
+* Calls onBackpressure(ctx, true) when the ring reaches high bytes (deassert RTS, stop
+* pulling data) and onBackpressure(ctx, false) once espRead() brought it down to low.
+* onBackpressure can be NULL to only count the time above high. It runs in the
+* receive interrupt when pausing. high is clamped to 1..SERIAL_RX_BUFFER_SIZE-1 and low
+* to 0..high-1.
+*/
+void espSerialRxSetBackpressure(uint32_t high, uint32_t low, void (*onBackpressure)(void *ctx, bool pause), void *ctx);
+
+/* Both briefly mask the receive interrupt, call them from thread context */
+void espSerialRxGetStats(EspSerialRxStats *stats);
+void espSerialRxResetStats(void);
+
 #endif // ESP8266_LINUX_H
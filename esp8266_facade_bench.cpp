@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*************** How to use *****************
+ * Linux/glibc only, links against the replay backend. The C sources are built as C:
+ *
+ * gcc -O2 -std=gnu99 -c esp8266.c esp8266_scan.c esp8266_timer.c esp8266_replay.c esp8266_capture.c esp8266_udp.c esp8266_log.c \
+ *     esp8266_wait.c
+ * g++ -O2 -std=c++17 -o esp8266_facade_bench esp8266_facade_bench.cpp esp8266.o esp8266_scan.o \
+ *     esp8266_timer.o esp8266_replay.o esp8266_capture.o esp8266_udp.o esp8266_log.o esp8266_wait.o
+ * ./esp8266_facade_bench
+ *
+ * Same "suite,case,param,value,unit" lines as esp8266_bench. Every heap allocation
+ * (malloc, and operator new through it) made while a case runs is counted: the esp::
+ * calls must report 0, the string_copy cases show what std::string wrappers cost.
+********************************************/
+
+#include "esp8266.hpp"
+#include "esp8266_replay.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <time.h>
+
+
+/* Allocation counter ---------------------------------------------------------*/
+
+static bool counting = false;
+static uint64_t allocations = 0;
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t num, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size){
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t num, size_t size){
+    allocations += counting;
+    return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size){
+    allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+
+
+static double nowNS(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1.0e9 + ts.tv_nsec;
+}
+
+static void report(const char *suite, const char *name, const char *param, double value, const char *unit){
+    printf("%s,%s,%s,%.4f,%s\n", suite, name, param, value, unit);
+}
+
+/* Starts counting, returns the start time */
+static double caseStart(void){
+    allocations = 0;
+    counting = true;
+    return nowNS();
+}
+
+static void caseEnd(const char *name, const char *param, double start, uint32_t ops, const char *unit){
+    double ns = nowNS() - start;
+    counting = false;
+    report("facade", name, param, ops / ns * 1.0e9, unit);
+    report("facade", name, param, (double)allocations / ops, "allocations/op");
+}
+
+
+/* Emulated sessions ----------------------------------------------------------*/
+
+#define FACADE_BENCH_OPS 1024
+
+/* Payloads are plain letters, nothing to escape */
+static std::string sendCapture(uint32_t size){
+    std::string cap = "> 0 \"AT+CWMODE=1\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n";
+    std::string payload(size, 's');
+    for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+        cap += "> 0 \"AT+CIPSEND=0," + std::to_string(size) + "\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n> \"\n";
+        cap += "> 0 \"" + payload + "\"\n";
+        cap += "< 0 \"\\r\\nRecv " + std::to_string(size) + " bytes\\r\\n\\r\\nSEND OK\\r\\n\"\n";
+    }
+    return cap;
+}
+
+static std::string receiveCapture(uint32_t size, bool udp){
+    std::string cap = "> 0 \"AT+CWMODE=1\\r\\n\"\n< 0 \"\\r\\nOK\\r\\n\"\n";
+    std::string payload(size, 'r');
+    if (udp){
+        cap += "> 0 \"AT+CIPSTART=0,\\\"UDP\\\",\\\"192.168.0.1\\\",5000,5000,2\\r\\n\"\n";
+        cap += "< 0 \"0,CONNECT\\r\\n\\r\\nOK\\r\\n\"\n";
+    }
+    for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+        cap += "< 0 \"\\r\\n+IPD,0," + std::to_string(size) + ",192.168.0.10,6000:\"\n";
+        cap += "< 0 \"" + payload + "\"\n";
+    }
+    return cap;
+}
+
+static void sessionStart(const std::string &cap){
+    espReplayLoad(cap.c_str(), REPLAY_FAST);
+    espDriverMode(REPLAY_FD, MODE_STA);
+    espSetEventHandlers(NULL);
+}
+
+
+/* The std::string wrapper the facade replaces */
+struct StringPacket{
+    std::string host;
+    std::string data;
+};
+
+static bool stringSend(int fd, uint8_t link, std::string data){
+    return espSendTCPData(fd, link, data.c_str(), (int)data.size());
+}
+
+static bool stringReceive(int fd, unsigned int timeout, StringPacket &packet){
+    char host[IP_BUFFER_SIZE];
+    char data[MAX_SEND_TCP_DATA_SIZE];
+    uint32_t len = 0;
+    if (!espWaitForData(fd, timeout, host, data, &len)){
+        return false;
+    }
+    packet = StringPacket{std::string(host), std::string(data, len)};
+    return true;
+}
+
+
+static uint8_t udpStorage[16 * 1472];
+
+int main(void){
+    const uint32_t sizes[] = {64, 512, 1460};
+    static std::byte buffer[MAX_SEND_TCP_DATA_SIZE];
+
+    printf("suite,case,param,value,unit\n");
+    fflush(stdout);
+
+    for (uint32_t size : sizes){
+        char param[16];
+        snprintf(param, sizeof(param), "%u", size);
+        std::string payload(size, 's');
+        uint32_t ok = 0;
+
+        esp::Driver wifi(REPLAY_FD);
+
+        std::string cap = sendCapture(size);
+        sessionStart(cap);
+        double start = caseStart();
+        for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+            ok += (bool)wifi.send(0, esp::asBytes(payload));
+        }
+        caseEnd("send", param, start, ok, "sends/s");
+
+        sessionStart(cap);
+        ok = 0;
+        start = caseStart();
+        for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+            ok += stringSend(REPLAY_FD, 0, payload);
+        }
+        caseEnd("send_string_copy", param, start, ok, "sends/s");
+
+        cap = receiveCapture(size, false);
+        sessionStart(cap);
+        ok = 0;
+        start = caseStart();
+        for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+            auto rx = wifi.receive(buffer, 1000);
+            ok += rx && rx->data.size() == size;
+        }
+        caseEnd("receive", param, start, ok, "frames/s");
+
+        sessionStart(cap);
+        ok = 0;
+        StringPacket packet;
+        start = caseStart();
+        for (uint32_t i = 0; i < FACADE_BENCH_OPS; i++){
+            ok += stringReceive(REPLAY_FD, 1000, packet) && packet.data.size() == size;
+        }
+        caseEnd("receive_string_copy", param, start, ok, "frames/s");
+
+        cap = receiveCapture(size, true);
+        espReplayLoad(cap.c_str(), REPLAY_FAST);
+        espDriverMode(REPLAY_FD, MODE_STA);
+        EspUdpPool pool;
+        espUdpPoolInit(&pool, udpStorage, 16, 1472);
+        esp::UdpServer udp(wifi, pool);
+        udp.start(0, "192.168.0.1", 5000, 5000);
+        ok = 0;
+        esp::Datagram batch[16];
+        start = caseStart();
+        while (ok < FACADE_BENCH_OPS){
+            std::size_t n = udp.receive(batch, 1000);
+            if (n == 0){
+                break;
+            }
+            for (std::size_t i = 0; i < n; i++){
+                ok += batch[i].data().size() == size;
+            }
+        }
+        caseEnd("udp_batch", param, start, ok, "datagrams/s");
+        espSetEventHandlers(NULL);
+
+        if (ok != FACADE_BENCH_OPS){
+            printf("# facade %s: %u/%u datagrams\n", param, ok, FACADE_BENCH_OPS);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_http.h"
+#include "esp8266_log.h"
+#include "esp8266_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef enum{
+    HTTP_IDLE,
+    HTTP_STATUS,
+    HTTP_HEADERS,
+    HTTP_BODY,
+    HTTP_BODY_UNTIL_CLOSE,
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_END,
+    HTTP_TRAILERS
+}HttpParseState;
+
+/* One kept alive connection and the parser of the response in progress */
+typedef struct{
+    bool inUse;
+    uint8_t conn_id;
+    char host[HTTP_HOST_SIZE];
+    uint16_t port;
+    /* Set from the event handlers, the link is closed on the next client call */
+    bool closeRequested;
+
+    /* Requests waiting for their response, oldest first */
+    EspHttpRequest *pending[HTTP_MAX_PIPELINE];
+    uint8_t head;
+    uint8_t count;
+
+    HttpParseState state;
+    char line[HTTP_LINE_SIZE];
+    uint32_t lineLen;
+    /* Body or chunk bytes left */
+    uint32_t remaining;
+    bool chunked;
+    bool hasLength;
+    bool closeAfter;
+}HttpConn;
+
+static HttpConn conns[NUM_LINKS];
+static EspEventHandlers appHandlers;
+static uint8_t txBuffer[HTTP_TX_BUFFER_SIZE];
+
+
+static HttpConn *httpConnByLink(uint8_t conn_id){
+    for (uint32_t i = 0; i < NUM_LINKS; i++){
+        if (conns[i].inUse && conns[i].conn_id == conn_id){
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+static EspHttpRequest *httpCurrent(HttpConn *c){
+    return c->count ? c->pending[c->head] : NULL;
+}
+
+/* Header names are case insensitive */
+static bool httpNameIs(const char *name, const char *expected){
+    while (*name && *expected){
+        char a = *name++;
+        char b = *expected++;
+        if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if (a != b){
+            return false;
+        }
+    }
+    return *name == *expected;
+}
+
+static bool httpValueHas(const char *value, const char *token){
+    uint32_t len = strlen(token);
+
+    for (; *value; value++){
+        uint32_t i = 0;
+        while (i < len && value[i] && (value[i] | 0x20) == (token[i] | 0x20)){
+            i++;
+        }
+        if (i == len){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void httpComplete(HttpConn *c, bool ok){
+    EspHttpRequest *req = httpCurrent(c);
+
+    c->state = HTTP_IDLE;
+    if (!req){
+        return;
+    }
+    c->head = (c->head + 1) % HTTP_MAX_PIPELINE;
+    c->count--;
+
+    req->done = true;
+    req->ok = ok;
+    if (req->onComplete){
+        req->onComplete(req->ctx, ok);
+    }
+
+    if (c->count){
+        c->state = HTTP_STATUS;
+    }
+    if (c->closeAfter){
+        c->closeRequested = true;
+    }
+}
+
+/* Fails every request still waiting on the connection */
+static void httpFailPending(HttpConn *c){
+    while (c->count){
+        httpComplete(c, false);
+    }
+}
+
+static void httpEndOfHeaders(HttpConn *c){
+    EspHttpRequest *req = httpCurrent(c);
+
+    /* 100 Continue and friends, the real status line follows */
+    if (req->status >= 100 && req->status < 200){
+        c->state = HTTP_STATUS;
+        return;
+    }
+
+    if (httpNameIs(req->method, "HEAD") || req->status == 204 || req->status == 304){
+        httpComplete(c, true);
+    }
+    else if (c->chunked){
+        c->state = HTTP_CHUNK_SIZE;
+    }
+    else if (c->hasLength){
+        c->state = HTTP_BODY;
+        if (c->remaining == 0){
+            httpComplete(c, true);
+        }
+    }
+    else{
+        c->state = HTTP_BODY_UNTIL_CLOSE;
+        c->closeAfter = true;
+    }
+}
+
+static void httpHeaderLine(HttpConn *c, char *line){
+    EspHttpRequest *req = httpCurrent(c);
+    char *value = strchr(line, ':');
+
+    if (!value){
+        return;
+    }
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t'){
+        value++;
+    }
+
+    if (httpNameIs(line, "Content-Length")){
+        c->hasLength = true;
+        c->remaining = strtoul(value, NULL, 10);
+    }
+    else if (httpNameIs(line, "Transfer-Encoding") && httpValueHas(value, "chunked")){
+        c->chunked = true;
+    }
+    else if (httpNameIs(line, "Connection") && httpValueHas(value, "close")){
+        c->closeAfter = true;
+    }
+
+    if (req->onHeader){
+        req->onHeader(req->ctx, line, value);
+    }
+}
+
+/* A complete line without its "\r\n" */
+static void httpLine(HttpConn *c, char *line, uint32_t len){
+    EspHttpRequest *req = httpCurrent(c);
+
+    switch (c->state){
+    case HTTP_STATUS:
+        /* "HTTP/1.1 200 OK", blank lines before it are allowed */
+        if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0){
+            return;
+        }
+        req->status = atoi(line + 9);
+        c->chunked = false;
+        c->hasLength = false;
+        c->remaining = 0;
+        c->closeAfter = (line[7] == '0');
+        c->state = HTTP_HEADERS;
+        if (req->onStatus && req->status >= 200){
+            req->onStatus(req->ctx, req->status);
+        }
+        break;
+
+    case HTTP_HEADERS:
+        if (len == 0){
+            httpEndOfHeaders(c);
+        }
+        else{
+            httpHeaderLine(c, line);
+        }
+        break;
+
+    case HTTP_CHUNK_SIZE:
+        /* Hex size, chunk extensions after ';' are ignored */
+        c->remaining = strtoul(line, NULL, 16);
+        c->state = c->remaining ? HTTP_CHUNK_DATA : HTTP_TRAILERS;
+        break;
+
+    case HTTP_CHUNK_END:
+        c->state = HTTP_CHUNK_SIZE;
+        break;
+
+    case HTTP_TRAILERS:
+        if (len == 0){
+            httpComplete(c, true);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Feeds response bytes as they come from +IPD, in pieces of any size */
+static void httpParse(HttpConn *c, const uint8_t *data, uint32_t len){
+    while (len > 0){
+        EspHttpRequest *req = httpCurrent(c);
+        uint32_t n;
+
+        if (!req){
+            /* Nothing asked, nothing to parse */
+            return;
+        }
+        if (c->state == HTTP_IDLE){
+            c->state = HTTP_STATUS;
+        }
+
+        switch (c->state){
+        case HTTP_BODY:
+        case HTTP_CHUNK_DATA:
+            n = len < c->remaining ? len : c->remaining;
+            if (req->onBody){
+                req->onBody(req->ctx, data, n);
+            }
+            c->remaining -= n;
+            if (c->remaining == 0){
+                if (c->state == HTTP_BODY){
+                    httpComplete(c, true);
+                }
+                else{
+                    c->state = HTTP_CHUNK_END;
+                }
+            }
+            break;
+
+        case HTTP_BODY_UNTIL_CLOSE:
+            n = len;
+            if (req->onBody){
+                req->onBody(req->ctx, data, n);
+            }
+            break;
+
+        default:{
+            const uint8_t *nl = memchr(data, '\n', len);
+            n = nl ? (uint32_t)(nl - data) + 1 : len;
+
+            uint32_t copy = n;
+            if (copy > HTTP_LINE_SIZE - 1 - c->lineLen){
+                copy = HTTP_LINE_SIZE - 1 - c->lineLen;
+            }
+            memcpy(c->line + c->lineLen, data, copy);
+            c->lineLen += copy;
+
+            if (nl){
+                uint32_t lineLen = c->lineLen;
+                while (lineLen > 0 && (c->line[lineLen-1] == '\n' || c->line[lineLen-1] == '\r')){
+                    lineLen--;
+                }
+                c->line[lineLen] = '\0';
+                c->lineLen = 0;
+                httpLine(c, c->line, lineLen);
+            }
+            break;
+        }
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+
+static void httpOnConnect(void *ctx, uint8_t conn_id){
+    (void)ctx;
+    if (!httpConnByLink(conn_id) && appHandlers.onConnect){
+        appHandlers.onConnect(appHandlers.ctx, conn_id);
+    }
+}
+
+static void httpOnClose(void *ctx, uint8_t conn_id){
+    HttpConn *c = httpConnByLink(conn_id);
+    (void)ctx;
+
+    if (!c){
+        if (appHandlers.onClose){
+            appHandlers.onClose(appHandlers.ctx, conn_id);
+        }
+        return;
+    }
+
+    if (c->state == HTTP_BODY_UNTIL_CLOSE){
+        httpComplete(c, true);
+    }
+    httpFailPending(c);
+    c->inUse = false;
+}
+
+static void httpOnData(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len){
+    HttpConn *c = httpConnByLink(info->conn_id);
+    (void)ctx;
+
+    if (c){
+        httpParse(c, data, len);
+    }
+    else if (appHandlers.onData){
+        appHandlers.onData(appHandlers.ctx, info, offset, data, len);
+    }
+}
+
+static void httpOnStation(void *ctx, const EspStation *station, bool connected){
+    (void)ctx;
+    if (appHandlers.onStation){
+        appHandlers.onStation(appHandlers.ctx, station, connected);
+    }
+}
+
+
+void espHttpInit(const EspEventHandlers *handlers){
+    EspEventHandlers own = {NULL, httpOnConnect, httpOnClose, httpOnData, httpOnStation};
+
+    if (handlers){
+        appHandlers = *handlers;
+    }
+    else{
+        memset(&appHandlers, 0, sizeof(appHandlers));
+    }
+    memset(conns, 0, sizeof(conns));
+    espSetEventHandlers(&own);
+}
+
+
+static void httpClose(int fd, HttpConn *c){
+    c->closeRequested = false;
+    if (espLinkIsOpen(c->conn_id)){
+        espCloseConnection(fd, c->conn_id);
+    }
+    /* CIPCLOSE answers with "<id>,CLOSED", httpOnClose may have run already */
+    if (c->inUse){
+        httpFailPending(c);
+        c->inUse = false;
+    }
+}
+
+/* Closes the links the handlers asked for, they cannot send AT commands themselves */
+static void httpHousekeeping(int fd){
+    for (uint32_t i = 0; i < NUM_LINKS; i++){
+        if (conns[i].inUse && conns[i].closeRequested && conns[i].count == 0){
+            httpClose(fd, &conns[i]);
+        }
+    }
+}
+
+static HttpConn *httpConnect(int fd, const char *host, uint16_t port){
+    HttpConn *slot = NULL;
+
+    for (uint32_t i = 0; i < NUM_LINKS; i++){
+        HttpConn *c = &conns[i];
+        if (c->inUse && !c->closeRequested && c->port == port && strcmp(c->host, host) == 0){
+            return c;
+        }
+        if (!c->inUse && !slot){
+            slot = c;
+        }
+    }
+
+    if (!slot || strlen(host) >= HTTP_HOST_SIZE){
+        return NULL;
+    }
+
+    /* Highest free link id, the application usually counts from 0 */
+    int conn_id = NUM_LINKS - 1;
+    while (conn_id >= 0 && (espLinkIsOpen(conn_id) || httpConnByLink(conn_id))){
+        conn_id--;
+    }
+    if (conn_id < 0){
+        return NULL;
+    }
+
+    /* Taken before CIPSTART so its "<id>,CONNECT" is not handed to the application */
+    memset(slot, 0, sizeof(*slot));
+    slot->inUse = true;
+    slot->conn_id = conn_id;
+    strcpy(slot->host, host);
+    slot->port = port;
+
+    if (!espStartTCPConnection(fd, conn_id, host, port)){
+        slot->inUse = false;
+        return NULL;
+    }
+    return slot;
+}
+
+/* Sends the request head, then the body as readBody produces it, packing both into full sends */
+static bool httpSendRequest(int fd, HttpConn *c, EspHttpRequest *req){
+    int used = snprintf((char*)txBuffer, sizeof(txBuffer), "%s %s HTTP/1.1\r\nHost: %s\r\n%s",
+                        req->method, req->path, c->host, req->headers ? req->headers : "");
+    if (req->bodyLength == HTTP_BODY_CHUNKED){
+        used += snprintf((char*)txBuffer + used, sizeof(txBuffer) - used, "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    else if (req->bodyLength > 0){
+        used += snprintf((char*)txBuffer + used, sizeof(txBuffer) - used, "Content-Length: %ld\r\n\r\n", (long)req->bodyLength);
+    }
+    else{
+        used += snprintf((char*)txBuffer + used, sizeof(txBuffer) - used, "\r\n");
+    }
+    if (used >= (int)sizeof(txBuffer)){
+        espLogError("HTTP request head longer than %d bytes", HTTP_TX_BUFFER_SIZE);
+        return false;
+    }
+
+    uint32_t fill = used;
+    bool chunked = req->bodyLength == HTTP_BODY_CHUNKED;
+    bool bodyDone = req->bodyLength == 0 || !req->readBody;
+    /* "<hex size>\r\n" before and "\r\n" after every chunk */
+    const uint32_t framing = chunked ? 8 : 0;
+
+    while (!bodyDone){
+        if (sizeof(txBuffer) - fill <= framing + 2){
+            if (!espSendTCPData(fd, c->conn_id, (const char*)txBuffer, fill)){
+                return false;
+            }
+            fill = 0;
+        }
+
+        uint32_t room = sizeof(txBuffer) - fill - framing;
+        uint32_t n = req->readBody(req->ctx, txBuffer + fill + (chunked ? 6 : 0), room);
+        if (n == 0){
+            bodyDone = true;
+            if (chunked){
+                memcpy(txBuffer + fill, "0\r\n\r\n", 5);
+                fill += 5;
+            }
+            break;
+        }
+
+        if (chunked){
+            /* Fixed width size so the data did not have to move */
+            char size[16];
+            snprintf(size, sizeof(size), "%04x\r\n", (unsigned)n);
+            memcpy(txBuffer + fill, size, 6);
+            memcpy(txBuffer + fill + 6 + n, "\r\n", 2);
+            fill += n + 8;
+        }
+        else{
+            fill += n;
+        }
+    }
+
+    return fill == 0 || espSendTCPData(fd, c->conn_id, (const char*)txBuffer, fill);
+}
+
+
+bool espHttpSend(int fd, const char *host, uint16_t port, EspHttpRequest *req){
+    httpHousekeeping(fd);
+
+    HttpConn *c = httpConnect(fd, host, port);
+    if (!c){
+        espLogError("HTTP no connection to %s:%u", host, port);
+        return false;
+    }
+    if (c->count == HTTP_MAX_PIPELINE){
+        return false;
+    }
+
+    req->status = 0;
+    req->done = false;
+    req->ok = false;
+
+    /* Queued before sending, earlier responses may be parsed while this one goes out */
+    c->pending[(c->head + c->count) % HTTP_MAX_PIPELINE] = req;
+    c->count++;
+    if (c->state == HTTP_IDLE){
+        c->state = HTTP_STATUS;
+    }
+
+    if (!httpSendRequest(fd, c, req)){
+        /* Half sent request, the connection cannot be trusted anymore */
+        httpClose(fd, c);
+        return false;
+    }
+    return true;
+}
+
+
+int espHttpPoll(int fd, unsigned int timeout){
+    int events = espProcessEvents(fd, timeout);
+
+    httpHousekeeping(fd);
+    return events;
+}
+
+
+bool espHttpWait(int fd, EspHttpRequest *req, unsigned int timeout){
+    EspTimer deadline;
+
+    espTimerInit(&deadline, NULL, NULL);
+    espTimerStartMS(&deadline, timeout);
+
+    while (!req->done && espTimerPending(&deadline)){
+        espHttpPoll(fd, 10);
+    }
+
+    espTimerCancel(&deadline);
+    return req->done && req->ok;
+}
+
+
+void espHttpCloseAll(int fd){
+    for (uint32_t i = 0; i < NUM_LINKS; i++){
+        if (conns[i].inUse){
+            httpClose(fd, &conns[i]);
+        }
+    }
+}
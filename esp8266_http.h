@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_HTTP_H
+#define ESP8266_HTTP_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * HTTP/1.1 client on top of the TCP link API. Connections are kept alive per
+ * host:port on free link ids and requests are pipelined on them.
+ *
+ * espHttpInit(&appHandlers);         // instead of espSetEventHandlers()
+ *
+ * EspHttpRequest req = {"GET", "/status", NULL, 0, NULL, onStatus, NULL, onBody, onComplete, ctx};
+ * espHttpSend(fd, "192.168.0.1", 80, &req);
+ * espHttpWait(fd, &req, 2000);
+ *
+ * Request bodies are pulled from readBody as they are sent, response bodies are
+ * handed to onBody as they arrive, nothing is buffered whole. The response
+ * callbacks run from inside driver calls, like the EspEventHandlers: they must
+ * not send AT commands, so they cannot start another request either.
+ * The request must stay valid until done is set.
+********************************************/
+
+/* Requests sent on one connection before their responses arrive */
+#define HTTP_MAX_PIPELINE 4
+/* Status, header and chunk size lines, longer lines are truncated */
+#define HTTP_LINE_SIZE 128
+#define HTTP_HOST_SIZE 64
+/* Request head and body pieces are built here before espSendTCPData() */
+#define HTTP_TX_BUFFER_SIZE 512
+
+/* Request body length when it is sent with Transfer-Encoding: chunked */
+#define HTTP_BODY_CHUNKED (-1)
+
+typedef struct EspHttpRequest{
+    const char *method;
+    const char *path;
+    /* Extra header lines, each one ending in "\r\n". Can be NULL */
+    const char *headers;
+    /* 0 without body, HTTP_BODY_CHUNKED if the length is not known in advance */
+    int32_t bodyLength;
+    /* Writes up to size body bytes to buf and returns how many, 0 at the end of the body */
+    uint32_t (*readBody)(void *ctx, uint8_t *buf, uint32_t size);
+
+    /* Any callback can be NULL */
+    void (*onStatus)(void *ctx, int status);
+    void (*onHeader)(void *ctx, const char *name, const char *value);
+    void (*onBody)(void *ctx, const uint8_t *data, uint32_t len);
+    /* ok is false if the connection failed before the response was complete */
+    void (*onComplete)(void *ctx, bool ok);
+    void *ctx;
+
+    /* Set by the client */
+    int status;
+    bool done;
+    bool ok;
+}EspHttpRequest;
+
+/* Installs the client event handlers, events of links the client does not own go to appHandlers */
+void espHttpInit(const EspEventHandlers *appHandlers);
+/*
+* Sends the request on the connection to host:port, opening one if needed.
+* Returns false if no link is free, the pipeline is full or the send failed.
+*/
+bool espHttpSend(int fd, const char *host, uint16_t port, EspHttpRequest *req);
+/* Dispatches responses for timeout ms. Returns the number of driver events */
+int espHttpPoll(int fd, unsigned int timeout);
+/* Polls until req is done. Returns req->ok, false on timeout */
+bool espHttpWait(int fd, EspHttpRequest *req, unsigned int timeout);
+/* Closes every connection, pending requests complete with ok false */
+void espHttpCloseAll(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_HTTP_H
@@ -3,11 +3,21 @@
 #include <stdio.h>
 #include <time.h>
 #include <termios.h>
+#include "esp8266_log.h"
 
 extern void debugESP8266CommunicationToLog(char *buf, int len, int type);
 
 //#define DEBUG_ESP8266
 
+//#define CAPTURE_ESP8266
+
+#ifdef CAPTURE_ESP8266
+#include "esp8266_capture.h"
+extern uint32_t getCurrentMS (void);
+/* Opened by the application, sessions written here can be fed to esp8266_replay.c */
+FILE *espCaptureFile = NULL;
+#endif
+
 
 #ifdef ANDROID
 #define tcdrain(fd) ioctl(fd, TCSBRK, 1)
@@ -19,7 +29,7 @@ extern void debugESP8266CommunicationToLog(char *buf, int len, int type);
 //uint32_t getCurrentMS (){
 //    struct timespec spec;
 //
-//    clock_gettime(CLOCK_REALTIME, &spec);
+//    clock_gettime(CLOCK_MONOTONIC, &spec);
 //
 //    return round(spec.tv_nsec / 1.0e6) + spec.tv_sec * 1000; // Convert nanoseconds to milliseconds
 //}
@@ -28,21 +38,38 @@ extern void debugESP8266CommunicationToLog(char *buf, int len, int type);
 //    while (getCurrentMS() - start < ms);
 //}
 
+/* Timer wheel clock, monotonic so NTP steps do not fire or stall deadlines */
+uint32_t getCurrentUS (void){
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (uint32_t)(spec.tv_sec * 1000000ULL + spec.tv_nsec / 1000);
+}
+
 
 void espPrintln(int fd, char *buf, int len){
 #ifdef DEBUG_ESP8266
     /* Send to log */
     debugESP8266CommunicationToLog(buf,len,1);
+#endif
+#ifdef CAPTURE_ESP8266
+    espCaptureWrite(espCaptureFile, CAPTURE_TO_MODULE, getCurrentMS(), buf, len);
 #endif
     write(fd, buf, len);
     tcdrain(fd);
 }
 
 int espRead(int __fd, void *__buf, size_t __nbytes){
+   /* The driver is about to wait for the module anyway, print its messages now */
+   espLogFlush();
    int num = read(__fd, __buf, __nbytes);
 #ifdef DEBUG_ESP8266
    /* Send to log */
    debugESP8266CommunicationToLog(__buf,num,0);
+#endif
+#ifdef CAPTURE_ESP8266
+   espCaptureWrite(espCaptureFile, CAPTURE_FROM_MODULE, getCurrentMS(), __buf, num);
 #endif
    return num;
 }
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+extern uint32_t getCurrentUS (void);
+
+
+#define RING_MASK (ESP_LOG_RING_WORDS - 1)
+#define WORD_SIZE sizeof(uintptr_t)
+#define HEADER_WORDS 3
+
+static uintptr_t ring[ESP_LOG_RING_WORDS];
+/* Free running word counters, head - tail words are stored */
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static uint32_t dropped = 0;
+static uint32_t droppedReported = 0;
+
+static void printOutput(void *ctx, uint8_t level, uint32_t timestampUS, const char *line){
+    printf("%s\n", line);
+}
+
+static void (*output)(void *ctx, uint8_t level, uint32_t timestampUS, const char *line) = printOutput;
+static void *outputCtx = NULL;
+
+
+void espLogSetOutput(void (*out)(void *ctx, uint8_t level, uint32_t timestampUS, const char *line), void *ctx){
+    output = out ? out : printOutput;
+    outputCtx = ctx;
+}
+
+
+void espLogWrite(uint8_t level, const char *fmt, uint32_t nargs, uint32_t strMask, const uintptr_t *args){
+    uint32_t lens[4];
+    uint32_t words = HEADER_WORDS + nargs;
+
+    for (uint32_t i = 0; i < nargs; i++){
+        if (strMask & (1u << i)){
+            const char *str = (const char*)args[i];
+            uint32_t len = 0;
+            while (len < ESP_LOG_MAX_STRING && str && str[len]){
+                len++;
+            }
+            lens[i] = len;
+            words += (len + WORD_SIZE - 1) / WORD_SIZE;
+        }
+    }
+
+    if (words > ESP_LOG_RING_WORDS - (head - tail)){
+        dropped++;
+        return;
+    }
+
+    ring[head++ & RING_MASK] = (uintptr_t)fmt;
+    ring[head++ & RING_MASK] = getCurrentUS();
+    ring[head++ & RING_MASK] = level | nargs << 4 | strMask << 8 | words << 16;
+    for (uint32_t i = 0; i < nargs; i++){
+        ring[head++ & RING_MASK] = (strMask & (1u << i)) ? lens[i] : args[i];
+    }
+    for (uint32_t i = 0; i < nargs; i++){
+        if (strMask & (1u << i)){
+            const char *str = (const char*)args[i];
+            for (uint32_t pos = 0; pos < lens[i]; pos += WORD_SIZE){
+                uintptr_t word = 0;
+                uint32_t n = lens[i] - pos < WORD_SIZE ? lens[i] - pos : WORD_SIZE;
+                memcpy(&word, str + pos, n);
+                ring[head++ & RING_MASK] = word;
+            }
+        }
+    }
+}
+
+
+/* Appends one conversion of the record to line, spec is the whole "%...c" */
+static uint32_t formatArg(char *line, uint32_t used, const char *spec, uint32_t specLen, uintptr_t arg, const char *str){
+    char fmt[16];
+    char conv = spec[specLen-1];
+    bool isLong = specLen >= 3 && spec[specLen-2] == 'l';
+    int n;
+
+    if (specLen >= sizeof(fmt)){
+        return used;
+    }
+    memcpy(fmt, spec, specLen);
+    fmt[specLen] = '\0';
+
+    if (conv == 's'){
+        n = snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, str ? str : "");
+    }
+    else if (conv == 'p'){
+        n = snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, (void*)arg);
+    }
+    else if (conv == 'd' || conv == 'i'){
+        n = isLong ? snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, (long)(intptr_t)arg)
+                   : snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, (int)(intptr_t)arg);
+    }
+    else{
+        n = isLong ? snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, (unsigned long)arg)
+                   : snprintf(line + used, ESP_LOG_LINE_SIZE - used, fmt, (unsigned)arg);
+    }
+
+    if (n < 0){
+        return used;
+    }
+    used += n;
+    return used < ESP_LOG_LINE_SIZE ? used : ESP_LOG_LINE_SIZE - 1;
+}
+
+
+/* Formats the record starting at ring[tail] */
+static void formatRecord(char *line, uint8_t *level, uint32_t *timestampUS){
+    const char *fmt = (const char*)ring[tail & RING_MASK];
+    uintptr_t info = ring[(tail + 2) & RING_MASK];
+    uint32_t nargs = (info >> 4) & 0xF;
+    uint32_t strMask = (info >> 8) & 0xF;
+    uint32_t strWord = tail + HEADER_WORDS + nargs;
+    uint32_t argIdx = 0;
+    uint32_t used = 0;
+
+    *timestampUS = ring[(tail + 1) & RING_MASK];
+    *level = info & 0xF;
+
+    while (*fmt && used < ESP_LOG_LINE_SIZE - 1){
+        if (*fmt != '%'){
+            line[used++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%'){
+            line[used++] = '%';
+            fmt += 2;
+            continue;
+        }
+
+        uint32_t specLen = 1;
+        while (fmt[specLen] && !strchr("diuxXcsp", fmt[specLen])){
+            specLen++;
+        }
+        if (!fmt[specLen] || argIdx >= nargs){
+            break;
+        }
+        specLen++;
+
+        uintptr_t arg = ring[(tail + HEADER_WORDS + argIdx) & RING_MASK];
+        char str[ESP_LOG_MAX_STRING + 1];
+        bool isStr = strMask & (1u << argIdx);
+        if (isStr){
+            /* The bytes may wrap around the end of the ring, copy them word by word */
+            for (uint32_t pos = 0; pos < arg; pos += WORD_SIZE){
+                uintptr_t word = ring[strWord++ & RING_MASK];
+                memcpy(str + pos, &word, arg - pos < WORD_SIZE ? arg - pos : WORD_SIZE);
+            }
+            str[arg] = '\0';
+        }
+
+        used = formatArg(line, used, fmt, specLen, arg, isStr ? str : NULL);
+        fmt += specLen;
+        argIdx++;
+    }
+
+    /* The call sites used to end lines with "\n", the output adds it */
+    if (used && line[used-1] == '\n'){
+        used--;
+    }
+    line[used] = '\0';
+}
+
+
+uint32_t espLogFlush(void){
+    char line[ESP_LOG_LINE_SIZE];
+    uint32_t flushed = 0;
+
+    while (tail != head){
+        uint8_t level;
+        uint32_t timestampUS;
+        uint32_t words = ring[(tail + 2) & RING_MASK] >> 16;
+
+        formatRecord(line, &level, &timestampUS);
+        tail += words;
+        flushed++;
+        output(outputCtx, level, timestampUS, line);
+    }
+
+    if (dropped != droppedReported){
+        snprintf(line, sizeof(line), "%u log records dropped", (unsigned)(dropped - droppedReported));
+        droppedReported = dropped;
+        output(outputCtx, ESP_LOG_WARN, getCurrentUS(), line);
+    }
+    return flushed;
+}
+
+
+uint32_t espLogReadRaw(uintptr_t *dest, uint32_t maxWords){
+    uint32_t copied = 0;
+
+    while (tail != head){
+        uint32_t words = ring[(tail + 2) & RING_MASK] >> 16;
+        if (copied + words > maxWords){
+            break;
+        }
+        for (uint32_t i = 0; i < words; i++){
+            dest[copied++] = ring[tail++ & RING_MASK];
+        }
+    }
+    return copied;
+}
+
+
+uint32_t espLogDropped(void){
+    return dropped;
+}
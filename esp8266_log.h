@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_LOG_H
+#define ESP8266_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Driver messages are not formatted where they happen. espLogInfo("TCP connected at port %u", port)
+ * stores the format pointer, a timestamp and the raw arguments in a ring (strings are copied,
+ * up to ESP_LOG_MAX_STRING bytes), and the text is made later:
+ *
+ * espLogSetOutput(uartConsole, NULL);    // default is printf to stdout
+ * ...
+ * espLogFlush();                         // idle loop or low priority task
+ *
+ * Levels above ESP_LOG_LEVEL are compiled out, arguments are not even evaluated.
+ * Format strings are checked like printf. At most 4 arguments, each one an integer
+ * (int, unsigned, %ld/%lu longs) or a string. Conversions: d i u x X c s p %.
+ * espLogReadRaw() hands the records out as they are, to be formatted off target: the
+ * first word of a record is the address of its format string in the firmware image.
+ * The ring is not interrupt safe, log from the driver thread only.
+********************************************/
+
+#define ESP_LOG_NONE 0
+#define ESP_LOG_ERROR 1
+#define ESP_LOG_WARN 2
+#define ESP_LOG_INFO 3
+#define ESP_LOG_DEBUG 4
+
+#ifndef ESP_LOG_LEVEL
+#define ESP_LOG_LEVEL ESP_LOG_INFO
+#endif
+
+/* Ring size in words (uintptr_t), power of two. A record takes 3 words plus one per argument */
+#ifndef ESP_LOG_RING_WORDS
+#define ESP_LOG_RING_WORDS 256
+#endif
+
+/* Longer string arguments are cut */
+#define ESP_LOG_MAX_STRING 32
+/* Longest formatted line */
+#define ESP_LOG_LINE_SIZE 160
+
+/*
+* Record layout, all words uintptr_t:
+*   fmt | timestampUS | level | nargs << 4 | strMask << 8 | words << 16 | arg0..argN-1 | string bytes
+* A string argument holds its length, its bytes follow the arguments padded to a word.
+*/
+
+/* Formatted lines go to output, line has no trailing newline */
+void espLogSetOutput(void (*output)(void *ctx, uint8_t level, uint32_t timestampUS, const char *line), void *ctx);
+/* Formats and outputs every stored record. Returns how many */
+uint32_t espLogFlush(void);
+/* Copies whole records, up to maxWords words, out of the ring. Returns the words copied */
+uint32_t espLogReadRaw(uintptr_t *dest, uint32_t maxWords);
+/* Records lost because the ring was full */
+uint32_t espLogDropped(void);
+
+/* Behind the macros */
+void espLogWrite(uint8_t level, const char *fmt, uint32_t nargs, uint32_t strMask, const uintptr_t *args);
+static inline void espLogCheck(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void espLogCheck(const char *fmt, ...) { (void)fmt; }
+
+#define ESP_LOG_NARGS(...) ESP_LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define ESP_LOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+#define ESP_LOG_CAT(a, b) ESP_LOG_CAT_(a, b)
+#define ESP_LOG_CAT_(a, b) a##b
+
+#define ESP_LOG_IS_STR(x) _Generic((x), char*: 1u, const char*: 1u, default: 0u)
+#define ESP_LOG_STRS_0()
+#define ESP_LOG_STRS_1(a) | ESP_LOG_IS_STR(a)
+#define ESP_LOG_STRS_2(a, b) ESP_LOG_STRS_1(a) | ESP_LOG_IS_STR(b) << 1
+#define ESP_LOG_STRS_3(a, b, c) ESP_LOG_STRS_2(a, b) | ESP_LOG_IS_STR(c) << 2
+#define ESP_LOG_STRS_4(a, b, c, d) ESP_LOG_STRS_3(a, b, c) | ESP_LOG_IS_STR(d) << 3
+#define ESP_LOG_ARGS_0()
+#define ESP_LOG_ARGS_1(a) , (uintptr_t)(a)
+#define ESP_LOG_ARGS_2(a, b) ESP_LOG_ARGS_1(a), (uintptr_t)(b)
+#define ESP_LOG_ARGS_3(a, b, c) ESP_LOG_ARGS_2(a, b), (uintptr_t)(c)
+#define ESP_LOG_ARGS_4(a, b, c, d) ESP_LOG_ARGS_3(a, b, c), (uintptr_t)(d)
+
+#define ESP_LOG_AT(level, fmt, ...) \
+    do{ \
+        if (0){ \
+            espLogCheck(fmt, ##__VA_ARGS__); \
+        } \
+        if ((level) <= ESP_LOG_LEVEL){ \
+            const uintptr_t espLogArgs_[] = {0 ESP_LOG_CAT(ESP_LOG_ARGS_, ESP_LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)}; \
+            espLogWrite((level), (fmt), ESP_LOG_NARGS(__VA_ARGS__), \
+                        0u ESP_LOG_CAT(ESP_LOG_STRS_, ESP_LOG_NARGS(__VA_ARGS__))(__VA_ARGS__), espLogArgs_ + 1); \
+        } \
+    }while(0)
+
+#define espLogError(...) ESP_LOG_AT(ESP_LOG_ERROR, __VA_ARGS__)
+#define espLogWarn(...) ESP_LOG_AT(ESP_LOG_WARN, __VA_ARGS__)
+#define espLogInfo(...) ESP_LOG_AT(ESP_LOG_INFO, __VA_ARGS__)
+#define espLogDebug(...) ESP_LOG_AT(ESP_LOG_DEBUG, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_LOG_H
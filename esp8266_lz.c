@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_lz.h"
+#include "esp8266_log.h"
+
+#include <string.h>
+
+
+#if ESP_LZ_FRAME_BOUND > 0xFFFF
+#error "ESP_LZ_MAX_BLOCK too large for the 2 byte frame lengths"
+#endif
+
+/* LZ4 block rules: the last 5 bytes are literals, the last match starts 12 bytes before the end */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+
+/* Block positions by hash of their 4 bytes */
+static uint16_t hashTable[1 << ESP_LZ_HASH_BITS];
+static uint8_t frameBuffer[ESP_LZ_FRAME_BOUND];
+static uint8_t decoded[ESP_LZ_MAX_BLOCK];
+
+
+static inline uint32_t lzRead32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lzHash(uint32_t v){
+    return (v * 2654435761u) >> (32 - ESP_LZ_HASH_BITS);
+}
+
+static uint8_t *lzPutLength(uint8_t *op, uint32_t len){
+    while (len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Token, literals and, if matchLen is not 0, the match. NULL if it does not fit */
+static uint8_t *lzPutSequence(uint8_t *op, uint8_t *opEnd, const uint8_t *literals, uint32_t litLen,
+                              uint32_t offset, uint32_t matchLen){
+    /* Token, both length extensions and the offset */
+    if ((uint32_t)(opEnd - op) < 1 + litLen/255 + 1 + litLen + 2 + matchLen/255 + 1){
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (litLen >= 15 ? 15 : litLen) << 4;
+    if (litLen >= 15){
+        op = lzPutLength(op, litLen - 15);
+    }
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    if (matchLen){
+        *op++ = offset;
+        *op++ = offset >> 8;
+        matchLen -= MIN_MATCH;
+        *token |= matchLen >= 15 ? 15 : matchLen;
+        if (matchLen >= 15){
+            op = lzPutLength(op, matchLen - 15);
+        }
+    }
+    return op;
+}
+
+
+uint32_t espLzCompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity){
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + capacity;
+
+    if (len > ESP_LZ_MAX_BLOCK){
+        return 0;
+    }
+
+    if (len >= MF_LIMIT){
+        const uint8_t *matchLimit = end - LAST_LITERALS;
+        const uint8_t *mfLimit = end - MF_LIMIT;
+
+        memset(hashTable, 0, sizeof(hashTable));
+        ip++;
+
+        while (ip < mfLimit){
+            uint32_t seq = lzRead32(ip);
+            uint32_t h = lzHash(seq);
+            const uint8_t *ref = src + hashTable[h];
+            hashTable[h] = ip - src;
+
+            if (lzRead32(ref) != seq || ref >= ip){
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + MIN_MATCH;
+            const uint8_t *r = ref + MIN_MATCH;
+            while (m < matchLimit && *m == *r){
+                m++;
+                r++;
+            }
+
+            op = lzPutSequence(op, opEnd, anchor, ip - anchor, ip - ref, m - ip);
+            if (!op){
+                return 0;
+            }
+            ip = anchor = m;
+
+            /* Position inside the match, finds the next repeat sooner */
+            hashTable[lzHash(lzRead32(ip - 2))] = ip - 2 - src;
+        }
+    }
+
+    op = lzPutSequence(op, opEnd, anchor, end - anchor, 0, 0);
+    return op ? (uint32_t)(op - dst) : 0;
+}
+
+
+/* Length extension bytes after a 15 nibble. False if the block ends first */
+static bool lzGetLength(const uint8_t **ip, const uint8_t *ipEnd, uint32_t *len){
+    uint8_t b;
+    do{
+        if (*ip >= ipEnd){
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+
+int32_t espLzDecompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity){
+    const uint8_t *ip = src;
+    const uint8_t *ipEnd = src + len;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + capacity;
+
+    while (ip < ipEnd){
+        uint8_t token = *ip++;
+        uint32_t litLen = token >> 4;
+
+        if (litLen == 15 && !lzGetLength(&ip, ipEnd, &litLen)){
+            return -1;
+        }
+        if (litLen > (uint32_t)(ipEnd - ip) || litLen > (uint32_t)(opEnd - op)){
+            return -1;
+        }
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+
+        /* The last sequence has no match */
+        if (ip == ipEnd){
+            break;
+        }
+        if (ipEnd - ip < 2){
+            return -1;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        uint32_t matchLen = token & 15;
+        if (matchLen == 15 && !lzGetLength(&ip, ipEnd, &matchLen)){
+            return -1;
+        }
+        matchLen += MIN_MATCH;
+        if (offset == 0 || offset > (uint32_t)(op - dst) || matchLen > (uint32_t)(opEnd - op)){
+            return -1;
+        }
+
+        const uint8_t *ref = op - offset;
+        if (offset >= matchLen){
+            memcpy(op, ref, matchLen);
+            op += matchLen;
+        }
+        else{
+            /* Overlapping match repeats the last offset bytes */
+            while (matchLen--){
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - dst;
+}
+
+
+uint32_t espLzEncodeFrame(EspLzTx *tx, const uint8_t *data, uint32_t len, uint8_t *frame){
+    uint32_t size = 0;
+
+    if (len > ESP_LZ_MAX_BLOCK){
+        len = ESP_LZ_MAX_BLOCK;
+    }
+
+    if (len < ESP_LZ_MIN_SIZE){
+        /* Not worth a try, does not count as a skip */
+    }
+    else if (tx->skip){
+        tx->skip--;
+        tx->stats.skippedFrames++;
+    }
+    else{
+        uint32_t compressed = espLzCompress(data, len, frame + ESP_LZ_HEADER_SIZE, ESP_LZ_BOUND(ESP_LZ_MAX_BLOCK));
+
+        if (compressed && compressed + ESP_LZ_HEADER_SIZE < len + 3){
+            frame[0] = ESP_LZ_FRAME_LZ4;
+            frame[1] = compressed;
+            frame[2] = compressed >> 8;
+            frame[3] = len;
+            frame[4] = len >> 8;
+            size = compressed + ESP_LZ_HEADER_SIZE;
+            tx->stats.compressedFrames++;
+        }
+
+        /* Less than 1/8 saved does not pay the CPU time, back off */
+        if (!size || size > (len + 3) - (len + 3)/8){
+            tx->skip = tx->backoff ? tx->backoff : 1;
+            tx->backoff = tx->skip*2 > ESP_LZ_MAX_SKIP ? ESP_LZ_MAX_SKIP : tx->skip*2;
+        }
+        else{
+            tx->backoff = 0;
+        }
+    }
+
+    if (!size){
+        frame[0] = ESP_LZ_FRAME_STORED;
+        frame[1] = len;
+        frame[2] = len >> 8;
+        memcpy(frame + 3, data, len);
+        size = len + 3;
+    }
+
+    tx->stats.frames++;
+    tx->stats.rawBytes += len;
+    tx->stats.wireBytes += size;
+    return size;
+}
+
+
+bool espLzSend(int fd, uint8_t conn_id, EspLzTx *tx, const uint8_t *data, uint32_t len){
+
+    while (len){
+        uint32_t chunk = len > ESP_LZ_MAX_BLOCK ? ESP_LZ_MAX_BLOCK : len;
+        uint32_t size = espLzEncodeFrame(tx, data, chunk, frameBuffer);
+
+        if (!espSendTCPData(fd, conn_id, (const char*)frameBuffer, size)){
+            return false;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+
+void espLzRxInit(EspLzRx *rx, void (*onData)(void *ctx, const uint8_t *data, uint32_t len), void *ctx){
+    memset(rx, 0, sizeof(*rx));
+    rx->onData = onData;
+    rx->ctx = ctx;
+}
+
+
+static bool lzRxError(EspLzRx *rx, const char *why){
+    espLogWarn("Compressed stream lost: %s", why);
+    rx->errors++;
+    rx->headerLen = 0;
+    rx->left = 0;
+    return false;
+}
+
+
+bool espLzFeed(EspLzRx *rx, const uint8_t *data, uint32_t len){
+
+    while (len){
+        if (rx->left == 0){
+            /* Header, 3 or 5 bytes depending on the type */
+            rx->header[rx->headerLen++] = *data++;
+            len--;
+
+            uint8_t type = rx->header[0];
+            if (type != ESP_LZ_FRAME_STORED && type != ESP_LZ_FRAME_LZ4){
+                return lzRxError(rx, "unknown frame");
+            }
+            if (rx->headerLen < (type == ESP_LZ_FRAME_LZ4 ? ESP_LZ_HEADER_SIZE : 3)){
+                continue;
+            }
+
+            uint32_t size = rx->header[1] | (rx->header[2] << 8);
+            if (type == ESP_LZ_FRAME_LZ4 && (size > sizeof(rx->block) || (uint32_t)(rx->header[3] | (rx->header[4] << 8)) > ESP_LZ_MAX_BLOCK)){
+                return lzRxError(rx, "frame too long");
+            }
+            rx->headerLen = 0;
+            rx->left = size;
+            rx->blockLen = 0;
+            rx->stats.frames++;
+            rx->stats.wireBytes += size + (type == ESP_LZ_FRAME_LZ4 ? ESP_LZ_HEADER_SIZE : 3);
+            continue;
+        }
+
+        uint32_t n = len < rx->left ? len : rx->left;
+
+        if (rx->header[0] == ESP_LZ_FRAME_STORED){
+            rx->stats.rawBytes += n;
+            if (rx->onData){
+                rx->onData(rx->ctx, data, n);
+            }
+        }
+        else{
+            memcpy(rx->block + rx->blockLen, data, n);
+            rx->blockLen += n;
+
+            if (n == rx->left){
+                uint32_t rawLen = rx->header[3] | (rx->header[4] << 8);
+                if (espLzDecompress(rx->block, rx->blockLen, decoded, rawLen) != (int32_t)rawLen){
+                    rx->left = 0;
+                    return lzRxError(rx, "corrupt block");
+                }
+                rx->stats.compressedFrames++;
+                rx->stats.rawBytes += rawLen;
+                if (rx->onData){
+                    rx->onData(rx->ctx, decoded, rawLen);
+                }
+            }
+        }
+        rx->left -= n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_LZ_H
+#define ESP8266_LZ_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Optional compressed framing on top of the TCP link API. At 115200 baud the UART,
+ * not Wi-Fi, bounds espSendTCPData(), so text payloads (JSON, logs) go out LZ4
+ * compressed and the link carries more data per second.
+ *
+ * static EspLzTx tx;                          // per link, zeroed
+ * espLzSend(fd, 0, &tx, json, jsonLen);
+ *
+ * static EspLzRx rx;                          // per link
+ * espLzRxInit(&rx, onPlainData, ctx);
+ * ...from the onData handler: espLzFeed(&rx, data, len);
+ *
+ * The stream is a sequence of frames, little endian:
+ *
+ *   0x00 <len:2> <len bytes>                  stored
+ *   0x01 <len:2> <rawLen:2> <len bytes>       LZ4 block of rawLen bytes
+ *
+ * Blocks hold up to ESP_LZ_MAX_BLOCK bytes and are independent of each other.
+ * esp8266_lz.py is the reference decoder for the server side.
+ *
+ * RAM is fixed: the hash table, one frame and one decoded block shared by all links
+ * (the driver is single threaded), plus one block per EspLzRx.
+ * A frame that does not shrink by 1/8 is sent stored and the next ones are sent
+ * stored without trying, for a run that doubles every time (up to ESP_LZ_MAX_SKIP).
+********************************************/
+
+/* Raw bytes per frame */
+#ifndef ESP_LZ_MAX_BLOCK
+#define ESP_LZ_MAX_BLOCK 1024
+#endif
+/* 1<<10 entries of 2 bytes */
+#ifndef ESP_LZ_HASH_BITS
+#define ESP_LZ_HASH_BITS 10
+#endif
+/* Shorter writes are sent stored without trying */
+#define ESP_LZ_MIN_SIZE 32
+#define ESP_LZ_MAX_SKIP 32
+
+#define ESP_LZ_FRAME_STORED 0x00
+#define ESP_LZ_FRAME_LZ4 0x01
+#define ESP_LZ_HEADER_SIZE 5
+
+/* Worst case LZ4 block of len bytes */
+#define ESP_LZ_BOUND(len) ((len) + (len)/255 + 16)
+#define ESP_LZ_FRAME_BOUND (ESP_LZ_HEADER_SIZE + ESP_LZ_BOUND(ESP_LZ_MAX_BLOCK))
+
+typedef struct{
+    uint32_t frames;
+    uint32_t compressedFrames;
+    /* Frames sent stored without trying, compression was not paying */
+    uint32_t skippedFrames;
+    /* Payload bytes before and after framing, rawBytes/wireBytes is the gain on the UART */
+    uint64_t rawBytes;
+    uint64_t wireBytes;
+}EspLzStats;
+
+typedef struct{
+    /* Frames left to send stored before trying again */
+    uint8_t skip;
+    /* Length of the next skip run */
+    uint8_t backoff;
+    EspLzStats stats;
+}EspLzTx;
+
+typedef struct{
+    void (*onData)(void *ctx, const uint8_t *data, uint32_t len);
+    void *ctx;
+    uint8_t header[ESP_LZ_HEADER_SIZE];
+    uint8_t headerLen;
+    /* Body bytes of the current frame still to come */
+    uint32_t left;
+    uint32_t blockLen;
+    uint8_t block[ESP_LZ_BOUND(ESP_LZ_MAX_BLOCK)];
+    EspLzStats stats;
+    uint32_t errors;
+}EspLzRx;
+
+/* LZ4 block format. Returns the compressed size, 0 if it does not fit in capacity */
+uint32_t espLzCompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity);
+/* Returns the decompressed size, -1 if the block is corrupt or does not fit */
+int32_t espLzDecompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity);
+
+/* Frames len bytes (up to ESP_LZ_MAX_BLOCK) into frame, ESP_LZ_FRAME_BOUND bytes. Returns the frame size */
+uint32_t espLzEncodeFrame(EspLzTx *tx, const uint8_t *data, uint32_t len, uint8_t *frame);
+/* espSendTCPData() of data as frames of ESP_LZ_MAX_BLOCK bytes */
+bool espLzSend(int fd, uint8_t conn_id, EspLzTx *tx, const uint8_t *data, uint32_t len);
+
+void espLzRxInit(EspLzRx *rx, void (*onData)(void *ctx, const uint8_t *data, uint32_t len), void *ctx);
+/*
+* Bytes of the link in any pieces, as onData or espReceiveData() gets them. Stored
+* frames are handed over as they come, LZ4 frames once decoded.
+* Returns false on a corrupt frame, the stream is lost and rx starts over.
+*/
+bool espLzFeed(EspLzRx *rx, const uint8_t *data, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_LZ_H
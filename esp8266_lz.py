@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+#   notice, this list of conditions and the following disclaimer.
+# * Redistributions in binary form must reproduce the above
+#   copyright notice, this list of conditions and the following disclaimer
+#   in the documentation and/or other materials provided with the
+#   distribution.
+# * Neither the name of the  nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+
+"""
+Reference decoder of the esp8266_lz.c framing, for the server side of a link.
+
+    ./esp8266_lz.py < received.bin > plain.bin
+
+As a module:
+
+    decoder = FrameDecoder()
+    plain = decoder.feed(chunk)          # bytes in any pieces, returns what is complete
+
+encode_stored() frames data for the other direction, the module decodes both kinds.
+"""
+
+import argparse
+import struct
+import sys
+
+FRAME_STORED = 0x00
+FRAME_LZ4 = 0x01
+# ESP_LZ_MAX_BLOCK of the module build
+MAX_BLOCK = 1024
+
+MIN_MATCH = 4
+
+
+class FrameError(Exception):
+    pass
+
+
+def _length(block, pos, value):
+    """LZ4 length extension after a 15 nibble"""
+    while True:
+        if pos >= len(block):
+            raise FrameError('block ends inside a length')
+        b = block[pos]
+        pos += 1
+        value += b
+        if b != 255:
+            return value, pos
+
+
+def lz4_block_decompress(block, raw_len):
+    out = bytearray()
+    pos = 0
+    while pos < len(block):
+        token = block[pos]
+        pos += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            lit_len, pos = _length(block, pos, lit_len)
+        if pos + lit_len > len(block):
+            raise FrameError('literals past the end of the block')
+        out += block[pos:pos + lit_len]
+        pos += lit_len
+        if pos == len(block):
+            break
+        if pos + 2 > len(block):
+            raise FrameError('block ends inside an offset')
+        offset = block[pos] | (block[pos + 1] << 8)
+        pos += 2
+        match_len = token & 15
+        if match_len == 15:
+            match_len, pos = _length(block, pos, match_len)
+        match_len += MIN_MATCH
+        if offset == 0 or offset > len(out):
+            raise FrameError('offset %d out of the block' % offset)
+        # Byte by byte, matches can overlap what they copy
+        start = len(out) - offset
+        for i in range(match_len):
+            out.append(out[start + i])
+    if len(out) != raw_len:
+        raise FrameError('block is %d bytes, header says %d' % (len(out), raw_len))
+    return bytes(out)
+
+
+class FrameDecoder:
+    def __init__(self, max_block=MAX_BLOCK):
+        self.max_block = max_block
+        self.pending = bytearray()
+        self.frames = 0
+        self.compressed_frames = 0
+        self.raw_bytes = 0
+        self.wire_bytes = 0
+
+    def feed(self, data):
+        self.pending += data
+        out = bytearray()
+        while self.pending:
+            kind = self.pending[0]
+            if kind == FRAME_STORED:
+                header = 3
+            elif kind == FRAME_LZ4:
+                header = 5
+            else:
+                raise FrameError('unknown frame type 0x%02x' % kind)
+            if len(self.pending) < header:
+                break
+            size = struct.unpack_from('<H', self.pending, 1)[0]
+            if len(self.pending) < header + size:
+                break
+            body = bytes(self.pending[header:header + size])
+            if kind == FRAME_LZ4:
+                raw_len = struct.unpack_from('<H', self.pending, 3)[0]
+                if raw_len > self.max_block:
+                    raise FrameError('block of %d bytes, more than %d' % (raw_len, self.max_block))
+                body = lz4_block_decompress(body, raw_len)
+                self.compressed_frames += 1
+            del self.pending[:header + size]
+            self.frames += 1
+            self.raw_bytes += len(body)
+            self.wire_bytes += header + size
+            out += body
+        return bytes(out)
+
+
+def encode_stored(data, max_block=MAX_BLOCK):
+    out = bytearray()
+    for i in range(0, len(data), max_block):
+        chunk = data[i:i + max_block]
+        out += struct.pack('<BH', FRAME_STORED, len(chunk)) + chunk
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--max-block', type=int, default=MAX_BLOCK, help='ESP_LZ_MAX_BLOCK of the module')
+    args = parser.parse_args()
+
+    decoder = FrameDecoder(args.max_block)
+    try:
+        sys.stdout.buffer.write(decoder.feed(sys.stdin.buffer.read()))
+    except FrameError as e:
+        sys.exit('esp8266_lz: %s' % e)
+    if decoder.pending:
+        sys.exit('esp8266_lz: stream ends inside a frame')
+    if decoder.wire_bytes:
+        print('%d frames, %d compressed, %d -> %d bytes (%.2fx)' %
+              (decoder.frames, decoder.compressed_frames, decoder.wire_bytes, decoder.raw_bytes,
+               decoder.raw_bytes / decoder.wire_bytes), file=sys.stderr)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
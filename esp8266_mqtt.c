@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_mqtt.h"
+#include "esp8266_log.h"
+#include "esp8266_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* Control packet types, already shifted into the fixed header */
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_PINGREQ     0xC0
+#define MQTT_PINGRESP    0xD0
+#define MQTT_DISCONNECT  0xE0
+
+/* Bytes kept of every received packet, enough for CONNACK and PUBACK */
+#define MQTT_RX_KEEP 4
+
+typedef enum{
+    RX_TYPE,
+    RX_LENGTH,
+    RX_BODY
+}MqttRxState;
+
+static EspEventHandlers appHandlers;
+static EspMqttConfig config;
+static EspMqttStats stats;
+
+static bool linkUp = false;
+static bool connected = false;
+static uint8_t linkId;
+
+/* Coalesced publishes, sent as one CIPSEND */
+static uint8_t txBuffer[MAX_SEND_TCP_DATA_SIZE];
+static uint32_t txFill = 0;
+
+static uint16_t nextPacketId = 1;
+static uint16_t inflight[MQTT_MAX_INFLIGHT];
+static uint32_t numInflight = 0;
+
+static EspTimer flushTimer;
+static EspTimer pingTimer;
+static EspTimer pingRespTimer;
+static bool pingOutstanding = false;
+
+static MqttRxState rxState = RX_TYPE;
+static uint8_t rxType;
+static uint32_t rxRemaining;
+static uint32_t rxShift;
+static uint8_t rxKeep[MQTT_RX_KEEP];
+static uint32_t rxPos;
+
+
+static uint32_t mqttEncodeLength(uint8_t *dest, uint32_t len){
+    uint32_t n = 0;
+    do{
+        uint8_t digit = len % 128;
+        len /= 128;
+        dest[n++] = digit | (len ? 0x80 : 0);
+    }while (len);
+    return n;
+}
+
+static uint32_t mqttLengthSize(uint32_t len){
+    return len < 128 ? 1 : len < 16384 ? 2 : len < 2097152 ? 3 : 4;
+}
+
+static uint32_t mqttPutString(uint8_t *dest, const char *str){
+    uint32_t len = strlen(str);
+    dest[0] = len >> 8;
+    dest[1] = len & 0xFF;
+    memcpy(dest + 2, str, len);
+    return len + 2;
+}
+
+
+/* Connection dropped, everything not acked is lost */
+static void mqttLinkDown(void){
+    linkUp = false;
+    connected = false;
+    txFill = 0;
+    pingOutstanding = false;
+    espTimerCancel(&flushTimer);
+    espTimerCancel(&pingTimer);
+    espTimerCancel(&pingRespTimer);
+
+    for (uint32_t i = 0; i < numInflight; i++){
+        stats.lost++;
+        if (config.onLost){
+            config.onLost(config.ctx, inflight[i]);
+        }
+    }
+    numInflight = 0;
+    rxState = RX_TYPE;
+}
+
+static bool mqttRemoveInflight(uint16_t packetId){
+    for (uint32_t i = 0; i < numInflight; i++){
+        if (inflight[i] == packetId){
+            inflight[i] = inflight[--numInflight];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void mqttOnPuback(uint16_t packetId){
+    if (mqttRemoveInflight(packetId)){
+        stats.acked++;
+        if (config.onAck){
+            config.onAck(config.ctx, packetId);
+        }
+    }
+}
+
+/* The CIPSEND of these packets failed, the QoS 1 publishes among them never reached the broker */
+static void mqttDropUnsent(const uint8_t *data, uint32_t len){
+    uint32_t pos = 0;
+
+    while (pos < len){
+        uint8_t type = data[pos++];
+        uint32_t remaining = 0;
+        uint32_t shift = 0;
+        while (pos < len && shift <= 21){
+            uint8_t b = data[pos++];
+            remaining |= (uint32_t)(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)){
+                break;
+            }
+        }
+        if ((type & 0xF0) == MQTT_PUBLISH && (type & 0x06) && pos + 2 <= len){
+            uint32_t idPos = pos + 2 + ((data[pos] << 8) | data[pos + 1]);
+            if (idPos + 2 <= len){
+                uint16_t packetId = (data[idPos] << 8) | data[idPos + 1];
+                if (mqttRemoveInflight(packetId)){
+                    stats.lost++;
+                    if (config.onLost){
+                        config.onLost(config.ctx, packetId);
+                    }
+                }
+            }
+        }
+        pos += remaining;
+    }
+}
+
+static void mqttPacket(void){
+    switch (rxType & 0xF0){
+    case MQTT_CONNACK:
+        /* Return code 0 is accepted */
+        connected = rxPos >= 2 && rxKeep[1] == 0;
+        if (!connected){
+            espLogError("MQTT connection refused, code %u", rxPos >= 2 ? rxKeep[1] : 0xFF);
+        }
+        break;
+    case MQTT_PUBACK:
+        if (rxPos >= 2){
+            mqttOnPuback((rxKeep[0] << 8) | rxKeep[1]);
+        }
+        break;
+    case MQTT_PINGRESP:
+        pingOutstanding = false;
+        espTimerCancel(&pingRespTimer);
+        break;
+    default:
+        /* A publisher is not subscribed to anything */
+        break;
+    }
+}
+
+/* Broker bytes as they come from +IPD, packets can be split anywhere */
+static void mqttParse(const uint8_t *data, uint32_t len){
+    for (uint32_t i = 0; i < len; i++){
+        uint8_t b = data[i];
+
+        switch (rxState){
+        case RX_TYPE:
+            rxType = b;
+            rxRemaining = 0;
+            rxShift = 0;
+            rxPos = 0;
+            rxState = RX_LENGTH;
+            break;
+
+        case RX_LENGTH:
+            rxRemaining |= (uint32_t)(b & 0x7F) << rxShift;
+            rxShift += 7;
+            if (!(b & 0x80) || rxShift > 21){
+                if (rxRemaining == 0){
+                    mqttPacket();
+                    rxState = RX_TYPE;
+                }
+                else{
+                    rxState = RX_BODY;
+                }
+            }
+            break;
+
+        case RX_BODY:{
+            /* Only the head of the body is kept, the rest is skipped in place */
+            uint32_t n = len - i < rxRemaining ? len - i : rxRemaining;
+            for (uint32_t k = 0; k < n && rxPos < MQTT_RX_KEEP; k++){
+                rxKeep[rxPos++] = data[i + k];
+            }
+            rxRemaining -= n;
+            i += n - 1;
+            if (rxRemaining == 0){
+                mqttPacket();
+                rxState = RX_TYPE;
+            }
+            break;
+        }
+        }
+    }
+}
+
+
+static void mqttOnConnect(void *ctx, uint8_t conn_id){
+    (void)ctx;
+    if (!(linkUp && conn_id == linkId) && appHandlers.onConnect){
+        appHandlers.onConnect(appHandlers.ctx, conn_id);
+    }
+}
+
+static void mqttOnClose(void *ctx, uint8_t conn_id){
+    (void)ctx;
+    if (linkUp && conn_id == linkId){
+        mqttLinkDown();
+    }
+    else if (appHandlers.onClose){
+        appHandlers.onClose(appHandlers.ctx, conn_id);
+    }
+}
+
+static void mqttOnData(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len){
+    (void)ctx;
+    if (linkUp && info->conn_id == linkId){
+        mqttParse(data, len);
+    }
+    else if (appHandlers.onData){
+        appHandlers.onData(appHandlers.ctx, info, offset, data, len);
+    }
+}
+
+static void mqttOnStation(void *ctx, const EspStation *station, bool connected){
+    (void)ctx;
+    if (appHandlers.onStation){
+        appHandlers.onStation(appHandlers.ctx, station, connected);
+    }
+}
+
+
+void espMqttInit(const EspEventHandlers *handlers){
+    EspEventHandlers own = {NULL, mqttOnConnect, mqttOnClose, mqttOnData, mqttOnStation};
+
+    if (handlers){
+        appHandlers = *handlers;
+    }
+    else{
+        memset(&appHandlers, 0, sizeof(appHandlers));
+    }
+    espTimerInit(&flushTimer, NULL, NULL);
+    espTimerInit(&pingTimer, NULL, NULL);
+    espTimerInit(&pingRespTimer, NULL, NULL);
+    memset(&stats, 0, sizeof(stats));
+    espSetEventHandlers(&own);
+}
+
+
+/* Writes the whole buffer in one CIPSEND */
+static bool mqttSend(int fd, const uint8_t *data, uint32_t len){
+    if (!espSendTCPData(fd, linkId, (const char*)data, len)){
+        return false;
+    }
+    stats.frames++;
+    stats.bytesSent += len;
+    if (config.keepAlive){
+        espTimerStartMS(&pingTimer, config.keepAlive * 1000u);
+    }
+    return true;
+}
+
+
+bool espMqttFlush(int fd){
+    espTimerCancel(&flushTimer);
+    if (txFill == 0){
+        return true;
+    }
+
+    uint32_t len = txFill;
+    txFill = 0;
+    if (!mqttSend(fd, txBuffer, len)){
+        mqttDropUnsent(txBuffer, len);
+        return false;
+    }
+    return true;
+}
+
+
+/* The link is open but the session was never set up */
+static void mqttConnectFailed(int fd){
+    if (linkUp){
+        espCloseConnection(fd, linkId);
+    }
+    if (linkUp){
+        mqttLinkDown();
+    }
+}
+
+
+bool espMqttConnect(int fd, uint8_t conn_id, const char *host, uint16_t port, const EspMqttConfig *cfg, unsigned int timeout){
+    config = *cfg;
+    linkId = conn_id;
+
+    /* Before CIPSTART so its "<id>,CONNECT" stays here */
+    linkUp = true;
+    if (!espStartTCPConnection(fd, conn_id, host, port)){
+        linkUp = false;
+        return false;
+    }
+
+    uint8_t flags = config.cleanSession ? 0x02 : 0;
+    uint32_t remaining = 10 + 2 + strlen(config.clientId);
+    if (config.username){
+        flags |= 0x80;
+        remaining += 2 + strlen(config.username);
+    }
+    if (config.password){
+        flags |= 0x40;
+        remaining += 2 + strlen(config.password);
+    }
+    if (1 + mqttLengthSize(remaining) + remaining > sizeof(txBuffer)){
+        espLogError("MQTT CONNECT does not fit in one CIPSEND");
+        mqttConnectFailed(fd);
+        return false;
+    }
+
+    /* CONNECT goes alone, nothing can be published before CONNACK */
+    uint32_t n = 0;
+    txBuffer[n++] = MQTT_CONNECT;
+    n += mqttEncodeLength(txBuffer + n, remaining);
+    n += mqttPutString(txBuffer + n, "MQTT");
+    txBuffer[n++] = 4;
+    txBuffer[n++] = flags;
+    txBuffer[n++] = config.keepAlive >> 8;
+    txBuffer[n++] = config.keepAlive & 0xFF;
+    n += mqttPutString(txBuffer + n, config.clientId);
+    if (config.username){
+        n += mqttPutString(txBuffer + n, config.username);
+    }
+    if (config.password){
+        n += mqttPutString(txBuffer + n, config.password);
+    }
+
+    txFill = 0;
+    numInflight = 0;
+    nextPacketId = 1;
+    rxState = RX_TYPE;
+    if (!mqttSend(fd, txBuffer, n)){
+        mqttConnectFailed(fd);
+        return false;
+    }
+
+    EspTimer deadline;
+    espTimerInit(&deadline, NULL, NULL);
+    espTimerStartMS(&deadline, timeout);
+    while (linkUp && !connected && espTimerPending(&deadline)){
+        espProcessEvents(fd, 10);
+    }
+    espTimerCancel(&deadline);
+
+    if (!connected){
+        mqttConnectFailed(fd);
+    }
+    return connected;
+}
+
+
+bool espMqttConnected(void){
+    return connected;
+}
+
+
+uint16_t espMqttPublish(int fd, const char *topic, const uint8_t *payload, uint32_t len, uint8_t qos, bool retain){
+    if (!connected || qos > 1){
+        return 0;
+    }
+    if (qos && numInflight == MQTT_MAX_INFLIGHT){
+        return 0;
+    }
+
+    uint32_t topicLen = strlen(topic);
+    uint32_t remaining = 2 + topicLen + (qos ? 2 : 0) + len;
+    uint32_t size = 1 + mqttLengthSize(remaining) + remaining;
+
+    if (size > sizeof(txBuffer)){
+        return 0;
+    }
+    if (txFill + size > sizeof(txBuffer) && !espMqttFlush(fd)){
+        return 0;
+    }
+
+    uint16_t packetId = 1;
+    if (qos){
+        packetId = nextPacketId;
+        nextPacketId = nextPacketId == 0xFFFF ? 1 : nextPacketId + 1;
+    }
+
+    uint8_t *p = txBuffer + txFill;
+    *p++ = MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0);
+    p += mqttEncodeLength(p, remaining);
+    *p++ = topicLen >> 8;
+    *p++ = topicLen & 0xFF;
+    memcpy(p, topic, topicLen);
+    p += topicLen;
+    if (qos){
+        *p++ = packetId >> 8;
+        *p++ = packetId & 0xFF;
+        inflight[numInflight++] = packetId;
+    }
+    memcpy(p, payload, len);
+
+    bool first = txFill == 0;
+    txFill += size;
+    stats.published++;
+
+    if (config.flushLatencyMS == 0){
+        return espMqttFlush(fd) ? packetId : 0;
+    }
+    if (first){
+        espTimerStartMS(&flushTimer, config.flushLatencyMS);
+    }
+    return packetId;
+}
+
+
+bool espMqttLoop(int fd, unsigned int timeout){
+    espProcessEvents(fd, timeout);
+
+    if (!linkUp){
+        return false;
+    }
+
+    if (txFill && !espTimerPending(&flushTimer) && !espMqttFlush(fd)){
+        return false;
+    }
+
+    if (config.keepAlive && connected){
+        if (pingOutstanding){
+            if (!espTimerPending(&pingRespTimer)){
+                /* No PINGRESP within a keepalive period, the broker is gone */
+                espLogError("MQTT broker not answering");
+                espCloseConnection(fd, linkId);
+                mqttLinkDown();
+                return false;
+            }
+        }
+        else if (!espTimerPending(&pingTimer)){
+            uint8_t ping[2] = {MQTT_PINGREQ, 0};
+            if (!espMqttFlush(fd) || !mqttSend(fd, ping, sizeof(ping))){
+                return false;
+            }
+            stats.pings++;
+            pingOutstanding = true;
+            espTimerStartMS(&pingRespTimer, config.keepAlive * 1000u);
+        }
+    }
+    return connected;
+}
+
+
+bool espMqttDisconnect(int fd){
+    if (!linkUp){
+        return true;
+    }
+
+    uint8_t disconnect[2] = {MQTT_DISCONNECT, 0};
+    bool ok = espMqttFlush(fd) && mqttSend(fd, disconnect, sizeof(disconnect));
+
+    espCloseConnection(fd, linkId);
+    if (linkUp){
+        mqttLinkDown();
+    }
+    return ok;
+}
+
+
+void espMqttGetStats(EspMqttStats *out){
+    *out = stats;
+}
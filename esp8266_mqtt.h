@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_MQTT_H
+#define ESP8266_MQTT_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * MQTT 3.1.1 publisher on one TCP link. Publishes are encoded straight into one
+ * MAX_SEND_TCP_DATA_SIZE buffer and go out together in a single CIPSEND, either
+ * when the buffer is full or flushLatencyMS after the first one was queued.
+ *
+ * EspMqttConfig config = {"sensor-12", NULL, NULL, 60, true, 20};
+ * espMqttInit(&appHandlers);          // instead of espSetEventHandlers()
+ * espMqttConnect(fd, 1, "192.168.0.1", 1883, &config, 2000);
+ * espMqttPublish(fd, "sensors/12/temp", (const uint8_t*)"21.5", 4, 1, false);
+ * ...
+ * espMqttLoop(fd, 10);                // flush, keepalive, acks
+ *
+ * No heap is used. QoS 1 publishes are tracked until their PUBACK. They are
+ * not retransmitted on the same connection (MQTT 3.1.1 4.4). The ones still
+ * unacked when the connection drops, or whose CIPSEND failed, are handed to onLost.
+********************************************/
+
+/* Publishes waiting for their PUBACK */
+#define MQTT_MAX_INFLIGHT 16
+
+typedef struct{
+    const char *clientId;
+    /* NULL if not used */
+    const char *username;
+    const char *password;
+    /* Seconds, 0 disables PINGREQ */
+    uint16_t keepAlive;
+    bool cleanSession;
+    /* How long a publish may wait for others to share its CIPSEND, 0 sends at once */
+    uint32_t flushLatencyMS;
+
+    /* Any callback can be NULL. They run from inside driver calls and must not send AT commands */
+    void (*onAck)(void *ctx, uint16_t packetId);
+    void (*onLost)(void *ctx, uint16_t packetId);
+    void *ctx;
+}EspMqttConfig;
+
+typedef struct{
+    uint32_t published;
+    uint32_t acked;
+    uint32_t lost;
+    /* CIPSEND frames and bytes written */
+    uint32_t frames;
+    uint32_t bytesSent;
+    uint32_t pings;
+}EspMqttStats;
+
+/* Installs the client event handlers, events of other links go to appHandlers */
+void espMqttInit(const EspEventHandlers *appHandlers);
+/* Opens the link, sends CONNECT and waits up to timeout ms for CONNACK. The link is closed if that fails */
+bool espMqttConnect(int fd, uint8_t conn_id, const char *host, uint16_t port, const EspMqttConfig *config, unsigned int timeout);
+bool espMqttConnected(void);
+/*
+* Queues a PUBLISH, qos 0 or 1. Returns the packet id (1 for qos 0) or 0 if it
+* could not be queued: not connected, too big, too many in flight or a flush failed.
+*/
+uint16_t espMqttPublish(int fd, const char *topic, const uint8_t *payload, uint32_t len, uint8_t qos, bool retain);
+/* Sends whatever is queued now */
+bool espMqttFlush(int fd);
+/* Processes the link for timeout ms and does the timed work: flush, PINGREQ, dead broker */
+bool espMqttLoop(int fd, unsigned int timeout);
+bool espMqttDisconnect(int fd);
+void espMqttGetStats(EspMqttStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_MQTT_H
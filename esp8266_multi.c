@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_multi.h"
+#include "esp8266_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* Monotonic microseconds, provided by the backend */
+extern uint32_t getCurrentUS (void);
+
+/* How often a module that stopped answering is probed again */
+#define MULTI_RECOVER_INTERVAL_US 5000000u
+
+typedef struct{
+    int fd;
+    bool up;
+    uint32_t baud;
+    /* Bytes handed to the module and not drained by its UART yet, as of drainedAtUS */
+    uint32_t queuedBytes;
+    uint32_t drainedAtUS;
+    /* EspHealth.reboots last seen, the module restarted when it moves */
+    uint32_t reboots;
+    uint32_t downAtUS;
+    /* Logical link on every conn_id, -1 if none */
+    int links[NUM_LINKS];
+    uint64_t bytesSent;
+    uint32_t linksOpened;
+    uint32_t drops;
+}MultiModule;
+
+typedef struct{
+    bool used;
+    bool open;
+    /* Lost with its module, to be opened on another one */
+    bool moving;
+    uint8_t module;
+    uint8_t connId;
+    ProtocolMode type;
+    char host[MULTI_HOST_SIZE];
+    uint16_t port;
+    uint16_t keepAlive;
+}MultiLink;
+
+static MultiModule modules[ESP_MAX_MODULES];
+static uint8_t numModules = 0;
+static MultiLink links[MULTI_MAX_LINKS];
+static EspMultiHandlers appHandlers;
+static EspMultiStats stats;
+
+
+static void multiDrain(MultiModule *m){
+    uint32_t now = getCurrentUS();
+    /* 10 bits per byte on the wire */
+    uint64_t drained = (uint64_t)(now - m->drainedAtUS) * (m->baud / 10) / 1000000u;
+
+    m->queuedBytes = drained >= m->queuedBytes ? 0 : m->queuedBytes - (uint32_t)drained;
+    m->drainedAtUS = now;
+}
+
+static uint8_t multiOpenLinks(const MultiModule *m){
+    uint8_t n = 0;
+    for (int c = 0; c < NUM_LINKS; c++){
+        if (m->links[c] >= 0){
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Never below a millisecond so the number of open links always counts */
+#define MULTI_MIN_RTT_US 1000u
+
+static bool multiMeasuredRttUS(uint8_t module, uint32_t *rttUS){
+    EspRttStats rtt;
+    uint8_t selected = espSelectedModule();
+
+    espSelectModule(module);
+    espGetRttStats(ESP_CMD_SEND, &rtt);
+    espSelectModule(selected);
+
+    *rttUS = rtt.samples ? rtt.srttUS : rtt.rtoUS;
+    if (*rttUS < MULTI_MIN_RTT_US){
+        *rttUS = MULTI_MIN_RTT_US;
+    }
+    return rtt.samples > 0;
+}
+
+/*
+* SEND time of the module. One that never sent anything gets the best measured
+* one, its default timeout would keep it from ever being picked and measured.
+*/
+static uint32_t multiSendRttUS(uint8_t module){
+    uint32_t rttUS;
+    if (multiMeasuredRttUS(module, &rttUS)){
+        return rttUS;
+    }
+
+    uint32_t best = rttUS;
+    bool found = false;
+    for (uint8_t i = 0; i < numModules; i++){
+        uint32_t other;
+        if (modules[i].up && multiMeasuredRttUS(i, &other) && (!found || other < best)){
+            best = other;
+            found = true;
+        }
+    }
+    return best;
+}
+
+/* Time until data given to the module now would be sent, -1 if it cannot take a link */
+static int64_t multiCost(uint8_t module){
+    MultiModule *m = &modules[module];
+    uint8_t open = multiOpenLinks(m);
+
+    if (!m->up || open == NUM_LINKS){
+        return -1;
+    }
+    multiDrain(m);
+    return (int64_t)m->queuedBytes * 10000000 / m->baud + (int64_t)multiSendRttUS(module) * (open + 1);
+}
+
+/* Cheapest module, avoid is only taken if nothing else can (-1 avoids none) */
+static int multiPickModule(int avoid){
+    int best = -1;
+    int64_t bestCost = 0;
+
+    for (uint8_t i = 0; i < numModules; i++){
+        int64_t cost = multiCost(i);
+        if (cost < 0){
+            continue;
+        }
+        if (best < 0 || (best == avoid && i != avoid) || (i != avoid && cost < bestCost)){
+            best = i;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+static bool multiRebooted(MultiModule *m){
+    EspHealth health;
+    espGetHealth(&health);
+    if (health.reboots != m->reboots){
+        m->reboots = health.reboots;
+        return true;
+    }
+    return false;
+}
+
+static bool multiDead(void){
+    EspHealth health;
+    espGetHealth(&health);
+    return health.state == ESP_HEALTH_DEAD;
+}
+
+/* Every link of the module has to go somewhere else */
+static void multiModuleDropped(uint8_t module, bool down){
+    MultiModule *m = &modules[module];
+
+    m->drops++;
+    if (down){
+        m->up = false;
+        m->downAtUS = getCurrentUS();
+    }
+    for (int c = 0; c < NUM_LINKS; c++){
+        if (m->links[c] >= 0){
+            links[m->links[c]].open = false;
+            links[m->links[c]].moving = true;
+            m->links[c] = -1;
+        }
+    }
+    m->queuedBytes = 0;
+}
+
+
+static void multiOnConnect(void *ctx, uint8_t conn_id){
+    MultiModule *m = ctx;
+    int link = m->links[conn_id];
+
+    if (link >= 0){
+        links[link].open = true;
+        if (appHandlers.onConnect){
+            appHandlers.onConnect(appHandlers.ctx, link);
+        }
+    }
+}
+
+static void multiOnClose(void *ctx, uint8_t conn_id){
+    MultiModule *m = ctx;
+    int link = m->links[conn_id];
+
+    if (link < 0){
+        return;
+    }
+    if (multiRebooted(m)){
+        /* The module restarted, nothing was closed by the remote end */
+        multiModuleDropped(m - modules, false);
+        return;
+    }
+
+    m->links[conn_id] = -1;
+    links[link].open = false;
+    links[link].used = false;
+    if (appHandlers.onClose){
+        appHandlers.onClose(appHandlers.ctx, link);
+    }
+}
+
+static void multiOnData(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len){
+    MultiModule *m = ctx;
+    int link = info->conn_id < NUM_LINKS ? m->links[info->conn_id] : -1;
+
+    if (link >= 0 && appHandlers.onData){
+        appHandlers.onData(appHandlers.ctx, link, offset, data, len, info->length);
+    }
+}
+
+
+bool espMultiInit(const int *fds, uint8_t count, const EspMultiHandlers *handlers){
+    if (count == 0 || count > ESP_MAX_MODULES){
+        return false;
+    }
+
+    numModules = count;
+    memset(links, 0, sizeof(links));
+    memset(&stats, 0, sizeof(stats));
+    if (handlers){
+        appHandlers = *handlers;
+    }
+    else{
+        memset(&appHandlers, 0, sizeof(appHandlers));
+    }
+
+    for (uint8_t i = 0; i < numModules; i++){
+        MultiModule *m = &modules[i];
+        EspEventHandlers own = {m, multiOnConnect, multiOnClose, multiOnData, NULL};
+
+        memset(m, 0, sizeof(*m));
+        m->fd = fds[i];
+        m->up = true;
+        m->baud = MULTI_DEFAULT_BAUD;
+        m->drainedAtUS = getCurrentUS();
+        for (int c = 0; c < NUM_LINKS; c++){
+            m->links[c] = -1;
+        }
+
+        espSelectModule(i);
+        espSetEventHandlers(&own);
+        multiRebooted(m);
+    }
+    return true;
+}
+
+
+void espMultiSetBaud(uint8_t module, uint32_t baud){
+    if (module < numModules && baud >= 10){
+        multiDrain(&modules[module]);
+        modules[module].baud = baud;
+    }
+}
+
+
+/* Opens the link on the cheapest module able to take it */
+static bool multiPlace(int link, int avoid){
+    MultiLink *l = &links[link];
+
+    for (;;){
+        int module = multiPickModule(avoid);
+        if (module < 0){
+            return false;
+        }
+
+        MultiModule *m = &modules[module];
+        espSelectModule(module);
+
+        /* Links the application opened itself on the module are left alone */
+        int connId = 0;
+        while (connId < NUM_LINKS && (m->links[connId] >= 0 || espLinkIsOpen(connId))){
+            connId++;
+        }
+        if (connId == NUM_LINKS){
+            return false;
+        }
+
+        /* Mapped first, the CONNECT event comes before the OK */
+        m->links[connId] = link;
+        bool ok = l->type == SSL_MODE ?
+            espStartSSLConnection(m->fd, connId, l->host, l->port, l->keepAlive) :
+            espStartTCPConnection(m->fd, connId, l->host, l->port);
+        if (ok){
+            l->module = module;
+            l->connId = connId;
+            l->open = true;
+            l->moving = false;
+            m->linksOpened++;
+            return true;
+        }
+
+        m->links[connId] = -1;
+        if (!multiDead() && !multiRebooted(m)){
+            /* The module is fine, the remote end is not */
+            return false;
+        }
+        multiModuleDropped(module, multiDead());
+    }
+}
+
+
+int espMultiOpen(ProtocolMode type, const char *host, uint16_t port, uint16_t keepAlive){
+    if ((type != TCP_MODE && type != SSL_MODE) || strlen(host) >= MULTI_HOST_SIZE){
+        return -1;
+    }
+
+    int link = 0;
+    while (link < MULTI_MAX_LINKS && links[link].used){
+        link++;
+    }
+    if (link == MULTI_MAX_LINKS){
+        return -1;
+    }
+
+    MultiLink *l = &links[link];
+    memset(l, 0, sizeof(*l));
+    l->used = true;
+    l->type = type;
+    strcpy(l->host, host);
+    l->port = port;
+    l->keepAlive = keepAlive;
+
+    if (!multiPlace(link, -1)){
+        l->used = false;
+        return -1;
+    }
+    stats.opens++;
+    return link;
+}
+
+
+static bool multiFailover(int link){
+    MultiLink *l = &links[link];
+    uint8_t from = l->module;
+
+    /* Somewhere else if possible, even a module that came back restarted may go again */
+    if (!multiPlace(link, from)){
+        stats.failoverFailures++;
+        l->used = false;
+        l->moving = false;
+        if (appHandlers.onClose){
+            appHandlers.onClose(appHandlers.ctx, link);
+        }
+        return false;
+    }
+
+    stats.failovers++;
+    if (appHandlers.onFailover){
+        appHandlers.onFailover(appHandlers.ctx, link, from, l->module);
+    }
+    return true;
+}
+
+
+bool espMultiSend(int link, const char *data, int len){
+    if (link < 0 || link >= MULTI_MAX_LINKS || !links[link].used){
+        return false;
+    }
+
+    MultiLink *l = &links[link];
+    if (l->moving && !multiFailover(link)){
+        return false;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++){
+        MultiModule *m = &modules[l->module];
+
+        espSelectModule(l->module);
+        if (espSendTCPData(m->fd, l->connId, data, len)){
+            multiDrain(m);
+            m->queuedBytes += len;
+            m->bytesSent += len;
+            return true;
+        }
+
+        bool dead = multiDead();
+        if (!dead && !multiRebooted(m)){
+            return false;
+        }
+        /* Lost with the module, once more on another one */
+        multiModuleDropped(l->module, dead);
+        if (!multiFailover(link)){
+            return false;
+        }
+    }
+    return false;
+}
+
+
+bool espMultiClose(int link){
+    if (link < 0 || link >= MULTI_MAX_LINKS || !links[link].used){
+        return false;
+    }
+
+    MultiLink *l = &links[link];
+    MultiModule *m = &modules[l->module];
+    bool wasOpen = l->open;
+
+    l->used = false;
+    l->open = false;
+    if (l->moving){
+        l->moving = false;
+        return true;
+    }
+
+    m->links[l->connId] = -1;
+    if (!wasOpen){
+        return true;
+    }
+    espSelectModule(l->module);
+    return espCloseConnection(m->fd, l->connId);
+}
+
+
+bool espMultiLinkIsOpen(int link){
+    return link >= 0 && link < MULTI_MAX_LINKS && links[link].used && links[link].open;
+}
+
+
+int espMultiLinkModule(int link){
+    if (!espMultiLinkIsOpen(link)){
+        return -1;
+    }
+    return links[link].module;
+}
+
+
+int espMultiPoll(unsigned int timeout){
+    int events = 0;
+    EspTimer deadline;
+
+    espTimerInit(&deadline, NULL, NULL);
+    espTimerStartMS(&deadline, timeout);
+
+    /* At least one round, one millisecond per module */
+    do{
+        for (uint8_t i = 0; i < numModules; i++){
+            MultiModule *m = &modules[i];
+
+            espSelectModule(i);
+            if (!m->up){
+                if (getCurrentUS() - m->downAtUS >= MULTI_RECOVER_INTERVAL_US){
+                    m->downAtUS = getCurrentUS();
+                    if (espRecover(m->fd)){
+                        m->up = true;
+                        multiRebooted(m);
+                        multiDrain(m);
+                    }
+                }
+                continue;
+            }
+
+            events += espProcessEvents(m->fd, 1);
+            if (multiRebooted(m)){
+                multiModuleDropped(i, false);
+            }
+        }
+    }while (espTimerPending(&deadline));
+    espTimerCancel(&deadline);
+
+    for (int link = 0; link < MULTI_MAX_LINKS; link++){
+        if (links[link].used && links[link].moving){
+            multiFailover(link);
+        }
+    }
+    return events;
+}
+
+
+void espMultiGetModuleStats(uint8_t module, EspMultiModuleStats *out){
+    memset(out, 0, sizeof(*out));
+    if (module >= numModules){
+        return;
+    }
+
+    MultiModule *m = &modules[module];
+    multiDrain(m);
+    out->up = m->up;
+    out->openLinks = multiOpenLinks(m);
+    out->queuedBytes = m->queuedBytes;
+    out->sendRttUS = multiSendRttUS(module);
+    out->bytesSent = m->bytesSent;
+    out->linksOpened = m->linksOpened;
+    out->drops = m->drops;
+}
+
+
+void espMultiGetStats(EspMultiStats *out){
+    *out = stats;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_MULTI_H
+#define ESP8266_MULTI_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Several modules on their own serial ports behind one link API. Build everything
+ * with -DESP_MAX_MODULES=<n>, bring every module up as usual and hand them over:
+ *
+ * for (i = 0; i < n; i++){
+ *     espSelectModule(i);
+ *     espDriverSetArena(arenas[i], ESP_ARENA_SIZE);   // not needed for module 0
+ *     espDriverInit(fds[i]);
+ *     espWifiConnect(fds[i], ssid, pass);
+ * }
+ * espMultiInit(fds, n, &appHandlers);
+ * int link = espMultiOpen(TCP_MODE, "192.168.0.1", 80, 0);
+ * espMultiSend(link, data, len);
+ * espMultiPoll(10);
+ *
+ * A new link goes to the module that would send its data first: the bytes it
+ * was given recently and is still draining through its UART, plus its measured
+ * SEND time for every link already open there. When a module drops (it restarts or stops
+ * answering) its links are opened again on the others and the application is
+ * told through onFailover. Event handlers get logical link ids.
+********************************************/
+
+#define MULTI_MAX_LINKS (ESP_MAX_MODULES * NUM_LINKS)
+#define MULTI_HOST_SIZE 64
+/* Default UART speed used to turn queued bytes into time */
+#define MULTI_DEFAULT_BAUD 115200
+
+typedef struct{
+    void *ctx;
+    void (*onConnect)(void *ctx, int link);
+    /* The remote end closed the link */
+    void (*onClose)(void *ctx, int link);
+    void (*onData)(void *ctx, int link, uint32_t offset, const uint8_t *data, uint32_t len, uint32_t frameLength);
+    /* The link moved to another module, data in flight on the old one is lost */
+    void (*onFailover)(void *ctx, int link, uint8_t fromModule, uint8_t toModule);
+}EspMultiHandlers;
+
+typedef struct{
+    bool up;
+    uint8_t openLinks;
+    /* Bytes sent recently, decaying, drained at the module baud rate */
+    uint32_t queuedBytes;
+    uint32_t sendRttUS;
+    uint64_t bytesSent;
+    uint32_t linksOpened;
+    uint32_t drops;
+}EspMultiModuleStats;
+
+typedef struct{
+    uint32_t opens;
+    uint32_t failovers;
+    /* Links lost because no module could take them */
+    uint32_t failoverFailures;
+}EspMultiStats;
+
+/* The modules must be initialized, module i is driven through fds[i] */
+bool espMultiInit(const int *fds, uint8_t numModules, const EspMultiHandlers *handlers);
+/* UART speed of a module, MULTI_DEFAULT_BAUD if not set */
+void espMultiSetBaud(uint8_t module, uint32_t baud);
+/* TCP_MODE or SSL_MODE, keepAlive in seconds for SSL. Returns the logical link or -1 */
+int espMultiOpen(ProtocolMode type, const char *host, uint16_t port, uint16_t keepAlive);
+bool espMultiSend(int link, const char *data, int len);
+bool espMultiClose(int link);
+bool espMultiLinkIsOpen(int link);
+/* Module currently carrying the link, -1 if none */
+int espMultiLinkModule(int link);
+/* Processes every module for timeout ms, moves the links of dropped modules. Returns events dispatched */
+int espMultiPoll(unsigned int timeout);
+void espMultiGetModuleStats(uint8_t module, EspMultiModuleStats *stats);
+void espMultiGetStats(EspMultiStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_MULTI_H
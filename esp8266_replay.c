@@ -0,0 +1,506 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+uint32_t getCurrentMS(void);
+uint32_t getCurrentUS(void);
+
+typedef struct{
+    char dir;
+    uint32_t timestampMS;
+    uint32_t offset;
+    uint32_t len;
+}ReplayRecord;
+
+
+typedef struct{
+    ReplayRecord *records;
+    uint32_t numRecords;
+    uint8_t *payload;
+    uint32_t payloadLen;
+
+    /*
+    * Reads and writes are independent streams, each one has its own cursor.
+    * An inbound record is only delivered once every outbound record captured
+    * before it has been written by the driver.
+    */
+    uint32_t readRecord;
+    uint32_t readPos;
+    uint32_t writeRecord;
+    uint32_t writePos;
+
+    EspReplayStats stats;
+}ReplaySession;
+
+/* Indexed by fd, all of them share the clock */
+static ReplaySession sessions[REPLAY_MAX_SESSIONS];
+
+static EspReplayMode replayMode = REPLAY_FAST;
+static uint32_t virtualMS = 0;
+static struct timespec wallStart;
+static struct timespec cpuStart;
+
+
+static double timespecDiff(const struct timespec *end, const struct timespec *start){
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1.0e9;
+}
+
+static uint64_t wallElapsedUS(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(timespecDiff(&now, &wallStart) * 1.0e6);
+}
+
+static int hexValue(char c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+* Decodes the quoted payload starting at src (just after the opening quote) into dest.
+* Returns the number of decoded bytes or -1 on syntax error.
+*/
+static int decodePayload(const char *src, uint8_t *dest, int destLen){
+    int len = 0;
+
+    while (*src != '"'){
+        uint8_t c;
+
+        if (*src == '\0' || *src == '\n' || len >= destLen){
+            return -1;
+        }
+
+        if (*src != '\\'){
+            c = *src++;
+        }
+        else{
+            src++;
+            switch (*src++){
+            case 'r': c = '\r'; break;
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case '"': c = '"'; break;
+            case '\\': c = '\\'; break;
+            case 'x':{
+                int hi = hexValue(src[0]);
+                int lo = hexValue(src[1]);
+                if (hi < 0 || lo < 0){
+                    return -1;
+                }
+                c = (uint8_t)((hi << 4) | lo);
+                src += 2;
+                break;
+            }
+            default:
+                return -1;
+            }
+        }
+        dest[len++] = c;
+    }
+    return len;
+}
+
+static ReplaySession *replaySession(int fd){
+    return fd >= 0 && fd < REPLAY_MAX_SESSIONS ? &sessions[fd] : NULL;
+}
+
+static bool addRecord(ReplaySession *session, char dir, uint32_t timestampMS, const uint8_t *data, uint32_t len){
+    ReplayRecord *newRecords = realloc(session->records, (session->numRecords + 1) * sizeof(ReplayRecord));
+    if (!newRecords){
+        return false;
+    }
+    session->records = newRecords;
+
+    uint8_t *newPayload = realloc(session->payload, session->payloadLen + len + 1);
+    if (!newPayload){
+        return false;
+    }
+    session->payload = newPayload;
+
+    memcpy(session->payload + session->payloadLen, data, len);
+
+    ReplayRecord *rec = &session->records[session->numRecords];
+    rec->dir = dir;
+    rec->timestampMS = timestampMS;
+    rec->offset = session->payloadLen;
+    rec->len = len;
+
+    session->numRecords++;
+    session->payloadLen += len;
+    return true;
+}
+
+static uint32_t nextRecord(const ReplaySession *session, uint32_t idx, char dir){
+    while (idx < session->numRecords && session->records[idx].dir != dir){
+        idx++;
+    }
+    return idx;
+}
+
+static void rewindSession(ReplaySession *session){
+    session->readRecord = nextRecord(session, 0, CAPTURE_FROM_MODULE);
+    session->readPos = 0;
+    session->writeRecord = nextRecord(session, 0, CAPTURE_TO_MODULE);
+    session->writePos = 0;
+    memset(&session->stats, 0, sizeof(session->stats));
+}
+
+static void closeSession(ReplaySession *session){
+    free(session->records);
+    free(session->payload);
+    memset(session, 0, sizeof(*session));
+}
+
+static void startClock(EspReplayMode mode){
+    replayMode = mode;
+    virtualMS = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStart);
+}
+
+static bool parseLine(ReplaySession *session, const char *line, int lineNum){
+    static uint8_t decoded[REPLAY_MAX_RECORD_SIZE];
+
+    while (*line == ' ' || *line == '\t'){
+        line++;
+    }
+
+    if (*line == '#' || *line == '\r' || *line == '\n' || *line == '\0'){
+        return true;
+    }
+
+    char dir = *line;
+    unsigned long timestampMS;
+    char *end;
+
+    if (dir != CAPTURE_FROM_MODULE && dir != CAPTURE_TO_MODULE){
+        printf("[replay]Line %d: unknown direction '%c'\n", lineNum, dir);
+        return false;
+    }
+
+    timestampMS = strtoul(line + 1, &end, 10);
+    while (*end == ' ' || *end == '\t'){
+        end++;
+    }
+
+    if (end == line + 1 || *end != '"'){
+        printf("[replay]Line %d: expected timestamp and quoted payload\n", lineNum);
+        return false;
+    }
+
+    int len = decodePayload(end + 1, decoded, sizeof(decoded));
+    if (len < 0){
+        printf("[replay]Line %d: bad payload\n", lineNum);
+        return false;
+    }
+
+    return addRecord(session, dir, timestampMS, decoded, len);
+}
+
+static bool loadCapture(ReplaySession *session, const char *capture){
+    int lineNum = 1;
+    const char *line = capture;
+
+    closeSession(session);
+
+    while (*line){
+        if (!parseLine(session, line, lineNum)){
+            closeSession(session);
+            return false;
+        }
+
+        const char *next = strchr(line, '\n');
+        if (!next){
+            break;
+        }
+        line = next + 1;
+        lineNum++;
+    }
+
+    rewindSession(session);
+    return true;
+}
+
+
+bool espReplayLoad(const char *capture, EspReplayMode mode){
+    espReplayClose();
+
+    if (!loadCapture(&sessions[REPLAY_FD], capture)){
+        return false;
+    }
+    startClock(mode);
+    return true;
+}
+
+
+bool espReplayLoadSession(int fd, const char *capture){
+    ReplaySession *session = replaySession(fd);
+
+    if (!session || fd == REPLAY_FD){
+        printf("[replay]fd %d is not an extra session\n", fd);
+        return false;
+    }
+    return loadCapture(session, capture);
+}
+
+
+bool espReplayOpen(const char *path, EspReplayMode mode){
+    FILE *file = fopen(path, "r");
+    if (!file){
+        printf("[replay]Cannot open %s\n", path);
+        return false;
+    }
+
+    espReplayClose();
+
+    /* Worst case line is every payload byte escaped as \xHH */
+    static char line[REPLAY_MAX_RECORD_SIZE * 4 + 64];
+    int lineNum = 1;
+    bool ok = true;
+
+    ReplaySession *session = &sessions[REPLAY_FD];
+    while (ok && fgets(line, sizeof(line), file)){
+        ok = parseLine(session, line, lineNum++);
+    }
+    fclose(file);
+
+    if (!ok){
+        espReplayClose();
+        return false;
+    }
+
+    rewindSession(session);
+    startClock(mode);
+    return true;
+}
+
+
+void espReplayClose(void){
+    for (int fd = 0; fd < REPLAY_MAX_SESSIONS; fd++){
+        closeSession(&sessions[fd]);
+    }
+}
+
+
+bool espReplaySessionDone(int fd){
+    const ReplaySession *session = replaySession(fd);
+    return !session || (session->readRecord >= session->numRecords && session->writeRecord >= session->numRecords);
+}
+
+
+bool espReplayDone(void){
+    for (int fd = 0; fd < REPLAY_MAX_SESSIONS; fd++){
+        if (!espReplaySessionDone(fd)){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void sessionStats(ReplaySession *session, EspReplayStats *out){
+    EspReplayStats *stats = &session->stats;
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    uint32_t first = session->readRecord < session->writeRecord ? session->readRecord : session->writeRecord;
+    stats->recordsLeft = 0;
+    for (uint32_t i = first; i < session->numRecords; i++){
+        if ((session->records[i].dir == CAPTURE_FROM_MODULE && i >= session->readRecord) ||
+            (session->records[i].dir == CAPTURE_TO_MODULE && i >= session->writeRecord)){
+            stats->recordsLeft++;
+        }
+    }
+    stats->sessionMS = getCurrentMS();
+    stats->cpuSeconds = timespecDiff(&now, &cpuStart);
+    stats->parseMBps = 0;
+    if (stats->cpuSeconds > 0){
+        stats->parseMBps = stats->bytesFed / stats->cpuSeconds / 1.0e6;
+    }
+
+    *out = *stats;
+}
+
+
+bool espReplayGetSessionStats(int fd, EspReplayStats *out){
+    ReplaySession *session = replaySession(fd);
+    if (!session){
+        return false;
+    }
+    sessionStats(session, out);
+    return true;
+}
+
+
+void espReplayGetStats(EspReplayStats *out){
+    EspReplayStats one;
+
+    sessionStats(&sessions[REPLAY_FD], out);
+    for (int fd = REPLAY_FD + 1; fd < REPLAY_MAX_SESSIONS; fd++){
+        sessionStats(&sessions[fd], &one);
+        out->bytesFed += one.bytesFed;
+        out->bytesChecked += one.bytesChecked;
+        out->mismatches += one.mismatches;
+        out->recordsLeft += one.recordsLeft;
+    }
+    if (out->cpuSeconds > 0){
+        out->parseMBps = out->bytesFed / out->cpuSeconds / 1.0e6;
+    }
+}
+
+
+void espReplayPrintStats(void){
+    EspReplayStats s;
+    espReplayGetStats(&s);
+
+    printf("[replay]fed %llu bytes, checked %llu bytes, %u mismatches, %u records left\n",
+           (unsigned long long)s.bytesFed, (unsigned long long)s.bytesChecked, s.mismatches, s.recordsLeft);
+    printf("[replay]session %u ms, cpu %.6f s, parse %.2f MB/s\n", s.sessionMS, s.cpuSeconds, s.parseMBps);
+}
+
+
+/* Driver backend -----------------------------------------------------------*/
+
+uint32_t getCurrentMS(void){
+    if (replayMode == REPLAY_REALTIME){
+        return (uint32_t)(wallElapsedUS() / 1000);
+    }
+    return virtualMS;
+}
+
+uint32_t getCurrentUS(void){
+    if (replayMode == REPLAY_REALTIME){
+        return (uint32_t)wallElapsedUS();
+    }
+    return virtualMS * 1000u;
+}
+
+void delayMS(int ms){
+    if (replayMode == REPLAY_REALTIME){
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    else{
+        virtualMS += ms;
+    }
+}
+
+static void advanceToTimestamp(uint32_t timestampMS){
+    if (replayMode == REPLAY_FAST && (int32_t)(timestampMS - virtualMS) > 0){
+        virtualMS = timestampMS;
+    }
+}
+
+void espPrintln(int fd, const char *buf, int len){
+    ReplaySession *session = replaySession(fd);
+    int checked = 0;
+    bool mismatch = false;
+
+    if (!session){
+        printf("[replay]Write to unknown fd %d\n", fd);
+        return;
+    }
+
+    while (checked < len && session->writeRecord < session->numRecords){
+        const ReplayRecord *rec = &session->records[session->writeRecord];
+        uint32_t toCompare = rec->len - session->writePos;
+
+        if (toCompare > (uint32_t)(len - checked)){
+            toCompare = len - checked;
+        }
+
+        advanceToTimestamp(rec->timestampMS);
+
+        if (memcmp(session->payload + rec->offset + session->writePos, buf + checked, toCompare) != 0){
+            mismatch = true;
+        }
+
+        checked += toCompare;
+        session->writePos += toCompare;
+        if (session->writePos == rec->len){
+            session->writeRecord = nextRecord(session, session->writeRecord + 1, CAPTURE_TO_MODULE);
+            session->writePos = 0;
+        }
+    }
+
+    session->stats.bytesChecked += checked;
+
+    /* Either the bytes differ or the driver wrote more than the capture has */
+    if (mismatch || checked < len){
+        session->stats.mismatches++;
+        /* Printed as a capture record, ready to be pasted into the session */
+        printf("[replay]Unexpected write before record %u:\n", session->writeRecord);
+        espCaptureWrite(stdout, CAPTURE_TO_MODULE, getCurrentMS(), buf, len);
+    }
+}
+
+int espRead(int fd, void *buf, size_t nbytes){
+    ReplaySession *session = replaySession(fd);
+
+    /* Nothing to deliver until the driver writes what the module answers to */
+    if (!session || session->readRecord >= session->numRecords || session->writeRecord < session->readRecord){
+        /* Let the driver timeouts run */
+        if (replayMode == REPLAY_FAST){
+            virtualMS++;
+        }
+        return 0;
+    }
+
+    const ReplayRecord *rec = &session->records[session->readRecord];
+
+    if (replayMode == REPLAY_REALTIME && (int32_t)(getCurrentMS() - rec->timestampMS) < 0){
+        return 0;
+    }
+    advanceToTimestamp(rec->timestampMS);
+
+    uint32_t available = rec->len - session->readPos;
+    if (nbytes > available){
+        nbytes = available;
+    }
+
+    memcpy(buf, session->payload + rec->offset + session->readPos, nbytes);
+    session->readPos += nbytes;
+    if (session->readPos == rec->len){
+        session->readRecord = nextRecord(session, session->readRecord + 1, CAPTURE_FROM_MODULE);
+        session->readPos = 0;
+    }
+
+    session->stats.bytesFed += nbytes;
+    return nbytes;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_REPLAY_H
+#define ESP8266_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp8266_capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Link esp8266_replay.c instead of esp8266_linux.c / esp8266_embedded.c.
+ * It implements espRead, espPrintln, getCurrentMS, getCurrentUS and delayMS on top of a
+ * recorded session, so the driver can run without hardware.
+ *
+ * espReplayOpen("cwlap_office.cap", REPLAY_FAST);
+ * espDriverInit(REPLAY_FD);
+ * ...
+ * espReplayPrintStats();
+ * espReplayClose();
+ *
+ * Link esp8266_capture.c too, esp8266_capture.h describes the capture file format.
+********************************************/
+
+#define REPLAY_FD 0
+/* fds REPLAY_FD to REPLAY_MAX_SESSIONS-1, one emulated module each */
+#define REPLAY_MAX_SESSIONS 8
+
+/* Longest record payload accepted when loading a capture */
+#define REPLAY_MAX_RECORD_SIZE 4096
+
+typedef enum{
+        /* Feed recorded bytes as fast as the driver consumes them, time is virtual */
+        REPLAY_FAST,
+        /* Feed recorded bytes respecting the original timing */
+        REPLAY_REALTIME
+}EspReplayMode;
+
+typedef struct{
+    /* module -> host bytes handed to espRead() */
+    uint64_t bytesFed;
+    /* host -> module bytes compared against the capture */
+    uint64_t bytesChecked;
+    /* espPrintln() calls whose bytes differed from the capture */
+    uint32_t mismatches;
+    /* Records not consumed yet */
+    uint32_t recordsLeft;
+    /* Virtual (REPLAY_FAST) or wall (REPLAY_REALTIME) session time */
+    uint32_t sessionMS;
+    /* CPU time spent since espReplayOpen() */
+    double cpuSeconds;
+    /* bytesFed / cpuSeconds */
+    double parseMBps;
+}EspReplayStats;
+
+bool espReplayOpen(const char *path, EspReplayMode mode);
+bool espReplayLoad(const char *capture, EspReplayMode mode);
+void espReplayClose(void);
+/* Every session done */
+bool espReplayDone(void);
+/* Totals of every session */
+void espReplayGetStats(EspReplayStats *stats);
+void espReplayPrintStats(void);
+
+/*
+* More emulated modules, each one on its own fd next to REPLAY_FD and on the
+* same clock. Load them after espReplayOpen()/espReplayLoad(), which close them.
+*/
+bool espReplayLoadSession(int fd, const char *capture);
+bool espReplaySessionDone(int fd);
+bool espReplayGetSessionStats(int fd, EspReplayStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_REPLAY_H
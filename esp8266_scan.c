@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_scan.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+
+static uint32_t scanScalar(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                           uint32_t *positions, uint32_t maxPositions){
+    uint32_t found = 0;
+
+    for (uint32_t i = 0; i < len && found < maxPositions; i++){
+        for (uint32_t d = 0; d < numDelims; d++){
+            if (buf[i] == delims[d]){
+                positions[found++] = i;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+/* Appends the set bits of mask as offsets from base, lowest bit first */
+static inline uint32_t emitMask(uint64_t mask, uint32_t base, uint32_t shift,
+                                uint32_t *positions, uint32_t found, uint32_t maxPositions){
+    while (mask && found < maxPositions){
+        uint32_t bit = __builtin_ctzll(mask);
+        positions[found++] = base + (bit >> shift);
+        /* Clear every bit belonging to this byte */
+        mask &= ~(((1ULL << (1u << shift)) - 1) << (bit & ~((1u << shift) - 1)));
+    }
+    return found;
+}
+
+
+#ifdef SCAN_X86
+
+#ifndef __SSE2__
+__attribute__((target("sse2")))
+#endif
+static uint32_t scanSSE2(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                         uint32_t *positions, uint32_t maxPositions){
+    __m128i d[SCAN_MAX_DELIMS];
+    uint32_t found = 0;
+    uint32_t i = 0;
+
+    for (uint32_t k = 0; k < numDelims; k++){
+        d[k] = _mm_set1_epi8((char)delims[k]);
+    }
+
+    for (; i + 16 <= len && found < maxPositions; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i m = _mm_cmpeq_epi8(v, d[0]);
+        for (uint32_t k = 1; k < numDelims; k++){
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, d[k]));
+        }
+        found = emitMask((uint32_t)_mm_movemask_epi8(m), i, 0, positions, found, maxPositions);
+    }
+
+    if (found < maxPositions && i < len){
+        uint32_t n = scanScalar(buf + i, len - i, delims, numDelims, positions + found, maxPositions - found);
+        for (uint32_t k = 0; k < n; k++){
+            positions[found + k] += i;
+        }
+        found += n;
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+static uint32_t scanAVX2(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                         uint32_t *positions, uint32_t maxPositions){
+    __m256i d[SCAN_MAX_DELIMS];
+    uint32_t found = 0;
+    uint32_t i = 0;
+
+    for (uint32_t k = 0; k < numDelims; k++){
+        d[k] = _mm256_set1_epi8((char)delims[k]);
+    }
+
+    for (; i + 32 <= len && found < maxPositions; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i m = _mm256_cmpeq_epi8(v, d[0]);
+        for (uint32_t k = 1; k < numDelims; k++){
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, d[k]));
+        }
+        found = emitMask((uint32_t)_mm256_movemask_epi8(m), i, 0, positions, found, maxPositions);
+    }
+
+    /* Remaining 0..31 bytes */
+    if (found < maxPositions && i < len){
+        uint32_t n = scanSSE2(buf + i, len - i, delims, numDelims, positions + found, maxPositions - found);
+        for (uint32_t k = 0; k < n; k++){
+            positions[found + k] += i;
+        }
+        found += n;
+    }
+    return found;
+}
+
+#endif /* SCAN_X86 */
+
+
+#ifdef SCAN_NEON
+
+static uint32_t scanNEON(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                         uint32_t *positions, uint32_t maxPositions){
+    uint8x16_t d[SCAN_MAX_DELIMS];
+    uint32_t found = 0;
+    uint32_t i = 0;
+
+    for (uint32_t k = 0; k < numDelims; k++){
+        d[k] = vdupq_n_u8(delims[k]);
+    }
+
+    for (; i + 16 <= len && found < maxPositions; i += 16){
+        uint8x16_t v = vld1q_u8(buf + i);
+        uint8x16_t m = vceqq_u8(v, d[0]);
+        for (uint32_t k = 1; k < numDelims; k++){
+            m = vorrq_u8(m, vceqq_u8(v, d[k]));
+        }
+        /* No movemask on NEON: narrow each byte to a nibble, 4 bits per input byte */
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        found = emitMask(mask, i, 2, positions, found, maxPositions);
+    }
+
+    if (found < maxPositions && i < len){
+        uint32_t n = scanScalar(buf + i, len - i, delims, numDelims, positions + found, maxPositions - found);
+        for (uint32_t k = 0; k < n; k++){
+            positions[found + k] += i;
+        }
+        found += n;
+    }
+    return found;
+}
+
+#endif /* SCAN_NEON */
+
+
+static const EspScanImpl scanImpls[] =
+{
+    {"scalar", scanScalar},
+#ifdef SCAN_X86
+    {"sse2", scanSSE2},
+    {"avx2", scanAVX2},
+#endif
+#ifdef SCAN_NEON
+    {"neon", scanNEON},
+#endif
+};
+
+static uint32_t numScanImpls = 0;
+static EspScanFunc selectedScan = NULL;
+static const char *selectedName = NULL;
+
+static void selectImplementation(void){
+    numScanImpls = sizeof(scanImpls)/sizeof(scanImpls[0]);
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2")){
+        /* avx2 is the last x86 entry */
+        numScanImpls--;
+        if (!__builtin_cpu_supports("sse2")){
+            /* sse2 the one before it, i386 CPUs without it keep the scalar scan */
+            numScanImpls--;
+        }
+    }
+#endif
+
+    selectedScan = scanImpls[numScanImpls-1].scan;
+    selectedName = scanImpls[numScanImpls-1].name;
+}
+
+
+uint32_t espScanDelims(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                       uint32_t *positions, uint32_t maxPositions){
+    if (!selectedScan){
+        selectImplementation();
+    }
+    if (numDelims == 0 || numDelims > SCAN_MAX_DELIMS || maxPositions == 0){
+        return 0;
+    }
+    return selectedScan(buf, len, delims, numDelims, positions, maxPositions);
+}
+
+
+uint32_t espScanGetImplementations(const EspScanImpl **impls){
+    if (!selectedScan){
+        selectImplementation();
+    }
+    *impls = scanImpls;
+    return numScanImpls;
+}
+
+
+const char *espScanSelectedName(void){
+    if (!selectedScan){
+        selectImplementation();
+    }
+    return selectedName;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_SCAN_H
+#define ESP8266_SCAN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Finds every byte of buf that is one of the delimiters, e.g.
+ *
+ * uint32_t pos[64];
+ * uint32_t n = espScanDelims(chunk, len, (const uint8_t*)"\n+:>", 4, pos, 64);
+ *
+ * pos[0..n-1] are the delimiter offsets in increasing order. Scanning stops
+ * once maxPositions offsets have been found, so maxPositions=1 finds the first.
+ *
+ * The fastest implementation available on the CPU is picked on first use:
+ * AVX2 or SSE2 on x86, NEON on ARM (Raspberry Pi) and plain C elsewhere
+ * (Cortex-M3).
+********************************************/
+
+#define SCAN_MAX_DELIMS 4
+
+typedef uint32_t (*EspScanFunc)(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                                uint32_t *positions, uint32_t maxPositions);
+
+typedef struct{
+    const char *name;
+    EspScanFunc scan;
+}EspScanImpl;
+
+uint32_t espScanDelims(const uint8_t *buf, uint32_t len, const uint8_t *delims, uint32_t numDelims,
+                       uint32_t *positions, uint32_t maxPositions);
+
+/* Implementations usable on this CPU, scalar first. Returns how many. */
+uint32_t espScanGetImplementations(const EspScanImpl **impls);
+
+/* Name of the implementation espScanDelims() dispatches to */
+const char *espScanSelectedName(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_SCAN_H
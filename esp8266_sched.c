@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_sched.h"
+
+#include <stddef.h>
+#include <string.h>
+
+
+extern uint32_t getCurrentUS (void);
+
+
+typedef struct{
+    EspTxFrame *head;
+    EspTxFrame *tail;
+    EspTxClass cls;
+    uint32_t quantum;
+    /* DRR credit in bytes */
+    uint32_t deficit;
+    /* The quantum of the current round was added */
+    bool visited;
+    EspTxLinkStats stats;
+}TxLink;
+
+static TxLink links[NUM_LINKS] = {
+    [0 ... NUM_LINKS-1] = {NULL, NULL, ESP_TX_NORMAL, TX_SEGMENT_NORMAL, 0, false, {0}}
+};
+
+/* Link whose turn it is, per class */
+static uint8_t cursor[NUM_TX_CLASSES];
+
+static const uint32_t segmentSize[NUM_TX_CLASSES] = {MAX_SEND_TCP_DATA_SIZE, TX_SEGMENT_NORMAL, TX_SEGMENT_BULK};
+
+static bool defaultSend(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len){
+    return espSendTCPData(fd, conn_id, (const char*)data, len);
+}
+
+static bool (*sender)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len) = defaultSend;
+static void *senderCtx = NULL;
+
+
+void espSchedSetSender(bool (*send)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len), void *ctx){
+    sender = send ? send : defaultSend;
+    senderCtx = ctx;
+}
+
+
+void espSchedSetLink(uint8_t conn_id, EspTxClass cls, uint32_t quantum){
+    if (conn_id >= NUM_LINKS || cls >= NUM_TX_CLASSES){
+        return;
+    }
+    /* Every visit of the link must be worth at least one segment */
+    if (quantum < segmentSize[cls]){
+        quantum = segmentSize[cls];
+    }
+    links[conn_id].cls = cls;
+    links[conn_id].quantum = quantum;
+    links[conn_id].deficit = 0;
+    links[conn_id].visited = false;
+}
+
+
+bool espSchedEnqueue(uint8_t conn_id, EspTxFrame *frame, const uint8_t *data, uint32_t length,
+                     void (*onDone)(void *ctx, EspTxFrame *frame, bool ok), void *ctx){
+    if (conn_id >= NUM_LINKS || length == 0){
+        return false;
+    }
+    TxLink *link = &links[conn_id];
+
+    frame->next = NULL;
+    frame->data = data;
+    frame->length = length;
+    frame->sent = 0;
+    frame->queuedUS = getCurrentUS();
+    frame->onDone = onDone;
+    frame->ctx = ctx;
+
+    if (link->tail){
+        link->tail->next = frame;
+    }
+    else{
+        link->head = frame;
+    }
+    link->tail = frame;
+    return true;
+}
+
+
+static void frameDone(TxLink *link, bool ok){
+    EspTxFrame *frame = link->head;
+
+    link->head = frame->next;
+    if (!link->head){
+        link->tail = NULL;
+    }
+    frame->next = NULL;
+
+    if (ok){
+        link->stats.totalCompletionUS += getCurrentUS() - frame->queuedUS;
+    }
+    else{
+        link->stats.failed++;
+    }
+    if (frame->onDone){
+        frame->onDone(frame->ctx, frame, ok);
+    }
+}
+
+
+/* DRR pick within a class. Returns the link or -1 if none has data */
+static int pickLink(EspTxClass cls, uint32_t *segLen){
+    /* One full turn to add the quanta plus the link we started on */
+    for (uint32_t tries = 0; tries <= NUM_LINKS; tries++){
+        uint8_t conn_id = cursor[cls];
+        TxLink *link = &links[conn_id];
+
+        if (link->cls == cls){
+            if (link->head){
+                if (!link->visited){
+                    link->deficit += link->quantum;
+                    link->visited = true;
+                }
+                uint32_t len = link->head->length - link->head->sent;
+                if (len > segmentSize[cls]){
+                    len = segmentSize[cls];
+                }
+                if (len <= link->deficit){
+                    link->deficit -= len;
+                    *segLen = len;
+                    return conn_id;
+                }
+            }
+            else{
+                /* No credit is kept while idle */
+                link->deficit = 0;
+            }
+            link->visited = false;
+        }
+        cursor[cls] = (conn_id + 1) % NUM_LINKS;
+    }
+    return -1;
+}
+
+
+uint32_t espSchedRun(int fd, uint32_t maxSegments){
+    uint32_t segments = 0;
+
+    while (segments < maxSegments){
+        int conn_id = -1;
+        uint32_t len = 0;
+
+        for (int cls = 0; cls < NUM_TX_CLASSES && conn_id < 0; cls++){
+            conn_id = pickLink(cls, &len);
+        }
+        if (conn_id < 0){
+            break;
+        }
+
+        TxLink *link = &links[conn_id];
+        EspTxFrame *frame = link->head;
+
+        if (frame->sent == 0){
+            uint32_t delay = getCurrentUS() - frame->queuedUS;
+            link->stats.lastDelayUS = delay;
+            link->stats.totalDelayUS += delay;
+            if (delay > link->stats.maxDelayUS){
+                link->stats.maxDelayUS = delay;
+            }
+            link->stats.frames++;
+        }
+
+        segments++;
+        if (!sender(senderCtx, fd, conn_id, frame->data + frame->sent, len)){
+            frameDone(link, false);
+            continue;
+        }
+        frame->sent += len;
+        link->stats.segments++;
+        link->stats.bytes += len;
+
+        if (frame->sent == frame->length){
+            frameDone(link, true);
+        }
+    }
+    return segments;
+}
+
+
+void espSchedCancel(uint8_t conn_id){
+    if (conn_id >= NUM_LINKS){
+        return;
+    }
+    while (links[conn_id].head){
+        frameDone(&links[conn_id], false);
+    }
+    links[conn_id].deficit = 0;
+    links[conn_id].visited = false;
+}
+
+
+bool espSchedIdle(void){
+    for (uint8_t conn_id = 0; conn_id < NUM_LINKS; conn_id++){
+        if (links[conn_id].head){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+uint32_t espSchedQueued(uint8_t conn_id){
+    uint32_t queued = 0;
+
+    if (conn_id < NUM_LINKS){
+        for (EspTxFrame *frame = links[conn_id].head; frame; frame = frame->next){
+            queued += frame->length - frame->sent;
+        }
+    }
+    return queued;
+}
+
+
+void espSchedGetStats(uint8_t conn_id, EspTxLinkStats *stats){
+    if (conn_id < NUM_LINKS){
+        *stats = links[conn_id].stats;
+    }
+}
+
+
+void espSchedResetStats(void){
+    for (uint8_t conn_id = 0; conn_id < NUM_LINKS; conn_id++){
+        memset(&links[conn_id].stats, 0, sizeof(links[conn_id].stats));
+    }
+}
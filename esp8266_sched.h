@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_SCHED_H
+#define ESP8266_SCHED_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Transmit scheduler for CIPMUX links. Instead of one espSendTCPData() holding the
+ * UART for a whole buffer, frames are queued per link and sent one CIPSEND segment
+ * at a time: strict priority between classes, deficit round robin between the links
+ * of a class. Bulk segments are short, so a control frame waits for one segment at most.
+ *
+ * espSchedSetLink(1, ESP_TX_HIGH, 0);                 // control link, default quantum
+ * espSchedSetLink(0, ESP_TX_BULK, 0);                 // upload
+ *
+ * static EspTxFrame upload;
+ * espSchedEnqueue(0, &upload, image, imageLen, onUploadDone, NULL);
+ * ...
+ * espSchedRun(fd, 1);                                 // one segment per call, from the main loop
+ *
+ * Frames and their data are owned by the caller until onDone. The scheduler only
+ * sends from espSchedRun(), never from a driver event handler.
+********************************************/
+
+typedef enum{
+    /* Control and latency critical messages, sent whole */
+    ESP_TX_HIGH,
+    ESP_TX_NORMAL,
+    /* Uploads, sent in the smallest segments */
+    ESP_TX_BULK,
+    NUM_TX_CLASSES
+}EspTxClass;
+
+/* Segment size of the NORMAL and BULK classes, HIGH frames go up to MAX_SEND_TCP_DATA_SIZE */
+#define TX_SEGMENT_NORMAL 1024
+#define TX_SEGMENT_BULK 512
+
+typedef struct EspTxFrame{
+    struct EspTxFrame *next;
+    const uint8_t *data;
+    uint32_t length;
+    /* Bytes already sent */
+    uint32_t sent;
+    /* getCurrentUS() when queued */
+    uint32_t queuedUS;
+    /* ok is false if a segment failed, the rest of the frame was not sent */
+    void (*onDone)(void *ctx, struct EspTxFrame *frame, bool ok);
+    void *ctx;
+}EspTxFrame;
+
+typedef struct{
+    uint32_t frames;
+    uint32_t failed;
+    uint32_t segments;
+    uint64_t bytes;
+    /* Queueing delay, from espSchedEnqueue() to the first segment on the UART */
+    uint32_t lastDelayUS;
+    uint32_t maxDelayUS;
+    uint64_t totalDelayUS;
+    /* From espSchedEnqueue() to the last SEND OK */
+    uint64_t totalCompletionUS;
+}EspTxLinkStats;
+
+/*
+* Class of a link and its DRR quantum in bytes per round, 0 for the default
+* (the segment size of the class). Links start in ESP_TX_NORMAL.
+*/
+void espSchedSetLink(uint8_t conn_id, EspTxClass cls, uint32_t quantum);
+bool espSchedEnqueue(uint8_t conn_id, EspTxFrame *frame, const uint8_t *data, uint32_t length,
+                     void (*onDone)(void *ctx, EspTxFrame *frame, bool ok), void *ctx);
+/* Sends up to maxSegments segments. Returns how many were sent */
+uint32_t espSchedRun(int fd, uint32_t maxSegments);
+/* Fails every frame queued on the link, e.g. after it closed */
+void espSchedCancel(uint8_t conn_id);
+bool espSchedIdle(void);
+/* Bytes queued on the link and not sent yet */
+uint32_t espSchedQueued(uint8_t conn_id);
+void espSchedGetStats(uint8_t conn_id, EspTxLinkStats *stats);
+void espSchedResetStats(void);
+
+/* How a segment goes out, espSendTCPData() unless set. NULL restores it */
+void espSchedSetSender(bool (*send)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_SCHED_H
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_timer.h"
+
+#include <stddef.h>
+
+
+/* Monotonic microseconds, provided by the backend */
+extern uint32_t getCurrentUS (void);
+
+
+#define SLOTS (1u << TIMER_LEVEL_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define TICK_US (1u << TIMER_TICK_SHIFT)
+
+static EspTimer *wheel[TIMER_LEVELS][SLOTS];
+/* One bit per non empty slot */
+static uint64_t occupied[TIMER_LEVELS];
+
+/* Next tick to process and the time it starts at */
+static uint32_t wheelTick = 0;
+static uint32_t wheelUS = 0;
+static bool wheelStarted = false;
+
+static uint32_t numPending = 0;
+
+
+static void wheelStart(void){
+    if (!wheelStarted){
+        wheelUS = getCurrentUS();
+        wheelStarted = true;
+    }
+}
+
+static inline uint32_t slotIndex(uint32_t tick, int level){
+    return (tick >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK;
+}
+
+/* Links the timer into the slot its expiresTick belongs to, relative to wheelTick */
+static void place(EspTimer *timer){
+    uint32_t delta = timer->expiresTick - wheelTick;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1u << ((level + 1) * TIMER_LEVEL_BITS))){
+        level++;
+    }
+
+    uint32_t idx = slotIndex(timer->expiresTick, level);
+    EspTimer **slot = &wheel[level][idx];
+
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot){
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    occupied[level] |= 1ULL << idx;
+}
+
+static void unlink(EspTimer *timer){
+    int level = 0;
+    uint32_t idx;
+
+    /* Find the slot back from expiresTick, same rule as place() but from the head pointer */
+    if (timer->prev){
+        timer->prev->next = timer->next;
+    }
+    else{
+        for (level = 0; level < TIMER_LEVELS; level++){
+            idx = slotIndex(timer->expiresTick, level);
+            if (wheel[level][idx] == timer){
+                wheel[level][idx] = timer->next;
+                if (!timer->next){
+                    occupied[level] &= ~(1ULL << idx);
+                }
+                break;
+            }
+        }
+    }
+    if (timer->next){
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+}
+
+static EspTimer *detachSlot(int level, uint32_t idx){
+    EspTimer *list = wheel[level][idx];
+    wheel[level][idx] = NULL;
+    occupied[level] &= ~(1ULL << idx);
+    return list;
+}
+
+/* Moves the timers of a higher level slot down, now that they are closer */
+static void cascade(int level, uint32_t idx){
+    EspTimer *timer = detachSlot(level, idx);
+
+    while (timer){
+        EspTimer *next = timer->next;
+        place(timer);
+        timer = next;
+    }
+}
+
+
+void espTimerInit(EspTimer *timer, void (*callback)(void *ctx), void *ctx){
+    timer->next = timer->prev = NULL;
+    timer->deadline = 0;
+    timer->expiresTick = 0;
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timer->pending = false;
+}
+
+
+void espTimerStartAt(EspTimer *timer, uint32_t deadline){
+    wheelStart();
+    espTimerCancel(timer);
+
+    if (numPending == 0){
+        /* Nothing placed, bring an idle wheel to now or the ticks would count from a stale wheelUS */
+        wheelUS = getCurrentUS();
+    }
+
+    int32_t remainingUS = (int32_t)(deadline - wheelUS);
+    uint32_t ticks = 0;
+    if (remainingUS > 0){
+        ticks = ((uint32_t)remainingUS + TICK_US - 1) >> TIMER_TICK_SHIFT;
+    }
+
+    timer->deadline = deadline;
+    timer->expiresTick = wheelTick + ticks;
+    timer->pending = true;
+    place(timer);
+    numPending++;
+}
+
+
+void espTimerStart(EspTimer *timer, uint32_t timeoutUS){
+    if (timeoutUS > TIMER_MAX_TIMEOUT_US){
+        timeoutUS = TIMER_MAX_TIMEOUT_US;
+    }
+    espTimerStartAt(timer, getCurrentUS() + timeoutUS);
+}
+
+
+void espTimerStartMS(EspTimer *timer, uint32_t timeoutMS){
+    espTimerStart(timer, timeoutMS < TIMER_MAX_TIMEOUT_US/1000 ? timeoutMS*1000u : TIMER_MAX_TIMEOUT_US);
+}
+
+
+void espTimerCancel(EspTimer *timer){
+    if (timer->pending){
+        unlink(timer);
+        timer->pending = false;
+        numPending--;
+    }
+}
+
+
+bool espTimerPending(EspTimer *timer){
+    espTimerRun();
+    /* The wheel works in ticks, the deadline itself is exact */
+    if (timer->pending && espTimeReached(getCurrentUS(), timer->deadline)){
+        espTimerCancel(timer);
+        if (timer->callback){
+            timer->callback(timer->ctx);
+        }
+    }
+    return timer->pending;
+}
+
+
+uint32_t espTimerRemaining(const EspTimer *timer){
+    if (!timer->pending){
+        return 0;
+    }
+    int32_t remaining = (int32_t)(timer->deadline - getCurrentUS());
+    return remaining > 0 ? (uint32_t)remaining : 0;
+}
+
+
+uint32_t espTimerRun(void){
+    uint32_t fired = 0;
+    uint32_t now = getCurrentUS();
+
+    wheelStart();
+
+    while (espTimeReached(now, wheelUS)){
+        uint32_t tick = wheelTick;
+
+        if (numPending == 0){
+            /* Nothing to fire, jump straight to now */
+            uint32_t ticks = ((now - wheelUS) >> TIMER_TICK_SHIFT) + 1;
+            wheelTick += ticks;
+            wheelUS += ticks << TIMER_TICK_SHIFT;
+            break;
+        }
+
+        /* Every time a lower level wraps the next slot of the level above comes down */
+        for (int level = 1; level < TIMER_LEVELS && slotIndex(tick, level - 1) == 0; level++){
+            cascade(level, slotIndex(tick, level));
+        }
+
+        EspTimer *timer = detachSlot(0, slotIndex(tick, 0));
+
+        /* Callbacks may re-arm timers, make them relative to the next tick */
+        wheelTick++;
+        wheelUS += TICK_US;
+
+        while (timer){
+            EspTimer *next = timer->next;
+            timer->next = timer->prev = NULL;
+            timer->pending = false;
+            numPending--;
+            fired++;
+            if (timer->callback){
+                timer->callback(timer->ctx);
+            }
+            timer = next;
+        }
+    }
+
+    return fired;
+}
+
+
+/* Earliest deadline among the timers of the first non empty slot of a level */
+static bool levelNextDeadline(int level, uint32_t now, uint32_t *deadline){
+    if (!occupied[level]){
+        return false;
+    }
+
+    uint32_t current = slotIndex(wheelTick, level);
+    uint32_t first = current;
+    /* Once the lower levels moved on the current slot was already cascaded, whatever is there is one turn away */
+    if (wheelTick & ((1u << (level * TIMER_LEVEL_BITS)) - 1)){
+        first = (current + 1) & SLOT_MASK;
+    }
+    uint64_t rotated = (occupied[level] >> first) | (first ? occupied[level] << (SLOTS - first) : 0);
+    uint32_t idx = (first + __builtin_ctzll(rotated)) & SLOT_MASK;
+
+    bool found = false;
+    for (EspTimer *timer = wheel[level][idx]; timer; timer = timer->next){
+        if (!found || (int32_t)(timer->deadline - now) < (int32_t)(*deadline - now)){
+            *deadline = timer->deadline;
+            found = true;
+        }
+    }
+    return found;
+}
+
+
+bool espTimerNextDeadline(uint32_t *deadline){
+    uint32_t now = getCurrentUS();
+    bool found = false;
+
+    for (int level = 0; level < TIMER_LEVELS; level++){
+        uint32_t levelDeadline;
+        if (levelNextDeadline(level, now, &levelDeadline)){
+            if (!found || (int32_t)(levelDeadline - now) < (int32_t)(*deadline - now)){
+                *deadline = levelDeadline;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+
+uint32_t espTimerNumPending(void){
+    return numPending;
+}
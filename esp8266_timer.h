@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_TIMER_H
+#define ESP8266_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Every deadline of the driver (and of the application if it wants) is an EspTimer
+ * in one hierarchical timer wheel driven by the backend monotonic getCurrentUS().
+ *
+ * static EspTimer idle;
+ * espTimerInit(&idle, onIdle, ctx);
+ * espTimerStart(&idle, 5000000);     // 5 s from now, re-arms if already pending
+ * ...
+ * espTimerRun();                     // fires every expired timer
+ * espTimerNextDeadline(&wakeUpAt);   // sleep until then
+ *
+ * Insert and cancel are O(1). Times are 32 bit microseconds, compared wrap safe,
+ * so a timeout must be shorter than TIMER_MAX_TIMEOUT_US (about 35 minutes).
+ * Timers can live on the stack as long as they are cancelled before going out of scope.
+********************************************/
+
+/* Wheel resolution, 1<<8 = 256 us */
+#define TIMER_TICK_SHIFT 8
+/* 4 levels of 64 slots cover 2^24 ticks, the whole 32 bit microsecond range */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVELS 4
+
+#define TIMER_MAX_TIMEOUT_US 0x7FFFFFFFu
+
+typedef struct EspTimer{
+    struct EspTimer *next;
+    struct EspTimer *prev;
+    /* Absolute getCurrentUS() deadline */
+    uint32_t deadline;
+    uint32_t expiresTick;
+    void (*callback)(void *ctx);
+    void *ctx;
+    bool pending;
+}EspTimer;
+
+/* Wrap safe "a is at or after b" for getCurrentUS()/getCurrentMS() values */
+static inline bool espTimeReached(uint32_t now, uint32_t deadline){
+    return (int32_t)(now - deadline) >= 0;
+}
+
+/* callback can be NULL for deadlines that are only polled with espTimerPending() */
+void espTimerInit(EspTimer *timer, void (*callback)(void *ctx), void *ctx);
+void espTimerStart(EspTimer *timer, uint32_t timeoutUS);
+/* Millisecond timeout, clamped to TIMER_MAX_TIMEOUT_US */
+void espTimerStartMS(EspTimer *timer, uint32_t timeoutMS);
+void espTimerStartAt(EspTimer *timer, uint32_t deadline);
+void espTimerCancel(EspTimer *timer);
+/* Advances the wheel to now and tells if the timer has not expired yet */
+bool espTimerPending(EspTimer *timer);
+/* Microseconds left, 0 if expired or not started */
+uint32_t espTimerRemaining(const EspTimer *timer);
+
+/* Advances the wheel to now firing expired timers. Returns how many fired */
+uint32_t espTimerRun(void);
+/* Earliest deadline of all pending timers. Returns false if there is none */
+bool espTimerNextDeadline(uint32_t *deadline);
+uint32_t espTimerNumPending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_TIMER_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_txqueue.h"
+#include "circular_buffer.h"
+
+
+/* head moves in the interrupt, make the writer read it again every time */
+#define COMPILER_BARRIER() __asm__ volatile("" ::: "memory")
+
+static const EspUartHal *hal = NULL;
+static CircularBuffer txRing;
+
+/* Bytes handed to the DMA channel, still in the ring until it is done */
+static volatile uint32_t dmaLen = 0;
+
+static EspTxQueueStats stats;
+
+
+/* Moves what fits from the ring to the TX FIFO. Runs with the interrupt masked or inside it */
+static void txFillFifo(void)
+{
+    CircularBufferSpan spans[2];
+    uint32_t numSpans = circularBufferReadSpans(&txRing, spans);
+
+    for (uint32_t i = 0; i < numSpans; i++){
+        uint32_t taken = hal->fifoWrite(hal->ctx, spans[i].data, spans[i].len);
+        circularBufferConsume(&txRing, taken);
+        stats.bytesSent += taken;
+        if (taken < spans[i].len){
+            break;
+        }
+    }
+}
+
+
+/* Hands the first contiguous span to the DMA channel if it is idle */
+static void txStartDma(void)
+{
+    CircularBufferSpan spans[2];
+
+    if (dmaLen == 0 && circularBufferReadSpans(&txRing, spans) > 0){
+        if (hal->dmaStart(hal->ctx, spans[0].data, spans[0].len)){
+            dmaLen = spans[0].len;
+        }
+    }
+}
+
+
+/* Starts draining after a write. The interrupt is masked meanwhile so it never races the writer */
+static void txKick(void)
+{
+    hal->irqEnable(hal->ctx, false);
+    if (hal->dmaStart){
+        txStartDma();
+        hal->irqEnable(hal->ctx, true);
+    }
+    else{
+        txFillFifo();
+        hal->irqEnable(hal->ctx, !circularBufferEmpty(&txRing));
+    }
+}
+
+
+void espTxQueueInit(const EspUartHal *uartHal, uint8_t *buffer, uint32_t size)
+{
+    hal = uartHal;
+    circularBufferInit(&txRing, buffer, size);
+    dmaLen = 0;
+    memset(&stats, 0, sizeof(stats));
+    hal->irqEnable(hal->ctx, hal->dmaStart != NULL);
+}
+
+
+uint32_t espTxQueueUsed(void)
+{
+    COMPILER_BARRIER();
+    return circularBufferUsedElementsNum(&txRing);
+}
+
+
+void espTxQueueWrite(const uint8_t *data, uint32_t len)
+{
+    stats.bytesQueued += len;
+
+    while (len > 0){
+        COMPILER_BARRIER();
+        uint32_t room = circularBufferFreeElementsNum(&txRing);
+
+        if (room == 0){
+            stats.writerWaits++;
+            while (circularBufferFreeElementsNum(&txRing) == 0){
+                if (hal->wait){
+                    hal->wait(hal->ctx);
+                }
+                COMPILER_BARRIER();
+            }
+            continue;
+        }
+
+        uint32_t chunk = len < room ? len : room;
+        circularBufferPutMultiple(&txRing, data, chunk);
+        data += chunk;
+        len -= chunk;
+
+        uint32_t used = circularBufferUsedElementsNum(&txRing);
+        if (used > stats.maxUsed){
+            stats.maxUsed = used;
+        }
+        txKick();
+    }
+}
+
+
+void espTxQueueFlush(void)
+{
+    while (espTxQueueUsed() > 0){
+        if (hal->wait){
+            hal->wait(hal->ctx);
+        }
+    }
+}
+
+
+void espTxQueueOnTxEmpty(void)
+{
+    stats.interrupts++;
+    txFillFifo();
+    if (circularBufferEmpty(&txRing)){
+        hal->irqEnable(hal->ctx, false);
+    }
+}
+
+
+void espTxQueueOnDmaDone(void)
+{
+    stats.interrupts++;
+    circularBufferConsume(&txRing, dmaLen);
+    stats.bytesSent += dmaLen;
+    dmaLen = 0;
+    txStartDma();
+}
+
+
+void espTxQueueGetStats(EspTxQueueStats *out)
+{
+    *out = stats;
+}
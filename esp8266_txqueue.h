@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_TXQUEUE_H
+#define ESP8266_TXQUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Non blocking UART transmit: espPrintln() copies into a transmit ring and returns,
+ * the TX FIFO empty interrupt (or a DMA channel) drains it while the CPU does
+ * something else. A writer only waits when the ring is full.
+ *
+ * static uint8_t txBuffer[512];
+ * static const EspUartHal hal = {ctx, fifoWrite, irqEnable, NULL, NULL};
+ * espTxQueueInit(&hal, txBuffer, sizeof(txBuffer));
+ * ...
+ * void UART_IRQHandler(void){            // TX FIFO empty
+ *     espTxQueueOnTxEmpty();
+ * }
+ *
+ * With a DMA channel set dmaStart and call espTxQueueOnDmaDone() from its
+ * completion interrupt instead. Only one writer, the interrupt is the only reader.
+********************************************/
+
+/* Hardware side, a few calls every UART port has */
+typedef struct{
+    void *ctx;
+    /* Puts up to len bytes in the TX FIFO without waiting. Returns how many it took */
+    uint32_t (*fifoWrite)(void *ctx, const uint8_t *data, uint32_t len);
+    /* Masks or unmasks the interrupt that drains the queue, TX FIFO empty or DMA done */
+    void (*irqEnable)(void *ctx, bool enable);
+    /* Optional, NULL without DMA: starts sending len contiguous bytes */
+    bool (*dmaStart)(void *ctx, const uint8_t *data, uint32_t len);
+    /* Optional, NULL spins: called while a writer waits for room, e.g. to sleep until the next interrupt */
+    void (*wait)(void *ctx);
+}EspUartHal;
+
+typedef struct{
+    uint32_t bytesQueued;
+    uint32_t bytesSent;
+    /* Times a writer found the ring full and had to wait */
+    uint32_t writerWaits;
+    uint32_t interrupts;
+    /* Most bytes ever waiting in the ring */
+    uint32_t maxUsed;
+}EspTxQueueStats;
+
+/* size must be a power of two */
+void espTxQueueInit(const EspUartHal *hal, uint8_t *buffer, uint32_t size);
+/* Queues len bytes, waits only for the room that is missing */
+void espTxQueueWrite(const uint8_t *data, uint32_t len);
+/* Waits until every queued byte went to the hardware, e.g. before changing the baud rate */
+void espTxQueueFlush(void);
+uint32_t espTxQueueUsed(void);
+
+/* Interrupt side */
+void espTxQueueOnTxEmpty(void);
+void espTxQueueOnDmaDone(void);
+
+void espTxQueueGetStats(EspTxQueueStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_TXQUEUE_H
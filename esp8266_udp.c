@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_udp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+extern uint32_t getCurrentUS (void);
+
+
+static EspEventHandlers appHandlers;
+static EspUdpPool *pool = NULL;
+static EspUdpStats stats;
+
+/* Links started with espUdpStartServer(), one bit each */
+static uint32_t udpLinks = 0;
+
+/* Received datagrams, handed out in order */
+static EspDatagram queue[UDP_QUEUE_SIZE];
+static uint32_t queueHead = 0;
+static uint32_t queueLen = 0;
+
+/* Datagram being received, data is NULL while its bytes are dropped */
+static EspDatagram current;
+
+
+bool espUdpPoolInit(EspUdpPool *udpPool, uint8_t *storage, uint32_t numBuffers, uint32_t bufferSize){
+    if (numBuffers == 0 || numBuffers > UDP_POOL_MAX_BUFFERS){
+        return false;
+    }
+    udpPool->storage = storage;
+    udpPool->numBuffers = numBuffers;
+    udpPool->bufferSize = bufferSize;
+    udpPool->next = 0;
+    memset(udpPool->refs, 0, sizeof(udpPool->refs));
+    return true;
+}
+
+
+/* Only the driver thread takes buffers, so a 0 seen here stays 0 until it is set */
+static uint8_t *udpPoolTake(EspUdpPool *udpPool){
+    for (uint32_t i = 0; i < udpPool->numBuffers; i++){
+        uint32_t idx = (udpPool->next + i) % udpPool->numBuffers;
+        if (__atomic_load_n(&udpPool->refs[idx], __ATOMIC_ACQUIRE) == 0){
+            __atomic_store_n(&udpPool->refs[idx], 1, __ATOMIC_RELAXED);
+            udpPool->next = idx + 1;
+            return udpPool->storage + idx * udpPool->bufferSize;
+        }
+    }
+    return NULL;
+}
+
+
+static uint32_t udpPoolIndex(const EspUdpPool *udpPool, const uint8_t *data){
+    return (data - udpPool->storage) / udpPool->bufferSize;
+}
+
+
+void espUdpRetain(EspUdpPool *udpPool, const uint8_t *data){
+    __atomic_fetch_add(&udpPool->refs[udpPoolIndex(udpPool, data)], 1, __ATOMIC_RELAXED);
+}
+
+
+void espUdpRelease(EspUdpPool *udpPool, const uint8_t *data){
+    __atomic_fetch_sub(&udpPool->refs[udpPoolIndex(udpPool, data)], 1, __ATOMIC_RELEASE);
+}
+
+
+uint32_t espUdpPoolFree(const EspUdpPool *udpPool){
+    uint32_t free = 0;
+    for (uint32_t i = 0; i < udpPool->numBuffers; i++){
+        free += __atomic_load_n(&udpPool->refs[i], __ATOMIC_ACQUIRE) == 0;
+    }
+    return free;
+}
+
+
+static bool udpLink(uint8_t conn_id){
+    return (udpLinks >> conn_id) & 1;
+}
+
+/* Gives back the buffer of a datagram whose last bytes never came */
+static void udpDropCurrent(void){
+    if (current.data){
+        espUdpRelease(pool, current.data);
+        current.data = NULL;
+        stats.droppedTruncated++;
+    }
+}
+
+static void udpOnConnect(void *ctx, uint8_t conn_id){
+    if (!udpLink(conn_id) && appHandlers.onConnect){
+        appHandlers.onConnect(appHandlers.ctx, conn_id);
+    }
+}
+
+static void udpOnClose(void *ctx, uint8_t conn_id){
+    if (current.conn_id == conn_id){
+        udpDropCurrent();
+    }
+    udpLinks &= ~(1u << conn_id);
+    if (appHandlers.onClose){
+        appHandlers.onClose(appHandlers.ctx, conn_id);
+    }
+}
+
+static void udpOnStation(void *ctx, const EspStation *station, bool connected){
+    if (appHandlers.onStation){
+        appHandlers.onStation(appHandlers.ctx, station, connected);
+    }
+}
+
+static void udpOnData(void *ctx, const EspIpdInfo *info, uint32_t offset, const uint8_t *data, uint32_t len){
+    if (!udpLink(info->conn_id)){
+        if (appHandlers.onData){
+            appHandlers.onData(appHandlers.ctx, info, offset, data, len);
+        }
+        return;
+    }
+
+    if (offset == 0){
+        udpDropCurrent();
+        current.conn_id = info->conn_id;
+        memcpy(current.ip, info->ip, sizeof(current.ip));
+        current.port = info->port;
+        current.timestampUS = getCurrentUS();
+        current.length = info->length;
+        current.data = NULL;
+
+        if (info->length > pool->bufferSize){
+            stats.droppedTooLong++;
+        }
+        else if (queueLen == UDP_QUEUE_SIZE){
+            stats.droppedQueueFull++;
+        }
+        else if (!(current.data = udpPoolTake(pool))){
+            stats.droppedNoBuffer++;
+        }
+    }
+
+    if (!current.data){
+        return;
+    }
+
+    /* The only copy of the payload */
+    memcpy(current.data + offset, data, len);
+
+    if (offset + len == info->length){
+        queue[(queueHead + queueLen) % UDP_QUEUE_SIZE] = current;
+        queueLen++;
+        stats.received++;
+        current.data = NULL;
+    }
+}
+
+
+void espUdpInit(EspUdpPool *udpPool, const EspEventHandlers *handlers){
+    EspEventHandlers own = {NULL, udpOnConnect, udpOnClose, udpOnData, udpOnStation};
+
+    if (handlers){
+        appHandlers = *handlers;
+    }
+    else{
+        memset(&appHandlers, 0, sizeof(appHandlers));
+    }
+    pool = udpPool;
+    udpLinks = 0;
+    queueHead = queueLen = 0;
+    current.data = NULL;
+    memset(&stats, 0, sizeof(stats));
+    espSetEventHandlers(&own);
+}
+
+
+bool espUdpStartServer(int fd, uint8_t conn_id, const char *dest, uint16_t remotePort, uint16_t localPort){
+    if (conn_id >= NUM_LINKS){
+        return false;
+    }
+    /* Before CIPSTART, a datagram can follow right after OK */
+    udpLinks |= 1u << conn_id;
+    if (!espStartUDPServer(fd, conn_id, dest, remotePort, localPort)){
+        udpLinks &= ~(1u << conn_id);
+        return false;
+    }
+    return true;
+}
+
+
+void espUdpStopServer(int fd, uint8_t conn_id){
+    espCloseConnection(fd, conn_id);
+    if (current.conn_id == conn_id){
+        udpDropCurrent();
+    }
+    udpLinks &= ~(1u << conn_id);
+}
+
+
+uint32_t espUdpRecvBatch(int fd, EspDatagram *datagrams, uint32_t maxDatagrams, unsigned int timeout){
+    if (!pool){
+        return 0;
+    }
+
+    /* Queued datagrams go at once, the module is only read when there is none */
+    if (queueLen == 0){
+        uint32_t room = espUdpPoolFree(pool);
+        uint32_t startUS = getCurrentUS();
+        uint32_t elapsedMS = 0;
+
+        /* Whatever already arrived comes with the first one, as long as there is a buffer for it */
+        do{
+            espProcessEventsBurst(fd, timeout - elapsedMS, room ? room : 1);
+            elapsedMS = (getCurrentUS() - startUS) / 1000;
+        }while (queueLen == 0 && elapsedMS < timeout);
+    }
+
+    uint32_t n = 0;
+    while (n < maxDatagrams && queueLen > 0){
+        datagrams[n++] = queue[queueHead];
+        queueHead = (queueHead + 1) % UDP_QUEUE_SIZE;
+        queueLen--;
+    }
+    if (n){
+        stats.batches++;
+    }
+    return n;
+}
+
+
+void espUdpGetStats(EspUdpStats *out){
+    *out = stats;
+}
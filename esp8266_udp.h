@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_UDP_H
+#define ESP8266_UDP_H
+
+#include "esp8266.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Batch datagram receive for UDP servers, recvmmsg() style. Every payload is written
+ * once, from the serial chunk into a buffer of a fixed pool, and handed over by pointer.
+ *
+ * static uint8_t storage[16 * 1472];
+ * static EspUdpPool pool;
+ * espUdpPoolInit(&pool, storage, 16, 1472);
+ * espUdpInit(&pool, &appHandlers);       // instead of espSetEventHandlers()
+ * espUdpStartServer(fd, 0, "192.168.0.1", 5000, 5000);
+ *
+ * EspDatagram batch[16];
+ * uint32_t n = espUdpRecvBatch(fd, batch, 16, 100);
+ * ...give batch[0..n-1] to workers, each calls espUdpRelease(&pool, d->data) when done...
+ *
+ * Buffers are refcounted with atomics: workers on other threads can espUdpRetain() and
+ * espUdpRelease() them, only the thread calling the driver takes them from the pool.
+ * With no free buffer, or more queued datagrams than UDP_QUEUE_SIZE, datagrams are
+ * dropped and counted. The sender is only known with AT+CIPDINFO=1.
+********************************************/
+
+#define UDP_POOL_MAX_BUFFERS 32
+/* Datagrams received but not handed out by espUdpRecvBatch() yet */
+#define UDP_QUEUE_SIZE 32
+
+typedef struct{
+    uint8_t conn_id;
+    uint8_t ip[4];
+    uint16_t port;
+    /* getCurrentUS() when the +IPD header arrived */
+    uint32_t timestampUS;
+    /* Pool buffer, hold until espUdpRelease() */
+    uint8_t *data;
+    uint32_t length;
+}EspDatagram;
+
+typedef struct{
+    uint8_t *storage;
+    uint32_t numBuffers;
+    uint32_t bufferSize;
+    uint32_t refs[UDP_POOL_MAX_BUFFERS];
+    /* Where the next free buffer search starts */
+    uint32_t next;
+}EspUdpPool;
+
+typedef struct{
+    uint32_t received;
+    uint32_t batches;
+    uint32_t droppedNoBuffer;
+    uint32_t droppedTooLong;
+    uint32_t droppedQueueFull;
+    /* The payload stopped short, or the link closed, before the datagram was complete */
+    uint32_t droppedTruncated;
+}EspUdpStats;
+
+/* storage holds numBuffers buffers of bufferSize bytes, numBuffers up to UDP_POOL_MAX_BUFFERS */
+bool espUdpPoolInit(EspUdpPool *pool, uint8_t *storage, uint32_t numBuffers, uint32_t bufferSize);
+void espUdpRetain(EspUdpPool *pool, const uint8_t *data);
+void espUdpRelease(EspUdpPool *pool, const uint8_t *data);
+uint32_t espUdpPoolFree(const EspUdpPool *pool);
+
+/* Installs the receive handlers, events of links not started here go to appHandlers */
+void espUdpInit(EspUdpPool *pool, const EspEventHandlers *appHandlers);
+/* espStartUDPServer() on conn_id, its datagrams go to espUdpRecvBatch() */
+bool espUdpStartServer(int fd, uint8_t conn_id, const char *dest, uint16_t remotePort, uint16_t localPort);
+void espUdpStopServer(int fd, uint8_t conn_id);
+/*
+* Waits up to timeout ms for the first datagram, then returns every datagram already
+* received, up to maxDatagrams. Returns how many were written to datagrams, 0 before
+* espUdpInit().
+*/
+uint32_t espUdpRecvBatch(int fd, EspDatagram *datagrams, uint32_t maxDatagrams, unsigned int timeout);
+void espUdpGetStats(EspUdpStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_UDP_H
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_wait.h"
+#include "esp8266_timer.h"
+
+#include <stddef.h>
+
+
+/* Provided by the backend */
+extern uint32_t getCurrentUS (void);
+extern void delayMS(int ms);
+
+
+static EspWaitHooks hooks;
+
+/* Deadlines compare as int32_t microseconds, longer sleeps go in slices of this */
+#define SLEEP_SLICE_MS 1000000u
+
+
+void espSetWaitHooks(const EspWaitHooks *waitHooks){
+    if (waitHooks){
+        hooks = *waitHooks;
+    }
+    else{
+        hooks = (EspWaitHooks){0};
+    }
+}
+
+
+void espSleepMS(uint32_t ms){
+    while (ms > 0){
+        uint32_t slice = ms < SLEEP_SLICE_MS ? ms : SLEEP_SLICE_MS;
+
+        if (hooks.sleepUntil){
+            hooks.sleepUntil(hooks.ctx, getCurrentUS() + slice * 1000u);
+        }
+        else{
+            delayMS(slice);
+        }
+        ms -= slice;
+    }
+}
+
+
+void espWaitRx(void){
+    uint32_t deadline;
+
+    if (hooks.waitRx && espTimerNextDeadline(&deadline)){
+        hooks.waitRx(hooks.ctx, deadline);
+    }
+    else if (hooks.yield){
+        hooks.yield(hooks.ctx);
+    }
+}
+
+
+void espWaitNotifyRx(void){
+    if (hooks.notifyRx){
+        hooks.notifyRx(hooks.ctx);
+    }
+}
+
+
+/* Generic RTOS ---------------------------------------------------------------*/
+
+/* Milliseconds until deadline, rounded up so the deadline has passed on return */
+static uint32_t msUntil(uint32_t deadlineUS){
+    int32_t remaining = (int32_t)(deadlineUS - getCurrentUS());
+    return remaining > 0 ? ((uint32_t)remaining + 999) / 1000 : 0;
+}
+
+static void rtosSleepUntil(void *ctx, uint32_t deadlineUS){
+    const EspRtosSemaphore *rtos = ctx;
+    uint32_t ms;
+
+    while ((ms = msUntil(deadlineUS)) > 0){
+        if (rtos->delay){
+            rtos->delay(ms);
+        }
+        else{
+            /* Gives in between only cut the sleep short, the loop goes back to it */
+            rtos->take(rtos->sem, ms);
+        }
+    }
+}
+
+static void rtosWaitRx(void *ctx, uint32_t deadlineUS){
+    const EspRtosSemaphore *rtos = ctx;
+    uint32_t ms = msUntil(deadlineUS);
+
+    if (ms > 0){
+        rtos->take(rtos->sem, ms);
+    }
+}
+
+static void rtosNotifyRx(void *ctx){
+    const EspRtosSemaphore *rtos = ctx;
+    rtos->give(rtos->sem);
+}
+
+
+void espWaitUseRtos(const EspRtosSemaphore *rtos){
+    EspWaitHooks rtosHooks = {(void*)rtos, rtosSleepUntil, rtosWaitRx, rtosNotifyRx, NULL};
+    espSetWaitHooks(&rtosHooks);
+}
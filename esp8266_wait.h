@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_WAIT_H
+#define ESP8266_WAIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Wherever the driver waits (a delay, or no serial byte yet before a deadline) it goes
+ * through these hooks, so an RTOS or event loop can run something else meanwhile.
+ * Without hooks it spins on delayMS() and espRead() as it always did.
+ *
+ * espWaitUsePoll(fd);                    // Linux, esp8266_linux.c reading the tty
+ * espWaitUsePthread();                   // Linux, bytes come from another thread
+ * espWaitUseRtos(&uartSemaphore);        // any RTOS with a counting/binary semaphore
+ *
+ * Whoever receives serial bytes then calls espWaitNotifyRx(): the embedded backend
+ * does it from espSerialRxPut(), a Linux reader thread after it queued bytes.
+ * The deadline of a wait is the earliest timer of the wheel (esp8266_timer.h), the
+ * one of the blocking call in progress. Times are getCurrentUS() values.
+********************************************/
+
+typedef struct{
+    void *ctx;
+    /* Blocks until deadlineUS. NULL: delayMS() */
+    void (*sleepUntil)(void *ctx, uint32_t deadlineUS);
+    /* Blocks until notifyRx() or deadlineUS, whichever comes first. NULL: yield or spin */
+    void (*waitRx)(void *ctx, uint32_t deadlineUS);
+    /* Serial bytes arrived, may be called from an interrupt */
+    void (*notifyRx)(void *ctx);
+    /* Lets other tasks run between two polls of the serial port, used when waitRx is NULL */
+    void (*yield)(void *ctx);
+}EspWaitHooks;
+
+/* NULL restores the spinning default */
+void espSetWaitHooks(const EspWaitHooks *hooks);
+
+/* Driver side */
+void espSleepMS(uint32_t ms);
+/* Nothing to read: waits for bytes or until the next timer deadline */
+void espWaitRx(void);
+/* Backend side, bytes arrived */
+void espWaitNotifyRx(void);
+
+/*
+* Generic RTOS adapter, e.g. xSemaphoreTake/xSemaphoreGiveFromISR, osSemaphoreAcquire/Release,
+* k_sem_take/k_sem_give. give is called from the UART interrupt.
+*/
+typedef struct{
+    void *sem;
+    /* Returns true if the semaphore was given before timeoutMS */
+    bool (*take)(void *sem, uint32_t timeoutMS);
+    void (*give)(void *sem);
+    /* Task delay, NULL sleeps with take() */
+    void (*delay)(uint32_t ms);
+}EspRtosSemaphore;
+
+/* rtos must stay valid while in use */
+void espWaitUseRtos(const EspRtosSemaphore *rtos);
+
+/*
+* Linux adapters, in esp8266_wait_pthread.c. espWaitUsePthread() waits on a condition
+* variable on CLOCK_MONOTONIC, for backends where a reader thread calls espWaitNotifyRx().
+* espWaitUsePoll() waits in poll() on the serial fd the driver reads itself, as
+* esp8266_linux.c does.
+*/
+bool espWaitUsePthread(void);
+bool espWaitUsePoll(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_WAIT_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_wait.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+
+extern uint32_t getCurrentUS (void);
+
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rxCond;
+static bool rxPending = false;
+static bool initialized = false;
+/* Serial port of espWaitUsePoll() */
+static int pollFd = -1;
+
+
+/* CLOCK_MONOTONIC time of a getCurrentUS() deadline, the backend clock can start anywhere */
+static struct timespec absoluteDeadline(uint32_t deadlineUS){
+    struct timespec ts;
+    int32_t remaining = (int32_t)(deadlineUS - getCurrentUS());
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (remaining > 0){
+        ts.tv_sec += remaining / 1000000;
+        ts.tv_nsec += (remaining % 1000000) * 1000L;
+        if (ts.tv_nsec >= 1000000000L){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+    }
+    return ts;
+}
+
+static void pthreadSleepUntil(void *ctx, uint32_t deadlineUS){
+    struct timespec ts = absoluteDeadline(deadlineUS);
+    /* Only a signal is worth sleeping again for, any other error would never clear */
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void pthreadWaitRx(void *ctx, uint32_t deadlineUS){
+    struct timespec ts = absoluteDeadline(deadlineUS);
+
+    pthread_mutex_lock(&mutex);
+    while (!rxPending){
+        if (pthread_cond_timedwait(&rxCond, &mutex, &ts) != 0){
+            break;
+        }
+    }
+    rxPending = false;
+    pthread_mutex_unlock(&mutex);
+}
+
+static void pthreadNotifyRx(void *ctx){
+    pthread_mutex_lock(&mutex);
+    rxPending = true;
+    pthread_cond_signal(&rxCond);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+static void pollWaitRx(void *ctx, uint32_t deadlineUS){
+    int32_t remaining = (int32_t)(deadlineUS - getCurrentUS());
+    struct pollfd serial = {pollFd, POLLIN, 0};
+
+    /* Rounded up, poll() returning just before the deadline would only spin once more */
+    poll(&serial, 1, remaining > 0 ? (remaining + 999) / 1000 : 0);
+}
+
+
+bool espWaitUsePoll(int fd){
+    if (fd < 0){
+        return false;
+    }
+    pollFd = fd;
+
+    EspWaitHooks pollHooks = {NULL, pthreadSleepUntil, pollWaitRx, NULL, NULL};
+    espSetWaitHooks(&pollHooks);
+    return true;
+}
+
+
+bool espWaitUsePthread(void){
+    if (!initialized){
+        pthread_condattr_t attr;
+        if (pthread_condattr_init(&attr) != 0 ||
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+            pthread_cond_init(&rxCond, &attr) != 0){
+            return false;
+        }
+        pthread_condattr_destroy(&attr);
+        initialized = true;
+    }
+
+    EspWaitHooks pthreadHooks = {NULL, pthreadSleepUntil, pthreadWaitRx, pthreadNotifyRx, NULL};
+    espSetWaitHooks(&pthreadHooks);
+    return true;
+}
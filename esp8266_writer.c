@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "esp8266_writer.h"
+#include "esp8266_log.h"
+
+#include <string.h>
+
+
+extern uint32_t getCurrentUS (void);
+
+
+static bool defaultSend(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len){
+    return espSendTCPData(fd, conn_id, (const char*)data, len);
+}
+
+static bool (*sender)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len) = defaultSend;
+static void *senderCtx = NULL;
+
+
+void espWriterSetSender(bool (*send)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len), void *ctx){
+    sender = send ? send : defaultSend;
+    senderCtx = ctx;
+}
+
+
+/* Latency of the writes of a frame that was just sent */
+static void writerAccount(EspWriter *writer, uint32_t writes, uint32_t firstUS, uint64_t offsetUS){
+    uint32_t latencyUS = getCurrentUS() - firstUS;
+
+    writer->stats.totalLatencyUS += (uint64_t)writes*latencyUS - offsetUS;
+    if (latencyUS > writer->stats.maxLatencyUS){
+        writer->stats.maxLatencyUS = latencyUS;
+    }
+}
+
+static bool writerSend(int fd, EspWriter *writer, uint32_t *reason){
+    uint32_t len = writer->fill;
+    uint32_t writes = writer->pendingWrites;
+
+    espTimerCancel(&writer->delay);
+    if (len == 0){
+        return true;
+    }
+    writer->fill = 0;
+    writer->pendingWrites = 0;
+
+    if (!sender(senderCtx, fd, writer->conn_id, writer->buffer, len)){
+        espLogWarn("Link %u: %u buffered bytes dropped", writer->conn_id, len);
+        return false;
+    }
+    (*reason)++;
+    writer->stats.frames++;
+    writer->stats.bytes += len;
+    writerAccount(writer, writes, writer->firstWriteUS, writer->pendingOffsetUS);
+    return true;
+}
+
+
+bool espWriterInit(EspWriter *writer, uint8_t conn_id, uint8_t *buffer, uint32_t size, uint32_t delayMS){
+    if (conn_id >= NUM_LINKS || !buffer || size == 0 || size > MAX_SEND_TCP_DATA_SIZE){
+        return false;
+    }
+    memset(writer, 0, sizeof(*writer));
+    writer->conn_id = conn_id;
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->delayMS = delayMS;
+    espTimerInit(&writer->delay, NULL, NULL);
+    return true;
+}
+
+
+bool espWrite(int fd, EspWriter *writer, const uint8_t *data, uint32_t len){
+    uint32_t nowUS = getCurrentUS();
+
+    writer->stats.writes++;
+
+    while (len){
+        /* A whole frame with nothing buffered goes out without the copy */
+        if (writer->fill == 0 && len >= writer->size){
+            if (!sender(senderCtx, fd, writer->conn_id, data, writer->size)){
+                return false;
+            }
+            writer->stats.fullFrames++;
+            writer->stats.frames++;
+            writer->stats.bytes += writer->size;
+            data += writer->size;
+            len -= writer->size;
+            if (len == 0){
+                writerAccount(writer, 1, nowUS, 0);
+            }
+            continue;
+        }
+
+        uint32_t n = writer->size - writer->fill;
+        if (n > len){
+            n = len;
+        }
+        if (writer->fill == 0){
+            writer->firstWriteUS = nowUS;
+            writer->pendingOffsetUS = 0;
+            if (writer->delayMS && !writer->corked){
+                espTimerStartMS(&writer->delay, writer->delayMS);
+            }
+        }
+        /* The write counts with the frame its last byte is in */
+        if (n == len){
+            writer->pendingWrites++;
+            writer->pendingOffsetUS += nowUS - writer->firstWriteUS;
+        }
+        memcpy(writer->buffer + writer->fill, data, n);
+        writer->fill += n;
+        data += n;
+        len -= n;
+
+        if (writer->fill == writer->size && !writerSend(fd, writer, &writer->stats.fullFrames)){
+            return false;
+        }
+    }
+
+    if (writer->fill && writer->delayMS == 0 && !writer->corked){
+        return writerSend(fd, writer, &writer->stats.flushFrames);
+    }
+    return true;
+}
+
+
+bool espWriterFlush(int fd, EspWriter *writer){
+    return writerSend(fd, writer, &writer->stats.flushFrames);
+}
+
+
+bool espWriterPoll(int fd, EspWriter *writer){
+    if (writer->fill == 0 || writer->corked || writer->delayMS == 0 || espTimerPending(&writer->delay)){
+        return true;
+    }
+    return writerSend(fd, writer, &writer->stats.delayFrames);
+}
+
+
+void espWriterCork(EspWriter *writer){
+    writer->corked = true;
+    espTimerCancel(&writer->delay);
+}
+
+
+bool espWriterUncork(int fd, EspWriter *writer){
+    writer->corked = false;
+    return writerSend(fd, writer, &writer->stats.flushFrames);
+}
+
+
+uint32_t espWriterPending(const EspWriter *writer){
+    return writer->fill;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the  nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef ESP8266_WRITER_H
+#define ESP8266_WRITER_H
+
+#include "esp8266.h"
+#include "esp8266_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*************** How to use *****************
+ * Buffered writer for a TCP link, Nagle style. Every espSendTCPData() costs a whole
+ * CIPSEND, ">", payload, SEND OK exchange, so small writes are gathered and go out as
+ * one frame when the buffer is full or delayMS after the first of them was written.
+ *
+ * static uint8_t storage[MAX_SEND_TCP_DATA_SIZE];
+ * static EspWriter writer;
+ * espWriterInit(&writer, 0, storage, sizeof(storage), 20);
+ * espWrite(fd, &writer, msg, msgLen);
+ * ...
+ * espWriterPoll(fd, &writer);         // from the main loop, sends once the delay ran out
+ *
+ * espWriterCork() holds everything but full frames until espWriterUncork(), to build
+ * one message from several writes. espWriterFlush() sends right away.
+ * Sends only happen from these calls, never from a timer or event handler. A frame
+ * that fails to send is dropped, like espSendTCPData() data.
+********************************************/
+
+typedef struct{
+    uint32_t writes;
+    uint32_t frames;
+    uint64_t bytes;
+    /* Why the frames went out */
+    uint32_t fullFrames;
+    uint32_t delayFrames;
+    uint32_t flushFrames;
+    /* From espWrite() to the end of the send of its frame, totalLatencyUS/writes is the mean */
+    uint64_t totalLatencyUS;
+    uint32_t maxLatencyUS;
+}EspWriterStats;
+
+typedef struct{
+    uint8_t conn_id;
+    uint8_t *buffer;
+    uint32_t size;
+    uint32_t fill;
+    /* 0 sends every write right away unless corked */
+    uint32_t delayMS;
+    bool corked;
+    EspTimer delay;
+    /* Writes in the buffer, getCurrentUS() of the first and the sum of the others after it */
+    uint32_t pendingWrites;
+    uint32_t firstWriteUS;
+    uint64_t pendingOffsetUS;
+    EspWriterStats stats;
+}EspWriter;
+
+/* size up to MAX_SEND_TCP_DATA_SIZE, the largest frame */
+bool espWriterInit(EspWriter *writer, uint8_t conn_id, uint8_t *buffer, uint32_t size, uint32_t delayMS);
+bool espWrite(int fd, EspWriter *writer, const uint8_t *data, uint32_t len);
+bool espWriterFlush(int fd, EspWriter *writer);
+/* Sends the buffer if its delay ran out. Returns false if a send failed */
+bool espWriterPoll(int fd, EspWriter *writer);
+void espWriterCork(EspWriter *writer);
+/* Sends what was held */
+bool espWriterUncork(int fd, EspWriter *writer);
+/* Bytes written but not sent yet */
+uint32_t espWriterPending(const EspWriter *writer);
+
+/* How a frame goes out, espSendTCPData() unless set. NULL restores it */
+void espWriterSetSender(bool (*send)(void *ctx, int fd, uint8_t conn_id, const uint8_t *data, uint32_t len), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP8266_WRITER_H
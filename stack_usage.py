@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2017 Jonaias Projetos e Tecnologia Ltda
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+#   notice, this list of conditions and the following disclaimer.
+# * Redistributions in binary form must reproduce the above
+#   copyright notice, this list of conditions and the following disclaimer
+#   in the documentation and/or other materials provided with the
+#   distribution.
+# * Neither the name of the  nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+"""
+Worst-case stack usage of the driver.
+
+Compiles the sources with -fstack-usage -fcallgraph-info=su, walks the call graph
+and prints the deepest stack reachable from every function. Exits with 1 if any
+of them is above the budget.
+
+Cortex-M3 build:
+
+    CC=arm-none-eabi-gcc CFLAGS="-mcpu=cortex-m3 -mthumb -Os" \
+        ./stack_usage.py --budget 1024 esp8266.c esp8266_scan.c esp8266_timer.c esp8266_log.c \
+            esp8266_wait.c
+
+Functions outside the sources (printf, espRead...) count as 0 bytes unless given
+with --extern name=bytes. Calls through function pointers (event handlers) are
+not in the graph, add the handler stack to the budget yourself.
+
+The recovery recurses once: espCommandV() > espRecoverSteps() > espRestoreConfig()
+> espCommand() > espCommandV(), where the recovering flag stops it. The --guard
+functions model that flag, the inner espCommandV() is counted without them.
+Any other recursion is reported and not counted.
+"""
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+
+NODE_RE = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE_RE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+STACK_RE = re.compile(r'(\d+) bytes \(([a-z,]+)\)')
+
+# The recovering flag: espCommandV() called from the recovery does not recover again
+DEFAULT_GUARDS = ['espRecover', 'espRecoverSteps']
+
+
+def compile_sources(cc, cflags, sources, outdir):
+    ci_files = []
+    for src in sources:
+        obj = os.path.join(outdir, os.path.splitext(os.path.basename(src))[0] + '.o')
+        cmd = [cc] + cflags + ['-fstack-usage', '-fcallgraph-info=su', '-DESP_STATIC_ARENA',
+                               '-c', src, '-o', obj]
+        if subprocess.call(cmd) != 0:
+            sys.exit('stack_usage: cannot compile %s' % src)
+        ci_files.append(os.path.splitext(obj)[0] + '.ci')
+    return ci_files
+
+
+def load_graph(ci_files):
+    frames = {}
+    kinds = {}
+    calls = {}
+    for ci in ci_files:
+        with open(ci) as f:
+            for line in f:
+                node = NODE_RE.search(line)
+                if node:
+                    title, label = node.groups()
+                    stack = STACK_RE.search(label.replace('\\n', ' '))
+                    if stack:
+                        frames[title] = int(stack.group(1))
+                        kinds[title] = stack.group(2)
+                    calls.setdefault(title, set())
+                    continue
+                edge = EDGE_RE.search(line)
+                if edge:
+                    calls.setdefault(edge.group(1), set()).add(edge.group(2))
+    return frames, kinds, calls
+
+
+def short_name(title):
+    return title.rsplit(':', 1)[-1]
+
+
+def worst_case(frames, calls, externs, guards):
+    memo = {}
+    path = {}
+    warned = set()
+
+    def visit(node, stack, guarded):
+        key = (node, guarded)
+        if key in memo:
+            return memo[key]
+        # Past a guard the same function is a new frame, not the same recursion
+        if key in stack:
+            return None
+        stack.add(key)
+        own = frames.get(node, externs.get(short_name(node), 0))
+        inner = guarded or short_name(node) in guards
+        deepest = 0
+        deepest_path = []
+        recursive = False
+        for callee in calls.get(node, ()):
+            if inner and short_name(callee) in guards:
+                # Returns at once, its guard is already taken further up the stack
+                continue
+            depth = visit(callee, stack, inner)
+            if depth is None:
+                recursive = True
+                continue
+            if depth > deepest:
+                deepest = depth
+                deepest_path = path[(callee, inner)]
+        stack.discard(key)
+        memo[key] = own + deepest
+        path[key] = [short_name(node)] + deepest_path
+        if recursive and node not in warned:
+            warned.add(node)
+            print('warning: %s is recursive, the recursion is not counted' % short_name(node))
+        return memo[key]
+
+    depths = {}
+    paths = {}
+    for node in calls:
+        depths[node] = visit(node, set(), False)
+        paths[node] = path[(node, False)]
+    return depths, paths
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--budget', type=int, default=1024, help='worst-case stack budget in bytes')
+    parser.add_argument('--extern', action='append', default=[], metavar='NAME=BYTES',
+                        help='stack used by a function outside the sources')
+    parser.add_argument('--guard', action='append', default=None, metavar='NAME',
+                        help='function that is not entered again while one of the guarded functions '
+                             'runs, default %s' % ' '.join(DEFAULT_GUARDS))
+    parser.add_argument('sources', nargs='+')
+    args = parser.parse_args()
+
+    cc = os.environ.get('CC', 'gcc')
+    cflags = shlex.split(os.environ.get('CFLAGS', '-Os')) + ['-std=gnu99']
+    externs = {}
+    for item in args.extern:
+        name, size = item.split('=')
+        externs[name] = int(size)
+
+    with tempfile.TemporaryDirectory() as outdir:
+        frames, kinds, calls = load_graph(compile_sources(cc, cflags, args.sources, outdir))
+
+    guards = set(args.guard if args.guard is not None else DEFAULT_GUARDS)
+    depths, paths = worst_case(frames, calls, externs, guards)
+    own_functions = sorted((n for n in frames), key=lambda n: depths[n], reverse=True)
+
+    failed = False
+    print('%-32s %8s %8s  %s' % ('function', 'frame', 'worst', 'deepest path'))
+    for node in own_functions:
+        over = depths[node] > args.budget
+        failed |= over
+        flag = ' OVER BUDGET' if over else ''
+        dynamic = ' (dynamic)' if 'dynamic' in kinds[node] else ''
+        print('%-32s %8d %8d  %s%s%s' % (short_name(node), frames[node], depths[node],
+                                         ' > '.join(paths[node]), dynamic, flag))
+
+    if failed:
+        print('Worst-case stack above the %d bytes budget' % args.budget)
+        return 1
+    print('Worst-case stack within the %d bytes budget' % args.budget)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())